@@ -0,0 +1,150 @@
+#include "cabloom.h"
+#include "util.h"
+
+/* With 10 bits per entry and 7 hash functions about 1% of the tests on IDs never added return true */
+#define CA_BLOOM_BITS_PER_ENTRY 10U
+#define CA_BLOOM_HASHES 7U
+
+#define CA_BLOOM_ENTRIES_MIN (UINT64_C(16)*UINT64_C(1024))
+
+typedef struct CaBloomLayer {
+        uint64_t *bits;
+        uint64_t n_bits;     /* Always a power of two */
+        uint64_t n_entries;
+        uint64_t n_entries_max;
+} CaBloomLayer;
+
+struct CaBloom {
+        CaBloomLayer *layers;
+        size_t n_layers;
+};
+
+CaBloom* ca_bloom_new(void) {
+        return new0(CaBloom, 1);
+}
+
+CaBloom* ca_bloom_free(CaBloom *b) {
+        size_t i;
+
+        if (!b)
+                return NULL;
+
+        for (i = 0; i < b->n_layers; i++)
+                free(b->layers[i].bits);
+        free(b->layers);
+
+        return mfree(b);
+}
+
+static int ca_bloom_add_layer(CaBloom *b) {
+        CaBloomLayer *l, *array;
+        uint64_t n;
+
+        assert(b);
+
+        n = b->n_layers > 0 ? b->layers[b->n_layers - 1].n_entries_max * 2 : CA_BLOOM_ENTRIES_MIN;
+
+        array = realloc_multiply(b->layers, sizeof(CaBloomLayer), b->n_layers + 1);
+        if (!array)
+                return -ENOMEM;
+        b->layers = array;
+
+        l = b->layers + b->n_layers;
+        *l = (CaBloomLayer) {
+                .n_bits = n * 16U, /* The next power of two above n * CA_BLOOM_BITS_PER_ENTRY */
+                .n_entries_max = n,
+        };
+
+        l->bits = new0(uint64_t, l->n_bits / 64U);
+        if (!l->bits)
+                return -ENOMEM;
+
+        b->n_layers++;
+        return 0;
+}
+
+/* Chunk IDs are cryptographic hashes, hence we can derive the bit positions from the ID directly, via double
+ * hashing. Two 64-bit parts of it are plenty for that. */
+#define CA_BLOOM_FOREACH_BIT(bit, i, l, id)                                              \
+        for ((i) = 0, (bit) = le64toh((id)->u64[0]) & ((l)->n_bits - 1);                 \
+             (i) < CA_BLOOM_HASHES;                                                      \
+             (i)++, (bit) = (le64toh((id)->u64[0]) + (i) * (le64toh((id)->u64[1]) | 1)) & ((l)->n_bits - 1))
+
+int ca_bloom_add(CaBloom *b, const CaChunkID *id) {
+        CaBloomLayer *l;
+        uint64_t bit;
+        unsigned i;
+        int r;
+
+        if (!b)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+
+        if (b->n_layers == 0 || b->layers[b->n_layers - 1].n_entries >= b->layers[b->n_layers - 1].n_entries_max) {
+                r = ca_bloom_add_layer(b);
+                if (r < 0)
+                        return r;
+        }
+
+        l = b->layers + b->n_layers - 1;
+
+        CA_BLOOM_FOREACH_BIT(bit, i, l, id)
+                l->bits[bit / 64U] |= UINT64_C(1) << (bit % 64U);
+
+        l->n_entries++;
+        return 0;
+}
+
+bool ca_bloom_test(CaBloom *b, const CaChunkID *id) {
+        size_t k;
+
+        if (!b)
+                return false;
+        if (!id)
+                return false;
+
+        for (k = 0; k < b->n_layers; k++) {
+                CaBloomLayer *l = b->layers + k;
+                bool found = true;
+                uint64_t bit;
+                unsigned i;
+
+                CA_BLOOM_FOREACH_BIT(bit, i, l, id)
+                        if (!(l->bits[bit / 64U] & (UINT64_C(1) << (bit % 64U)))) {
+                                found = false;
+                                break;
+                        }
+
+                if (found)
+                        return true;
+        }
+
+        return false;
+}
+
+uint64_t ca_bloom_entries(CaBloom *b) {
+        uint64_t n = 0;
+        size_t k;
+
+        if (!b)
+                return 0;
+
+        for (k = 0; k < b->n_layers; k++)
+                n += b->layers[k].n_entries;
+
+        return n;
+}
+
+uint64_t ca_bloom_size(CaBloom *b) {
+        uint64_t n = 0;
+        size_t k;
+
+        if (!b)
+                return 0;
+
+        for (k = 0; k < b->n_layers; k++)
+                n += b->layers[k].n_bits / 8U;
+
+        return n;
+}
@@ -0,0 +1,24 @@
+#ifndef foocabloomhfoo
+#define foocabloomhfoo
+
+#include <stdbool.h>
+
+#include "cachunkid.h"
+
+/* A Bloom filter of chunk IDs, for telling cheaply that a chunk is definitely not in a store or seed. It grows as
+ * entries are added, by stacking filters twice the size of the previous one on top. */
+
+typedef struct CaBloom CaBloom;
+
+CaBloom* ca_bloom_new(void);
+CaBloom* ca_bloom_free(CaBloom *b);
+
+int ca_bloom_add(CaBloom *b, const CaChunkID *id);
+
+/* Returns false if the ID was definitely never added, true if it probably was */
+bool ca_bloom_test(CaBloom *b, const CaChunkID *id);
+
+uint64_t ca_bloom_entries(CaBloom *b);
+uint64_t ca_bloom_size(CaBloom *b);
+
+#endif
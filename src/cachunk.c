@@ -1,6 +1,6 @@
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <lzma.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -78,10 +78,9 @@ int ca_load_fd(int fd, ReallocBuffer *buffer) {
 }
 
 int ca_load_and_decompress_fd(int fd, ReallocBuffer *buffer) {
+        CaCompressionContext context = {};
         uint64_t ccount = 0, dcount = 0;
-        bool got_xz_eof = false;
-        lzma_stream xz = {};
-        lzma_ret xzr;
+        bool got_eof = false;
         int r;
 
         if (fd < 0)
@@ -89,9 +88,9 @@ int ca_load_and_decompress_fd(int fd, ReallocBuffer *buffer) {
         if (!buffer)
                 return -EINVAL;
 
-        xzr = lzma_stream_decoder(&xz, UINT64_MAX, LZMA_TELL_UNSUPPORTED_CHECK);
-        if (xzr != LZMA_OK)
-                return -EIO;
+        r = ca_compression_start(&context, CA_COMPRESSION_DECOMPRESS, _CA_COMPRESSION_TYPE_INVALID, CA_COMPRESSION_LEVEL_DEFAULT);
+        if (r < 0)
+                return r;
 
         for (;;) {
                 uint8_t fd_buffer[BUFFER_SIZE];
@@ -111,7 +110,7 @@ int ca_load_and_decompress_fd(int fd, ReallocBuffer *buffer) {
                 ccount += l;
 
                 if (l == 0) {
-                        if (!got_xz_eof) {
+                        if (!got_eof) {
                                 r = -EPIPE;
                                 goto finish;
                         }
@@ -119,8 +118,8 @@ int ca_load_and_decompress_fd(int fd, ReallocBuffer *buffer) {
                         break;
                 }
 
-                xz.next_in = fd_buffer;
-                xz.avail_in = l;
+                context.next_in = fd_buffer;
+                context.avail_in = l;
 
                 do {
                         void *p;
@@ -136,29 +135,27 @@ int ca_load_and_decompress_fd(int fd, ReallocBuffer *buffer) {
                                 goto finish;
                         }
 
-                        xz.next_out = p;
-                        xz.avail_out = BUFFER_SIZE;
+                        context.next_out = p;
+                        context.avail_out = BUFFER_SIZE;
 
-                        xzr = lzma_code(&xz, LZMA_RUN);
-                        if (xzr != LZMA_OK && xzr != LZMA_STREAM_END) {
-                                r = -EIO;
+                        r = ca_compression_run(&context, false);
+                        if (r < 0)
                                 goto finish;
-                        }
 
-                        realloc_buffer_shorten(buffer, xz.avail_out);
-                        dcount += BUFFER_SIZE - xz.avail_out;
+                        realloc_buffer_shorten(buffer, context.avail_out);
+                        dcount += BUFFER_SIZE - context.avail_out;
 
-                        if (xzr == LZMA_STREAM_END) {
+                        if (r == CA_COMPRESSION_EOF) {
 
-                                if (xz.avail_in > 0) {
+                                if (context.avail_in > 0) {
                                         r = -EBADMSG;
                                         goto finish;
                                 }
 
-                                got_xz_eof = true;
+                                got_eof = true;
                         }
 
-                } while (xz.avail_in > 0);
+                } while (context.avail_in > 0);
         }
 
         if (ccount < CA_CHUNK_SIZE_LIMIT_MIN || dcount < CA_CHUNK_SIZE_LIMIT_MIN) {
@@ -169,14 +166,13 @@ int ca_load_and_decompress_fd(int fd, ReallocBuffer *buffer) {
         r = 0;
 
 finish:
-        lzma_end(&xz);
+        ca_compression_done(&context);
         return r;
 }
 
-int ca_load_and_compress_fd(int fd, ReallocBuffer *buffer) {
+int ca_load_and_compress_fd(int fd, CaCompressionType type, int level, ReallocBuffer *buffer) {
+        CaCompressionContext context = {};
         uint64_t ccount = 0, dcount = 0;
-        lzma_stream xz = {};
-        lzma_ret xzr;
         int r;
 
         if (fd < 0)
@@ -184,9 +180,9 @@ int ca_load_and_compress_fd(int fd, ReallocBuffer *buffer) {
         if (!buffer)
                 return -EINVAL;
 
-        xzr = lzma_easy_encoder(&xz, LZMA_PRESET_DEFAULT, LZMA_CHECK_CRC64);
-        if (xzr != LZMA_OK)
-                return -EIO;
+        r = ca_compression_start(&context, CA_COMPRESSION_COMPRESS, type, level);
+        if (r < 0)
+                return r;
 
         for (;;) {
                 uint8_t fd_buffer[BUFFER_SIZE];
@@ -205,8 +201,8 @@ int ca_load_and_compress_fd(int fd, ReallocBuffer *buffer) {
 
                 dcount += l;
 
-                xz.next_in = fd_buffer;
-                xz.avail_in = l;
+                context.next_in = fd_buffer;
+                context.avail_in = l;
 
                 do {
                         uint8_t *p;
@@ -222,24 +218,22 @@ int ca_load_and_compress_fd(int fd, ReallocBuffer *buffer) {
                                 goto finish;
                         }
 
-                        xz.next_out = p;
-                        xz.avail_out = BUFFER_SIZE;
+                        context.next_out = p;
+                        context.avail_out = BUFFER_SIZE;
 
-                        xzr = lzma_code(&xz, (size_t) l < sizeof(fd_buffer) ? LZMA_FINISH : LZMA_RUN);
-                        if (xzr != LZMA_OK && xzr != LZMA_STREAM_END) {
-                                r = -EIO;
+                        r = ca_compression_run(&context, (size_t) l < sizeof(fd_buffer));
+                        if (r < 0)
                                 goto finish;
-                        }
 
-                        realloc_buffer_shorten(buffer, xz.avail_out);
-                        ccount += BUFFER_SIZE - xz.avail_out;
+                        realloc_buffer_shorten(buffer, context.avail_out);
+                        ccount += BUFFER_SIZE - context.avail_out;
 
-                        if (xzr == LZMA_STREAM_END) {
-                                assert(xz.avail_in == 0);
+                        if (r == CA_COMPRESSION_EOF) {
+                                assert(context.avail_in == 0);
                                 goto done;
                         }
 
-                } while (xz.avail_in > 0);
+                } while (context.avail_in > 0 || (size_t) l < sizeof(fd_buffer));
         }
 
 done:
@@ -251,7 +245,7 @@ done:
         r = 0;
 
 finish:
-        lzma_end(&xz);
+        ca_compression_done(&context);
         return r;
 }
 
@@ -268,11 +262,10 @@ int ca_save_fd(int fd, const void *data, size_t size) {
         return loop_write(fd, data, size);
 }
 
-int ca_save_and_compress_fd(int fd, const void *data, size_t size) {
+int ca_save_and_compress_fd(int fd, CaCompressionType type, int level, const void *data, size_t size) {
+        CaCompressionContext context = {};
         uint64_t ccount = 0;
-        lzma_stream xz = {};
-        lzma_ret xzr;
-        int r;
+        int r, k;
 
         if (fd < 0)
                 return -EINVAL;
@@ -283,12 +276,12 @@ int ca_save_and_compress_fd(int fd, const void *data, size_t size) {
         if (!data)
                 return -EINVAL;
 
-        xzr = lzma_easy_encoder(&xz, LZMA_PRESET_DEFAULT, LZMA_CHECK_CRC64);
-        if (xzr != LZMA_OK)
-                return -EIO;
+        r = ca_compression_start(&context, CA_COMPRESSION_COMPRESS, type, level);
+        if (r < 0)
+                return r;
 
-        xz.next_in = data;
-        xz.avail_in = size;
+        context.next_in = data;
+        context.avail_in = size;
 
         for (;;) {
                 uint8_t buffer[BUFFER_SIZE];
@@ -298,22 +291,22 @@ int ca_save_and_compress_fd(int fd, const void *data, size_t size) {
                         goto finish;
                 }
 
-                xz.next_out = buffer;
-                xz.avail_out = sizeof(buffer);
+                context.next_out = buffer;
+                context.avail_out = sizeof(buffer);
 
-                xzr = lzma_code(&xz, LZMA_FINISH);
-                if (xzr != LZMA_OK && xzr != LZMA_STREAM_END) {
-                        r = -EIO;
+                k = ca_compression_run(&context, true);
+                if (k < 0) {
+                        r = k;
                         goto finish;
                 }
 
-                r = loop_write(fd, buffer, sizeof(buffer) - xz.avail_out);
+                r = loop_write(fd, buffer, sizeof(buffer) - context.avail_out);
                 if (r < 0)
                         goto finish;
 
-                ccount += sizeof(buffer) - xz.avail_out;
+                ccount += sizeof(buffer) - context.avail_out;
 
-                if (xzr == LZMA_STREAM_END)
+                if (k == CA_COMPRESSION_EOF)
                         break;
         }
 
@@ -325,15 +318,14 @@ int ca_save_and_compress_fd(int fd, const void *data, size_t size) {
         r = 0;
 
 finish:
-        lzma_end(&xz);
+        ca_compression_done(&context);
         return r;
 }
 
 int ca_save_and_decompress_fd(int fd, const void *data, size_t size) {
+        CaCompressionContext context = {};
         uint64_t dcount = 0;
-        lzma_stream xz = {};
-        lzma_ret xzr;
-        int r;
+        int r, k;
 
         if (fd < 0)
                 return -EINVAL;
@@ -344,12 +336,12 @@ int ca_save_and_decompress_fd(int fd, const void *data, size_t size) {
         if (!data)
                 return -EINVAL;
 
-        xzr = lzma_stream_decoder(&xz, UINT64_MAX, LZMA_TELL_UNSUPPORTED_CHECK);
-        if (xzr != LZMA_OK)
-                return -EIO;
+        r = ca_compression_start(&context, CA_COMPRESSION_DECOMPRESS, _CA_COMPRESSION_TYPE_INVALID, CA_COMPRESSION_LEVEL_DEFAULT);
+        if (r < 0)
+                return r;
 
-        xz.next_in = data;
-        xz.avail_in = size;
+        context.next_in = data;
+        context.avail_in = size;
 
         for (;;) {
                 uint8_t buffer[BUFFER_SIZE];
@@ -359,24 +351,24 @@ int ca_save_and_decompress_fd(int fd, const void *data, size_t size) {
                         goto finish;
                 }
 
-                xz.next_out = buffer;
-                xz.avail_out = sizeof(buffer);
+                context.next_out = buffer;
+                context.avail_out = sizeof(buffer);
 
-                xzr = lzma_code(&xz, LZMA_FINISH);
-                if (xzr != LZMA_OK && xzr != LZMA_STREAM_END) {
-                        r = -EIO;
+                k = ca_compression_run(&context, true);
+                if (k < 0) {
+                        r = k;
                         goto finish;
                 }
 
-                r = loop_write(fd, buffer, sizeof(buffer) - xz.avail_out);
+                r = loop_write(fd, buffer, sizeof(buffer) - context.avail_out);
                 if (r < 0)
                         goto finish;
 
-                dcount += sizeof(buffer) - xz.avail_out;
+                dcount += sizeof(buffer) - context.avail_out;
 
-                if (xzr == LZMA_STREAM_END) {
+                if (k == CA_COMPRESSION_EOF) {
 
-                        if (xz.avail_in > 0) {
+                        if (context.avail_in > 0) {
                                 r = -EBADMSG;
                                 goto finish;
                         }
@@ -393,14 +385,21 @@ int ca_save_and_decompress_fd(int fd, const void *data, size_t size) {
         r = 0;
 
 finish:
-        lzma_end(&xz);
+        ca_compression_done(&context);
         return r;
 }
 
-int ca_compress(const void *data, size_t size, ReallocBuffer *buffer) {
-        uint64_t ccount = 0;
-        lzma_stream xz = {};
-        lzma_ret xzr;
+int ca_compress(
+                CaCompressionContext *context,
+                CaCompressionType type,
+                int level,
+                const void *data,
+                size_t size,
+                ReallocBuffer *buffer) {
+
+        CaCompressionContext temporary = {};
+        size_t bound;
+        uint8_t *p;
         int r;
 
         if (!buffer)
@@ -412,44 +411,41 @@ int ca_compress(const void *data, size_t size, ReallocBuffer *buffer) {
         if (!data)
                 return -EINVAL;
 
-        xzr = lzma_easy_encoder(&xz, LZMA_PRESET_DEFAULT, LZMA_CHECK_CRC64);
-        if (xzr != LZMA_OK)
-                return -EIO;
+        if (!context)
+                context = &temporary;
 
-        xz.next_in = data;
-        xz.avail_in = size;
-
-        for (;;) {
-                uint8_t *p;
-
-                if (ccount >= CA_CHUNK_SIZE_LIMIT_MAX) {
-                        r = -EINVAL;
-                        goto finish;
-                }
-
-                p = realloc_buffer_extend(buffer, BUFFER_SIZE);
-                if (!p) {
-                        r = -ENOMEM;
-                        goto finish;
-                }
+        r = ca_compression_start(context, CA_COMPRESSION_COMPRESS, type, level);
+        if (r < 0)
+                return r;
 
-                xz.next_out = p;
-                xz.avail_out = BUFFER_SIZE;
+        /* Reserve room for the worst case, so that we can compress the whole chunk in a single step */
+        bound = ca_compression_bound(type, size);
+        if (bound == 0) {
+                r = -EOPNOTSUPP;
+                goto finish;
+        }
 
-                xzr = lzma_code(&xz, LZMA_FINISH);
-                if (xzr != LZMA_OK && xzr != LZMA_STREAM_END) {
-                        r = -EIO;
-                        goto finish;
-                }
+        p = realloc_buffer_extend(buffer, bound);
+        if (!p) {
+                r = -ENOMEM;
+                goto finish;
+        }
 
-                realloc_buffer_shorten(buffer, xz.avail_out);
-                ccount += BUFFER_SIZE - xz.avail_out;
+        context->next_in = data;
+        context->avail_in = size;
+        context->next_out = p;
+        context->avail_out = bound;
 
-                if (xzr == LZMA_STREAM_END)
-                        break;
+        r = ca_compression_run(context, true);
+        realloc_buffer_shorten(buffer, context->avail_out);
+        if (r < 0)
+                goto finish;
+        if (r != CA_COMPRESSION_EOF) {
+                r = -EIO;
+                goto finish;
         }
 
-        if (ccount < CA_CHUNK_SIZE_LIMIT_MIN) {
+        if (bound - context->avail_out < CA_CHUNK_SIZE_LIMIT_MIN) {
                 r = -EINVAL;
                 goto finish;
         }
@@ -457,14 +453,20 @@ int ca_compress(const void *data, size_t size, ReallocBuffer *buffer) {
         r = 0;
 
 finish:
-        lzma_end(&xz);
+        if (context == &temporary)
+                ca_compression_done(&temporary);
+
         return r;
 }
 
-int ca_decompress(const void *data, size_t size, ReallocBuffer *buffer) {
+int ca_decompress(
+                CaCompressionContext *context,
+                const void *data,
+                size_t size,
+                ReallocBuffer *buffer) {
+
+        CaCompressionContext temporary = {};
         uint64_t dcount = 0;
-        lzma_stream xz = {};
-        lzma_ret xzr;
         int r;
 
         if (!buffer)
@@ -476,14 +478,18 @@ int ca_decompress(const void *data, size_t size, ReallocBuffer *buffer) {
         if (!data)
                 return -EINVAL;
 
-        xzr = lzma_stream_decoder(&xz, UINT64_MAX, LZMA_TELL_UNSUPPORTED_CHECK);
-        if (xzr != LZMA_OK)
-                return -EIO;
+        if (!context)
+                context = &temporary;
+
+        r = ca_compression_start(context, CA_COMPRESSION_DECOMPRESS, _CA_COMPRESSION_TYPE_INVALID, CA_COMPRESSION_LEVEL_DEFAULT);
+        if (r < 0)
+                return r;
 
-        xz.next_in = data;
-        xz.avail_in = size;
+        context->next_in = data;
+        context->avail_in = size;
 
         for (;;) {
+                size_t n;
                 uint8_t *p;
 
                 if (dcount >= CA_CHUNK_SIZE_LIMIT_MAX) {
@@ -491,27 +497,28 @@ int ca_decompress(const void *data, size_t size, ReallocBuffer *buffer) {
                         goto finish;
                 }
 
-                p = realloc_buffer_extend(buffer, BUFFER_SIZE);
+                /* Start with a guess, and then double the output space each iteration */
+                n = MAX(MAX((size_t) dcount, size * 2), (size_t) BUFFER_SIZE);
+
+                p = realloc_buffer_extend(buffer, n);
                 if (!p) {
                         r = -ENOMEM;
                         goto finish;
                 }
 
-                xz.next_out = p;
-                xz.avail_out = BUFFER_SIZE;
+                context->next_out = p;
+                context->avail_out = n;
 
-                xzr = lzma_code(&xz, LZMA_FINISH);
-                if (xzr != LZMA_OK && xzr != LZMA_STREAM_END) {
-                        r = -EIO;
+                r = ca_compression_run(context, true);
+                realloc_buffer_shorten(buffer, context->avail_out);
+                if (r < 0)
                         goto finish;
-                }
 
-                realloc_buffer_shorten(buffer, xz.avail_out);
-                dcount += BUFFER_SIZE - xz.avail_out;
+                dcount += n - context->avail_out;
 
-                if (xzr == LZMA_STREAM_END) {
+                if (r == CA_COMPRESSION_EOF) {
 
-                        if (xz.avail_in > 0) {
+                        if (context->avail_in > 0) {
                                 r = -EBADMSG;
                                 goto finish;
                         }
@@ -528,7 +535,9 @@ int ca_decompress(const void *data, size_t size, ReallocBuffer *buffer) {
         r = 0;
 
 finish:
-        lzma_end(&xz);
+        if (context == &temporary)
+                ca_compression_done(&temporary);
+
         return r;
 }
 
@@ -646,6 +655,8 @@ int ca_chunk_file_load(
                 const char *prefix,
                 const CaChunkID *chunkid,
                 CaChunkCompression desired_compression,
+                CaCompressionType compression_type,
+                int compression_level,
                 ReallocBuffer *buffer,
                 CaChunkCompression *ret_effective_compression) {
 
@@ -685,7 +696,7 @@ int ca_chunk_file_load(
 
         } else {
                 if (desired_compression == CA_CHUNK_COMPRESSED)
-                        r = ca_load_and_compress_fd(fd, buffer);
+                        r = ca_load_and_compress_fd(fd, compression_type, compression_level, buffer);
                 else
                         r = ca_load_fd(fd, buffer);
 
@@ -703,6 +714,8 @@ int ca_chunk_file_save(
                 const CaChunkID *chunkid,
                 CaChunkCompression effective_compression,
                 CaChunkCompression desired_compression,
+                CaCompressionType compression_type,
+                int compression_level,
                 const void *p,
                 size_t l) {
 
@@ -749,7 +762,7 @@ int ca_chunk_file_save(
         if (desired_compression == effective_compression)
                 r = loop_write(fd, p, l);
         else if (desired_compression == CA_CHUNK_COMPRESSED)
-                r = ca_save_and_compress_fd(fd, p, l);
+                r = ca_save_and_compress_fd(fd, compression_type, compression_level, p, l);
         else {
                 assert(desired_compression == CA_CHUNK_UNCOMPRESSED);
                 r = ca_save_and_decompress_fd(fd, p, l);
@@ -845,3 +858,116 @@ int ca_chunk_file_remove(int chunk_fd, const char *prefix, const CaChunkID *chun
 
         return ca_chunk_file_unlink(chunk_fd, prefix, chunkid, ".xz");
 }
+
+static int ca_chunk_file_enumerate_directory(int root_fd, const char *name, int (*callback)(const CaChunkID *id, void *userdata), void *userdata) {
+        struct dirent *de;
+        DIR *d;
+        int fd, r = 0;
+
+        assert(root_fd >= 0);
+        assert(name);
+        assert(callback);
+
+        fd = openat(root_fd, name, O_RDONLY|O_CLOEXEC|O_DIRECTORY|O_NOFOLLOW);
+        if (fd < 0)
+                return errno == ENOTDIR ? 0 : -errno;
+
+        d = fdopendir(fd);
+        if (!d) {
+                r = -errno;
+                safe_close(fd);
+                return r;
+        }
+
+        for (;;) {
+                char id_str[CA_CHUNK_ID_FORMAT_MAX];
+                CaChunkID id;
+                size_t l;
+
+                errno = 0;
+                de = readdir(d);
+                if (!de) {
+                        r = -errno;
+                        break;
+                }
+
+                /* Chunk files are named after their ID, optionally suffixed with ".xz" if compressed */
+                l = strlen(de->d_name);
+                if (l != CA_CHUNK_ID_FORMAT_MAX - 1 &&
+                    !(l == CA_CHUNK_ID_FORMAT_MAX - 1 + 3 && streq(de->d_name + CA_CHUNK_ID_FORMAT_MAX - 1, ".xz")))
+                        continue;
+
+                memcpy(id_str, de->d_name, CA_CHUNK_ID_FORMAT_MAX - 1);
+                id_str[CA_CHUNK_ID_FORMAT_MAX - 1] = 0;
+
+                if (!ca_chunk_id_parse(id_str, &id))
+                        continue;
+
+                if (de->d_type == DT_UNKNOWN) {
+                        struct stat st;
+
+                        if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                                if (errno == ENOENT)
+                                        continue;
+
+                                r = -errno;
+                                break;
+                        }
+
+                        if (!S_ISREG(st.st_mode))
+                                continue;
+
+                } else if (de->d_type != DT_REG)
+                        continue;
+
+                if (ca_chunk_id_is_null(&id))
+                        continue;
+
+                r = callback(&id, userdata);
+                if (r < 0)
+                        break;
+        }
+
+        closedir(d);
+        return r;
+}
+
+int ca_chunk_file_enumerate(const char *prefix, int (*callback)(const CaChunkID *id, void *userdata), void *userdata) {
+        struct dirent *de;
+        DIR *d;
+        int r = 0;
+
+        if (!prefix)
+                return -EINVAL;
+        if (!callback)
+                return -EINVAL;
+
+        d = opendir(prefix);
+        if (!d)
+                return -errno;
+
+        for (;;) {
+                errno = 0;
+                de = readdir(d);
+                if (!de) {
+                        r = -errno;
+                        break;
+                }
+
+                /* Chunks are stored in subdirectories named after the first four hex digits of their ID */
+                if (strlen(de->d_name) != 4 ||
+                    unhexchar(de->d_name[0]) < 0 || unhexchar(de->d_name[1]) < 0 ||
+                    unhexchar(de->d_name[2]) < 0 || unhexchar(de->d_name[3]) < 0)
+                        continue;
+
+                if (!IN_SET(de->d_type, DT_DIR, DT_UNKNOWN))
+                        continue;
+
+                r = ca_chunk_file_enumerate_directory(dirfd(d), de->d_name, callback, userdata);
+                if (r < 0)
+                        break;
+        }
+
+        closedir(d);
+        return r;
+}
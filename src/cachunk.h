@@ -2,6 +2,7 @@
 #define foocachunkhfoo
 
 #include "cachunkid.h"
+#include "cacompression.h"
 #include "realloc-buffer.h"
 
 /* The hardcoded, maximum chunk size, after which we refuse operation */
@@ -17,21 +18,27 @@ typedef enum CaChunkCompression {
 
 int ca_load_fd(int fd, ReallocBuffer *buffer);
 int ca_load_and_decompress_fd(int fd, ReallocBuffer *buffer);
-int ca_load_and_compress_fd(int fd, ReallocBuffer *buffer);
+int ca_load_and_compress_fd(int fd, CaCompressionType type, int level, ReallocBuffer *buffer);
 
 int ca_save_fd(int fd, const void *data, size_t size);
 int ca_save_and_decompress_fd(int fd, const void *data, size_t size);
-int ca_save_and_compress_fd(int fd, const void *data, size_t size);
+int ca_save_and_compress_fd(int fd, CaCompressionType type, int level, const void *data, size_t size);
 
-int ca_compress(const void *data, size_t size, ReallocBuffer *buffer);
-int ca_decompress(const void *data, size_t size, ReallocBuffer *buffer);
+/* Compresses with the specified codec, decompression detects the codec from the data. Both append to 'buffer'. If
+ * 'context' is specified it is reused, which saves setting up the codec from scratch for each chunk, otherwise a
+ * temporary one is used. */
+int ca_compress(CaCompressionContext *context, CaCompressionType type, int level, const void *data, size_t size, ReallocBuffer *buffer);
+int ca_decompress(CaCompressionContext *context, const void *data, size_t size, ReallocBuffer *buffer);
 
 int ca_chunk_file_open(int cache_fd, const char *prefix, const CaChunkID *chunkid, const char *suffix, int flags);
 
 int ca_chunk_file_test(int cache_fd, const char *prefix, const CaChunkID *chunkid);
-int ca_chunk_file_load(int cache_fd, const char *prefix, const CaChunkID *chunkid, CaChunkCompression desired_compression, ReallocBuffer *buffer, CaChunkCompression *ret_effective_compression);
-int ca_chunk_file_save(int cache_fd, const char *prefix, const CaChunkID *chunkid, CaChunkCompression effective_compression, CaChunkCompression desired_compression, const void *p, size_t l);
+int ca_chunk_file_load(int cache_fd, const char *prefix, const CaChunkID *chunkid, CaChunkCompression desired_compression, CaCompressionType compression_type, int compression_level, ReallocBuffer *buffer, CaChunkCompression *ret_effective_compression);
+int ca_chunk_file_save(int cache_fd, const char *prefix, const CaChunkID *chunkid, CaChunkCompression effective_compression, CaChunkCompression desired_compression, CaCompressionType compression_type, int compression_level, const void *p, size_t l);
 int ca_chunk_file_mark_missing(int cache_fd, const char *prefix, const CaChunkID *chunkid);
 int ca_chunk_file_remove(int chunk_fd, const char *prefix, const CaChunkID *chunkid);
 
+/* Calls 'callback' for each chunk file in the store directory 'prefix', until it returns an error */
+int ca_chunk_file_enumerate(const char *prefix, int (*callback)(const CaChunkID *id, void *userdata), void *userdata);
+
 #endif
@@ -0,0 +1,264 @@
+#include "cachunkcache.h"
+#include "util.h"
+
+#define CA_CHUNK_CACHE_BUCKETS_MIN ((size_t) 64)
+
+typedef struct CaChunkCacheEntry CaChunkCacheEntry;
+
+struct CaChunkCacheEntry {
+        CaChunkID id;
+
+        CaChunkCacheEntry *bucket_next;
+
+        /* The LRU list, most recently used first */
+        CaChunkCacheEntry *lru_prev, *lru_next;
+
+        size_t size;
+        uint8_t data[];
+};
+
+struct CaChunkCache {
+        CaChunkCacheEntry **buckets;
+        size_t n_buckets;
+        size_t n_entries;
+
+        CaChunkCacheEntry *lru_first, *lru_last;
+
+        uint64_t size;
+        uint64_t size_max;
+
+        uint64_t n_hits;
+        uint64_t n_misses;
+};
+
+CaChunkCache* ca_chunk_cache_new(uint64_t size_max) {
+        CaChunkCache *c;
+
+        c = new0(CaChunkCache, 1);
+        if (!c)
+                return NULL;
+
+        c->size_max = size_max;
+
+        return c;
+}
+
+CaChunkCache* ca_chunk_cache_free(CaChunkCache *c) {
+        CaChunkCacheEntry *e, *n;
+
+        if (!c)
+                return NULL;
+
+        for (e = c->lru_first; e; e = n) {
+                n = e->lru_next;
+                free(e);
+        }
+
+        free(c->buckets);
+
+        return mfree(c);
+}
+
+static CaChunkCacheEntry** ca_chunk_cache_bucket(CaChunkCache *c, const CaChunkID *id) {
+        assert(c);
+        assert(c->n_buckets > 0);
+        assert(id);
+
+        /* Chunk IDs are cryptographic hashes, hence any part of them is as good a hash value as we can get */
+        return c->buckets + ((size_t) le64toh(id->u64[0]) & (c->n_buckets - 1));
+}
+
+static CaChunkCacheEntry** ca_chunk_cache_find(CaChunkCache *c, const CaChunkID *id) {
+        CaChunkCacheEntry **e;
+
+        assert(c);
+        assert(id);
+
+        if (c->n_buckets == 0)
+                return NULL;
+
+        for (e = ca_chunk_cache_bucket(c, id); *e; e = &(*e)->bucket_next)
+                if (ca_chunk_id_equal(&(*e)->id, id))
+                        return e;
+
+        return NULL;
+}
+
+static void ca_chunk_cache_unlink_lru(CaChunkCache *c, CaChunkCacheEntry *e) {
+        assert(c);
+        assert(e);
+
+        if (e->lru_prev)
+                e->lru_prev->lru_next = e->lru_next;
+        else
+                c->lru_first = e->lru_next;
+
+        if (e->lru_next)
+                e->lru_next->lru_prev = e->lru_prev;
+        else
+                c->lru_last = e->lru_prev;
+
+        e->lru_prev = e->lru_next = NULL;
+}
+
+static void ca_chunk_cache_link_lru(CaChunkCache *c, CaChunkCacheEntry *e) {
+        assert(c);
+        assert(e);
+
+        e->lru_prev = NULL;
+        e->lru_next = c->lru_first;
+
+        if (c->lru_first)
+                c->lru_first->lru_prev = e;
+        else
+                c->lru_last = e;
+
+        c->lru_first = e;
+}
+
+static void ca_chunk_cache_evict(CaChunkCache *c) {
+        CaChunkCacheEntry *e, **b;
+
+        assert(c);
+        assert(c->lru_last);
+
+        e = c->lru_last;
+
+        b = ca_chunk_cache_find(c, &e->id);
+        assert(b && *b == e);
+        *b = e->bucket_next;
+
+        ca_chunk_cache_unlink_lru(c, e);
+
+        c->size -= e->size;
+        c->n_entries--;
+
+        free(e);
+}
+
+static int ca_chunk_cache_grow(CaChunkCache *c) {
+        CaChunkCacheEntry **buckets, *e;
+        size_t n;
+
+        assert(c);
+
+        if (c->n_entries < c->n_buckets)
+                return 0;
+
+        n = MAX(c->n_buckets * 2, CA_CHUNK_CACHE_BUCKETS_MIN);
+
+        buckets = new0(CaChunkCacheEntry*, n);
+        if (!buckets)
+                return -ENOMEM;
+
+        free(c->buckets);
+        c->buckets = buckets;
+        c->n_buckets = n;
+
+        for (e = c->lru_first; e; e = e->lru_next) {
+                CaChunkCacheEntry **b;
+
+                b = ca_chunk_cache_bucket(c, &e->id);
+                e->bucket_next = *b;
+                *b = e;
+        }
+
+        return 0;
+}
+
+int ca_chunk_cache_get(CaChunkCache *c, const CaChunkID *id, const void **ret, size_t *ret_size) {
+        CaChunkCacheEntry **b, *e;
+
+        if (!c)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+        if (!ret_size)
+                return -EINVAL;
+
+        b = ca_chunk_cache_find(c, id);
+        if (!b) {
+                c->n_misses++;
+                return -ENOENT;
+        }
+
+        e = *b;
+
+        if (c->lru_first != e) {
+                ca_chunk_cache_unlink_lru(c, e);
+                ca_chunk_cache_link_lru(c, e);
+        }
+
+        c->n_hits++;
+
+        *ret = e->data;
+        *ret_size = e->size;
+
+        return 0;
+}
+
+int ca_chunk_cache_put(CaChunkCache *c, const CaChunkID *id, const void *data, size_t size) {
+        CaChunkCacheEntry *e, **b;
+        int r;
+
+        if (!c)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+        if (!data && size > 0)
+                return -EINVAL;
+
+        if (size > c->size_max)
+                return 0;
+        if (ca_chunk_cache_find(c, id))
+                return 0;
+
+        while (c->size + size > c->size_max)
+                ca_chunk_cache_evict(c);
+
+        r = ca_chunk_cache_grow(c);
+        if (r < 0)
+                return r;
+
+        e = malloc(offsetof(CaChunkCacheEntry, data) + size);
+        if (!e)
+                return -ENOMEM;
+
+        e->id = *id;
+        e->size = size;
+        memcpy(e->data, data, size);
+
+        b = ca_chunk_cache_bucket(c, id);
+        e->bucket_next = *b;
+        *b = e;
+
+        ca_chunk_cache_link_lru(c, e);
+
+        c->size += size;
+        c->n_entries++;
+
+        return 1;
+}
+
+uint64_t ca_chunk_cache_get_hits(CaChunkCache *c) {
+        if (!c)
+                return 0;
+
+        return c->n_hits;
+}
+
+uint64_t ca_chunk_cache_get_misses(CaChunkCache *c) {
+        if (!c)
+                return 0;
+
+        return c->n_misses;
+}
+
+uint64_t ca_chunk_cache_get_size(CaChunkCache *c) {
+        if (!c)
+                return 0;
+
+        return c->size;
+}
@@ -0,0 +1,31 @@
+#ifndef foocachunkcachehfoo
+#define foocachunkcachehfoo
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include "cachunkid.h"
+
+/* A small in-memory cache of recently used chunks in their decompressed form, limited in the number of bytes it
+ * holds. The least recently used chunks are dropped first. This is useful when extracting images that refer to the
+ * same chunk again and again, for example for runs of zeroes. */
+
+#define CA_CHUNK_CACHE_SIZE_DEFAULT (UINT64_C(32)*UINT64_C(1024)*UINT64_C(1024))
+
+typedef struct CaChunkCache CaChunkCache;
+
+CaChunkCache* ca_chunk_cache_new(uint64_t size_max);
+CaChunkCache* ca_chunk_cache_free(CaChunkCache *c);
+
+/* Returns -ENOENT if the chunk isn't cached. The data stays valid until the next ca_chunk_cache_put() call. */
+int ca_chunk_cache_get(CaChunkCache *c, const CaChunkID *id, const void **ret, size_t *ret_size);
+
+/* Copies the data into the cache, dropping other chunks as necessary. Returns 0 if the chunk is too large to be
+ * cached, or was cached already, > 0 if it was added. */
+int ca_chunk_cache_put(CaChunkCache *c, const CaChunkID *id, const void *data, size_t size);
+
+uint64_t ca_chunk_cache_get_hits(CaChunkCache *c);
+uint64_t ca_chunk_cache_get_misses(CaChunkCache *c);
+uint64_t ca_chunk_cache_get_size(CaChunkCache *c);
+
+#endif
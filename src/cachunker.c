@@ -14,7 +14,7 @@ int ca_chunker_set_size(
 
         assert(c);
 
-        if (c->window_size != 0) /* Already started? */
+        if (c->window_size != 0 || c->chunk_size != 0) /* Already started? */
                 return -EBUSY;
 
         if (avg_size == 0) {
@@ -183,36 +183,101 @@ uint32_t ca_chunker_roll(CaChunker *c, uint8_t leave, uint8_t enter) {
         return c->h;
 }
 
-static bool shall_break(CaChunker *c, uint32_t v) {
+/* The cut test is "h mod discriminator == discriminator - 1", evaluated for every single byte. Integer division is
+ * slow, hence use Lemire's "fastmod" for this: with a 64bit magic multiplier we can calculate the remainder of a 32bit
+ * value with two multiplications, yielding exactly the same result as the '%' operator. */
+#if defined(__SIZEOF_INT128__)
+static inline uint64_t discriminator_magic(uint32_t d) {
+        return UINT64_C(0xFFFFFFFFFFFFFFFF) / d + 1;
+}
+
+static inline uint32_t discriminator_mod(uint32_t v, uint32_t d, uint64_t magic) {
+        return (uint32_t) (((__uint128_t) (magic * v) * d) >> 64);
+}
+#else
+static inline uint64_t discriminator_magic(uint32_t d) {
+        return 0;
+}
+
+static inline uint32_t discriminator_mod(uint32_t v, uint32_t d, uint64_t magic) {
+        return v % d;
+}
+#endif
+
+static size_t ca_chunker_cut(CaChunker *c, size_t k) {
+        assert(c);
+
+        c->h = 0;
+        c->chunk_size = 0;
+        c->window_size = 0;
+
+        return k;
+}
+
+static size_t ca_chunker_skippable(CaChunker *c, size_t n) {
+        size_t first_test;
+
         assert(c);
 
-        if (c->chunk_size >= c->chunk_size_max)
-                return true;
+        /* Returns how many of the next n bytes don't need to be looked at, as they are neither tested for a cut nor
+         * end up in the window before the first test */
 
-        if (c->chunk_size < c->chunk_size_min)
-                return false;
+        first_test = MAX(c->chunk_size_min, (size_t) CA_CHUNKER_WINDOW_SIZE);
 
-        return (v % c->discriminator) == (c->discriminator - 1);
+        if (c->chunk_size + CA_CHUNKER_WINDOW_SIZE >= first_test)
+                return 0;
+
+        return MIN(first_test - CA_CHUNKER_WINDOW_SIZE - c->chunk_size, n);
 }
 
 size_t ca_chunker_scan(CaChunker *c, const void* p, size_t n) {
         const uint8_t *q = p;
-        uint32_t v;
-        size_t k = 0, idx;
+        size_t limit, i, m;
+        uint32_t h, d;
+        uint64_t magic;
 
         assert(c);
         assert(p);
 
         /* Scans the specified bytes for chunk borders. Returns (size_t) -1 if no border was discovered, otherwise the
-         * chunk size. */
+         * chunk size.
+         *
+         * The rolling hash only depends on the last CA_CHUNKER_WINDOW_SIZE bytes, and we never cut before the
+         * minimum chunk size is reached. Hence, we skip over the beginning of each chunk without looking at it at all,
+         * and only start filling the window CA_CHUNKER_WINDOW_SIZE bytes before the first position we need to test
+         * for a cut. The resulting chunk borders are identical to hashing every single byte. */
+
+        m = ca_chunker_skippable(c, n);
+        q += m, n -= m;
+        c->chunk_size += m;
+
+        d = (uint32_t) c->discriminator;
+        magic = discriminator_magic(d);
 
         if (c->window_size < CA_CHUNKER_WINDOW_SIZE) {
-                size_t m;
+                const uint8_t *w;
 
-                /* Append to window to make it full */
+                /* Append to window to make it full. Bytes are stored in the window at the index of their chunk
+                 * position modulo the window size. */
                 m = MIN(CA_CHUNKER_WINDOW_SIZE - c->window_size, n);
 
-                memcpy(c->window + c->window_size, q, m);
+                for (i = 0; i < m; i++)
+                        c->window[(c->chunk_size + i) % CA_CHUNKER_WINDOW_SIZE] = q[i];
+
+                /* If the window is filled in one go, we can hash the data directly from the input buffer, otherwise
+                 * linearize it first */
+                if (m == CA_CHUNKER_WINDOW_SIZE)
+                        w = q;
+                else {
+                        uint8_t *t;
+
+                        t = newa(uint8_t, CA_CHUNKER_WINDOW_SIZE);
+                        for (i = 0; i < CA_CHUNKER_WINDOW_SIZE; i++)
+                                t[i] = c->window[(c->chunk_size + m + i) % CA_CHUNKER_WINDOW_SIZE];
+
+                        w = t;
+                }
+
                 q += m, n -= m;
 
                 c->window_size += m;
@@ -223,36 +288,93 @@ size_t ca_chunker_scan(CaChunker *c, const void* p, size_t n) {
                         return (size_t) -1;
 
                 /* Window is full, we are now ready to go. */
-                v = ca_chunker_start(c, c->window, c->window_size);
-                k = m;
+                h = ca_chunker_start(c, w, CA_CHUNKER_WINDOW_SIZE);
 
-                if (shall_break(c, v))
-                        goto now;
+                if (c->chunk_size >= c->chunk_size_max ||
+                    discriminator_mod(h, d, magic) == d - 1)
+                        return ca_chunker_cut(c, q - (const uint8_t*) p);
         }
 
-        idx = c->chunk_size % CA_CHUNKER_WINDOW_SIZE;
+        if (n == 0)
+                return (size_t) -1;
+
+        /* From here on we are past the minimum chunk size, hence only the maximum size limits where we might cut */
+        assert(c->chunk_size < c->chunk_size_max);
+        limit = MIN(n, c->chunk_size_max - c->chunk_size);
+        h = c->h;
 
-        while (n > 0) {
-                v = ca_chunker_roll(c, c->window[idx], *q);
-                c->chunk_size++;
-                k++;
+        /* The first bytes leaving the window are still in the window buffer, from the previous call */
+        m = MIN(limit, (size_t) CA_CHUNKER_WINDOW_SIZE);
+        for (i = 0; i < m; i++) {
+                h = rol32(h, 1) ^
+                    rol32(buzhash_table[c->window[(c->chunk_size + i) % CA_CHUNKER_WINDOW_SIZE]], CA_CHUNKER_WINDOW_SIZE) ^
+                    buzhash_table[q[i]];
 
-                if (shall_break(c, v))
-                        goto now;
+                if (discriminator_mod(h, d, magic) == d - 1)
+                        return ca_chunker_cut(c, q + i + 1 - (const uint8_t*) p);
+        }
 
-                c->window[idx++] = *q;
-                if (idx == CA_CHUNKER_WINDOW_SIZE)
-                        idx = 0;
+        /* And the remaining ones we can take directly from the input buffer */
+        for (; i < limit; i++) {
+                h = rol32(h, 1) ^
+                    rol32(buzhash_table[q[i - CA_CHUNKER_WINDOW_SIZE]], CA_CHUNKER_WINDOW_SIZE) ^
+                    buzhash_table[q[i]];
 
-                q++, n--;
+                if (discriminator_mod(h, d, magic) == d - 1)
+                        return ca_chunker_cut(c, q + i + 1 - (const uint8_t*) p);
         }
 
+        if (c->chunk_size + limit >= c->chunk_size_max)
+                return ca_chunker_cut(c, q + limit - (const uint8_t*) p);
+
+        /* No border found, remember the last bytes in the window buffer for the next invocation */
+        for (i = limit - m; i < limit; i++)
+                c->window[(c->chunk_size + i) % CA_CHUNKER_WINDOW_SIZE] = q[i];
+
+        c->h = h;
+        c->chunk_size += limit;
+
         return (size_t) -1;
+}
 
-now:
-        c->h = 0;
-        c->chunk_size = 0;
-        c->window_size = 0;
+size_t ca_chunker_scan_zeroes(CaChunker *c, size_t n) {
+        static const uint8_t zeroes[CA_CHUNKER_WINDOW_SIZE] = {};
+        size_t done = 0;
 
-        return k;
+        assert(c);
+
+        /* Like ca_chunker_scan(), but for n zero bytes. Once the window is filled with zeroes the hash doesn't change
+         * anymore. If it didn't result in a cut right-away it never will, and the chunk continues up to the maximum
+         * chunk size, hence there's no need to look at the individual bytes. */
+
+        while (done < n) {
+                size_t m, k;
+
+                m = ca_chunker_skippable(c, n - done);
+                if (m > 0) {
+                        c->chunk_size += m;
+                        done += m;
+                        continue;
+                }
+
+                if (c->window_size == CA_CHUNKER_WINDOW_SIZE && memeqzero(c->window, sizeof(c->window))) {
+                        m = MIN(n - done, c->chunk_size_max - c->chunk_size);
+
+                        if (c->chunk_size + m >= c->chunk_size_max)
+                                return ca_chunker_cut(c, done + m);
+
+                        c->chunk_size += m;
+                        return (size_t) -1;
+                }
+
+                /* Fill the window the regular way */
+                m = MIN(n - done, sizeof(zeroes));
+                k = ca_chunker_scan(c, zeroes, m);
+                if (k != (size_t) -1)
+                        return done + k;
+
+                done += m;
+        }
+
+        return (size_t) -1;
 }
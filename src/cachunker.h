@@ -48,6 +48,9 @@ int ca_chunker_set_size(CaChunker *c, size_t min_size, size_t avg_size, size_t m
  * called with more data later on), or another value indicating the position of a border. */
 size_t ca_chunker_scan(CaChunker *c, const void* p, size_t n);
 
+/* Same as ca_chunker_scan() on n zero bytes, but skips over long runs of them without hashing each byte */
+size_t ca_chunker_scan_zeroes(CaChunker *c, size_t n);
+
 /* Low-level buzhash functions. Only exported for testing purposes. */
 uint32_t ca_chunker_start(CaChunker *c, const void *p, size_t n);
 uint32_t ca_chunker_roll(CaChunker *c, uint8_t pop_byte, uint8_t push_byte);
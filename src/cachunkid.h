@@ -5,13 +5,14 @@
 #include <stdbool.h>
 #include <string.h>
 #include <sys/types.h>
-#include <gcrypt.h>
+
+#include "cadigest.h"
 
 #define CA_CHUNK_ID_SIZE 32
 #define CA_CHUNK_ID_FORMAT_MAX (CA_CHUNK_ID_SIZE*2+1)
 
 typedef union CaChunkID {
-        /* For now, a SHA256 sum */
+        /* A SHA256 or BLAKE2b-256 sum, see CaDigestType */
         uint8_t bytes[CA_CHUNK_ID_SIZE];
         uint64_t u64[CA_CHUNK_ID_SIZE / sizeof(uint64_t)];
 } CaChunkID;
@@ -31,12 +32,12 @@ static inline bool ca_chunk_id_is_null(const CaChunkID *a) {
         size_t i;
 
         for (i = 0; i < CA_CHUNK_ID_SIZE / sizeof(uint64_t); i++)
-                if (a->u64[0] != 0)
+                if (a->u64[i] != 0)
                         return false;
 
         return true;
 }
 
-int ca_chunk_id_make(gcry_md_hd_t *digest, const void *p, size_t l, CaChunkID *ret);
+int ca_chunk_id_make(CaDigest *digest, const void *p, size_t l, CaChunkID *ret);
 
 #endif
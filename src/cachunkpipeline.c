@@ -0,0 +1,312 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "cachunk.h"
+#include "cachunkpipeline.h"
+#include "gcrypt-util.h"
+#include "realloc-buffer.h"
+#include "util.h"
+
+typedef struct CaChunkJob {
+        ReallocBuffer buffer;
+        CaChunkID id;
+        size_t size;
+        int result;
+        bool done;
+} CaChunkJob;
+
+struct CaChunkPipeline {
+        pthread_mutex_t mutex;
+        pthread_cond_t work_cond; /* signalled when a new job was queued, or we shall shut down */
+        pthread_cond_t done_cond; /* signalled when a job was processed */
+
+        pthread_t *threads;
+        unsigned n_threads;
+
+        CaDigestType digest_type;
+
+        CaChunkPipelineProcess process;
+        void *userdata;
+
+        /* A ring buffer of jobs. Sequence numbers are absolute: 'head' is the oldest job not dequeued yet, 'dispatch'
+         * the next job not yet picked up by a worker, 'tail' the next free slot. */
+        CaChunkJob *jobs;
+        size_t n_jobs;
+        uint64_t head, dispatch, tail;
+
+        bool shutdown;
+};
+
+static CaChunkJob *ca_chunk_pipeline_job(CaChunkPipeline *p, uint64_t seq) {
+        assert(p);
+
+        return p->jobs + (seq % p->n_jobs);
+}
+
+static void* ca_chunk_pipeline_worker(void *userdata) {
+        CaChunkPipeline *p = userdata;
+        CaDigest *digest = NULL;
+
+        assert(p);
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        for (;;) {
+                CaChunkJob *j;
+                int r;
+
+                while (!p->shutdown && p->dispatch >= p->tail)
+                        assert_se(pthread_cond_wait(&p->work_cond, &p->mutex) == 0);
+
+                if (p->shutdown)
+                        break;
+
+                j = ca_chunk_pipeline_job(p, p->dispatch++);
+                if (j->done) /* Enqueued with ca_chunk_pipeline_put_done(), nothing to do */
+                        continue;
+
+                /* The job is ours now, nobody else touches it until we mark it done, hence process it unlocked */
+                assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+                r = ca_digest_ensure_allocated(&digest, p->digest_type);
+                if (r >= 0)
+                        r = ca_chunk_id_make(digest, realloc_buffer_data(&j->buffer), realloc_buffer_size(&j->buffer), &j->id);
+                if (r >= 0)
+                        r = p->process(p->userdata, &j->id, realloc_buffer_data(&j->buffer), realloc_buffer_size(&j->buffer));
+
+                assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+                j->result = r;
+                j->done = true;
+
+                assert_se(pthread_cond_broadcast(&p->done_cond) == 0);
+        }
+
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        ca_digest_free(digest);
+        return NULL;
+}
+
+int ca_chunk_pipeline_new(
+                unsigned n_threads,
+                CaDigestType digest_type,
+                CaChunkPipelineProcess process,
+                void *userdata,
+                CaChunkPipeline **ret) {
+        CaChunkPipeline *p;
+        sigset_t ss, saved_ss;
+        int r;
+
+        if (n_threads < 1)
+                return -EINVAL;
+        if (n_threads > CA_CHUNK_PIPELINE_THREADS_MAX)
+                return -EINVAL;
+        if (digest_type < 0 || digest_type >= _CA_DIGEST_TYPE_MAX)
+                return -EINVAL;
+        if (!process)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        p = new0(CaChunkPipeline, 1);
+        if (!p)
+                return -ENOMEM;
+
+        p->digest_type = digest_type;
+        p->process = process;
+        p->userdata = userdata;
+
+        p->n_jobs = n_threads * CA_CHUNK_PIPELINE_QUEUE_PER_THREAD;
+        p->jobs = new0(CaChunkJob, p->n_jobs);
+        if (!p->jobs) {
+                free(p);
+                return -ENOMEM;
+        }
+
+        p->threads = new0(pthread_t, n_threads);
+        if (!p->threads) {
+                free(p->jobs);
+                free(p);
+                return -ENOMEM;
+        }
+
+        assert_se(pthread_mutex_init(&p->mutex, NULL) == 0);
+        assert_se(pthread_cond_init(&p->work_cond, NULL) == 0);
+        assert_se(pthread_cond_init(&p->done_cond, NULL) == 0);
+
+        /* libgcrypt initialization is not thread-safe, hence do it before we fork off any threads */
+        initialize_libgcrypt();
+
+        /* Make sure signals are only delivered to the main thread, not our workers */
+        assert_se(sigfillset(&ss) >= 0);
+        assert_se(pthread_sigmask(SIG_BLOCK, &ss, &saved_ss) == 0);
+
+        for (; p->n_threads < n_threads; p->n_threads++) {
+                r = pthread_create(p->threads + p->n_threads, NULL, ca_chunk_pipeline_worker, p);
+                if (r != 0) {
+                        assert_se(pthread_sigmask(SIG_SETMASK, &saved_ss, NULL) == 0);
+                        ca_chunk_pipeline_free(p);
+                        return -r;
+                }
+        }
+
+        assert_se(pthread_sigmask(SIG_SETMASK, &saved_ss, NULL) == 0);
+
+        *ret = p;
+        return 0;
+}
+
+CaChunkPipeline* ca_chunk_pipeline_free(CaChunkPipeline *p) {
+        unsigned i;
+        size_t k;
+
+        if (!p)
+                return NULL;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        p->shutdown = true;
+        assert_se(pthread_cond_broadcast(&p->work_cond) == 0);
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        for (i = 0; i < p->n_threads; i++)
+                assert_se(pthread_join(p->threads[i], NULL) == 0);
+
+        assert_se(pthread_cond_destroy(&p->done_cond) == 0);
+        assert_se(pthread_cond_destroy(&p->work_cond) == 0);
+        assert_se(pthread_mutex_destroy(&p->mutex) == 0);
+
+        for (k = 0; k < p->n_jobs; k++)
+                realloc_buffer_free(&p->jobs[k].buffer);
+
+        free(p->jobs);
+        free(p->threads);
+
+        return mfree(p);
+}
+
+int ca_chunk_pipeline_put(CaChunkPipeline *p, const void *data, size_t size) {
+        CaChunkJob *j;
+
+        if (!p)
+                return -EINVAL;
+        if (!data)
+                return -EINVAL;
+        if (size < CA_CHUNK_SIZE_LIMIT_MIN)
+                return -EINVAL;
+        if (size > CA_CHUNK_SIZE_LIMIT_MAX)
+                return -EINVAL;
+
+        /* Only the thread that enqueues and dequeues ever changes 'head' and 'tail', hence no need to lock for
+         * checking them, or for filling in the free slot. */
+        if (p->tail - p->head >= p->n_jobs)
+                return -EAGAIN;
+
+        j = ca_chunk_pipeline_job(p, p->tail);
+
+        realloc_buffer_empty(&j->buffer);
+        if (!realloc_buffer_append(&j->buffer, data, size))
+                return -ENOMEM;
+
+        j->size = size;
+        j->result = 0;
+        j->done = false;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        p->tail++;
+        assert_se(pthread_cond_signal(&p->work_cond) == 0);
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        return 0;
+}
+
+int ca_chunk_pipeline_put_done(CaChunkPipeline *p, const CaChunkID *id, size_t size, int result) {
+        CaChunkJob *j;
+
+        if (!p)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+
+        if (p->tail - p->head >= p->n_jobs)
+                return -EAGAIN;
+
+        j = ca_chunk_pipeline_job(p, p->tail);
+
+        realloc_buffer_empty(&j->buffer);
+
+        j->id = *id;
+        j->size = size;
+        j->result = result;
+        j->done = true;
+
+        /* No need to wake up any worker, they skip over jobs that are done already */
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        p->tail++;
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        return 0;
+}
+
+int ca_chunk_pipeline_get(CaChunkPipeline *p, bool wait, CaChunkID *ret_id, size_t *ret_size, int *ret_result) {
+        CaChunkJob *j;
+
+        if (!p)
+                return -EINVAL;
+
+        if (p->head >= p->tail)
+                return 0;
+
+        j = ca_chunk_pipeline_job(p, p->head);
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        while (!j->done) {
+                if (!wait) {
+                        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+                        return -EAGAIN;
+                }
+
+                assert_se(pthread_cond_wait(&p->done_cond, &p->mutex) == 0);
+        }
+
+        p->head++;
+
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        if (j->result < 0)
+                return j->result;
+
+        if (ret_id)
+                *ret_id = j->id;
+        if (ret_size)
+                *ret_size = j->size;
+        if (ret_result)
+                *ret_result = j->result;
+
+        return 1;
+}
+
+bool ca_chunk_pipeline_is_full(CaChunkPipeline *p) {
+        assert(p);
+
+        return p->tail - p->head >= p->n_jobs;
+}
+
+size_t ca_chunk_pipeline_queued(CaChunkPipeline *p) {
+        assert(p);
+
+        return (size_t) (p->tail - p->head);
+}
+
+unsigned ca_threads_auto(void) {
+        long n;
+
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n <= 0)
+                return 1;
+
+        return (unsigned) MIN((unsigned long) n, (unsigned long) CA_CHUNK_PIPELINE_THREADS_MAX);
+}
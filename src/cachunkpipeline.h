@@ -0,0 +1,44 @@
+#ifndef foocachunkpipelinehfoo
+#define foocachunkpipelinehfoo
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "cachunkid.h"
+
+/* A pool of worker threads that calculates chunk IDs and hands each chunk to a processing callback (typically: compress
+ * and write it to a store). Chunks are enqueued in stream order, and are dequeued again in exactly the same order,
+ * regardless in which order the workers finish them, so that the index can be written sequentially. */
+
+typedef struct CaChunkPipeline CaChunkPipeline;
+
+/* Invoked on a worker thread, hence must be thread-safe. Returns a negative errno-style error, or a non-negative value
+ * that is passed back to the caller when the chunk is dequeued. */
+typedef int (*CaChunkPipelineProcess)(void *userdata, const CaChunkID *id, const void *p, size_t l);
+
+/* The number of chunks that may be queued or in flight per worker thread before ca_chunk_pipeline_put() refuses more */
+#define CA_CHUNK_PIPELINE_QUEUE_PER_THREAD 4U
+
+#define CA_CHUNK_PIPELINE_THREADS_MAX 256U
+
+int ca_chunk_pipeline_new(unsigned n_threads, CaDigestType digest_type, CaChunkPipelineProcess process, void *userdata, CaChunkPipeline **ret);
+CaChunkPipeline* ca_chunk_pipeline_free(CaChunkPipeline *p);
+
+/* Enqueues a copy of the specified chunk. Returns -EAGAIN if the queue is full, in which case the caller should dequeue
+ * a chunk first. */
+int ca_chunk_pipeline_put(CaChunkPipeline *p, const void *data, size_t size);
+
+/* Enqueues a chunk that needs no processing, because the caller already knows its ID and result. It is dequeued in
+ * order with all others. Returns -EAGAIN if the queue is full. */
+int ca_chunk_pipeline_put_done(CaChunkPipeline *p, const CaChunkID *id, size_t size, int result);
+
+/* Dequeues the oldest chunk. Returns 0 if the queue is empty, -EAGAIN if the oldest chunk is not processed yet and
+ * 'wait' is false, and > 0 if a chunk was dequeued. If processing the chunk failed, the error is returned. */
+int ca_chunk_pipeline_get(CaChunkPipeline *p, bool wait, CaChunkID *ret_id, size_t *ret_size, int *ret_result);
+
+bool ca_chunk_pipeline_is_full(CaChunkPipeline *p);
+size_t ca_chunk_pipeline_queued(CaChunkPipeline *p);
+
+unsigned ca_threads_auto(void);
+
+#endif
@@ -0,0 +1,358 @@
+#include <errno.h>
+
+#include "cacompression.h"
+#include "util.h"
+
+static const uint8_t xz_signature[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+static const uint8_t zstd_signature[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+static const char* const compression_type_table[_CA_COMPRESSION_TYPE_MAX] = {
+        [CA_COMPRESSION_XZ] = "xz",
+        [CA_COMPRESSION_ZSTD] = "zstd",
+};
+
+bool ca_compression_type_supported(CaCompressionType t) {
+
+        switch (t) {
+
+        case CA_COMPRESSION_XZ:
+                return true;
+
+        case CA_COMPRESSION_ZSTD:
+                return HAVE_LIBZSTD;
+
+        default:
+                return false;
+        }
+}
+
+int ca_compression_level_valid(CaCompressionType t, int level) {
+
+        if (!ca_compression_type_supported(t))
+                return -EOPNOTSUPP;
+
+        if (level == CA_COMPRESSION_LEVEL_DEFAULT)
+                return true;
+
+        switch (t) {
+
+        case CA_COMPRESSION_XZ:
+                return level >= 0 && level <= 9;
+
+#if HAVE_LIBZSTD
+        case CA_COMPRESSION_ZSTD:
+                return level >= ZSTD_minCLevel() && level <= ZSTD_maxCLevel();
+#endif
+
+        default:
+                return false;
+        }
+}
+
+int ca_compression_detect(const void *p, size_t l, CaCompressionType *ret) {
+        if (!p && l > 0)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        if (l >= sizeof(xz_signature) && memcmp(p, xz_signature, sizeof(xz_signature)) == 0) {
+                *ret = CA_COMPRESSION_XZ;
+                return 0;
+        }
+
+        if (l >= sizeof(zstd_signature) && memcmp(p, zstd_signature, sizeof(zstd_signature)) == 0) {
+                *ret = CA_COMPRESSION_ZSTD;
+                return 0;
+        }
+
+        /* If what we have so far is the beginning of one of the signatures, we need more data */
+        if ((l < sizeof(xz_signature) && memcmp(p, xz_signature, l) == 0) ||
+            (l < sizeof(zstd_signature) && memcmp(p, zstd_signature, l) == 0))
+                return -EAGAIN;
+
+        return -EBADMSG;
+}
+
+static int ca_compression_init(CaCompressionContext *c) {
+        lzma_ret xzr;
+
+        assert(c);
+        assert(!c->initialized);
+
+        /* Sets up the codec for a new stream. If the context was used before, the codec's state is reset instead of
+         * being allocated anew, which is where most of the cost of compressing small chunks goes otherwise. */
+
+        switch (c->type) {
+
+        case CA_COMPRESSION_XZ:
+                /* liblzma reuses the memory of a stream that was initialized before, as long as the settings match */
+                if (c->operation == CA_COMPRESSION_COMPRESS)
+                        xzr = lzma_easy_encoder(&c->xz,
+                                                c->level == CA_COMPRESSION_LEVEL_DEFAULT ? LZMA_PRESET_DEFAULT : (uint32_t) c->level,
+                                                LZMA_CHECK_CRC64);
+                else
+                        xzr = lzma_stream_decoder(&c->xz, UINT64_MAX, LZMA_TELL_UNSUPPORTED_CHECK);
+                if (xzr != LZMA_OK)
+                        return -EIO;
+
+                c->xz_allocated = true;
+                break;
+
+#if HAVE_LIBZSTD
+        case CA_COMPRESSION_ZSTD:
+                if (c->operation == CA_COMPRESSION_COMPRESS) {
+                        if (c->zstd_cctx) {
+                                if (ZSTD_isError(ZSTD_CCtx_reset(c->zstd_cctx, ZSTD_reset_session_only)))
+                                        return -EIO;
+                        } else {
+                                c->zstd_cctx = ZSTD_createCCtx();
+                                if (!c->zstd_cctx)
+                                        return -ENOMEM;
+
+                                /* Protect the data with a checksum, like we do for xz */
+                                if (ZSTD_isError(ZSTD_CCtx_setParameter(c->zstd_cctx, ZSTD_c_checksumFlag, 1)))
+                                        return -EIO;
+                        }
+
+                        if (ZSTD_isError(ZSTD_CCtx_setParameter(c->zstd_cctx, ZSTD_c_compressionLevel,
+                                                                c->level == CA_COMPRESSION_LEVEL_DEFAULT ? ZSTD_CLEVEL_DEFAULT : c->level)))
+                                return -EINVAL;
+                } else {
+                        if (c->zstd_dctx) {
+                                if (ZSTD_isError(ZSTD_DCtx_reset(c->zstd_dctx, ZSTD_reset_session_only)))
+                                        return -EIO;
+                        } else {
+                                c->zstd_dctx = ZSTD_createDCtx();
+                                if (!c->zstd_dctx)
+                                        return -ENOMEM;
+                        }
+                }
+
+                break;
+#endif
+
+        default:
+                return -EOPNOTSUPP;
+        }
+
+        c->initialized = true;
+        return 0;
+}
+
+int ca_compression_start(CaCompressionContext *c, CaCompressionOperation operation, CaCompressionType type, int level) {
+        int r;
+
+        if (!c)
+                return -EINVAL;
+        if (!IN_SET(operation, CA_COMPRESSION_COMPRESS, CA_COMPRESSION_DECOMPRESS))
+                return -EINVAL;
+
+        if (operation == CA_COMPRESSION_COMPRESS) {
+                r = ca_compression_level_valid(type, level);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        return -ERANGE;
+        }
+
+        /* Note that we keep the codec state around, if this context was used before */
+        c->operation = operation;
+        c->type = operation == CA_COMPRESSION_COMPRESS ? type : _CA_COMPRESSION_TYPE_INVALID;
+        c->level = level;
+        c->next_in = NULL;
+        c->avail_in = 0;
+        c->next_out = NULL;
+        c->avail_out = 0;
+        c->n_magic = 0;
+        c->initialized = false;
+
+        /* When decompressing we can only initialize the codec once we know which one it is */
+        if (operation == CA_COMPRESSION_DECOMPRESS)
+                return 0;
+
+        r = ca_compression_init(c);
+        if (r < 0) {
+                ca_compression_done(c);
+                return r;
+        }
+
+        return 0;
+}
+
+static int ca_compression_run_codec(CaCompressionContext *c, bool finish) {
+        assert(c);
+        assert(c->initialized);
+
+        switch (c->type) {
+
+        case CA_COMPRESSION_XZ: {
+                lzma_ret xzr;
+
+                c->xz.next_in = c->next_in;
+                c->xz.avail_in = c->avail_in;
+                c->xz.next_out = c->next_out;
+                c->xz.avail_out = c->avail_out;
+
+                xzr = lzma_code(&c->xz, finish ? LZMA_FINISH : LZMA_RUN);
+
+                c->next_in = c->xz.next_in;
+                c->avail_in = c->xz.avail_in;
+                c->next_out = c->xz.next_out;
+                c->avail_out = c->xz.avail_out;
+
+                if (xzr == LZMA_STREAM_END)
+                        return CA_COMPRESSION_EOF;
+                if (xzr != LZMA_OK)
+                        return -EIO;
+
+                return CA_COMPRESSION_MORE;
+        }
+
+#if HAVE_LIBZSTD
+        case CA_COMPRESSION_ZSTD: {
+                ZSTD_inBuffer input = {
+                        .src = c->next_in,
+                        .size = c->avail_in,
+                };
+                ZSTD_outBuffer output = {
+                        .dst = c->next_out,
+                        .size = c->avail_out,
+                };
+                size_t k;
+
+                if (c->operation == CA_COMPRESSION_COMPRESS)
+                        k = ZSTD_compressStream2(c->zstd_cctx, &output, &input, finish ? ZSTD_e_end : ZSTD_e_continue);
+                else
+                        k = ZSTD_decompressStream(c->zstd_dctx, &output, &input);
+                if (ZSTD_isError(k))
+                        return -EIO;
+
+                /* Like xz, refuse if the input ended prematurely, instead of asking for more forever */
+                if (c->operation == CA_COMPRESSION_DECOMPRESS && finish && k > 0 &&
+                    c->avail_out > 0 && input.pos == 0 && output.pos == 0)
+                        return -EIO;
+
+                c->next_in += input.pos;
+                c->avail_in -= input.pos;
+                c->next_out += output.pos;
+                c->avail_out -= output.pos;
+
+                /* When compressing, 0 means everything is flushed, when decompressing that the frame is complete */
+                if (k == 0 && (finish || c->operation == CA_COMPRESSION_DECOMPRESS))
+                        return CA_COMPRESSION_EOF;
+
+                return CA_COMPRESSION_MORE;
+        }
+#endif
+
+        default:
+                return -EOPNOTSUPP;
+        }
+}
+
+int ca_compression_run(CaCompressionContext *c, bool finish) {
+        int r;
+
+        if (!c)
+                return -EINVAL;
+        if (!c->next_in && c->avail_in > 0)
+                return -EINVAL;
+        if (!c->next_out && c->avail_out > 0)
+                return -EINVAL;
+
+        if (!c->initialized) {
+                const uint8_t *saved_next_in;
+                size_t saved_avail_in, m;
+
+                assert(c->operation == CA_COMPRESSION_DECOMPRESS);
+
+                /* Collect enough bytes to identify the codec */
+                m = MIN(sizeof(c->magic) - c->n_magic, c->avail_in);
+                memcpy(c->magic + c->n_magic, c->next_in, m);
+                c->n_magic += m;
+                c->next_in += m;
+                c->avail_in -= m;
+
+                r = ca_compression_detect(c->magic, c->n_magic, &c->type);
+                if (r == -EAGAIN)
+                        return finish ? -EBADMSG : CA_COMPRESSION_MORE;
+                if (r < 0)
+                        return r;
+
+                r = ca_compression_init(c);
+                if (r < 0)
+                        return r;
+
+                /* Now pass the bytes we already took to the decoder. They are too few to generate any output. */
+                saved_next_in = c->next_in;
+                saved_avail_in = c->avail_in;
+
+                c->next_in = c->magic;
+                c->avail_in = c->n_magic;
+
+                r = ca_compression_run_codec(c, false);
+                if (r < 0)
+                        return r;
+                if (r != CA_COMPRESSION_MORE || c->avail_in > 0)
+                        return -EBADMSG;
+
+                c->next_in = saved_next_in;
+                c->avail_in = saved_avail_in;
+        }
+
+        return ca_compression_run_codec(c, finish);
+}
+
+void ca_compression_done(CaCompressionContext *c) {
+        if (!c)
+                return;
+
+        if (c->xz_allocated)
+                lzma_end(&c->xz);
+
+#if HAVE_LIBZSTD
+        ZSTD_freeCCtx(c->zstd_cctx);
+        ZSTD_freeDCtx(c->zstd_dctx);
+#endif
+
+        *c = (CaCompressionContext) {
+                .xz = LZMA_STREAM_INIT,
+        };
+}
+
+size_t ca_compression_bound(CaCompressionType t, size_t size) {
+
+        switch (t) {
+
+        case CA_COMPRESSION_XZ:
+                return lzma_stream_buffer_bound(size);
+
+#if HAVE_LIBZSTD
+        case CA_COMPRESSION_ZSTD:
+                return ZSTD_compressBound(size);
+#endif
+
+        default:
+                return 0;
+        }
+}
+
+const char *ca_compression_type_to_string(CaCompressionType t) {
+        if (t < 0 || t >= _CA_COMPRESSION_TYPE_MAX)
+                return NULL;
+
+        return compression_type_table[t];
+}
+
+CaCompressionType ca_compression_type_from_string(const char *name) {
+        CaCompressionType t;
+
+        if (!name)
+                return _CA_COMPRESSION_TYPE_INVALID;
+
+        for (t = 0; t < _CA_COMPRESSION_TYPE_MAX; t++)
+                if (streq(compression_type_table[t], name))
+                        return t;
+
+        return _CA_COMPRESSION_TYPE_INVALID;
+}
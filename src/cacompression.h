@@ -0,0 +1,87 @@
+#ifndef foocacompressionhfoo
+#define foocacompressionhfoo
+
+#include <inttypes.h>
+#include <lzma.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#if HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+/* The codecs we may store compressed chunks in. When decompressing, the codec is detected from the magic bytes at the
+ * beginning of the data, hence stores may contain chunks compressed with different codecs. */
+typedef enum CaCompressionType {
+        CA_COMPRESSION_XZ,
+        CA_COMPRESSION_ZSTD,
+        _CA_COMPRESSION_TYPE_MAX,
+        CA_COMPRESSION_DEFAULT = CA_COMPRESSION_XZ,
+        _CA_COMPRESSION_TYPE_INVALID = -1,
+} CaCompressionType;
+
+typedef enum CaCompressionOperation {
+        CA_COMPRESSION_COMPRESS,
+        CA_COMPRESSION_DECOMPRESS,
+} CaCompressionOperation;
+
+/* Pick the codec's default compression level */
+#define CA_COMPRESSION_LEVEL_DEFAULT INT32_MIN
+
+/* The longest magic we need to see before we can tell the codec */
+#define CA_COMPRESSION_MAGIC_MAX 6
+
+/* A streaming compressor/decompressor context, modelled after lzma_stream: set next_in/avail_in and
+ * next_out/avail_out, and call ca_compression_run() until it returns CA_COMPRESSION_EOF. Zero-initialize it before the
+ * first use. It may be reused for any number of streams by calling ca_compression_start() again, which keeps the
+ * codecs' working memory allocated. Release it with ca_compression_done(). Not thread-safe, use one per thread. */
+typedef struct CaCompressionContext {
+        CaCompressionOperation operation;
+        CaCompressionType type; /* When decompressing, _CA_COMPRESSION_TYPE_INVALID until the magic is read */
+        int level;
+
+        const uint8_t *next_in;
+        size_t avail_in;
+
+        uint8_t *next_out;
+        size_t avail_out;
+
+        /* The beginning of the data, while we are still looking for the magic */
+        uint8_t magic[CA_COMPRESSION_MAGIC_MAX];
+        size_t n_magic;
+
+        bool initialized;   /* Codec is set up for the current stream */
+        bool xz_allocated;  /* 'xz' has been initialized at least once, and needs lzma_end() */
+
+        lzma_stream xz;
+
+#if HAVE_LIBZSTD
+        ZSTD_CCtx *zstd_cctx;
+        ZSTD_DCtx *zstd_dctx;
+#endif
+} CaCompressionContext;
+
+enum {
+        CA_COMPRESSION_MORE, /* Call me again with more input or more output space */
+        CA_COMPRESSION_EOF,  /* The end of the compressed stream was reached */
+};
+
+/* 'type' and 'level' are ignored when decompressing */
+int ca_compression_start(CaCompressionContext *c, CaCompressionOperation operation, CaCompressionType type, int level);
+int ca_compression_run(CaCompressionContext *c, bool finish);
+void ca_compression_done(CaCompressionContext *c);
+
+/* The maximum size 'size' bytes may take up when compressed */
+size_t ca_compression_bound(CaCompressionType t, size_t size);
+
+bool ca_compression_type_supported(CaCompressionType t);
+int ca_compression_level_valid(CaCompressionType t, int level);
+
+/* Returns the codec the data is compressed with, -EAGAIN if there's not enough data to tell, -EBADMSG if it's none we
+ * know */
+int ca_compression_detect(const void *p, size_t l, CaCompressionType *ret);
+
+const char *ca_compression_type_to_string(CaCompressionType t);
+CaCompressionType ca_compression_type_from_string(const char *name);
+
+#endif
@@ -1,6 +1,4 @@
 #include <fcntl.h>
-#include <grp.h>
-#include <pwd.h>
 #include <stddef.h>
 #include <sys/acl.h>
 #include <sys/ioctl.h>
@@ -13,6 +11,7 @@
 #include <linux/msdos_fs.h>
 
 #include "cadecoder.h"
+#include "cadirentindex.h"
 #include "caformat-util.h"
 #include "caformat.h"
 #include "cautil.h"
@@ -107,6 +106,7 @@ typedef struct CaDecoderNode {
         char **dirents;
         size_t n_dirents;
         size_t n_dirents_allocated;
+        CaDirentIndex *dirent_index;
 
         bool dirents_invalid;
         bool hardlinked;
@@ -182,12 +182,8 @@ struct CaDecoder {
 
         uint64_t skip_bytes; /* How many bytes to skip if we are in CA_DECODER_SKIPPING state */
 
-        /* Cached name → UID/GID translation */
-        uid_t cached_uid;
-        gid_t cached_gid;
-
-        char *cached_user_name;
-        char *cached_group_name;
+        /* Cached name → UID/GID translation, possibly shared with others */
+        CaNameCache *name_cache;
 
         /* A cached pair of st_dev and magic, so that we don't have to call statfs() for each file */
         dev_t cached_st_dev;
@@ -270,9 +266,6 @@ CaDecoder *ca_decoder_new(void) {
         d->seek_offset = UINT64_MAX;
         d->seek_end_offset = UINT64_MAX;
 
-        d->cached_uid = UID_INVALID;
-        d->cached_gid = GID_INVALID;
-
         d->boundary_fd = -1;
 
         d->punch_holes = true;
@@ -363,6 +356,7 @@ static void ca_decoder_node_free(CaDecoderNode *n) {
 
         n->payload_origin = ca_origin_unref(n->payload_origin);
 
+        n->dirent_index = ca_dirent_index_free(n->dirent_index);
         n->dirents = strv_free(n->dirents);
         n->n_dirents = n->n_dirents_allocated = 0;
         n->dirents_invalid = false;
@@ -391,8 +385,7 @@ CaDecoder *ca_decoder_unref(CaDecoder *d) {
         realloc_buffer_free(&d->buffer);
         ca_origin_unref(d->buffer_origin);
 
-        free(d->cached_user_name);
-        free(d->cached_group_name);
+        ca_name_cache_unref(d->name_cache);
 
         free(d->seek_path);
 
@@ -2272,6 +2265,12 @@ static int ca_decoder_parse_filename(CaDecoder *d, CaDecoderNode *n) {
                         if (d->delete && !n->dirents_invalid) {
                                 char *nd;
 
+                                if (!n->dirent_index) {
+                                        n->dirent_index = ca_dirent_index_new(0);
+                                        if (!n->dirent_index)
+                                                return -ENOMEM;
+                                }
+
                                 nd = strdup(filename->name);
                                 if (!nd)
                                         return -ENOMEM;
@@ -2283,6 +2282,10 @@ static int ca_decoder_parse_filename(CaDecoder *d, CaDecoderNode *n) {
 
                                 n->dirents[n->n_dirents++] = nd;
                                 n->dirents[n->n_dirents] = NULL;
+
+                                r = ca_dirent_index_put(n->dirent_index, nd, n->n_dirents - 1);
+                                if (r < 0)
+                                        return r;
                         }
 
                         break;
@@ -2667,20 +2670,29 @@ static gid_t ca_decoder_shift_gid(CaDecoder *d, gid_t gid) {
         return (gid_t) ca_decoder_shift_uid(d, (uid_t) gid);
 }
 
+static int ca_decoder_get_name_cache(CaDecoder *d, CaNameCache **ret) {
+        assert(d);
+        assert(ret);
+
+        if (!d->name_cache) {
+                d->name_cache = ca_name_cache_new();
+                if (!d->name_cache)
+                        return -ENOMEM;
+        }
+
+        *ret = d->name_cache;
+        return 0;
+}
+
 static int name_to_uid(CaDecoder *d, const char *name, uid_t *ret) {
         uid_t parsed_uid;
-        long bufsize;
+        CaNameCache *c;
         int r;
 
         assert(d);
         assert(name);
         assert(ret);
 
-        if (streq_ptr(name, d->cached_user_name)) {
-                *ret = d->cached_uid;
-                return 1;
-        }
-
         if (parse_uid(name, &parsed_uid) >= 0) {
                 uid_t shifted_uid;
 
@@ -2692,51 +2704,26 @@ static int name_to_uid(CaDecoder *d, const char *name, uid_t *ret) {
                 return 1;
         }
 
-        bufsize = sysconf(_SC_GETPW_R_SIZE_MAX);
-        if (bufsize <= 0)
-                bufsize = 4096;
-
-        for (;;) {
-                struct passwd pwbuf, *pw = NULL;
-                char *buf;
-
-                buf = malloc(bufsize);
-                if (!buf)
-                        return -ENOMEM;
-
-                r = getpwnam_r(name, &pwbuf, buf, (size_t) bufsize, &pw);
-                if (r == 0 && pw) {
-
-                        free(d->cached_user_name);
-                        d->cached_user_name = strdup(pw->pw_name);
-                        d->cached_uid = pw->pw_uid;
+        r = ca_decoder_get_name_cache(d, &c);
+        if (r < 0)
+                return r;
 
-                        *ret = pw->pw_uid;
-                        free(buf);
-                        return 1;
-                }
-                free(buf);
-                if (r != ERANGE)
-                        return r > 0 ? -r : -ESRCH;
+        r = ca_name_cache_name_to_uid(c, name, ret);
+        if (r == 0)
+                return -ESRCH;
 
-                bufsize *= 2;
-        }
+        return r;
 }
 
 static int name_to_gid(CaDecoder *d, const char *name, gid_t *ret) {
         gid_t parsed_gid;
-        long bufsize;
+        CaNameCache *c;
         int r;
 
         assert(d);
         assert(name);
         assert(ret);
 
-        if (streq_ptr(name, d->cached_group_name)) {
-                *ret = d->cached_gid;
-                return 1;
-        }
-
         if (parse_gid(name, &parsed_gid) >= 0) {
                 uid_t shifted_gid;
 
@@ -2748,35 +2735,15 @@ static int name_to_gid(CaDecoder *d, const char *name, gid_t *ret) {
                 return 1;
         }
 
-        bufsize = sysconf(_SC_GETGR_R_SIZE_MAX);
-        if (bufsize <= 0)
-                bufsize = 4096;
-
-        for (;;) {
-                struct group grbuf, *gr = NULL;
-                char *buf;
-
-                buf = malloc(bufsize);
-                if (!buf)
-                        return -ENOMEM;
-
-                r = getgrnam_r(name, &grbuf, buf, (size_t) bufsize, &gr);
-                if (r == 0 && gr) {
-
-                        free(d->cached_group_name);
-                        d->cached_group_name = strdup(gr->gr_name);
-                        d->cached_gid = gr->gr_gid;
+        r = ca_decoder_get_name_cache(d, &c);
+        if (r < 0)
+                return r;
 
-                        *ret = gr->gr_gid;
-                        free(buf);
-                        return 1;
-                }
-                free(buf);
-                if (r != ERANGE)
-                        return r > 0 ? -r : -ESRCH;
+        r = ca_name_cache_name_to_gid(c, name, ret);
+        if (r == 0)
+                return -ESRCH;
 
-                bufsize *= 2;
-        }
+        return r;
 }
 
 static int acl_add_entry_full(acl_t *acl, acl_tag_t tag, const void *qualifier, uint64_t permissions) {
@@ -3045,25 +3012,6 @@ static int ca_decoder_node_reflink(CaDecoder *d, CaDecoderNode *n) {
         return 0;
 }
 
-static int comparison_fn_strcmpp(const void *x, const void *y) {
-        const char* const *a = x, * const* b = y;
-
-        return strcmp(*a, *b);
-}
-
-static inline void* safe_bsearch(
-                const void *key, const void *base,
-                size_t nmemb, size_t size,
-                comparison_fn_t fn) {
-
-        /* A wrapper that makes sure we can bsearch and don't have to pass a non-NULL base for nmemb == 0 */
-
-        if (nmemb == 0)
-                return NULL;
-
-        return bsearch(key, base, nmemb, size, fn);
-}
-
 static int ca_decoder_node_delete(CaDecoder *d, CaDecoderNode *n) {
         int r, fd_copy;
         mode_t mode;
@@ -3102,7 +3050,6 @@ static int ca_decoder_node_delete(CaDecoder *d, CaDecoderNode *n) {
 
         for (;;) {
                 struct dirent *de;
-                const char *key;
 
                 errno = 0;
                 de = readdir(dd);
@@ -3118,9 +3065,7 @@ static int ca_decoder_node_delete(CaDecoder *d, CaDecoderNode *n) {
                 if (dot_or_dot_dot(de->d_name))
                         continue;
 
-                key = de->d_name;
-
-                if (safe_bsearch(&key, n->dirents, n->n_dirents, sizeof(char*), comparison_fn_strcmpp))
+                if (n->dirent_index && ca_dirent_index_get(n->dirent_index, de->d_name, NULL) >= 0)
                         continue;
 
                 r = rm_rf_at(n->fd, de->d_name, REMOVE_ROOT|REMOVE_PHYSICAL|(d->undo_immutable ? REMOVE_UNDO_IMMUTABLE : 0));
@@ -4122,6 +4067,39 @@ int ca_decoder_get_request_offset(CaDecoder *d, uint64_t *ret) {
         return 0;
 }
 
+int ca_decoder_get_payload_request(CaDecoder *d, uint64_t *ret_offset, uint64_t *ret_size) {
+        CaDecoderNode *n;
+        mode_t mode;
+
+        if (!d)
+                return -EINVAL;
+        if (!ret_offset)
+                return -EINVAL;
+        if (!ret_size)
+                return -EINVAL;
+
+        /* Before the first entry has been decoded there's no payload to continue either */
+        n = ca_decoder_current_node(d);
+        if (!n)
+                return -ENODATA;
+
+        mode = ca_decoder_node_mode(n);
+        if (mode == (mode_t) -1)
+                return -ENODATA;
+        if (!S_ISREG(mode) && !S_ISBLK(mode))
+                return -ENODATA;
+
+        /* Only if everything we got so far has been written out, the next data we get continues right there */
+        if (d->state != CA_DECODER_IN_PAYLOAD)
+                return -ENODATA;
+        if (realloc_buffer_size(&d->buffer) > 0)
+                return -ENODATA;
+
+        *ret_offset = d->payload_offset;
+        *ret_size = n->size == UINT64_MAX ? UINT64_MAX : n->size - d->payload_offset;
+        return 0;
+}
+
 int ca_decoder_put_data(CaDecoder *d, const void *p, size_t size, CaOrigin *origin) {
         int r;
 
@@ -4943,6 +4921,18 @@ int ca_decoder_set_uid_shift(CaDecoder *d, uid_t u) {
         return 0;
 }
 
+int ca_decoder_set_name_cache(CaDecoder *d, CaNameCache *c) {
+        if (!d)
+                return -EINVAL;
+        if (!c)
+                return -EINVAL;
+
+        ca_name_cache_unref(d->name_cache);
+        d->name_cache = ca_name_cache_ref(c);
+
+        return 0;
+}
+
 int ca_decoder_set_uid_range(CaDecoder *d, uid_t u) {
         if (!d)
                 return -EINVAL;
@@ -8,6 +8,7 @@
 #include "cachunkid.h"
 #include "cacommon.h"
 #include "calocation.h"
+#include "canamecache.h"
 #include "caorigin.h"
 
 typedef struct CaDecoder CaDecoder;
@@ -48,6 +49,9 @@ int ca_decoder_set_undo_immutable(CaDecoder *d, bool enabled);
 int ca_decoder_set_uid_shift(CaDecoder *e, uid_t u);
 int ca_decoder_set_uid_range(CaDecoder *e, uid_t u);
 
+/* Use the specified cache for looking up user and group IDs by name, instead of a private one */
+int ca_decoder_set_name_cache(CaDecoder *d, CaNameCache *c);
+
 /* Output: a file descriptor to a directory tree, block device node, or regular file */
 int ca_decoder_set_base_fd(CaDecoder *d, int fd);
 int ca_decoder_set_boundary_fd(CaDecoder *d, int fd);
@@ -64,6 +68,10 @@ int ca_decoder_step(CaDecoder *d);
 /* If ca_decoder_step() returned CA_DECODER_REQUEST, which offset we are at now */
 int ca_decoder_get_request_offset(CaDecoder *d, uint64_t *offset);
 
+/* If ca_decoder_step() returned CA_DECODER_REQUEST in the middle of a file's payload, at which payload offset the
+ * requested data goes, and how much of the payload is left (UINT64_MAX if unknown). Returns -ENODATA otherwise. */
+int ca_decoder_get_payload_request(CaDecoder *d, uint64_t *ret_offset, uint64_t *ret_size);
+
 /* If ca_decoder_step() returned CA_DECODER_SEEK, where are we supposed to seek now? (returns absolute position) */
 int ca_decoder_get_seek_offset(CaDecoder *d, uint64_t *ret);
 
@@ -0,0 +1,153 @@
+#include <errno.h>
+#include <gcrypt.h>
+
+#include "cadigest.h"
+#include "gcrypt-util.h"
+#include "util.h"
+
+struct CaDigest {
+        CaDigestType type;
+        gcry_md_hd_t md;
+};
+
+/* libgcrypt picks the fastest implementation of each algorithm at runtime, i.e. uses the SHA extensions of x86-64
+ * CPUs and the ARMv8 crypto extensions for SHA256 if they are available. */
+static const struct {
+        const char *name;
+        int algo;
+} digest_map[_CA_DIGEST_TYPE_MAX] = {
+        [CA_DIGEST_SHA256] = { "sha256", GCRY_MD_SHA256 },
+#if GCRYPT_VERSION_NUMBER >= 0x010800
+        [CA_DIGEST_BLAKE2B_256] = { "blake2b-256", GCRY_MD_BLAKE2B_256 },
+#else
+        [CA_DIGEST_BLAKE2B_256] = { "blake2b-256", 0 },
+#endif
+};
+
+bool ca_digest_type_supported(CaDigestType t) {
+        if (t < 0 || t >= _CA_DIGEST_TYPE_MAX)
+                return false;
+
+        if (digest_map[t].algo == 0)
+                return false;
+
+        initialize_libgcrypt();
+
+        return gcry_md_test_algo(digest_map[t].algo) == 0;
+}
+
+int ca_digest_new(CaDigestType t, CaDigest **ret) {
+        CaDigest *d;
+
+        if (t < 0 || t >= _CA_DIGEST_TYPE_MAX)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        if (!ca_digest_type_supported(t))
+                return -EOPNOTSUPP;
+
+        d = new0(CaDigest, 1);
+        if (!d)
+                return -ENOMEM;
+
+        d->type = t;
+
+        if (gcry_md_open(&d->md, digest_map[t].algo, 0) != 0) {
+                free(d);
+                return -EIO;
+        }
+
+        *ret = d;
+        return 0;
+}
+
+CaDigest *ca_digest_free(CaDigest *d) {
+        if (!d)
+                return NULL;
+
+        gcry_md_close(d->md);
+
+        return mfree(d);
+}
+
+int ca_digest_ensure_allocated(CaDigest **d, CaDigestType t) {
+        CaDigest *n;
+        int r;
+
+        if (!d)
+                return -EINVAL;
+
+        if (*d && (*d)->type == t)
+                return 0;
+
+        r = ca_digest_new(t, &n);
+        if (r < 0)
+                return r;
+
+        ca_digest_free(*d);
+        *d = n;
+
+        return 1;
+}
+
+void ca_digest_write(CaDigest *d, const void *p, size_t l) {
+        assert(d);
+        assert(p || l == 0);
+
+        gcry_md_write(d->md, p, l);
+}
+
+const void* ca_digest_read(CaDigest *d) {
+        assert(d);
+
+        return gcry_md_read(d->md, digest_map[d->type].algo);
+}
+
+void ca_digest_reset(CaDigest *d) {
+        assert(d);
+
+        gcry_md_reset(d->md);
+}
+
+CaDigestType ca_digest_get_type(CaDigest *d) {
+        if (!d)
+                return _CA_DIGEST_TYPE_INVALID;
+
+        return d->type;
+}
+
+size_t ca_digest_get_size(CaDigest *d) {
+        if (!d)
+                return (size_t) -1;
+
+        return ca_digest_type_size(d->type);
+}
+
+size_t ca_digest_type_size(CaDigestType t) {
+        if (t < 0 || t >= _CA_DIGEST_TYPE_MAX)
+                return (size_t) -1;
+
+        /* All our digests are 256bit wide, so that they may be used as chunk IDs */
+        return 32;
+}
+
+const char *ca_digest_type_to_string(CaDigestType t) {
+        if (t < 0 || t >= _CA_DIGEST_TYPE_MAX)
+                return NULL;
+
+        return digest_map[t].name;
+}
+
+CaDigestType ca_digest_type_from_string(const char *name) {
+        CaDigestType t;
+
+        if (!name)
+                return _CA_DIGEST_TYPE_INVALID;
+
+        for (t = 0; t < _CA_DIGEST_TYPE_MAX; t++)
+                if (streq(digest_map[t].name, name))
+                        return t;
+
+        return _CA_DIGEST_TYPE_INVALID;
+}
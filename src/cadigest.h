@@ -0,0 +1,40 @@
+#ifndef foocadigesthfoo
+#define foocadigesthfoo
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* The hash function used to calculate chunk IDs. SHA256 is what casync always used and remains the default. BLAKE2b
+ * cut to 256 bits is considerably faster on CPUs without SHA extensions, and may be selected when creating an index,
+ * in which case this is recorded in the index' feature flags. */
+
+typedef enum CaDigestType {
+        CA_DIGEST_SHA256,
+        CA_DIGEST_BLAKE2B_256,
+        _CA_DIGEST_TYPE_MAX,
+        CA_DIGEST_DEFAULT = CA_DIGEST_SHA256,
+        _CA_DIGEST_TYPE_INVALID = -1,
+} CaDigestType;
+
+typedef struct CaDigest CaDigest;
+
+int ca_digest_new(CaDigestType t, CaDigest **ret);
+CaDigest *ca_digest_free(CaDigest *d);
+
+/* Allocates a digest object of the specified type in *d, if there's none yet or if it has a different type */
+int ca_digest_ensure_allocated(CaDigest **d, CaDigestType t);
+
+void ca_digest_write(CaDigest *d, const void *p, size_t l);
+const void* ca_digest_read(CaDigest *d);
+void ca_digest_reset(CaDigest *d);
+
+CaDigestType ca_digest_get_type(CaDigest *d);
+size_t ca_digest_get_size(CaDigest *d);
+
+size_t ca_digest_type_size(CaDigestType t);
+bool ca_digest_type_supported(CaDigestType t);
+
+const char *ca_digest_type_to_string(CaDigestType t);
+CaDigestType ca_digest_type_from_string(const char *name);
+
+#endif
@@ -0,0 +1,184 @@
+#include <pthread.h>
+
+#include "cadirentindex.h"
+#include "siphash24.h"
+#include "util.h"
+
+#define CA_DIRENT_INDEX_SLOTS_MIN ((size_t) 16)
+
+typedef struct CaDirentIndexSlot {
+        const char *name;     /* NULL for unused slots */
+        uint32_t hash;        /* The lower bits of the name's hash, so that we rarely need to compare names */
+        uint32_t idx;
+} CaDirentIndexSlot;
+
+struct CaDirentIndex {
+        CaDirentIndexSlot *slots;
+        size_t n_slots;
+        size_t n_used;
+};
+
+/* The names might come from an archive, hence don't let them pick the slots. One key for all indexes is enough for
+ * that, and saves us from reading /dev/urandom for each directory. */
+static uint8_t hash_key[16];
+static pthread_once_t hash_key_once = PTHREAD_ONCE_INIT;
+
+static void hash_key_init(void) {
+        uint64_t k[2];
+
+        k[0] = random_u64();
+        k[1] = random_u64();
+        memcpy(hash_key, k, sizeof(hash_key));
+}
+
+static size_t slots_for(size_t n) {
+        size_t k = CA_DIRENT_INDEX_SLOTS_MIN;
+
+        /* Keep the table at most 70% full, as linear probing gets slow beyond that */
+        while (n * 10 > k * 7)
+                k *= 2;
+
+        return k;
+}
+
+CaDirentIndex* ca_dirent_index_new(size_t n) {
+        CaDirentIndex *x;
+
+        assert_se(pthread_once(&hash_key_once, hash_key_init) == 0);
+
+        x = new0(CaDirentIndex, 1);
+        if (!x)
+                return NULL;
+
+        if (n > 0) {
+                x->n_slots = slots_for(n);
+                x->slots = new0(CaDirentIndexSlot, x->n_slots);
+                if (!x->slots)
+                        return mfree(x);
+        }
+
+        return x;
+}
+
+CaDirentIndex* ca_dirent_index_free(CaDirentIndex *x) {
+        if (!x)
+                return NULL;
+
+        free(x->slots);
+        return mfree(x);
+}
+
+static CaDirentIndexSlot* ca_dirent_index_find(CaDirentIndex *x, const char *name, uint32_t hash) {
+        size_t k, mask;
+
+        assert(x);
+        assert(name);
+        assert(x->n_slots > 0);
+
+        mask = x->n_slots - 1;
+        k = (size_t) hash & mask;
+
+        for (;;) {
+                CaDirentIndexSlot *s = x->slots + k;
+
+                if (!s->name)
+                        return s;
+                if (s->hash == hash && streq(s->name, name))
+                        return s;
+
+                k = (k + 1) & mask;
+        }
+}
+
+static int ca_dirent_index_grow(CaDirentIndex *x) {
+        CaDirentIndexSlot *old = x->slots;
+        size_t n_old = x->n_slots, i;
+
+        assert(x);
+
+        if ((x->n_used + 1) * 10 <= x->n_slots * 7)
+                return 0;
+
+        x->n_slots = MAX(n_old * 2, CA_DIRENT_INDEX_SLOTS_MIN);
+        x->slots = new0(CaDirentIndexSlot, x->n_slots);
+        if (!x->slots) {
+                x->slots = old;
+                x->n_slots = n_old;
+                return -ENOMEM;
+        }
+
+        for (i = 0; i < n_old; i++)
+                if (old[i].name)
+                        *ca_dirent_index_find(x, old[i].name, old[i].hash) = old[i];
+
+        free(old);
+        return 0;
+}
+
+static uint32_t ca_dirent_index_hash(const char *name) {
+        return (uint32_t) siphash24(name, strlen(name), hash_key);
+}
+
+int ca_dirent_index_put(CaDirentIndex *x, const char *name, size_t idx) {
+        CaDirentIndexSlot *s;
+        uint32_t hash;
+        int r;
+
+        if (!x)
+                return -EINVAL;
+        if (!name)
+                return -EINVAL;
+        if (idx > UINT32_MAX)
+                return -EOVERFLOW;
+
+        r = ca_dirent_index_grow(x);
+        if (r < 0)
+                return r;
+
+        hash = ca_dirent_index_hash(name);
+
+        s = ca_dirent_index_find(x, name, hash);
+        if (s->name)
+                return 0;
+
+        *s = (CaDirentIndexSlot) {
+                .name = name,
+                .hash = hash,
+                .idx = (uint32_t) idx,
+        };
+
+        x->n_used++;
+        return 1;
+}
+
+int ca_dirent_index_get(CaDirentIndex *x, const char *name, size_t *ret) {
+        CaDirentIndexSlot *s;
+
+        if (!x)
+                return -EINVAL;
+        if (!name)
+                return -EINVAL;
+
+        if (x->n_used == 0)
+                return -ENOENT;
+
+        s = ca_dirent_index_find(x, name, ca_dirent_index_hash(name));
+        if (!s->name)
+                return -ENOENT;
+
+        if (ret)
+                *ret = s->idx;
+
+        return 0;
+}
+
+size_t ca_dirent_index_entries(CaDirentIndex *x) {
+        return x ? x->n_used : 0;
+}
+
+size_t ca_dirent_index_size(CaDirentIndex *x) {
+        if (!x)
+                return 0;
+
+        return sizeof(CaDirentIndex) + x->n_slots * sizeof(CaDirentIndexSlot);
+}
@@ -0,0 +1,28 @@
+#ifndef foocadirentindexhfoo
+#define foocadirentindexhfoo
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+/* A hash table mapping the names of directory entries to their position in the array they are kept in, so that even in
+ * directories with hundreds of thousands of entries looking up a name doesn't require a search. The names aren't
+ * copied, they need to stay around for as long as the index does. */
+
+typedef struct CaDirentIndex CaDirentIndex;
+
+/* 'n' is the number of entries expected, or 0 if that isn't known */
+CaDirentIndex* ca_dirent_index_new(size_t n);
+CaDirentIndex* ca_dirent_index_free(CaDirentIndex *x);
+
+/* Returns 0 if there's an entry for the name already, and leaves it as it is then, > 0 if the entry was added */
+int ca_dirent_index_put(CaDirentIndex *x, const char *name, size_t idx);
+
+/* Returns -ENOENT if there's no entry for the name. 'ret' may be NULL to just check for one. */
+int ca_dirent_index_get(CaDirentIndex *x, const char *name, size_t *ret);
+
+size_t ca_dirent_index_entries(CaDirentIndex *x);
+
+/* The memory the index takes up, not counting the names */
+size_t ca_dirent_index_size(CaDirentIndex *x);
+
+#endif
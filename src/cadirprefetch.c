@@ -0,0 +1,440 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "cadirprefetch.h"
+#include "util.h"
+
+typedef enum CaDirPrefetchState {
+        CA_DIR_PREFETCH_FREE,
+        CA_DIR_PREFETCH_QUEUED,
+        CA_DIR_PREFETCH_RUNNING,
+        CA_DIR_PREFETCH_DONE,
+} CaDirPrefetchState;
+
+typedef struct CaDirPrefetchEntry {
+        CaDirPrefetchWindow *window;
+        size_t idx;
+        CaDirPrefetchState state;
+
+        int fd;
+        struct stat stat;
+        int error;
+} CaDirPrefetchEntry;
+
+struct CaDirPrefetchWindow {
+        CaDirPrefetch *prefetch;
+
+        int dir_fd;
+        struct dirent **dirents;
+        size_t n_dirents;
+
+        /* Entry idx is stored at idx % CA_DIR_PREFETCH_WINDOW */
+        CaDirPrefetchEntry entries[CA_DIR_PREFETCH_WINDOW];
+        size_t next; /* The next entry to queue */
+};
+
+struct CaDirPrefetch {
+        pthread_mutex_t mutex;
+        pthread_cond_t work_cond; /* signalled when a new entry was queued, or we shall shut down */
+        pthread_cond_t done_cond; /* signalled when an entry was processed */
+
+        pthread_t *threads;
+        unsigned n_threads;
+
+        /* Entries waiting for a thread, oldest first */
+        CaDirPrefetchEntry *queue[CA_DIR_PREFETCH_FILES_MAX];
+        size_t n_queue;
+
+        /* Entries in any state but FREE, in all windows */
+        size_t n_pending;
+
+        uint64_t n_hits;
+        uint64_t n_misses;
+
+        bool shutdown;
+};
+
+int ca_open_dirent(int dir_fd, const struct dirent *de, int *ret_fd, struct stat *ret_stat) {
+        int open_flags = O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW, fd;
+        bool shall_open, have_stat;
+
+        if (dir_fd < 0)
+                return -EBADF;
+        if (!de)
+                return -EINVAL;
+        if (!ret_fd)
+                return -EINVAL;
+        if (!ret_stat)
+                return -EINVAL;
+
+        /* If the directory entry tells us the type already we can open it right-away, and only need to stat it
+         * afterwards */
+        if (IN_SET(de->d_type, DT_DIR, DT_REG)) {
+                shall_open = true;
+                have_stat = false;
+
+                if (de->d_type == DT_DIR)
+                        open_flags |= O_DIRECTORY;
+        } else {
+                if (fstatat(dir_fd, de->d_name, ret_stat, AT_SYMLINK_NOFOLLOW) < 0)
+                        return -errno;
+
+                have_stat = true;
+                shall_open = S_ISREG(ret_stat->st_mode) || S_ISDIR(ret_stat->st_mode);
+
+                if (S_ISDIR(ret_stat->st_mode))
+                        open_flags |= O_DIRECTORY;
+        }
+
+        if (!shall_open) {
+                *ret_fd = -1;
+                return 0;
+        }
+
+        fd = openat(dir_fd, de->d_name, open_flags);
+        if (fd < 0)
+                return -errno;
+
+        if (!have_stat) {
+                if (fstat(fd, ret_stat) < 0) {
+                        int r = -errno;
+
+                        safe_close(fd);
+                        return r;
+                }
+        }
+
+        *ret_fd = fd;
+        return 0;
+}
+
+static void* ca_dir_prefetch_thread(void *userdata) {
+        CaDirPrefetch *p = userdata;
+
+        assert(p);
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        for (;;) {
+                CaDirPrefetchWindow *w;
+                CaDirPrefetchEntry *e;
+                struct stat st;
+                int fd = -1, r;
+
+                while (!p->shutdown && p->n_queue == 0)
+                        assert_se(pthread_cond_wait(&p->work_cond, &p->mutex) == 0);
+
+                if (p->shutdown)
+                        break;
+
+                e = p->queue[0];
+                memmove(p->queue, p->queue + 1, --p->n_queue * sizeof(CaDirPrefetchEntry*));
+
+                assert(e->state == CA_DIR_PREFETCH_QUEUED);
+                e->state = CA_DIR_PREFETCH_RUNNING;
+                w = e->window;
+
+                /* The window can't go away while one of its entries is running, hence work on it unlocked */
+                assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+                r = ca_open_dirent(w->dir_fd, w->dirents[e->idx], &fd, &st);
+                assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+                e->error = r < 0 ? r : 0;
+                e->fd = fd;
+                if (r >= 0)
+                        e->stat = st;
+                e->state = CA_DIR_PREFETCH_DONE;
+
+                assert_se(pthread_cond_broadcast(&p->done_cond) == 0);
+        }
+
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        return NULL;
+}
+
+int ca_dir_prefetch_new(unsigned n_threads, CaDirPrefetch **ret) {
+        CaDirPrefetch *p;
+        sigset_t ss, saved_ss;
+        int r;
+
+        if (n_threads < 1)
+                return -EINVAL;
+        if (n_threads > CA_DIR_PREFETCH_THREADS_MAX)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        p = new0(CaDirPrefetch, 1);
+        if (!p)
+                return -ENOMEM;
+
+        p->threads = new0(pthread_t, n_threads);
+        if (!p->threads) {
+                free(p);
+                return -ENOMEM;
+        }
+
+        assert_se(pthread_mutex_init(&p->mutex, NULL) == 0);
+        assert_se(pthread_cond_init(&p->work_cond, NULL) == 0);
+        assert_se(pthread_cond_init(&p->done_cond, NULL) == 0);
+
+        /* Make sure signals are only delivered to the main thread */
+        assert_se(sigfillset(&ss) >= 0);
+        assert_se(pthread_sigmask(SIG_BLOCK, &ss, &saved_ss) == 0);
+
+        for (; p->n_threads < n_threads; p->n_threads++) {
+                r = pthread_create(p->threads + p->n_threads, NULL, ca_dir_prefetch_thread, p);
+                if (r != 0) {
+                        assert_se(pthread_sigmask(SIG_SETMASK, &saved_ss, NULL) == 0);
+                        ca_dir_prefetch_free(p);
+                        return -r;
+                }
+        }
+
+        assert_se(pthread_sigmask(SIG_SETMASK, &saved_ss, NULL) == 0);
+
+        *ret = p;
+        return 0;
+}
+
+CaDirPrefetch* ca_dir_prefetch_free(CaDirPrefetch *p) {
+        unsigned i;
+
+        if (!p)
+                return NULL;
+
+        /* All windows must have been freed before */
+        assert(p->n_pending == 0);
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        p->shutdown = true;
+        assert_se(pthread_cond_broadcast(&p->work_cond) == 0);
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        for (i = 0; i < p->n_threads; i++)
+                assert_se(pthread_join(p->threads[i], NULL) == 0);
+
+        assert_se(pthread_cond_destroy(&p->done_cond) == 0);
+        assert_se(pthread_cond_destroy(&p->work_cond) == 0);
+        assert_se(pthread_mutex_destroy(&p->mutex) == 0);
+
+        free(p->threads);
+
+        return mfree(p);
+}
+
+uint64_t ca_dir_prefetch_get_hits(CaDirPrefetch *p) {
+        if (!p)
+                return 0;
+
+        return p->n_hits;
+}
+
+uint64_t ca_dir_prefetch_get_misses(CaDirPrefetch *p) {
+        if (!p)
+                return 0;
+
+        return p->n_misses;
+}
+
+int ca_dir_prefetch_window_new(CaDirPrefetch *p, int dir_fd, struct dirent **dirents, size_t n_dirents, CaDirPrefetchWindow **ret) {
+        CaDirPrefetchWindow *w;
+        size_t i;
+
+        if (!p)
+                return -EINVAL;
+        if (dir_fd < 0)
+                return -EBADF;
+        if (!dirents && n_dirents > 0)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        w = new0(CaDirPrefetchWindow, 1);
+        if (!w)
+                return -ENOMEM;
+
+        w->prefetch = p;
+        w->dir_fd = dir_fd;
+        w->dirents = dirents;
+        w->n_dirents = n_dirents;
+
+        for (i = 0; i < CA_DIR_PREFETCH_WINDOW; i++)
+                w->entries[i] = (CaDirPrefetchEntry) {
+                        .window = w,
+                        .fd = -1,
+                };
+
+        *ret = w;
+        return 0;
+}
+
+static void ca_dir_prefetch_entry_release(CaDirPrefetch *p, CaDirPrefetchEntry *e) {
+        size_t i;
+
+        assert(p);
+        assert(e);
+
+        /* Needs to be called with the mutex held */
+
+        switch (e->state) {
+
+        case CA_DIR_PREFETCH_FREE:
+                return;
+
+        case CA_DIR_PREFETCH_QUEUED:
+                for (i = 0; i < p->n_queue; i++)
+                        if (p->queue[i] == e)
+                                break;
+
+                assert(i < p->n_queue);
+                memmove(p->queue + i, p->queue + i + 1, (--p->n_queue - i) * sizeof(CaDirPrefetchEntry*));
+                break;
+
+        case CA_DIR_PREFETCH_RUNNING:
+                while (e->state == CA_DIR_PREFETCH_RUNNING)
+                        assert_se(pthread_cond_wait(&p->done_cond, &p->mutex) == 0);
+
+                /* Fall through */
+
+        case CA_DIR_PREFETCH_DONE:
+                e->fd = safe_close(e->fd);
+                break;
+        }
+
+        e->state = CA_DIR_PREFETCH_FREE;
+
+        assert(p->n_pending > 0);
+        p->n_pending--;
+}
+
+CaDirPrefetchWindow* ca_dir_prefetch_window_free(CaDirPrefetchWindow *w) {
+        CaDirPrefetch *p;
+        size_t i;
+
+        if (!w)
+                return NULL;
+
+        p = w->prefetch;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        for (i = 0; i < CA_DIR_PREFETCH_WINDOW; i++)
+                ca_dir_prefetch_entry_release(p, w->entries + i);
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        return mfree(w);
+}
+
+int ca_dir_prefetch_window_advance(CaDirPrefetchWindow *w, size_t idx) {
+        size_t i, end, n_queued = 0;
+        CaDirPrefetch *p;
+
+        if (!w)
+                return -EINVAL;
+
+        p = w->prefetch;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        /* Drop everything outside of the new window. If we went backwards, start over. */
+        for (i = 0; i < CA_DIR_PREFETCH_WINDOW; i++) {
+                CaDirPrefetchEntry *e = w->entries + i;
+
+                if (e->state == CA_DIR_PREFETCH_FREE)
+                        continue;
+
+                if (e->idx < idx || e->idx >= idx + CA_DIR_PREFETCH_WINDOW || idx + CA_DIR_PREFETCH_WINDOW < w->next)
+                        ca_dir_prefetch_entry_release(p, e);
+        }
+
+        if (w->next < idx || idx + CA_DIR_PREFETCH_WINDOW < w->next)
+                w->next = idx;
+
+        end = MIN(idx + CA_DIR_PREFETCH_WINDOW, w->n_dirents);
+
+        while (w->next < end && p->n_pending < CA_DIR_PREFETCH_FILES_MAX) {
+                CaDirPrefetchEntry *e;
+
+                e = w->entries + (w->next % CA_DIR_PREFETCH_WINDOW);
+                assert(e->state == CA_DIR_PREFETCH_FREE);
+
+                e->idx = w->next++;
+                e->state = CA_DIR_PREFETCH_QUEUED;
+                e->fd = -1;
+
+                p->queue[p->n_queue++] = e;
+                p->n_pending++;
+                n_queued++;
+        }
+
+        /* Usually a single entry is queued, don't wake up all threads for it */
+        if (n_queued == 1)
+                assert_se(pthread_cond_signal(&p->work_cond) == 0);
+        else if (n_queued > 1)
+                assert_se(pthread_cond_broadcast(&p->work_cond) == 0);
+
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        return 0;
+}
+
+int ca_dir_prefetch_window_take(CaDirPrefetchWindow *w, size_t idx, int *ret_fd, struct stat *ret_stat) {
+        CaDirPrefetchEntry *e;
+        CaDirPrefetch *p;
+        int r;
+
+        if (!w)
+                return -EINVAL;
+        if (!ret_fd)
+                return -EINVAL;
+        if (!ret_stat)
+                return -EINVAL;
+
+        p = w->prefetch;
+        e = w->entries + (idx % CA_DIR_PREFETCH_WINDOW);
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        if (e->state == CA_DIR_PREFETCH_FREE || e->idx != idx) {
+                r = -ENOENT;
+                goto finish;
+        }
+
+        /* If no thread got to it yet, we are faster doing it ourselves than waiting behind the others */
+        if (e->state == CA_DIR_PREFETCH_QUEUED) {
+                ca_dir_prefetch_entry_release(p, e);
+                r = -ENOENT;
+                goto finish;
+        }
+
+        while (e->state == CA_DIR_PREFETCH_RUNNING)
+                assert_se(pthread_cond_wait(&p->done_cond, &p->mutex) == 0);
+
+        if (e->error < 0) {
+                /* Let the caller try again, so that it sees the error (or success) it would have seen without us */
+                ca_dir_prefetch_entry_release(p, e);
+                r = -ENOENT;
+                goto finish;
+        }
+
+        *ret_fd = e->fd;
+        *ret_stat = e->stat;
+
+        e->fd = -1;
+        ca_dir_prefetch_entry_release(p, e);
+
+        r = 0;
+
+finish:
+        if (r < 0)
+                p->n_misses++;
+        else
+                p->n_hits++;
+
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        return r;
+}
@@ -0,0 +1,49 @@
+#ifndef foocadirprefetchhfoo
+#define foocadirprefetchhfoo
+
+#include <dirent.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* Opens and stats the entries of a directory on a pool of threads, ahead of a serial walker that processes them in
+ * order. On file systems where each such call costs a round trip, this hides most of the latency. The results are
+ * exactly what ca_open_dirent() returns, hence the walker's output doesn't depend on whether they were prefetched or
+ * not. Only if the directory is modified concurrently, the results might reflect its state a bit earlier than the
+ * walker would have seen it, as if it had been faster. */
+
+typedef struct CaDirPrefetch CaDirPrefetch;
+typedef struct CaDirPrefetchWindow CaDirPrefetchWindow;
+
+#define CA_DIR_PREFETCH_THREADS_DEFAULT 8U
+#define CA_DIR_PREFETCH_THREADS_MAX 64U
+
+/* How many entries to look ahead in each directory */
+#define CA_DIR_PREFETCH_WINDOW 32U
+
+/* How many prefetched entries may be pending at most in all directories together, as each might be an open file */
+#define CA_DIR_PREFETCH_FILES_MAX 256U
+
+/* Opens directories and regular files, and stats everything else, without following symlinks. Returns the fd in
+ * *ret_fd, or -1 if the entry wasn't opened. */
+int ca_open_dirent(int dir_fd, const struct dirent *de, int *ret_fd, struct stat *ret_stat);
+
+int ca_dir_prefetch_new(unsigned n_threads, CaDirPrefetch **ret);
+CaDirPrefetch* ca_dir_prefetch_free(CaDirPrefetch *p);
+
+uint64_t ca_dir_prefetch_get_hits(CaDirPrefetch *p);
+uint64_t ca_dir_prefetch_get_misses(CaDirPrefetch *p);
+
+/* A window over the entries of one directory. The directory fd and the entries must stay valid until the window is
+ * freed. */
+int ca_dir_prefetch_window_new(CaDirPrefetch *p, int dir_fd, struct dirent **dirents, size_t n_dirents, CaDirPrefetchWindow **ret);
+CaDirPrefetchWindow* ca_dir_prefetch_window_free(CaDirPrefetchWindow *w);
+
+/* Drops whatever was prefetched for entries before 'idx', and queues the entries following it */
+int ca_dir_prefetch_window_advance(CaDirPrefetchWindow *w, size_t idx);
+
+/* Hands over the results for entry 'idx', waiting for them if necessary. Returns -ENOENT if the entry wasn't
+ * prefetched or that failed, in which case the caller should call ca_open_dirent() itself. */
+int ca_dir_prefetch_window_take(CaDirPrefetchWindow *w, size_t idx, int *ret_fd, struct stat *ret_stat);
+
+#endif
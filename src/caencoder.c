@@ -3,8 +3,6 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <grp.h>
-#include <pwd.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
@@ -20,10 +18,13 @@
 #include <linux/magic.h>
 #include <linux/msdos_fs.h>
 
+#include "cadirentindex.h"
+#include "cadirprefetch.h"
 #include "caencoder.h"
 #include "caformat-util.h"
 #include "caformat.h"
 #include "camakebst.h"
+#include "canamecache.h"
 #include "cautil.h"
 #include "def.h"
 #include "fssize.h"
@@ -69,6 +70,8 @@ typedef struct CaEncoderNode {
         struct dirent **dirents;
         size_t n_dirents;
         size_t dirent_idx;
+        CaDirPrefetchWindow *prefetch;
+        CaDirentIndex *dirent_index; /* Only built once we seek to a child by name */
 
         /* For S_ISLNK */
         char *symlink_target;
@@ -156,15 +159,30 @@ struct CaEncoder {
         uint64_t archive_offset;
         uint64_t payload_offset;
 
+        /* How much payload to read at once */
+        size_t payload_read_size;
+
+        /* The payload before payload_hole_end is known to be a hole, the payload before payload_data_end to be data.
+         * Beyond both we need to find out with SEEK_DATA/SEEK_HOLE. */
+        uint64_t payload_hole_end;
+        uint64_t payload_data_end;
+        uint64_t n_hole_bytes;
+
         uid_t cached_uid;
         gid_t cached_gid;
 
         char *cached_user_name;
         char *cached_group_name;
 
+        /* Looking up user and group names by ID, possibly shared with others */
+        CaNameCache *name_cache;
+
         uid_t uid_shift;
         uid_t uid_range; /* uid_range == 0 means "full range" */
 
+        /* Opens and stats the next entries of the directories we enumerate on threads */
+        CaDirPrefetch *dir_prefetch;
+
         gcry_md_hd_t archive_digest;
         gcry_md_hd_t payload_digest;
         gcry_md_hd_t hardlink_digest;
@@ -195,6 +213,7 @@ CaEncoder *ca_encoder_new(void) {
 
         assert_se(ca_feature_flags_normalize(CA_FORMAT_WITH_BEST|CA_FORMAT_EXCLUDE_NODUMP, &e->feature_flags) >= 0);
         e->time_granularity = 1;
+        e->payload_read_size = CA_ENCODER_PAYLOAD_READ_SIZE_DEFAULT;
 
         return e;
 }
@@ -213,11 +232,16 @@ static void ca_encoder_node_free(CaEncoderNode *n) {
 
         assert(n);
 
+        /* The prefetch threads might still be using the fd and the dirents, hence get rid of them first */
+        n->prefetch = ca_dir_prefetch_window_free(n->prefetch);
+
         if (n->fd >= 3)
                 n->fd = safe_close(n->fd);
         else
                 n->fd = -1;
 
+        n->dirent_index = ca_dirent_index_free(n->dirent_index);
+
         for (i = 0; i < n->n_dirents; i++)
                 free(n->dirents[i]);
         n->dirents = mfree(n->dirents);
@@ -271,8 +295,11 @@ CaEncoder *ca_encoder_unref(CaEncoder *e) {
         for (i = 0; i < e->n_nodes; i++)
                 ca_encoder_node_free(e->nodes + i);
 
+        ca_dir_prefetch_free(e->dir_prefetch);
+
         free(e->cached_user_name);
         free(e->cached_group_name);
+        ca_name_cache_unref(e->name_cache);
 
         realloc_buffer_free(&e->buffer);
         realloc_buffer_free(&e->xattr_list_buffer);
@@ -936,8 +963,23 @@ static gid_t ca_encoder_shift_gid(CaEncoder *e, gid_t gid) {
         return (gid_t) ca_encoder_shift_uid(e, (uid_t) gid);
 }
 
+static int ca_encoder_get_name_cache(CaEncoder *e, CaNameCache **ret) {
+        assert(e);
+        assert(ret);
+
+        if (!e->name_cache) {
+                e->name_cache = ca_name_cache_new();
+                if (!e->name_cache)
+                        return -ENOMEM;
+        }
+
+        *ret = e->name_cache;
+        return 0;
+}
+
 static int uid_to_name(CaEncoder *e, uid_t uid, char **ret) {
-        long bufsize;
+        CaNameCache *c;
+        uid_t shifted_uid;
         int r;
 
         assert(e);
@@ -952,54 +994,34 @@ static int uid_to_name(CaEncoder *e, uid_t uid, char **ret) {
                 return 0;
         }
 
-        bufsize = sysconf(_SC_GETPW_R_SIZE_MAX);
-        if (bufsize <= 0)
-                bufsize = 4096;
-
-        for (;;) {
-                struct passwd pwbuf, *pw = NULL;
-                char *buf;
-
-                buf = malloc(bufsize);
-                if (!buf)
-                        return -ENOMEM;
-
-                r = getpwuid_r(uid, &pwbuf, buf, (size_t) bufsize, &pw);
-                if (r == 0 && pw) {
-                        char *n;
+        r = ca_encoder_get_name_cache(e, &c);
+        if (r < 0)
+                return r;
 
-                        n = strdup(pw->pw_name);
-                        free(buf);
+        r = ca_name_cache_uid_to_name(c, uid, ret);
+        if (r > 0 || r == -ENOMEM)
+                return r;
 
-                        *ret = n;
-                        return 1;
-                }
-                free(buf);
-                if (r != ERANGE) {
-                        uid_t shifted_uid;
-                        /* User name cannot be retrieved */
-
-                        if (e->feature_flags & (CA_FORMAT_WITH_16BIT_UIDS|CA_FORMAT_WITH_32BIT_UIDS)) {
-                                *ret = NULL;
-                                return 0;
-                        }
+        /* User name cannot be retrieved */
 
-                        shifted_uid = ca_encoder_shift_uid(e, uid);
-                        if (!uid_is_valid(shifted_uid))
-                                return -EINVAL;
+        if (e->feature_flags & (CA_FORMAT_WITH_16BIT_UIDS|CA_FORMAT_WITH_32BIT_UIDS)) {
+                *ret = NULL;
+                return 0;
+        }
 
-                        if (asprintf(ret, UID_FMT, shifted_uid) < 0)
-                                return -ENOMEM;
+        shifted_uid = ca_encoder_shift_uid(e, uid);
+        if (!uid_is_valid(shifted_uid))
+                return -EINVAL;
 
-                        return 1;
-                }
+        if (asprintf(ret, UID_FMT, shifted_uid) < 0)
+                return -ENOMEM;
 
-                bufsize *= 2;
-        }
+        return 1;
 }
 
 static int gid_to_name(CaEncoder *e, gid_t gid, char **ret) {
-        long bufsize;
+        gid_t shifted_gid;
+        CaNameCache *c;
         int r;
 
         assert(e);
@@ -1010,50 +1032,27 @@ static int gid_to_name(CaEncoder *e, gid_t gid, char **ret) {
                 return 0;
         }
 
-        bufsize = sysconf(_SC_GETGR_R_SIZE_MAX);
-        if (bufsize <= 0)
-                bufsize = 4096;
-
-        for (;;) {
-                struct group grbuf, *gr = NULL;
-                char *buf;
-
-                buf = malloc(bufsize);
-                if (!buf)
-                        return -ENOMEM;
-
-                r = getgrgid_r(gid, &grbuf, buf, (size_t) bufsize, &gr);
-                if (r == 0 && gr) {
-                        char *n;
-
-                        n = strdup(gr->gr_name);
-                        free(buf);
-
-                        *ret = n;
-                        return 1;
-                }
-
-                free(buf);
-                if (r != ERANGE) {
-                        gid_t shifted_gid;
+        r = ca_encoder_get_name_cache(e, &c);
+        if (r < 0)
+                return r;
 
-                        if (e->feature_flags & (CA_FORMAT_WITH_16BIT_UIDS|CA_FORMAT_WITH_32BIT_UIDS)) {
-                                *ret = NULL;
-                                return 0;
-                        }
+        r = ca_name_cache_gid_to_name(c, gid, ret);
+        if (r > 0 || r == -ENOMEM)
+                return r;
 
-                        shifted_gid = ca_encoder_shift_gid(e, gid);
-                        if (!gid_is_valid(shifted_gid))
-                                return -EINVAL;
+        if (e->feature_flags & (CA_FORMAT_WITH_16BIT_UIDS|CA_FORMAT_WITH_32BIT_UIDS)) {
+                *ret = NULL;
+                return 0;
+        }
 
-                        if (asprintf(ret, GID_FMT, shifted_gid) < 0)
-                                return -ENOMEM;
+        shifted_gid = ca_encoder_shift_gid(e, gid);
+        if (!gid_is_valid(shifted_gid))
+                return -EINVAL;
 
-                        return 1;
-                }
+        if (asprintf(ret, GID_FMT, shifted_gid) < 0)
+                return -ENOMEM;
 
-                bufsize *= 2;
-        }
+        return 1;
 }
 
 static int compare_acl_entry(const void *a, const void *b) {
@@ -1489,13 +1488,13 @@ static CaEncoderNode* ca_encoder_init_child(CaEncoder *e) {
 }
 
 static int ca_encoder_open_child(CaEncoder *e, CaEncoderNode *n, const struct dirent *de) {
-        int r, open_flags = O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW;
-        bool shall_open, have_stat;
         CaEncoderNode *child;
+        int r;
 
         assert(e);
         assert(n);
         assert(de);
+        assert(de == ca_encoder_node_current_dirent(n));
 
         if (!S_ISDIR(n->stat.st_mode))
                 return -ENOTDIR;
@@ -1506,33 +1505,18 @@ static int ca_encoder_open_child(CaEncoder *e, CaEncoderNode *n, const struct di
         if (!child)
                 return -E2BIG;
 
-        if (IN_SET(de->d_type, DT_DIR, DT_REG)) {
-                shall_open = true;
-                have_stat = false;
-
-                if (de->d_type == DT_DIR)
-                        open_flags |= O_DIRECTORY;
-        } else {
-                if (fstatat(n->fd, de->d_name, &child->stat, AT_SYMLINK_NOFOLLOW) < 0)
-                        return -errno;
-
-                have_stat = true;
-                shall_open = S_ISREG(child->stat.st_mode) || S_ISDIR(child->stat.st_mode);
-
-                if (S_ISDIR(child->stat.st_mode))
-                        open_flags |= O_DIRECTORY;
-        }
-
-        if (shall_open) {
-                child->fd = openat(n->fd, de->d_name, open_flags);
-                if (child->fd < 0)
-                        return -errno;
+        if (n->prefetch) {
+                r = ca_dir_prefetch_window_take(n->prefetch, n->dirent_idx, &child->fd, &child->stat);
+                if (r == -ENOENT)
+                        r = ca_open_dirent(n->fd, de, &child->fd, &child->stat);
+                if (r < 0)
+                        return r;
 
-                if (!have_stat) {
-                        if (fstat(child->fd, &child->stat) < 0)
-                                return -errno;
-                }
-        }
+                r = ca_dir_prefetch_window_advance(n->prefetch, n->dirent_idx + 1);
+        } else
+                r = ca_open_dirent(n->fd, de, &child->fd, &child->stat);
+        if (r < 0)
+                return r;
 
         if (child->stat.st_dev == n->stat.st_dev ||
             child->fd < 0)
@@ -1693,6 +1677,35 @@ static void ca_encoder_enter_state(CaEncoder *e, CaEncoderState state) {
         e->payload_offset = 0;
 }
 
+static void ca_encoder_reset_extents(CaEncoder *e, CaEncoderNode *n) {
+        assert(e);
+        assert(n);
+
+        /* Only bother looking for holes in regular files that occupy less space on disk than their size suggests.
+         * SEEK_DATA/SEEK_HOLE isn't implemented for block devices anyway, they are entirely data. */
+        e->payload_hole_end = 0;
+        if (S_ISREG(n->stat.st_mode) && (uint64_t) n->stat.st_blocks * 512U < (uint64_t) n->stat.st_size)
+                e->payload_data_end = 0;
+        else
+                e->payload_data_end = UINT64_MAX;
+}
+
+static void ca_encoder_enter_payload(CaEncoder *e, CaEncoderNode *n) {
+        uint64_t size;
+
+        assert(e);
+        assert(n);
+
+        ca_encoder_enter_state(e, CA_ENCODER_IN_PAYLOAD);
+        ca_encoder_reset_extents(e, n);
+
+        /* We are going to read the payload from the beginning to the end. If it takes more than a single read, tell
+         * the kernel, so that it reads ahead more aggressively. This is purely an optimization, hence ignore
+         * failures. */
+        if (ca_encoder_node_get_payload_size(n, &size) >= 0 && size > e->payload_read_size)
+                (void) posix_fadvise(n->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
 static int ca_encoder_step_node(CaEncoder *e, CaEncoderNode *n) {
         int r;
 
@@ -1708,7 +1721,7 @@ static int ca_encoder_step_node(CaEncoder *e, CaEncoderNode *n) {
 
                         /* If we are just initializing and looking at a regular file/block device, then our top-level
                          * node is serialized as its contents, hence continue in payload mode. */
-                        ca_encoder_enter_state(e, CA_ENCODER_IN_PAYLOAD);
+                        ca_encoder_enter_payload(e, n);
                 } else
                         /* Otherwise, if we are initializing and looking at anything else, then start with an ENTRY
                          * record. */
@@ -1748,7 +1761,7 @@ static int ca_encoder_step_node(CaEncoder *e, CaEncoderNode *n) {
                 if (r > 0) {
                         if (S_ISREG(n->stat.st_mode)) {
                                 /* The ENTRY record has been generated, now go for the payload. */
-                                ca_encoder_enter_state(e, CA_ENCODER_IN_PAYLOAD);
+                                ca_encoder_enter_payload(e, n);
                                 return ca_encoder_step_node(e, n);
                         }
 
@@ -1819,6 +1832,12 @@ static int ca_encoder_step_node(CaEncoder *e, CaEncoderNode *n) {
                 if (r < 0)
                         return r;
 
+                if (e->dir_prefetch && !n->prefetch && n->n_dirents > 1) {
+                        r = ca_dir_prefetch_window_new(e->dir_prefetch, n->fd, n->dirents, n->n_dirents, &n->prefetch);
+                        if (r < 0)
+                                return r;
+                }
+
                 for (;;) {
                         de = ca_encoder_node_current_dirent(n);
                         if (!de) {
@@ -1946,9 +1965,57 @@ int ca_encoder_step(CaEncoder *e) {
         return ca_encoder_step_node(e, n);
 }
 
+static int ca_encoder_find_extent(CaEncoder *e, CaEncoderNode *n, uint64_t size) {
+        off_t data, hole;
+
+        assert(e);
+        assert(n);
+
+        /* Determines whether the payload at the current offset is a hole or data, and where that ends */
+
+        data = lseek(n->fd, (off_t) e->payload_offset, SEEK_DATA);
+        if (data < 0) {
+                struct stat st;
+
+                if (IN_SET(errno, EINVAL, EOPNOTSUPP)) {
+                        /* Not supported by the file system, treat everything as data */
+                        e->payload_data_end = UINT64_MAX;
+                        return 0;
+                }
+                if (errno != ENXIO)
+                        return -errno;
+
+                /* Either there's only a hole left, or the file was truncated under our feet */
+                if (fstat(n->fd, &st) < 0)
+                        return -errno;
+                if ((uint64_t) st.st_size < size)
+                        return -EIO;
+
+                e->payload_hole_end = size;
+                return 0;
+        }
+
+        if ((uint64_t) data > e->payload_offset) {
+                e->payload_hole_end = MIN((uint64_t) data, size);
+                return 0;
+        }
+
+        hole = lseek(n->fd, (off_t) e->payload_offset, SEEK_HOLE);
+        if (hole < 0)
+                return -errno;
+
+        e->payload_data_end = (uint64_t) hole > e->payload_offset ? (uint64_t) hole : UINT64_MAX;
+
+        /* Both calls moved the file offset, we want to read from where we are */
+        if (lseek(n->fd, (off_t) e->payload_offset, SEEK_SET) < 0)
+                return -errno;
+
+        return 0;
+}
+
 static int ca_encoder_get_payload_data(CaEncoder *e, CaEncoderNode *n) {
         uint64_t size;
-        ssize_t m;
+        ssize_t l;
         size_t k;
         void *p;
         int r;
@@ -1968,18 +2035,41 @@ static int ca_encoder_get_payload_data(CaEncoder *e, CaEncoderNode *n) {
         if (realloc_buffer_size(&e->buffer) > 0) /* already in buffer? */
                 return 1;
 
-        k = (size_t) MIN(BUFFER_SIZE, size - e->payload_offset);
+        if (e->payload_offset >= e->payload_hole_end && e->payload_offset >= e->payload_data_end) {
+                r = ca_encoder_find_extent(e, n, size);
+                if (r < 0)
+                        return r;
+        }
+
+        k = (size_t) MIN(e->payload_read_size, size - e->payload_offset);
+
+        if (e->payload_offset < e->payload_hole_end) {
+                /* Don't read holes, we know they are zero. Note that the file offset doesn't follow here, but we
+                 * always look for the next extent when the hole ends, which sets it again. */
+                k = (size_t) MIN(k, e->payload_hole_end - e->payload_offset);
+
+                p = realloc_buffer_acquire0(&e->buffer, k);
+                if (!p)
+                        return -ENOMEM;
+
+                e->n_hole_bytes += k;
+                return 1;
+        }
+
+        k = (size_t) MIN(k, e->payload_data_end - e->payload_offset);
 
         p = realloc_buffer_acquire(&e->buffer, k);
         if (!p)
                 return -ENOMEM;
 
-        m = read(n->fd, p, k);
-        if (m < 0) {
-                r = -errno;
+        /* A single read() may return less than requested for large reads, in particular on network file systems and
+         * when interrupted, hence read in a loop. Only if we hit EOF early the file was truncated under our feet. */
+        l = loop_read(n->fd, p, k);
+        if (l < 0) {
+                r = (int) l;
                 goto fail;
         }
-        if ((size_t) m != k) {
+        if ((size_t) l != k) {
                 r = -EIO;
                 goto fail;
         }
@@ -2981,6 +3071,22 @@ eof:
         return 0;
 }
 
+int ca_encoder_current_stat(CaEncoder *e, struct stat *ret) {
+        CaEncoderNode *n;
+
+        if (!e)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        n = ca_encoder_current_node(e);
+        if (!n)
+                return -EUNATCH;
+
+        *ret = n->stat;
+        return 0;
+}
+
 int ca_encoder_current_payload_offset(CaEncoder *e, uint64_t *ret) {
         CaEncoderNode *n;
 
@@ -3073,11 +3179,70 @@ int ca_encoder_current_location(CaEncoder *e, uint64_t add, CaLocation **ret) {
         return 0;
 }
 
-static int dirent_bsearch_func(const void *key, const void *member) {
-        const char *k = key;
-        const struct dirent ** const m = (const struct dirent ** const) member;
+int ca_encoder_skip_payload(CaEncoder *e, uint64_t offset) {
+        CaEncoderNode *n;
+        uint64_t size, current;
+        int r;
+
+        if (!e)
+                return -EINVAL;
+        if (e->state != CA_ENCODER_IN_PAYLOAD)
+                return -ENOTTY;
+
+        /* We can't leave out any data from the archive digest */
+        if (e->archive_digest)
+                return -EBUSY;
+
+        n = ca_encoder_current_node(e);
+        if (!n)
+                return -EUNATCH;
+
+        r = ca_encoder_node_get_payload_size(n, &size);
+        if (r < 0)
+                return r;
+
+        /* The data in the buffer has already been handed out, hence counts as consumed */
+        current = e->payload_offset + realloc_buffer_size(&e->buffer);
+        if (offset < current || offset > size)
+                return -EINVAL;
+
+        if (lseek(n->fd, offset, SEEK_SET) == (off_t) -1)
+                return -errno;
+
+        ca_encoder_advance_buffer(e);
+
+        if (e->archive_offset != UINT64_MAX)
+                e->archive_offset += offset - e->payload_offset;
+        e->payload_offset = offset;
+
+        e->payload_digest_invalid = e->hardlink_digest_invalid = true;
+        return 0;
+}
+
+static int ca_encoder_node_index_dirents(CaEncoderNode *n) {
+        CaDirentIndex *x;
+        size_t i;
+        int r;
+
+        assert(n);
+
+        if (n->dirent_index)
+                return 0;
+
+        x = ca_dirent_index_new(n->n_dirents);
+        if (!x)
+                return -ENOMEM;
+
+        for (i = 0; i < n->n_dirents; i++) {
+                r = ca_dirent_index_put(x, n->dirents[i]->d_name, i);
+                if (r < 0) {
+                        ca_dirent_index_free(x);
+                        return r;
+                }
+        }
 
-        return strcmp(k, (*m)->d_name);
+        n->dirent_index = x;
+        return 0;
 }
 
 static int ca_encoder_node_seek_child(CaEncoder *e, CaEncoderNode *n, const char *name) {
@@ -3104,17 +3269,20 @@ static int ca_encoder_node_seek_child(CaEncoder *e, CaEncoderNode *n, const char
                         return 0;
 
         } else {
-                struct dirent **found;
+                size_t idx;
 
-                found = bsearch(name, n->dirents, n->n_dirents, sizeof(struct dirent*), dirent_bsearch_func);
-                if (!found)
-                        return -ENOENT;
+                r = ca_encoder_node_index_dirents(n);
+                if (r < 0)
+                        return r;
+
+                r = ca_dirent_index_get(n->dirent_index, name, &idx);
+                if (r < 0)
+                        return r;
 
-                assert(found >= n->dirents);
-                assert((size_t) (found - n->dirents) < n->n_dirents);
-                n->dirent_idx = found - n->dirents;
+                assert(idx < n->n_dirents);
+                n->dirent_idx = idx;
 
-                de = *found;
+                de = n->dirents[idx];
         }
 
         return ca_encoder_open_child(e, n, de);
@@ -3257,6 +3425,7 @@ int ca_encoder_seek_location(CaEncoder *e, CaLocation *location) {
                         return -errno;
 
                 ca_encoder_enter_state(e, CA_ENCODER_IN_PAYLOAD);
+                ca_encoder_reset_extents(e, node);
                 e->payload_offset = location->offset;
 
                 if (CA_ENCODER_AT_ROOT(e))
@@ -3338,6 +3507,64 @@ int ca_encoder_seek_location(CaEncoder *e, CaLocation *location) {
         return 0;
 }
 
+int ca_encoder_set_name_cache(CaEncoder *e, CaNameCache *c) {
+        if (!e)
+                return -EINVAL;
+        if (!c)
+                return -EINVAL;
+
+        ca_name_cache_unref(e->name_cache);
+        e->name_cache = ca_name_cache_ref(c);
+
+        return 0;
+}
+
+int ca_encoder_set_payload_read_size(CaEncoder *e, size_t size) {
+        if (!e)
+                return -EINVAL;
+        if (size == 0)
+                return -EINVAL;
+        if (size > CA_ENCODER_PAYLOAD_READ_SIZE_MAX)
+                return -ERANGE;
+
+        e->payload_read_size = size;
+        return 0;
+}
+
+int ca_encoder_get_hole_bytes(CaEncoder *e, uint64_t *ret) {
+        if (!e)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        *ret = e->n_hole_bytes;
+        return 0;
+}
+
+int ca_encoder_set_prefetch_threads(CaEncoder *e, unsigned n) {
+        if (!e)
+                return -EINVAL;
+        if (e->dir_prefetch)
+                return -EBUSY;
+
+        if (n == 0)
+                return 0;
+
+        return ca_dir_prefetch_new(n, &e->dir_prefetch);
+}
+
+int ca_encoder_get_prefetch_hits(CaEncoder *e, uint64_t *ret) {
+        if (!e)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+        if (!e->dir_prefetch)
+                return -ENODATA;
+
+        *ret = ca_dir_prefetch_get_hits(e->dir_prefetch);
+        return 0;
+}
+
 int ca_encoder_set_uid_shift(CaEncoder *e, uid_t u) {
         if (!e)
                 return -EINVAL;
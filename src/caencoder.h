@@ -3,11 +3,13 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include "cachunkid.h"
 #include "cacommon.h"
 #include "calocation.h"
+#include "canamecache.h"
 
 typedef struct CaEncoder CaEncoder;
 
@@ -27,6 +29,24 @@ int ca_encoder_get_feature_flags(CaEncoder *e, uint64_t *ret);
 
 int ca_encoder_get_covering_feature_flags(CaEncoder *e, uint64_t *ret);
 
+/* Use the specified cache for looking up user and group names, instead of a private one */
+int ca_encoder_set_name_cache(CaEncoder *e, CaNameCache *c);
+
+/* Payload is read in blocks of this size by default, which suits random access. Users reading the payload from
+ * beginning to end should use larger reads. */
+#define CA_ENCODER_PAYLOAD_READ_SIZE_DEFAULT ((size_t) (64U*1024U))
+#define CA_ENCODER_PAYLOAD_READ_SIZE_MAX ((size_t) (64U*1024U*1024U))
+
+int ca_encoder_set_payload_read_size(CaEncoder *e, size_t size);
+
+/* How many payload bytes were in holes of sparse files, and hence not read */
+int ca_encoder_get_hole_bytes(CaEncoder *e, uint64_t *ret);
+
+/* Open and stat the entries of each directory on this many threads ahead of time, 0 to do so only when needed. The
+ * generated archive is the same either way. */
+int ca_encoder_set_prefetch_threads(CaEncoder *e, unsigned n);
+int ca_encoder_get_prefetch_hits(CaEncoder *e, uint64_t *ret);
+
 int ca_encoder_set_uid_shift(CaEncoder *e, uid_t u);
 int ca_encoder_set_uid_range(CaEncoder *e, uid_t u);
 
@@ -52,6 +72,7 @@ int ca_encoder_current_rdev(CaEncoder *e, dev_t *ret);
 int ca_encoder_current_chattr(CaEncoder *e, unsigned *ret);
 int ca_encoder_current_fat_attrs(CaEncoder *e, uint32_t *ret);
 int ca_encoder_current_xattr(CaEncoder *e, CaIterate where, const char **ret_name, const void **ret_value, size_t *ret_size);
+int ca_encoder_current_stat(CaEncoder *e, struct stat *ret);
 
 int ca_encoder_current_payload_offset(CaEncoder *e, uint64_t *ret);
 int ca_encoder_current_archive_offset(CaEncoder *e, uint64_t *ret);
@@ -60,6 +81,10 @@ int ca_encoder_current_location(CaEncoder *e, uint64_t add, CaLocation **ret);
 
 int ca_encoder_seek_location(CaEncoder *e, CaLocation *location);
 
+/* Continues the payload of the current file at 'offset', without generating the data in between. The payload and
+ * hardlink digests of the file become unavailable. */
+int ca_encoder_skip_payload(CaEncoder *e, uint64_t offset);
+
 int ca_encoder_enable_archive_digest(CaEncoder *e, bool b);
 int ca_encoder_enable_payload_digest(CaEncoder *e, bool b);
 int ca_encoder_enable_hardlink_digest(CaEncoder *e, bool b);
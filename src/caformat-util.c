@@ -143,7 +143,7 @@ int ca_with_feature_flags_format(uint64_t features, char **ret) {
                 features &= ~f;
         }
 
-        if ((features & ~(CA_FORMAT_EXCLUDE_NODUMP|CA_FORMAT_EXCLUDE_SUBMOUNTS)) != 0) {
+        if ((features & ~(CA_FORMAT_BLAKE2B_256|CA_FORMAT_EXCLUDE_NODUMP|CA_FORMAT_EXCLUDE_SUBMOUNTS)) != 0) {
                 free(s);
                 return -EINVAL;
         }
@@ -454,3 +454,26 @@ uint64_t ca_feature_flags_from_magic(statfs_f_type_t magic) {
                         CA_FORMAT_WITH_SOCKETS;
         }
 }
+
+CaDigestType ca_feature_flags_to_digest_type(uint64_t flags) {
+
+        if ((flags & ~CA_FORMAT_FEATURE_FLAGS_MAX) != 0)
+                return _CA_DIGEST_TYPE_INVALID;
+
+        if (flags & CA_FORMAT_BLAKE2B_256)
+                return CA_DIGEST_BLAKE2B_256;
+
+        return CA_DIGEST_SHA256;
+}
+
+uint64_t ca_feature_flags_from_digest_type(CaDigestType type) {
+
+        switch (type) {
+
+        case CA_DIGEST_BLAKE2B_256:
+                return CA_FORMAT_BLAKE2B_256;
+
+        default:
+                return 0;
+        }
+}
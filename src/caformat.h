@@ -115,6 +115,9 @@ enum {
         /* CA_FORMAT_WITH_SELINUX           = 0x40000000, */
         CA_FORMAT_WITH_FCAPS             = 0x80000000,
 
+        /* Chunk IDs are BLAKE2b-256 rather than SHA256 sums. Only relevant for index files. */
+        CA_FORMAT_BLAKE2B_256            = UINT64_C(0x2000000000000000),
+
         CA_FORMAT_EXCLUDE_SUBMOUNTS      = UINT64_C(0x4000000000000000),
         CA_FORMAT_EXCLUDE_NODUMP         = UINT64_C(0x8000000000000000),
 
@@ -207,7 +210,7 @@ enum {
                 CA_FORMAT_WITH_CHATTR|
                 CA_FORMAT_WITH_XATTRS,
 
-        CA_FORMAT_FEATURE_FLAGS_MAX        = 0xFFFFFFFF | CA_FORMAT_EXCLUDE_NODUMP | CA_FORMAT_EXCLUDE_SUBMOUNTS,
+        CA_FORMAT_FEATURE_FLAGS_MAX        = 0xFFFFFFFF | CA_FORMAT_BLAKE2B_256 | CA_FORMAT_EXCLUDE_NODUMP | CA_FORMAT_EXCLUDE_SUBMOUNTS,
 };
 
 typedef struct CaFormatHeader {
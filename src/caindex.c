@@ -7,6 +7,7 @@
 #include "caformat.h"
 #include "caindex.h"
 #include "def.h"
+#include "realloc-buffer.h"
 #include "util.h"
 
 /* #undef EBADMSG */
@@ -46,6 +47,14 @@ struct CaIndex {
 
         uint64_t file_size; /* The size of the index file */
         uint64_t blob_size; /* The size of the blob this index file describes */
+
+        /* When reading, the data following cooked_offset, read ahead in large blocks. The file offset is at its end. */
+        ReallocBuffer read_buffer;
+
+        /* The end offsets of all chunks in the blob we know of, loaded when seeking, so that seeks need no I/O */
+        uint64_t *seek_offsets;
+        size_t n_seek_offsets, n_allocated_seek_offsets;
+        size_t seek_hint; /* The chunk found by the last seek */
 };
 
 static inline uint64_t CA_INDEX_METADATA_SIZE(CaIndex *i) {
@@ -140,6 +149,9 @@ CaIndex *ca_index_unref(CaIndex *i) {
         if (i->fd >= 2)
                 safe_close(i->fd);
 
+        realloc_buffer_free(&i->read_buffer);
+        free(i->seek_offsets);
+
         return mfree(i);
 }
 
@@ -494,6 +506,23 @@ int ca_index_write_eof(CaIndex *i) {
         return 0;
 }
 
+/* Makes sure at least 'n' bytes are in the read buffer, unless we hit the end of the file first */
+static int ca_index_fill_read_buffer(CaIndex *i, size_t n) {
+        int r;
+
+        assert(i);
+
+        while (realloc_buffer_size(&i->read_buffer) < n) {
+                r = realloc_buffer_read(&i->read_buffer, i->fd);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        break;
+        }
+
+        return 0;
+}
+
 int ca_index_read_chunk(CaIndex *i, CaChunkID *ret_id, uint64_t *ret_offset_end, uint64_t *ret_size) {
         union {
                 CaFormatTableItem item;
@@ -520,12 +549,15 @@ int ca_index_read_chunk(CaIndex *i, CaChunkID *ret_id, uint64_t *ret_offset_end,
         if (r == 0)
                 return -EAGAIN;
 
-        n = loop_read(i->fd, &buffer, sizeof(buffer));
-        if (n < 0)
-                return (int) n;
-        if (n != sizeof(buffer))
+        /* Rather than issuing a read() for each item, read plenty of them at once */
+        r = ca_index_fill_read_buffer(i, sizeof(buffer));
+        if (r < 0)
+                return r;
+        if (realloc_buffer_size(&i->read_buffer) < sizeof(buffer))
                 return -EPIPE;
 
+        memcpy(&buffer, realloc_buffer_data(&i->read_buffer), sizeof(buffer));
+
         /* { */
         /*         char ids[CA_CHUNK_ID_FORMAT_MAX]; */
         /*         fprintf(stderr, "READING INDEX CHUNK: %s\n", ca_chunk_id_format((const CaChunkID*) item.chunk, ids)); */
@@ -539,7 +571,11 @@ int ca_index_read_chunk(CaIndex *i, CaChunkID *ret_id, uint64_t *ret_offset_end,
             le64toh(buffer.tail.size) == (i->cooked_offset - i->start_offset + offsetof(CaFormatTable, items) + sizeof(CaFormatTableTail))) {
                 uint8_t final_byte;
 
-                /* We try to read one more byte than we expect. if we can read it there's trailing garbage. */
+                /* If there's more data after the tail, there's trailing garbage. Unless we read ahead past the
+                 * tail already, try to read one more byte than we expect. */
+                if (realloc_buffer_size(&i->read_buffer) > sizeof(buffer))
+                        return -EBADMSG;
+
                 n = read(i->fd, &final_byte, sizeof(final_byte));
                 if (n < 0)
                         return -errno;
@@ -580,9 +616,43 @@ int ca_index_read_chunk(CaIndex *i, CaChunkID *ret_id, uint64_t *ret_offset_end,
         i->item_position++;
         i->cooked_offset += sizeof(buffer);
 
+        r = realloc_buffer_advance(&i->read_buffer, sizeof(buffer));
+        if (r < 0)
+                return r;
+
         return 1;
 }
 
+int ca_index_read_chunks(CaIndex *i, CaIndexChunk *chunks, size_t n_chunks, size_t *ret_n) {
+        size_t k = 0;
+        int r = 0;
+
+        if (!i)
+                return -EINVAL;
+        if (!chunks && n_chunks > 0)
+                return -EINVAL;
+        if (!ret_n)
+                return -EINVAL;
+
+        /* The items come straight from the read buffer, hence this needs a system call only every few thousand
+         * items */
+        while (k < n_chunks) {
+                r = ca_index_read_chunk(i, &chunks[k].id, &chunks[k].offset_end, &chunks[k].size);
+                if (r <= 0)
+                        break;
+
+                k++;
+        }
+
+        *ret_n = k;
+
+        /* Report EOF and errors once we returned everything before them */
+        if (k > 0)
+                return 1;
+
+        return r;
+}
+
 int ca_index_set_position(CaIndex *i, uint64_t position) {
         uint64_t p, q;
 
@@ -601,8 +671,19 @@ int ca_index_set_position(CaIndex *i, uint64_t position) {
         if (q < p)
                 return -EINVAL;
 
-        if (lseek(i->fd, q, SEEK_SET) == (off_t) -1)
-                return -errno;
+        if (q >= i->cooked_offset && q - i->cooked_offset <= realloc_buffer_size(&i->read_buffer)) {
+                int r;
+
+                /* If we read ahead that far already, there's no need to seek */
+                r = realloc_buffer_advance(&i->read_buffer, q - i->cooked_offset);
+                if (r < 0)
+                        return r;
+        } else {
+                if (lseek(i->fd, q, SEEK_SET) == (off_t) -1)
+                        return -errno;
+
+                realloc_buffer_empty(&i->read_buffer);
+        }
 
         i->cooked_offset = q;
         i->item_position = position;
@@ -996,94 +1077,135 @@ int ca_index_get_blob_size(CaIndex *i, uint64_t *ret) {
         return 0;
 }
 
-int ca_index_seek(CaIndex *i, uint64_t offset, uint64_t *ret_skip) {
-        uint64_t size, n_chunks, left, right;
+/* Loads the end offsets of all chunks that became available since the last call into memory */
+static int ca_index_load_seek_offsets(CaIndex *i) {
+        CaFormatTableItem *items;
+        uint64_t available;
+        size_t m, k;
+        ssize_t l;
         int r;
 
-        if (!i)
-                return -EINVAL;
+        assert(i);
 
-        r = ca_index_get_blob_size(i, &size);
+        r = ca_index_get_available_chunks(i, &available);
         if (r < 0)
                 return r;
+        if (available <= i->n_seek_offsets)
+                return 0;
+        if (available > SIZE_MAX)
+                return -EFBIG;
 
-        if (offset >= size)
-                return -ENXIO;
+        if (!GREEDY_REALLOC(i->seek_offsets, i->n_allocated_seek_offsets, available))
+                return -ENOMEM;
 
-        r = ca_index_get_total_chunks(i, &n_chunks);
-        if (n_chunks == 0)
-                return -ENXIO;
+        items = new(CaFormatTableItem, BUFFER_SIZE / sizeof(CaFormatTableItem));
+        if (!items)
+                return -ENOMEM;
 
-        /* Small opimization for seeking within the first chunk */
-        if (n_chunks == 1 || offset < i->chunk_size_min) {
-                r = ca_index_set_position(i, 0);
-                if (r < 0)
-                        return r;
+        while (i->n_seek_offsets < available) {
+                m = MIN(available - i->n_seek_offsets, BUFFER_SIZE / sizeof(CaFormatTableItem));
 
-                if (ret_skip)
-                        *ret_skip = offset;
+                l = pread(i->fd, items, m * sizeof(CaFormatTableItem), i->start_offset + i->n_seek_offsets * sizeof(CaFormatTableItem));
+                if (l < 0) {
+                        r = -errno;
+                        goto finish;
+                }
+                if ((size_t) l != m * sizeof(CaFormatTableItem)) {
+                        r = -EPIPE;
+                        goto finish;
+                }
 
-                return 0;
-        }
+                for (k = 0; k < m; k++) {
+                        uint64_t previous, offset;
 
-        /* Implement bisection to find the right chunk */
-        left = 0;
-        right = n_chunks - 2;
-        for (;;) {
-                uint64_t first_chunk_end, second_chunk_end, p;
+                        previous = i->n_seek_offsets > 0 ? i->seek_offsets[i->n_seek_offsets - 1] : 0;
+                        offset = le64toh(items[k].offset);
 
-                p = left + (right - left) / 2;
+                        if (offset <= previous || offset - previous > i->chunk_size_max) {
+                                r = -EBADMSG;
+                                goto finish;
+                        }
 
-                r = ca_index_set_position(i, p);
-                if (r < 0)
-                        return r;
+                        i->seek_offsets[i->n_seek_offsets++] = offset;
+                }
+        }
 
-                r = ca_index_read_chunk(i, NULL, &first_chunk_end, NULL);
-                if (r < 0)
-                        return r;
+        r = 0;
 
-                if (offset < first_chunk_end) {
+finish:
+        free(items);
+        return r;
+}
 
-                        if (p == 0) {
-                                /* This is left of the first chunk boundary? Then it's definitely in the first chunk */
+/* Returns the first chunk ending after 'offset'. The loop compiles to conditional moves rather than branches, which
+ * the CPU would mispredict half of the time. */
+static size_t ca_index_search_seek_offsets(const uint64_t *offsets, size_t n, uint64_t offset) {
+        const uint64_t *base = offsets;
 
-                                r = ca_index_set_position(i, 0);
-                                if (r < 0)
-                                        return r;
+        assert(offsets);
+        assert(n > 0);
 
-                                if (ret_skip)
-                                        *ret_skip = offset;
+        while (n > 1) {
+                size_t half = n / 2;
 
-                                return 0;
-                        }
+                base = base[half] <= offset ? base + half : base;
+                n -= half;
+        }
 
-                        if (p == right)
-                                return -EBADMSG;
+        return (base - offsets) + (*base <= offset);
+}
 
-                        right = p;
-                        continue;
-                }
+static bool ca_index_seek_offset_in_chunk(CaIndex *i, size_t k, uint64_t offset) {
+        assert(i);
 
-                r = ca_index_read_chunk(i, NULL, &second_chunk_end, NULL);
-                if (r < 0)
-                        return r;
+        if (k >= i->n_seek_offsets)
+                return false;
 
-                if (offset >= second_chunk_end) {
-                        left = p+1;
-                        continue;
-                }
+        return offset < i->seek_offsets[k] &&
+                (k == 0 || offset >= i->seek_offsets[k - 1]);
+}
 
-                /* We found it, now let's position the read ptr on the second chunk again */
+int ca_index_seek(CaIndex *i, uint64_t offset, uint64_t *ret_skip) {
+        size_t k;
+        int r;
 
-                r = ca_index_set_position(i, p + 1);
-                if (r < 0)
-                        return r;
+        if (!i)
+                return -EINVAL;
 
-                if (ret_skip)
-                        *ret_skip = offset - first_chunk_end;
+        r = ca_index_load_seek_offsets(i);
+        if (r < 0)
+                return r;
 
-                return 0;
+        if (i->n_seek_offsets == 0 || offset >= i->seek_offsets[i->n_seek_offsets - 1]) {
+                /* Not in any chunk we know of. Unless there are more to come, it's beyond the end. */
+                if (i->mode == CA_INDEX_INCREMENTAL_READ && !i->wrote_eof)
+                        return -EAGAIN;
+
+                return -ENXIO;
         }
+
+        /* Sequential reads mostly end up in the chunk we found the last time, or the one after it */
+        k = i->seek_hint;
+        if (!ca_index_seek_offset_in_chunk(i, k, offset)) {
+                k++;
+                if (!ca_index_seek_offset_in_chunk(i, k, offset))
+                        k = ca_index_search_seek_offsets(i->seek_offsets, i->n_seek_offsets, offset);
+        }
+
+        assert(ca_index_seek_offset_in_chunk(i, k, offset));
+
+        r = ca_index_set_position(i, k);
+        if (r < 0)
+                return r;
+
+        /* We know where the previous chunk ended, hence the size of the next one read can be determined */
+        i->previous_chunk_offset = k > 0 ? i->seek_offsets[k - 1] : 0;
+        i->seek_hint = k;
+
+        if (ret_skip)
+                *ret_skip = offset - i->previous_chunk_offset;
+
+        return 0;
 }
 
 int ca_index_set_feature_flags(CaIndex *i, uint64_t flags) {
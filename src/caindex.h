@@ -6,6 +6,12 @@
 
 typedef struct CaIndex CaIndex;
 
+typedef struct CaIndexChunk {
+        CaChunkID id;
+        uint64_t offset_end;
+        uint64_t size;
+} CaIndexChunk;
+
 CaIndex *ca_index_new_write(void); /* only (cooked) writing */
 CaIndex *ca_index_new_read(void); /* only (cooked) reading */
 CaIndex *ca_index_new_incremental_write(void); /* incremental cooked writing + raw/byte-wise reading (for uploads) */
@@ -26,6 +32,10 @@ int ca_index_write_eof(CaIndex *i);
 
 int ca_index_read_chunk(CaIndex *i, CaChunkID *id, uint64_t *ret_offset_end, uint64_t *ret_size);
 
+/* Reads up to 'n_chunks' chunks at once, and returns how many in 'ret_n'. Returns > 0 if there was at least one, 0 on
+ * EOF, and -EAGAIN if more data is needed, like ca_index_read_chunk(). */
+int ca_index_read_chunks(CaIndex *i, CaIndexChunk *chunks, size_t n_chunks, size_t *ret_n);
+
 int ca_index_set_position(CaIndex *i, uint64_t position);
 int ca_index_get_position(CaIndex *i, uint64_t *ret);
 int ca_index_get_available_chunks(CaIndex *i, uint64_t *ret);
@@ -50,6 +60,9 @@ int ca_index_get_blob_size(CaIndex *i, uint64_t *ret);
 int ca_index_get_index_size(CaIndex *i, uint64_t *ret);
 int ca_index_get_total_chunks(CaIndex *i, uint64_t *ret);
 
+/* Positions the index on the chunk containing the blob offset 'offset', and returns how far into the chunk it is. The
+ * chunk offsets are loaded into memory on first use, hence seeking needs no I/O. Fails with -EAGAIN if the chunk
+ * wasn't downloaded yet. */
 int ca_index_seek(CaIndex *i, uint64_t offset, uint64_t *ret_skip);
 
 #endif
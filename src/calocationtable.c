@@ -0,0 +1,349 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "calocationtable.h"
+#include "siphash24.h"
+#include "util.h"
+
+#define CA_LOCATION_TABLE_SLOTS_MIN ((size_t) 1024)
+
+#define CA_LOCATION_TABLE_PATH_HASH_KEY {                               \
+                0x3a, 0x9d, 0x51, 0xe2, 0x07, 0xc4, 0x6b, 0x18,         \
+                0xf5, 0x2e, 0x80, 0x4c, 0xd7, 0x63, 0xb9, 0x1f          \
+        }
+
+typedef struct CaLocationTableEntry {
+        CaChunkID id;         /* All zeroes for unused slots */
+        uint64_t offset;
+        uint64_t size;
+        uint32_t path;        /* Where the path starts in the path table */
+        uint32_t designator;
+} CaLocationTableEntry;
+
+struct CaLocationTable {
+        CaLocationTableEntry *entries;
+        size_t n_slots;
+        size_t n_used;
+
+        /* All paths, NUL terminated, one after the other, and a hash table of their offsets plus one, for finding
+         * them again */
+        char *paths;
+        size_t paths_size, n_allocated_paths;
+        uint32_t *path_slots;
+        size_t n_path_slots;
+        size_t n_paths;
+        uint32_t last_path;
+
+        int spill_fd;
+};
+
+CaLocationTable* ca_location_table_new(void) {
+        CaLocationTable *t;
+
+        t = new0(CaLocationTable, 1);
+        if (!t)
+                return NULL;
+
+        t->last_path = UINT32_MAX;
+        t->spill_fd = -1;
+
+        return t;
+}
+
+CaLocationTable* ca_location_table_free(CaLocationTable *t) {
+        if (!t)
+                return NULL;
+
+        if (t->entries)
+                (void) munmap(t->entries, t->n_slots * sizeof(CaLocationTableEntry));
+
+        free(t->paths);
+        free(t->path_slots);
+        safe_close(t->spill_fd);
+
+        return mfree(t);
+}
+
+int ca_location_table_set_spill_fd(CaLocationTable *t, int dir_fd) {
+        int fd;
+
+        if (!t)
+                return -EINVAL;
+        if (dir_fd < 0)
+                return -EINVAL;
+
+        fd = fcntl(dir_fd, F_DUPFD_CLOEXEC, 3);
+        if (fd < 0)
+                return -errno;
+
+        safe_close(t->spill_fd);
+        t->spill_fd = fd;
+
+        return 0;
+}
+
+static int ca_location_table_map(CaLocationTable *t, size_t size, void **ret) {
+        void *p;
+        int fd;
+
+        assert(t);
+        assert(ret);
+
+        if (t->spill_fd >= 0) {
+                fd = openat(t->spill_fd, ".", O_TMPFILE|O_RDWR|O_CLOEXEC, 0600);
+                if (fd >= 0) {
+                        if (ftruncate(fd, size) < 0) {
+                                safe_close(fd);
+                                return -errno;
+                        }
+
+                        p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+                        safe_close(fd);
+                        if (p == MAP_FAILED)
+                                return -errno;
+
+                        *ret = p;
+                        return 0;
+                }
+
+                /* Not all file systems support O_TMPFILE, let's keep it in memory then */
+                if (!IN_SET(errno, EOPNOTSUPP, EISDIR))
+                        return -errno;
+        }
+
+        p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+                return -errno;
+
+        *ret = p;
+        return 0;
+}
+
+static CaLocationTableEntry* ca_location_table_find(CaLocationTable *t, const CaChunkID *id) {
+        size_t k, mask;
+
+        assert(t);
+        assert(id);
+
+        if (t->n_slots == 0)
+                return NULL;
+
+        /* Chunk IDs are cryptographic hashes, hence any part of them is as good a hash value as we can get */
+        mask = t->n_slots - 1;
+        k = (size_t) le64toh(id->u64[0]) & mask;
+
+        for (;;) {
+                CaLocationTableEntry *e = t->entries + k;
+
+                if (ca_chunk_id_equal(&e->id, id))
+                        return e;
+                if (ca_chunk_id_is_null(&e->id))
+                        return e;
+
+                k = (k + 1) & mask;
+        }
+}
+
+static int ca_location_table_grow(CaLocationTable *t) {
+        CaLocationTableEntry *old = t->entries;
+        size_t n_old = t->n_slots, i;
+        void *p = NULL;
+        int r;
+
+        assert(t);
+
+        /* Keep the table at most 70% full, as linear probing gets slow beyond that */
+        if ((t->n_used + 1) * 10 <= t->n_slots * 7)
+                return 0;
+
+        r = ca_location_table_map(t, MAX(n_old * 2, CA_LOCATION_TABLE_SLOTS_MIN) * sizeof(CaLocationTableEntry), &p);
+        if (r < 0)
+                return r;
+
+        t->entries = p;
+        t->n_slots = MAX(n_old * 2, CA_LOCATION_TABLE_SLOTS_MIN);
+
+        for (i = 0; i < n_old; i++)
+                if (!ca_chunk_id_is_null(&old[i].id))
+                        *ca_location_table_find(t, &old[i].id) = old[i];
+
+        if (old)
+                (void) munmap(old, n_old * sizeof(CaLocationTableEntry));
+
+        return 0;
+}
+
+static uint64_t ca_location_table_path_hash(const char *path) {
+        return siphash24(path, strlen(path), (const uint8_t[16]) CA_LOCATION_TABLE_PATH_HASH_KEY);
+}
+
+static uint32_t* ca_location_table_find_path(CaLocationTable *t, const char *path) {
+        size_t k, mask;
+
+        assert(t);
+        assert(path);
+        assert(t->n_path_slots > 0);
+
+        mask = t->n_path_slots - 1;
+        k = (size_t) ca_location_table_path_hash(path) & mask;
+
+        while (t->path_slots[k] != 0 && !streq(t->paths + t->path_slots[k] - 1, path))
+                k = (k + 1) & mask;
+
+        return t->path_slots + k;
+}
+
+static int ca_location_table_intern(CaLocationTable *t, const char *path, uint32_t *ret) {
+        uint32_t *slot;
+        size_t l;
+
+        assert(t);
+        assert(path);
+        assert(ret);
+
+        /* Consecutive chunks mostly come from the same file */
+        if (t->last_path != UINT32_MAX && streq(t->paths + t->last_path, path)) {
+                *ret = t->last_path;
+                return 0;
+        }
+
+        if ((t->n_paths + 1) * 10 > t->n_path_slots * 7) {
+                uint32_t *old = t->path_slots;
+                size_t n_old = t->n_path_slots, i;
+
+                t->n_path_slots = MAX(n_old * 2, CA_LOCATION_TABLE_SLOTS_MIN);
+                t->path_slots = new0(uint32_t, t->n_path_slots);
+                if (!t->path_slots) {
+                        t->path_slots = old;
+                        t->n_path_slots = n_old;
+                        return -ENOMEM;
+                }
+
+                for (i = 0; i < n_old; i++)
+                        if (old[i] != 0)
+                                *ca_location_table_find_path(t, t->paths + old[i] - 1) = old[i];
+
+                free(old);
+        }
+
+        slot = ca_location_table_find_path(t, path);
+        if (*slot == 0) {
+                l = strlen(path) + 1;
+
+                if (t->paths_size + l >= UINT32_MAX)
+                        return -EFBIG;
+
+                if (!GREEDY_REALLOC(t->paths, t->n_allocated_paths, t->paths_size + l))
+                        return -ENOMEM;
+
+                memcpy(t->paths + t->paths_size, path, l);
+                *slot = t->paths_size + 1;
+
+                t->paths_size += l;
+                t->n_paths++;
+        }
+
+        *ret = t->last_path = *slot - 1;
+        return 0;
+}
+
+int ca_location_table_put(
+                CaLocationTable *t,
+                const CaChunkID *id,
+                CaLocationDesignator designator,
+                const char *path,
+                uint64_t offset,
+                uint64_t size) {
+
+        CaLocationTableEntry *e;
+        uint32_t p;
+        int r;
+
+        if (!t)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+        if (ca_chunk_id_is_null(id))
+                return -EINVAL;
+        if (!CA_LOCATION_DESIGNATOR_VALID(designator))
+                return -EINVAL;
+
+        e = ca_location_table_find(t, id);
+        if (e && !ca_chunk_id_is_null(&e->id))
+                return 0;
+
+        r = ca_location_table_intern(t, strempty(path), &p);
+        if (r < 0)
+                return r;
+
+        r = ca_location_table_grow(t);
+        if (r < 0)
+                return r;
+
+        e = ca_location_table_find(t, id);
+        *e = (CaLocationTableEntry) {
+                .id = *id,
+                .offset = offset,
+                .size = size,
+                .path = p,
+                .designator = designator,
+        };
+
+        t->n_used++;
+        return 1;
+}
+
+int ca_location_table_get(CaLocationTable *t, const CaChunkID *id, CaLocation **ret) {
+        CaLocationTableEntry *e;
+
+        if (!t)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+
+        e = ca_location_table_find(t, id);
+        if (!e || ca_chunk_id_is_null(&e->id))
+                return -ENOENT;
+
+        if (!ret)
+                return 0;
+
+        return ca_location_new(e->designator == CA_LOCATION_VOID ? NULL : t->paths + e->path,
+                               e->designator, e->offset, e->size, ret);
+}
+
+int ca_location_table_enumerate(CaLocationTable *t, int (*callback)(const CaChunkID *id, void *userdata), void *userdata) {
+        size_t i;
+        int r;
+
+        if (!t)
+                return -EINVAL;
+        if (!callback)
+                return -EINVAL;
+
+        for (i = 0; i < t->n_slots; i++) {
+                if (ca_chunk_id_is_null(&t->entries[i].id))
+                        continue;
+
+                r = callback(&t->entries[i].id, userdata);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+uint64_t ca_location_table_entries(CaLocationTable *t) {
+        if (!t)
+                return 0;
+
+        return t->n_used;
+}
+
+uint64_t ca_location_table_size(CaLocationTable *t) {
+        if (!t)
+                return 0;
+
+        return t->n_slots * sizeof(CaLocationTableEntry) + t->n_allocated_paths + t->n_path_slots * sizeof(uint32_t);
+}
@@ -0,0 +1,30 @@
+#ifndef foocalocationtablehfoo
+#define foocalocationtablehfoo
+
+#include "cachunkid.h"
+#include "calocation.h"
+
+/* A hash table mapping chunk IDs to the locations their data may be generated from. Locations are stored in binary
+ * form, with each path stored only once. */
+
+typedef struct CaLocationTable CaLocationTable;
+
+CaLocationTable* ca_location_table_new(void);
+CaLocationTable* ca_location_table_free(CaLocationTable *t);
+
+/* Keeps the table in an unlinked file in this directory rather than in anonymous memory, so that the kernel can write
+ * it out instead of holding all of it in RAM. The fd is duplicated, not taken possession of. */
+int ca_location_table_set_spill_fd(CaLocationTable *t, int dir_fd);
+
+/* Returns 0 if there's an entry for the ID already, and leaves it as it is then, > 0 if the entry was added */
+int ca_location_table_put(CaLocationTable *t, const CaChunkID *id, CaLocationDesignator designator, const char *path, uint64_t offset, uint64_t size);
+
+/* Returns -ENOENT if there's no entry for the ID. 'ret' may be NULL to just check for one. */
+int ca_location_table_get(CaLocationTable *t, const CaChunkID *id, CaLocation **ret);
+
+int ca_location_table_enumerate(CaLocationTable *t, int (*callback)(const CaChunkID *id, void *userdata), void *userdata);
+
+uint64_t ca_location_table_entries(CaLocationTable *t);
+uint64_t ca_location_table_size(CaLocationTable *t);
+
+#endif
@@ -0,0 +1,431 @@
+#include <errno.h>
+#include <grp.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#include "canamecache.h"
+#include "siphash24.h"
+#include "util.h"
+
+#define CA_NAME_CACHE_BUCKETS_MIN ((size_t) 64)
+
+typedef enum CaNameCacheType {
+        CA_NAME_CACHE_USER_BY_ID,
+        CA_NAME_CACHE_GROUP_BY_ID,
+        CA_NAME_CACHE_USER_BY_NAME,
+        CA_NAME_CACHE_GROUP_BY_NAME,
+} CaNameCacheType;
+
+#define CA_NAME_CACHE_TYPE_BY_NAME(t) IN_SET(t, CA_NAME_CACHE_USER_BY_NAME, CA_NAME_CACHE_GROUP_BY_NAME)
+
+typedef struct CaNameCacheEntry CaNameCacheEntry;
+
+struct CaNameCacheEntry {
+        CaNameCacheEntry *bucket_next;
+        uint64_t hash;
+
+        CaNameCacheType type;
+        bool found; /* false if the user database doesn't know the user or group */
+
+        /* One of the two is what we looked up, the other what we found, depending on the type */
+        uint32_t id;
+        char name[];
+};
+
+struct CaNameCache {
+        unsigned n_ref;
+
+        /* Protects everything below, but is never held while asking the user database */
+        pthread_mutex_t mutex;
+
+        CaNameCacheEntry **buckets;
+        size_t n_buckets;
+        size_t n_entries;
+
+        /* Names might come from an archive, hence don't let them pick the buckets */
+        uint8_t hash_key[16];
+
+        uint64_t n_hits;
+        uint64_t n_misses;
+};
+
+CaNameCache* ca_name_cache_new(void) {
+        CaNameCache *c;
+        uint64_t k[2];
+
+        c = new0(CaNameCache, 1);
+        if (!c)
+                return NULL;
+
+        c->n_ref = 1;
+        assert_se(pthread_mutex_init(&c->mutex, NULL) == 0);
+
+        k[0] = random_u64();
+        k[1] = random_u64();
+        memcpy(c->hash_key, k, sizeof(c->hash_key));
+
+        return c;
+}
+
+CaNameCache* ca_name_cache_ref(CaNameCache *c) {
+        if (!c)
+                return NULL;
+
+        assert_se(pthread_mutex_lock(&c->mutex) == 0);
+        assert(c->n_ref > 0);
+        c->n_ref++;
+        assert_se(pthread_mutex_unlock(&c->mutex) == 0);
+
+        return c;
+}
+
+CaNameCache* ca_name_cache_unref(CaNameCache *c) {
+        size_t i;
+        bool last;
+
+        if (!c)
+                return NULL;
+
+        assert_se(pthread_mutex_lock(&c->mutex) == 0);
+        assert(c->n_ref > 0);
+        last = --c->n_ref == 0;
+        assert_se(pthread_mutex_unlock(&c->mutex) == 0);
+
+        if (!last)
+                return NULL;
+
+        for (i = 0; i < c->n_buckets; i++) {
+                CaNameCacheEntry *e, *n;
+
+                for (e = c->buckets[i]; e; e = n) {
+                        n = e->bucket_next;
+                        free(e);
+                }
+        }
+
+        free(c->buckets);
+        assert_se(pthread_mutex_destroy(&c->mutex) == 0);
+
+        return mfree(c);
+}
+
+static uint64_t ca_name_cache_hash(CaNameCache *c, CaNameCacheType type, uint32_t id, const char *name) {
+        struct siphash state;
+
+        assert(c);
+
+        siphash24_init(&state, c->hash_key);
+        siphash24_compress_byte((uint8_t) type, &state);
+
+        if (CA_NAME_CACHE_TYPE_BY_NAME(type))
+                siphash24_compress(name, strlen(name), &state);
+        else
+                siphash24_compress(&id, sizeof(id), &state);
+
+        return siphash24_finalize(&state);
+}
+
+static CaNameCacheEntry* ca_name_cache_find(CaNameCache *c, CaNameCacheType type, uint64_t hash, uint32_t id, const char *name) {
+        CaNameCacheEntry *e;
+
+        assert(c);
+
+        if (c->n_buckets == 0)
+                return NULL;
+
+        for (e = c->buckets[hash & (c->n_buckets - 1)]; e; e = e->bucket_next) {
+                if (e->hash != hash || e->type != type)
+                        continue;
+
+                if (CA_NAME_CACHE_TYPE_BY_NAME(type) ? streq(e->name, name) : e->id == id)
+                        return e;
+        }
+
+        return NULL;
+}
+
+static int ca_name_cache_grow(CaNameCache *c) {
+        CaNameCacheEntry **buckets;
+        size_t n, i;
+
+        assert(c);
+
+        if (c->n_entries < c->n_buckets)
+                return 0;
+
+        n = MAX(c->n_buckets * 2, CA_NAME_CACHE_BUCKETS_MIN);
+
+        buckets = new0(CaNameCacheEntry*, n);
+        if (!buckets)
+                return -ENOMEM;
+
+        for (i = 0; i < c->n_buckets; i++) {
+                CaNameCacheEntry *e, *next;
+
+                for (e = c->buckets[i]; e; e = next) {
+                        CaNameCacheEntry **b;
+
+                        next = e->bucket_next;
+
+                        b = buckets + (e->hash & (n - 1));
+                        e->bucket_next = *b;
+                        *b = e;
+                }
+        }
+
+        free(c->buckets);
+        c->buckets = buckets;
+        c->n_buckets = n;
+
+        return 0;
+}
+
+static int ca_name_cache_add(CaNameCache *c, CaNameCacheType type, uint64_t hash, uint32_t id, const char *name, bool found) {
+        CaNameCacheEntry *e, **b;
+        size_t l;
+        int r;
+
+        assert(c);
+        assert(name);
+
+        if (c->n_entries >= CA_NAME_CACHE_ENTRIES_MAX)
+                return 0;
+
+        r = ca_name_cache_grow(c);
+        if (r < 0)
+                return r;
+
+        l = strlen(name);
+
+        e = malloc(offsetof(CaNameCacheEntry, name) + l + 1);
+        if (!e)
+                return -ENOMEM;
+
+        e->hash = hash;
+        e->type = type;
+        e->found = found;
+        e->id = id;
+        memcpy(e->name, name, l + 1);
+
+        b = c->buckets + (hash & (c->n_buckets - 1));
+        e->bucket_next = *b;
+        *b = e;
+
+        c->n_entries++;
+
+        return 1;
+}
+
+static int query_database(CaNameCacheType type, uint32_t id, const char *name, uint32_t *ret_id, char **ret_name) {
+        long bufsize;
+
+        bufsize = sysconf(IN_SET(type, CA_NAME_CACHE_USER_BY_ID, CA_NAME_CACHE_USER_BY_NAME) ? _SC_GETPW_R_SIZE_MAX : _SC_GETGR_R_SIZE_MAX);
+        if (bufsize <= 0)
+                bufsize = 4096;
+
+        for (;;) {
+                struct passwd pwbuf, *pw = NULL;
+                struct group grbuf, *gr = NULL;
+                char *buf;
+                int r;
+
+                buf = malloc(bufsize);
+                if (!buf)
+                        return -ENOMEM;
+
+                switch (type) {
+
+                case CA_NAME_CACHE_USER_BY_ID:
+                        r = getpwuid_r((uid_t) id, &pwbuf, buf, (size_t) bufsize, &pw);
+                        break;
+
+                case CA_NAME_CACHE_USER_BY_NAME:
+                        r = getpwnam_r(name, &pwbuf, buf, (size_t) bufsize, &pw);
+                        break;
+
+                case CA_NAME_CACHE_GROUP_BY_ID:
+                        r = getgrgid_r((gid_t) id, &grbuf, buf, (size_t) bufsize, &gr);
+                        break;
+
+                case CA_NAME_CACHE_GROUP_BY_NAME:
+                        r = getgrnam_r(name, &grbuf, buf, (size_t) bufsize, &gr);
+                        break;
+
+                default:
+                        assert(false);
+                        r = EINVAL;
+                }
+
+                if (r == 0 && (pw || gr)) {
+                        *ret_id = pw ? (uint32_t) pw->pw_uid : (uint32_t) gr->gr_gid;
+                        *ret_name = strdup(pw ? pw->pw_name : gr->gr_name);
+                        free(buf);
+
+                        if (!*ret_name)
+                                return -ENOMEM;
+
+                        return 1;
+                }
+
+                free(buf);
+
+                /* Depending on the backend, a user or group that doesn't exist is reported in different ways */
+                if (r == 0 || IN_SET(r, ENOENT, ESRCH))
+                        return 0;
+                if (r != ERANGE)
+                        return -r;
+
+                bufsize *= 2;
+        }
+}
+
+static int ca_name_cache_lookup(CaNameCache *c, CaNameCacheType type, uint32_t id, const char *name, uint32_t *ret_id, char **ret_name) {
+        CaNameCacheEntry *e;
+        char *found_name = NULL;
+        uint32_t found_id = 0;
+        uint64_t hash;
+        int r;
+
+        assert(c);
+        assert(!CA_NAME_CACHE_TYPE_BY_NAME(type) || name);
+
+        hash = ca_name_cache_hash(c, type, id, name);
+
+        assert_se(pthread_mutex_lock(&c->mutex) == 0);
+
+        e = ca_name_cache_find(c, type, hash, id, name);
+        if (e) {
+                c->n_hits++;
+
+                r = e->found;
+                if (r > 0) {
+                        found_id = e->id;
+                        if (ret_name) {
+                                found_name = strdup(e->name);
+                                if (!found_name)
+                                        r = -ENOMEM;
+                        }
+                }
+
+                assert_se(pthread_mutex_unlock(&c->mutex) == 0);
+                goto finish;
+        }
+
+        c->n_misses++;
+        assert_se(pthread_mutex_unlock(&c->mutex) == 0);
+
+        r = query_database(type, id, name, &found_id, &found_name);
+        if (r < 0) /* Don't remember errors, they might be temporary */
+                return r;
+
+        assert_se(pthread_mutex_lock(&c->mutex) == 0);
+
+        /* Another thread might have looked up the same in the meantime */
+        if (!ca_name_cache_find(c, type, hash, id, name)) {
+                if (CA_NAME_CACHE_TYPE_BY_NAME(type))
+                        (void) ca_name_cache_add(c, type, hash, found_id, name, r > 0);
+                else
+                        (void) ca_name_cache_add(c, type, hash, id, found_name ?: "", r > 0);
+        }
+
+        assert_se(pthread_mutex_unlock(&c->mutex) == 0);
+
+finish:
+        if (r > 0) {
+                if (ret_id)
+                        *ret_id = found_id;
+                if (ret_name) {
+                        *ret_name = found_name;
+                        found_name = NULL;
+                }
+        }
+
+        free(found_name);
+        return r;
+}
+
+int ca_name_cache_uid_to_name(CaNameCache *c, uid_t uid, char **ret) {
+        if (!c)
+                return -EINVAL;
+        if (!uid_is_valid(uid))
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        return ca_name_cache_lookup(c, CA_NAME_CACHE_USER_BY_ID, (uint32_t) uid, NULL, NULL, ret);
+}
+
+int ca_name_cache_gid_to_name(CaNameCache *c, gid_t gid, char **ret) {
+        if (!c)
+                return -EINVAL;
+        if (!gid_is_valid(gid))
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        return ca_name_cache_lookup(c, CA_NAME_CACHE_GROUP_BY_ID, (uint32_t) gid, NULL, NULL, ret);
+}
+
+int ca_name_cache_name_to_uid(CaNameCache *c, const char *name, uid_t *ret) {
+        uint32_t id;
+        int r;
+
+        if (!c)
+                return -EINVAL;
+        if (!name)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        r = ca_name_cache_lookup(c, CA_NAME_CACHE_USER_BY_NAME, 0, name, &id, NULL);
+        if (r > 0)
+                *ret = (uid_t) id;
+
+        return r;
+}
+
+int ca_name_cache_name_to_gid(CaNameCache *c, const char *name, gid_t *ret) {
+        uint32_t id;
+        int r;
+
+        if (!c)
+                return -EINVAL;
+        if (!name)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        r = ca_name_cache_lookup(c, CA_NAME_CACHE_GROUP_BY_NAME, 0, name, &id, NULL);
+        if (r > 0)
+                *ret = (gid_t) id;
+
+        return r;
+}
+
+uint64_t ca_name_cache_get_hits(CaNameCache *c) {
+        uint64_t n;
+
+        if (!c)
+                return 0;
+
+        assert_se(pthread_mutex_lock(&c->mutex) == 0);
+        n = c->n_hits;
+        assert_se(pthread_mutex_unlock(&c->mutex) == 0);
+
+        return n;
+}
+
+uint64_t ca_name_cache_get_misses(CaNameCache *c) {
+        uint64_t n;
+
+        if (!c)
+                return 0;
+
+        assert_se(pthread_mutex_lock(&c->mutex) == 0);
+        n = c->n_misses;
+        assert_se(pthread_mutex_unlock(&c->mutex) == 0);
+
+        return n;
+}
@@ -0,0 +1,32 @@
+#ifndef foocanamecachehfoo
+#define foocanamecachehfoo
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+/* Caches the results of looking up user and group names by ID and vice versa in the user database. With the database
+ * served over the network, each lookup may take a while, and we'd do one for each file otherwise. Failed lookups are
+ * cached too. The cache may be shared between encoders, decoders and seeds, also on different threads. */
+
+typedef struct CaNameCache CaNameCache;
+
+/* The maximum number of lookups remembered, as the names might come from an archive we extract */
+#define CA_NAME_CACHE_ENTRIES_MAX 65536U
+
+CaNameCache* ca_name_cache_new(void);
+CaNameCache* ca_name_cache_ref(CaNameCache *c);
+CaNameCache* ca_name_cache_unref(CaNameCache *c);
+
+/* Return 1 and a newly allocated name in *ret if the user or group exists, 0 if not */
+int ca_name_cache_uid_to_name(CaNameCache *c, uid_t uid, char **ret);
+int ca_name_cache_gid_to_name(CaNameCache *c, gid_t gid, char **ret);
+
+/* Return 1 and the ID in *ret if the user or group exists, 0 if not */
+int ca_name_cache_name_to_uid(CaNameCache *c, const char *name, uid_t *ret);
+int ca_name_cache_name_to_gid(CaNameCache *c, const char *name, gid_t *ret);
+
+/* How many lookups were answered from the cache, and how many had to ask the user database */
+uint64_t ca_name_cache_get_hits(CaNameCache *c);
+uint64_t ca_name_cache_get_misses(CaNameCache *c);
+
+#endif
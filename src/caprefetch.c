@@ -0,0 +1,300 @@
+#include "caprefetch.h"
+#include "util.h"
+
+/* How often to sample the decoder's throughput */
+#define CA_PREFETCH_RATE_INTERVAL_NSEC UINT64_C(1000000000)
+
+#define CA_PREFETCH_SLOTS (CA_PREFETCH_CHUNKS_MAX * 2)
+
+typedef struct CaPrefetchEntry {
+        CaChunkID id;
+        uint64_t size;
+        bool requested;
+} CaPrefetchEntry;
+
+struct CaPrefetch {
+        /* Ring of the window's index positions, position i is stored at i % CA_PREFETCH_CHUNKS_MAX */
+        CaPrefetchEntry *entries;
+        uint64_t start, end;
+
+        /* Hash table of the IDs requested within the window, all zeroes for unused slots */
+        CaChunkID *slots;
+
+        uint64_t window;
+        uint64_t window_max;
+        uint64_t requested_bytes;
+
+        uint64_t rate;             /* Bytes per second the decoder consumes */
+        uint64_t rate_bytes;
+        uint64_t rate_since;
+
+        uint64_t n_requested;
+        uint64_t n_duplicates;
+        uint64_t n_stalls;
+};
+
+CaPrefetch* ca_prefetch_new(void) {
+        CaPrefetch *p;
+
+        p = new0(CaPrefetch, 1);
+        if (!p)
+                return NULL;
+
+        p->window = CA_PREFETCH_WINDOW_MIN;
+        p->window_max = CA_PREFETCH_WINDOW_MAX_DEFAULT;
+
+        return p;
+}
+
+CaPrefetch* ca_prefetch_free(CaPrefetch *p) {
+        if (!p)
+                return NULL;
+
+        free(p->entries);
+        free(p->slots);
+
+        return mfree(p);
+}
+
+int ca_prefetch_set_window_max(CaPrefetch *p, uint64_t size) {
+        if (!p)
+                return -EINVAL;
+        if (size < CA_PREFETCH_WINDOW_MIN)
+                return -ERANGE;
+
+        p->window_max = size;
+        p->window = MIN(p->window, size);
+
+        return 0;
+}
+
+uint64_t ca_prefetch_get_window(CaPrefetch *p) {
+        if (!p)
+                return 0;
+
+        return p->window;
+}
+
+static size_t ca_prefetch_slot(const CaChunkID *id) {
+        assert(id);
+
+        /* Chunk IDs are cryptographic hashes, hence any part of them is as good a hash value as we can get */
+        return (size_t) le64toh(id->u64[0]) & (CA_PREFETCH_SLOTS - 1);
+}
+
+static bool ca_prefetch_slot_used(CaPrefetch *p, size_t k) {
+        static const CaChunkID null = {};
+
+        assert(p);
+
+        return !ca_chunk_id_equal(p->slots + k, &null);
+}
+
+static CaChunkID* ca_prefetch_find(CaPrefetch *p, const CaChunkID *id) {
+        size_t k;
+
+        assert(p);
+        assert(id);
+
+        if (!p->slots)
+                return NULL;
+
+        for (k = ca_prefetch_slot(id); ca_prefetch_slot_used(p, k); k = (k + 1) & (CA_PREFETCH_SLOTS - 1))
+                if (ca_chunk_id_equal(p->slots + k, id))
+                        return p->slots + k;
+
+        return NULL;
+}
+
+static void ca_prefetch_remove(CaPrefetch *p, const CaChunkID *id) {
+        CaChunkID *slot;
+        size_t i, j;
+
+        assert(p);
+        assert(id);
+
+        slot = ca_prefetch_find(p, id);
+        if (!slot)
+                return;
+
+        /* Move later entries of the same probe sequence up, so that lookups don't stop early at the free slot */
+        i = slot - p->slots;
+        for (j = (i + 1) & (CA_PREFETCH_SLOTS - 1); ca_prefetch_slot_used(p, j); j = (j + 1) & (CA_PREFETCH_SLOTS - 1)) {
+                size_t k;
+
+                k = ca_prefetch_slot(p->slots + j);
+
+                /* Leave the entry where it is if its home slot is cyclically within (i, j] */
+                if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                        continue;
+
+                p->slots[i] = p->slots[j];
+                i = j;
+        }
+
+        p->slots[i] = (CaChunkID) {};
+}
+
+static void ca_prefetch_pop(CaPrefetch *p) {
+        CaPrefetchEntry *e;
+
+        assert(p);
+        assert(p->start < p->end);
+
+        e = p->entries + (p->start % CA_PREFETCH_CHUNKS_MAX);
+        if (e->requested) {
+                ca_prefetch_remove(p, &e->id);
+                p->requested_bytes -= e->size;
+        }
+
+        p->start++;
+}
+
+int ca_prefetch_advance(CaPrefetch *p, uint64_t position) {
+        if (!p)
+                return -EINVAL;
+
+        if (position < p->start || position > p->end) {
+                while (p->start < p->end)
+                        ca_prefetch_pop(p);
+
+                p->start = p->end = position;
+                return 0;
+        }
+
+        while (p->start < position)
+                ca_prefetch_pop(p);
+
+        return 0;
+}
+
+uint64_t ca_prefetch_next(CaPrefetch *p) {
+        if (!p)
+                return 0;
+
+        return p->end;
+}
+
+bool ca_prefetch_full(CaPrefetch *p) {
+        if (!p)
+                return true;
+
+        return p->requested_bytes >= p->window ||
+                p->end - p->start >= CA_PREFETCH_CHUNKS_MAX;
+}
+
+int ca_prefetch_is_requested(CaPrefetch *p, const CaChunkID *id) {
+        if (!p)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+
+        return !!ca_prefetch_find(p, id);
+}
+
+int ca_prefetch_push(CaPrefetch *p, const CaChunkID *id, uint64_t size, bool requested) {
+        CaPrefetchEntry *e;
+
+        if (!p)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+        if (p->end - p->start >= CA_PREFETCH_CHUNKS_MAX)
+                return -ENOBUFS;
+
+        if (!p->entries) {
+                p->entries = new(CaPrefetchEntry, CA_PREFETCH_CHUNKS_MAX);
+                if (!p->entries)
+                        return -ENOMEM;
+        }
+
+        if (requested) {
+                size_t k;
+
+                if (!p->slots) {
+                        p->slots = new0(CaChunkID, CA_PREFETCH_SLOTS);
+                        if (!p->slots)
+                                return -ENOMEM;
+                }
+
+                if (ca_prefetch_find(p, id))
+                        return -EEXIST;
+
+                /* There are at most half as many requested entries as slots, hence this always finds a free one */
+                for (k = ca_prefetch_slot(id); ca_prefetch_slot_used(p, k); k = (k + 1) & (CA_PREFETCH_SLOTS - 1))
+                        ;
+
+                p->slots[k] = *id;
+                p->requested_bytes += size;
+                p->n_requested++;
+        } else if (ca_prefetch_find(p, id))
+                p->n_duplicates++;
+
+        e = p->entries + (p->end % CA_PREFETCH_CHUNKS_MAX);
+        *e = (CaPrefetchEntry) {
+                .id = *id,
+                .size = size,
+                .requested = requested,
+        };
+
+        p->end++;
+        return 0;
+}
+
+int ca_prefetch_put_consumed(CaPrefetch *p, uint64_t size, bool stalled, uint64_t t) {
+        uint64_t limit;
+
+        if (!p)
+                return -EINVAL;
+
+        if (p->rate_since == 0 || t < p->rate_since)
+                p->rate_since = t;
+
+        p->rate_bytes += size;
+
+        if (t - p->rate_since >= CA_PREFETCH_RATE_INTERVAL_NSEC) {
+                uint64_t sample;
+
+                sample = (uint64_t) ((double) p->rate_bytes * 1e9 / (double) (t - p->rate_since));
+                p->rate = p->rate == 0 ? sample : (p->rate * 3 + sample) / 4;
+
+                p->rate_bytes = 0;
+                p->rate_since = t;
+        }
+
+        /* Requesting more than we can consume in a while doesn't help with latency, it just piles up requests */
+        limit = p->window_max;
+        if (p->rate > 0 && p->rate < limit / CA_PREFETCH_HORIZON_SEC)
+                limit = MAX(p->rate * CA_PREFETCH_HORIZON_SEC, CA_PREFETCH_WINDOW_MIN);
+
+        /* The decoder had to wait, hence we need to request earlier */
+        if (stalled) {
+                p->n_stalls++;
+                p->window *= 2;
+        }
+
+        p->window = MIN(p->window, limit);
+
+        return 0;
+}
+
+uint64_t ca_prefetch_get_requested(CaPrefetch *p) {
+        if (!p)
+                return 0;
+
+        return p->n_requested;
+}
+
+uint64_t ca_prefetch_get_duplicates(CaPrefetch *p) {
+        if (!p)
+                return 0;
+
+        return p->n_duplicates;
+}
+
+uint64_t ca_prefetch_get_stalls(CaPrefetch *p) {
+        if (!p)
+                return 0;
+
+        return p->n_stalls;
+}
@@ -0,0 +1,55 @@
+#ifndef foocaprefetchhfoo
+#define foocaprefetchhfoo
+
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "cachunkid.h"
+
+/* Tracks the chunks requested ahead of the decoder. The window covers the index positions from the one the decoder is
+ * at to the last one we looked at, and is limited in the number of bytes requested and not received yet. Its size
+ * adapts: it grows whenever the decoder had to wait for a chunk, i.e. the requests weren't issued early enough for
+ * the latency of the remote, and is limited to what the decoder consumes in CA_PREFETCH_HORIZON_SEC seconds at the
+ * throughput observed. Chunks requested already within the window aren't requested again. */
+
+/* Lower and (default) upper limit of the window, in bytes of chunk data requested */
+#define CA_PREFETCH_WINDOW_MIN (UINT64_C(4)*UINT64_C(1024)*UINT64_C(1024))
+#define CA_PREFETCH_WINDOW_MAX_DEFAULT (UINT64_C(256)*UINT64_C(1024)*UINT64_C(1024))
+
+/* The window is limited to what the decoder consumes in this many seconds */
+#define CA_PREFETCH_HORIZON_SEC UINT64_C(10)
+
+/* The window never covers more index positions than this */
+#define CA_PREFETCH_CHUNKS_MAX ((size_t) 16384)
+
+typedef struct CaPrefetch CaPrefetch;
+
+CaPrefetch* ca_prefetch_new(void);
+CaPrefetch* ca_prefetch_free(CaPrefetch *p);
+
+int ca_prefetch_set_window_max(CaPrefetch *p, uint64_t size);
+uint64_t ca_prefetch_get_window(CaPrefetch *p);
+
+/* Moves the start of the window to the index position the decoder is at. If that's outside of the window, for
+ * example after seeking, the window is emptied and starts over there. */
+int ca_prefetch_advance(CaPrefetch *p, uint64_t position);
+
+/* The index position to look at next, and whether there's room in the window for it */
+uint64_t ca_prefetch_next(CaPrefetch *p);
+bool ca_prefetch_full(CaPrefetch *p);
+
+/* Returns > 0 if the chunk has been requested already by an earlier position in the window */
+int ca_prefetch_is_requested(CaPrefetch *p, const CaChunkID *id);
+
+/* Adds the chunk at the next index position to the window, 'requested' tells whether it has been requested for it */
+int ca_prefetch_push(CaPrefetch *p, const CaChunkID *id, uint64_t size, bool requested);
+
+/* To be called whenever the decoder consumed a chunk, with the CLOCK_MONOTONIC time in ns, and whether it had to
+ * wait for the chunk. */
+int ca_prefetch_put_consumed(CaPrefetch *p, uint64_t size, bool stalled, uint64_t t);
+
+uint64_t ca_prefetch_get_requested(CaPrefetch *p);
+uint64_t ca_prefetch_get_duplicates(CaPrefetch *p);
+uint64_t ca_prefetch_get_stalls(CaPrefetch *p);
+
+#endif
@@ -54,6 +54,7 @@ struct CaRemote {
         int output_fd;
 
         uint64_t rate_limit_bps;
+        unsigned max_active_chunks;
 
         ReallocBuffer input_buffer;
         ReallocBuffer output_buffer;
@@ -79,7 +80,9 @@ struct CaRemote {
 
         size_t frame_size;
 
-        gcry_md_hd_t validate_digest;
+        CaDigestType digest_type;
+        CaDigest *validate_digest;
+        CaCompressionContext validate_compression;
 };
 
 CaRemote* ca_remote_new(void) {
@@ -91,6 +94,8 @@ CaRemote* ca_remote_new(void) {
 
         rr->n_ref = 1;
 
+        rr->digest_type = CA_DIGEST_DEFAULT;
+
         rr->cache_fd = -1;
         rr->input_fd = -1;
         rr->output_fd = -1;
@@ -209,7 +214,8 @@ CaRemote* ca_remote_unref(CaRemote *rr) {
                 (void) wait_for_terminate(rr->pid, NULL);
         }
 
-        gcry_md_close(rr->validate_digest);
+        ca_digest_free(rr->validate_digest);
+        ca_compression_done(&rr->validate_compression);
 
         return mfree(rr);
 }
@@ -223,6 +229,25 @@ int ca_remote_set_rate_limit_bps(CaRemote *rr, uint64_t rate_limit_bps) {
         return 0;
 }
 
+int ca_remote_set_max_active_chunks(CaRemote *rr, unsigned n) {
+        if (!rr)
+                return -EINVAL;
+
+        rr->max_active_chunks = n;
+
+        return 0;
+}
+
+int ca_remote_set_digest_type(CaRemote *rr, CaDigestType type) {
+        if (!rr)
+                return -EINVAL;
+        if (type < 0 || type >= _CA_DIGEST_TYPE_MAX)
+                return -EINVAL;
+
+        rr->digest_type = type;
+        return 0;
+}
+
 int ca_remote_set_local_feature_flags(CaRemote *rr, uint64_t flags) {
         if (!rr)
                 return -EINVAL;
@@ -965,6 +990,9 @@ static int ca_remote_start(CaRemote *rr) {
                         if (rr->rate_limit_bps != UINT64_MAX)
                                 argc++;
 
+                        if (rr->callout && rr->max_active_chunks > 0)
+                                argc++;
+
                         args = newa(char*, argc + 1);
 
                         if (rr->callout) {
@@ -1002,6 +1030,15 @@ static int ca_remote_start(CaRemote *rr) {
                                 i++;
                         }
 
+                        /* Only the protocol helpers fetch chunks in parallel, a remote casync reads them from disk */
+                        if (rr->callout && rr->max_active_chunks > 0) {
+                                r = asprintf(args + i, "--max-active-chunks=%u", rr->max_active_chunks);
+                                if (r < 0)
+                                        return log_oom();
+
+                                i++;
+                        }
+
                         args[i++] = (char*) ((rr->local_feature_flags & (CA_PROTOCOL_PUSH_CHUNKS|CA_PROTOCOL_PUSH_INDEX|CA_PROTOCOL_PUSH_ARCHIVE)) ? "push" : "pull");
                         args[i++] = /* rr->base_url ? rr->base_url + skip :*/ (char*) "-";
                         args[i++] = rr->archive_url ? rr->archive_url + skip : (char*) "-";
@@ -1286,6 +1323,8 @@ static int ca_remote_process_chunk(CaRemote *rr, const CaProtocolChunk *chunk) {
                                &rr->last_chunk,
                                (le64toh(chunk->flags) & CA_PROTOCOL_CHUNK_COMPRESSED) ? CA_CHUNK_COMPRESSED : CA_CHUNK_UNCOMPRESSED,
                                CA_CHUNK_AS_IS,
+                               CA_COMPRESSION_DEFAULT,
+                               CA_COMPRESSION_LEVEL_DEFAULT,
                                chunk->data,
                                ms);
         if (r == -EEXIST)
@@ -1997,7 +2036,7 @@ static int ca_remote_validate_chunk(
         if (compression == CA_CHUNK_COMPRESSED) {
                 realloc_buffer_empty(&rr->validate_buffer);
 
-                r = ca_decompress(p, l, &rr->validate_buffer);
+                r = ca_decompress(&rr->validate_compression, p, l, &rr->validate_buffer);
                 if (r < 0)
                         return r;
 
@@ -2005,7 +2044,11 @@ static int ca_remote_validate_chunk(
                 l = realloc_buffer_size(&rr->validate_buffer);
         }
 
-        r = ca_chunk_id_make(&rr->validate_digest, p, l, &actual);
+        r = ca_digest_ensure_allocated(&rr->validate_digest, rr->digest_type);
+        if (r < 0)
+                return r;
+
+        r = ca_chunk_id_make(rr->validate_digest, p, l, &actual);
         if (r < 0)
                 return r;
 
@@ -2047,7 +2090,7 @@ int ca_remote_request(
 
         realloc_buffer_empty(&rr->chunk_buffer);
 
-        r = ca_chunk_file_load(rr->cache_fd, NULL, chunk_id, desired_compression, &rr->chunk_buffer, &compression);
+        r = ca_chunk_file_load(rr->cache_fd, NULL, chunk_id, desired_compression, CA_COMPRESSION_DEFAULT, CA_COMPRESSION_LEVEL_DEFAULT, &rr->chunk_buffer, &compression);
         if (r == -ENOENT) {
                 /* We don't have it right now. Enqueue it */
                 r = ca_remote_enqueue_request(rr, chunk_id, high_priority, true);
@@ -2549,7 +2592,7 @@ int ca_remote_next_chunk(
 
                 realloc_buffer_empty(&rr->chunk_buffer);
 
-                r = ca_chunk_file_load(rr->cache_fd, NULL, &rr->last_chunk, desired_compression, &rr->chunk_buffer, &compression);
+                r = ca_chunk_file_load(rr->cache_fd, NULL, &rr->last_chunk, desired_compression, CA_COMPRESSION_DEFAULT, CA_COMPRESSION_LEVEL_DEFAULT, &rr->chunk_buffer, &compression);
                 if (r < 0)
                         return r;
 
@@ -1,16 +1,19 @@
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
 #include "cachunk.h"
 #include "cachunker.h"
+#include "def.h"
 #include "caencoder.h"
 #include "cafileroot.h"
 #include "caformat-util.h"
 #include "caformat.h"
 #include "calocation.h"
+#include "calocationtable.h"
 #include "caseed.h"
 #include "realloc-buffer.h"
-#include "rm-rf.h"
 #include "util.h"
 
 /* #undef EINVAL */
@@ -22,6 +25,63 @@
 /* #undef EUNATCH */
 /* #define EUNATCH __LINE__ */
 
+/* In a persistent cache we keep a database of the regular files in the seed and the chunks that start in their
+ * payload. On the next run the chunks of files whose inode, size and timestamps didn't change are taken from there, and
+ * the encoder skips over the data they cover, rather than reading and hashing it again. */
+#define CA_SEED_DB_FILENAME "seed.db"
+#define CA_SEED_DB_TEMPORARY_FILENAME "seed.db.tmp"
+
+#define CA_SEED_DB_MAGIC UINT64_C(0x5be3a0c81f6d4e27)
+#define CA_SEED_DB_FILE UINT64_C(0x93d1e6b04a7c2f58)
+
+#define CA_SEED_DB_HARDLINK UINT64_C(1)
+
+/* The database starts with this, any differences to what we'd write mean the chunks in it aren't what we'd get */
+typedef struct CaSeedDbHeader {
+        le64_t magic;
+        le64_t feature_flags;
+        le64_t chunk_size_min;
+        le64_t chunk_size_avg;
+        le64_t chunk_size_max;
+        le64_t chunk_digest_type;
+        le64_t flags;
+        le64_t reserved;
+} CaSeedDbHeader;
+
+/* And continues with a series of items, each starting with this */
+typedef struct CaSeedDbItem {
+        le64_t size;        /* Including this header */
+        le64_t type;
+} CaSeedDbItem;
+
+/* A CA_SEED_DB_FILE item is followed by the path, NUL terminated and padded to a multiple of 8 bytes, and then by the
+ * chunks that start in the file's payload, ordered by offset */
+typedef struct CaSeedDbFile {
+        CaSeedDbItem item;
+        le64_t device;
+        le64_t inode;
+        le64_t size;
+        le64_t mtime;       /* In nsec */
+        le64_t ctime;       /* In nsec */
+        le64_t n_chunks;
+        CaChunkID hardlink; /* All zeroes if not known */
+} CaSeedDbFile;
+
+typedef struct CaSeedDbChunk {
+        le64_t offset;      /* In the payload */
+        le64_t size;
+        CaChunkID id;
+} CaSeedDbChunk;
+
+/* A file we are writing the database entry for, kept until all chunks starting in its payload are known */
+typedef struct CaSeedFile {
+        char *path;
+        CaSeedDbFile header;
+        uint64_t end;       /* Where its payload ends in the stream, UINT64_MAX while we are still in it */
+        CaSeedDbChunk *chunks;
+        size_t n_chunks, n_allocated_chunks;
+} CaSeedFile;
+
 struct CaSeed {
         CaEncoder *encoder;
         int base_fd;
@@ -29,19 +89,46 @@ struct CaSeed {
         char *cache_path;
 
         CaChunker chunker;
-        gcry_md_hd_t chunk_digest;
+        CaDigestType chunk_digest_type;
+        CaDigest *chunk_digest;
 
         bool ready:1;
-        bool remove_cache:1;
         bool cache_hardlink:1;
         bool cache_chunks:1;
+        bool db_usable:1;
+        bool file_current:1;
+        bool file_skipped:1;
 
         ReallocBuffer buffer;
         CaLocation *buffer_location;
+        uint64_t buffer_offset;    /* Where the chunk in the buffer starts in the stream */
+        uint64_t stream_offset;    /* How much of the stream we passed to the chunker */
 
         CaFileRoot *root;
 
+        /* Where to find the data of the chunks and hardlinkable files, by chunk ID or hardlink digest */
+        CaLocationTable *table;
+
+        /* The database of the previous run, with its files sorted by path. Only usable for taking over chunks if it
+         * was made with the same parameters. */
+        void *db_map;
+        size_t db_map_size;
+        const CaSeedDbFile **db_files;
+        size_t n_db_files, n_allocated_db_files;
+
+        /* The database we are writing, if the cache is persistent */
+        int db_fd;
+        ReallocBuffer db_buffer;
+        CaSeedFile *files;
+        size_t n_files, n_allocated_files;
+
+        /* If the file we are in (the last in 'files') didn't change since the previous run, its entry there */
+        const CaSeedDbFile *file_previous;
+        uint64_t n_skipped_bytes;
+
         uint64_t feature_flags;
+
+        CaNameCache *name_cache;
 };
 
 CaSeed *ca_seed_new(void) {
@@ -53,30 +140,53 @@ CaSeed *ca_seed_new(void) {
 
         s->cache_fd = -1;
         s->base_fd = -1;
+        s->db_fd = -1;
 
         s->cache_chunks = true;
 
         s->chunker = (CaChunker) CA_CHUNKER_INIT;
+        s->chunk_digest_type = CA_DIGEST_DEFAULT;
 
         assert_se(ca_feature_flags_normalize(CA_FORMAT_WITH_BEST|CA_FORMAT_EXCLUDE_NODUMP, &s->feature_flags) >= 0);
 
         return s;
 }
 
-static void ca_seed_remove_and_close_cache(CaSeed *s) {
+static void ca_seed_unload_db(CaSeed *s) {
+        assert(s);
+
+        if (s->db_map) {
+                (void) munmap(s->db_map, s->db_map_size);
+                s->db_map = NULL;
+                s->db_map_size = 0;
+        }
+
+        s->db_files = mfree(s->db_files);
+        s->n_db_files = s->n_allocated_db_files = 0;
+        s->file_previous = NULL;
+}
+
+static void ca_seed_close_db(CaSeed *s) {
+        size_t i;
+
         assert(s);
 
-        if (!s->remove_cache)
-                return;
+        ca_seed_unload_db(s);
 
-        if (s->cache_path) {
-                (void) rm_rf(s->cache_path, REMOVE_ROOT|REMOVE_PHYSICAL);
-                s->cache_path = mfree(s->cache_path);
-                s->cache_fd = safe_close(s->cache_fd);
-        } else if (s->cache_fd >= 0) {
-                (void) rm_rf_children(s->cache_fd, REMOVE_PHYSICAL, NULL);
-                s->cache_fd = -1;
+        if (s->db_fd >= 0) {
+                /* Not complete, hence don't keep it */
+                s->db_fd = safe_close(s->db_fd);
+                (void) unlinkat(s->cache_fd, CA_SEED_DB_TEMPORARY_FILENAME, 0);
         }
+
+        for (i = 0; i < s->n_files; i++) {
+                free(s->files[i].path);
+                free(s->files[i].chunks);
+        }
+        s->files = mfree(s->files);
+        s->n_files = s->n_allocated_files = 0;
+
+        realloc_buffer_free(&s->db_buffer);
 }
 
 CaSeed *ca_seed_unref(CaSeed *s) {
@@ -85,21 +195,24 @@ CaSeed *ca_seed_unref(CaSeed *s) {
 
         ca_file_root_invalidate(s->root);
 
-        ca_seed_remove_and_close_cache(s);
+        ca_seed_close_db(s);
 
         ca_encoder_unref(s->encoder);
+        ca_name_cache_unref(s->name_cache);
 
         safe_close(s->base_fd);
         safe_close(s->cache_fd);
         free(s->cache_path);
 
-        gcry_md_close(s->chunk_digest);
+        ca_digest_free(s->chunk_digest);
 
         realloc_buffer_free(&s->buffer);
         ca_location_unref(s->buffer_location);
 
         ca_file_root_unref(s->root);
 
+        ca_location_table_free(s->table);
+
         free(s);
 
         return NULL;
@@ -134,6 +247,29 @@ int ca_seed_set_base_path(CaSeed *s, const char *path) {
         return 0;
 }
 
+int ca_seed_get_base_stat(CaSeed *s, struct stat *ret) {
+        int fd;
+
+        if (!s)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        if (s->base_fd >= 0)
+                fd = s->base_fd;
+        else if (s->encoder) {
+                fd = ca_encoder_get_base_fd(s->encoder);
+                if (fd < 0)
+                        return fd;
+        } else
+                return -EUNATCH;
+
+        if (fstat(fd, ret) < 0)
+                return -errno;
+
+        return 0;
+}
+
 int ca_seed_set_cache_fd(CaSeed *s, int fd) {
         if (!s)
                 return -EINVAL;
@@ -167,6 +303,478 @@ int ca_seed_set_cache_path(CaSeed *s, const char *path) {
         return 0;
 }
 
+static void ca_seed_db_header(CaSeed *s, CaSeedDbHeader *ret) {
+        assert(s);
+        assert(ret);
+
+        *ret = (CaSeedDbHeader) {
+                .magic = htole64(CA_SEED_DB_MAGIC),
+                .feature_flags = htole64(s->feature_flags),
+                .chunk_size_min = htole64(s->chunker.chunk_size_min),
+                .chunk_size_avg = htole64(s->chunker.chunk_size_avg),
+                .chunk_size_max = htole64(s->chunker.chunk_size_max),
+                .chunk_digest_type = htole64(s->chunk_digest_type),
+                .flags = htole64(s->cache_hardlink ? CA_SEED_DB_HARDLINK : 0),
+        };
+}
+
+static const char *ca_seed_db_file_path(const CaSeedDbFile *f) {
+        return (const char*) (f + 1);
+}
+
+static const CaSeedDbChunk *ca_seed_db_file_chunks(const CaSeedDbFile *f) {
+        return (const CaSeedDbChunk*) ((const uint8_t*) (f + 1) + ALIGN_TO(strlen(ca_seed_db_file_path(f)) + 1, 8));
+}
+
+static bool ca_seed_db_file_valid(const CaSeedDbFile *f, uint64_t size) {
+        const CaSeedDbChunk *chunks;
+        uint64_t n, i, l;
+
+        assert(f);
+
+        if (size < sizeof(CaSeedDbFile) + 8)
+                return false;
+        if (!memchr(ca_seed_db_file_path(f), 0, size - sizeof(CaSeedDbFile)))
+                return false;
+
+        l = ALIGN_TO(strlen(ca_seed_db_file_path(f)) + 1, 8);
+        n = le64toh(f->n_chunks);
+
+        if (n > (size - sizeof(CaSeedDbFile) - l) / sizeof(CaSeedDbChunk))
+                return false;
+        if (size != sizeof(CaSeedDbFile) + l + n * sizeof(CaSeedDbChunk))
+                return false;
+
+        chunks = ca_seed_db_file_chunks(f);
+        for (i = 0; i < n; i++) {
+                if (le64toh(chunks[i].offset) >= le64toh(f->size))
+                        return false;
+                if (le64toh(chunks[i].size) == 0)
+                        return false;
+                if (i > 0 && le64toh(chunks[i].offset) <= le64toh(chunks[i-1].offset))
+                        return false;
+        }
+
+        return true;
+}
+
+static int ca_seed_db_file_compare(const void *a, const void *b) {
+        const CaSeedDbFile * const *x = a, * const *y = b;
+
+        return strcmp(ca_seed_db_file_path(*x), ca_seed_db_file_path(*y));
+}
+
+static int ca_seed_load_db(CaSeed *s) {
+        CaSeedDbHeader header;
+        struct stat st;
+        uint64_t p;
+        void *m;
+        int fd, r;
+
+        assert(s);
+        assert(s->cache_fd >= 0);
+
+        fd = openat(s->cache_fd, CA_SEED_DB_FILENAME, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+        if (fd < 0)
+                return -errno;
+
+        if (fstat(fd, &st) < 0) {
+                safe_close(fd);
+                return -errno;
+        }
+
+        if ((uint64_t) st.st_size < sizeof(CaSeedDbHeader) || (uint64_t) st.st_size > SIZE_MAX) {
+                safe_close(fd);
+                return -EBADMSG;
+        }
+
+        m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        safe_close(fd);
+        if (m == MAP_FAILED)
+                return -errno;
+
+        s->db_map = m;
+        s->db_map_size = st.st_size;
+
+        r = -EBADMSG;
+
+        if (le64toh(((const CaSeedDbHeader*) m)->magic) != CA_SEED_DB_MAGIC)
+                goto fail;
+
+        for (p = sizeof(CaSeedDbHeader); p < s->db_map_size;) {
+                const CaSeedDbItem *item;
+                uint64_t size;
+
+                if (s->db_map_size - p < sizeof(CaSeedDbItem))
+                        goto fail;
+
+                item = (const CaSeedDbItem*) ((const uint8_t*) m + p);
+                size = le64toh(item->size);
+
+                if (size < sizeof(CaSeedDbItem) || size > s->db_map_size - p || size % 8 != 0)
+                        goto fail;
+
+                switch (le64toh(item->type)) {
+
+                case CA_SEED_DB_FILE:
+                        if (!ca_seed_db_file_valid((const CaSeedDbFile*) item, size))
+                                goto fail;
+
+                        if (!GREEDY_REALLOC(s->db_files, s->n_allocated_db_files, s->n_db_files + 1)) {
+                                r = -ENOMEM;
+                                goto fail;
+                        }
+
+                        s->db_files[s->n_db_files++] = (const CaSeedDbFile*) item;
+                        break;
+
+                default:
+                        goto fail;
+                }
+
+                p += size;
+        }
+
+        if (s->n_db_files > 1)
+                qsort(s->db_files, s->n_db_files, sizeof(CaSeedDbFile*), ca_seed_db_file_compare);
+
+        ca_seed_db_header(s, &header);
+        s->db_usable = memcmp(m, &header, sizeof(header)) == 0;
+
+        return 0;
+
+fail:
+        ca_seed_unload_db(s);
+        return r;
+}
+
+static const CaSeedDbFile *ca_seed_db_find(CaSeed *s, const char *path) {
+        size_t lo = 0, hi;
+
+        assert(s);
+        assert(path);
+
+        hi = s->n_db_files;
+        while (lo < hi) {
+                size_t m = lo + (hi - lo) / 2;
+                int c;
+
+                c = strcmp(path, ca_seed_db_file_path(s->db_files[m]));
+                if (c == 0)
+                        return s->db_files[m];
+                if (c < 0)
+                        hi = m;
+                else
+                        lo = m + 1;
+        }
+
+        return NULL;
+}
+
+static int ca_seed_open_db(CaSeed *s) {
+        CaSeedDbHeader header;
+        int r;
+
+        assert(s);
+        assert(s->cache_fd >= 0);
+
+        /* Only one of us may update the cache at a time */
+        if (flock(s->cache_fd, LOCK_EX|LOCK_NB) < 0)
+                return errno == EWOULDBLOCK ? 0 : -errno;
+
+        /* Without a valid database from a previous run we simply start from scratch */
+        r = ca_seed_load_db(s);
+        if (r < 0 && !IN_SET(r, -ENOENT, -EBADMSG))
+                return r;
+
+        s->db_fd = openat(s->cache_fd, CA_SEED_DB_TEMPORARY_FILENAME, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC|O_NOCTTY, 0666);
+        if (s->db_fd < 0)
+                return -errno;
+
+        ca_seed_db_header(s, &header);
+        if (!realloc_buffer_append(&s->db_buffer, &header, sizeof(header)))
+                return -ENOMEM;
+
+        return 1;
+}
+
+static int ca_seed_write_db_buffer(CaSeed *s, bool force) {
+        int r;
+
+        assert(s);
+
+        if (realloc_buffer_size(&s->db_buffer) == 0)
+                return 0;
+        if (!force && realloc_buffer_size(&s->db_buffer) < BUFFER_SIZE)
+                return 0;
+
+        r = loop_write(s->db_fd, realloc_buffer_data(&s->db_buffer), realloc_buffer_size(&s->db_buffer));
+        if (r < 0)
+                return r;
+
+        realloc_buffer_empty(&s->db_buffer);
+        return 0;
+}
+
+static int ca_seed_write_db_file(CaSeed *s, CaSeedFile *f) {
+        size_t l, size;
+        uint8_t *p;
+
+        assert(s);
+        assert(f);
+
+        l = ALIGN_TO(strlen(f->path) + 1, 8);
+        size = sizeof(CaSeedDbFile) + l + f->n_chunks * sizeof(CaSeedDbChunk);
+
+        f->header.item = (CaSeedDbItem) {
+                .size = htole64(size),
+                .type = htole64(CA_SEED_DB_FILE),
+        };
+        f->header.n_chunks = htole64(f->n_chunks);
+
+        p = realloc_buffer_extend0(&s->db_buffer, size);
+        if (!p)
+                return -ENOMEM;
+
+        memcpy(p, &f->header, sizeof(CaSeedDbFile));
+        strcpy((char*) p + sizeof(CaSeedDbFile), f->path);
+        memcpy(p + sizeof(CaSeedDbFile) + l, f->chunks, f->n_chunks * sizeof(CaSeedDbChunk));
+
+        return ca_seed_write_db_buffer(s, false);
+}
+
+/* Writes out the files whose payload ended at or before 'offset' in the stream */
+static int ca_seed_flush_files(CaSeed *s, uint64_t offset) {
+        size_t n = 0;
+        int r = 0;
+
+        assert(s);
+
+        while (n < s->n_files && s->files[n].end != UINT64_MAX && s->files[n].end <= offset) {
+                r = ca_seed_write_db_file(s, s->files + n);
+
+                free(s->files[n].path);
+                free(s->files[n].chunks);
+                n++;
+
+                if (r < 0)
+                        break;
+        }
+
+        memmove(s->files, s->files + n, (s->n_files - n) * sizeof(CaSeedFile));
+        s->n_files -= n;
+
+        return r;
+}
+
+static int ca_seed_file_add_chunk(CaSeedFile *f, uint64_t offset, uint64_t size, const CaChunkID *id) {
+        assert(f);
+        assert(id);
+
+        if (!GREEDY_REALLOC(f->chunks, f->n_allocated_chunks, f->n_chunks + 1))
+                return -ENOMEM;
+
+        f->chunks[f->n_chunks++] = (CaSeedDbChunk) {
+                .offset = htole64(offset),
+                .size = htole64(size),
+                .id = *id,
+        };
+
+        return 0;
+}
+
+static int ca_seed_db_add_chunk(CaSeed *s, CaLocation *location, uint64_t start, uint64_t size, const CaChunkID *id) {
+        size_t i;
+        int r;
+
+        assert(s);
+        assert(location);
+        assert(id);
+
+        if (s->db_fd < 0)
+                return 0;
+
+        /* Files whose payload ended before this chunk started won't get any more */
+        r = ca_seed_flush_files(s, start);
+        if (r < 0)
+                return r;
+
+        if (location->designator != CA_LOCATION_PAYLOAD)
+                return 0;
+
+        for (i = s->n_files; i > 0; i--)
+                if (streq_ptr(s->files[i-1].path, location->path))
+                        return ca_seed_file_add_chunk(s->files + i - 1, location->offset, size, id);
+
+        return 0;
+}
+
+static int ca_seed_begin_file(CaSeed *s) {
+        const CaSeedDbFile *previous;
+        struct stat st;
+        CaSeedFile *f;
+        char *path;
+        int r;
+
+        assert(s);
+
+        if (s->db_fd < 0 || s->file_current)
+                return 0;
+
+        r = ca_encoder_current_stat(s->encoder, &st);
+        if (r < 0)
+                return r;
+        if (!S_ISREG(st.st_mode))
+                return 0;
+
+        r = ca_encoder_current_path(s->encoder, &path);
+        if (r < 0)
+                return r;
+
+        if (!GREEDY_REALLOC(s->files, s->n_allocated_files, s->n_files + 1)) {
+                free(path);
+                return -ENOMEM;
+        }
+
+        f = s->files + s->n_files++;
+        *f = (CaSeedFile) {
+                .path = path,
+                .header = {
+                        .device = htole64(st.st_dev),
+                        .inode = htole64(st.st_ino),
+                        .size = htole64(st.st_size),
+                        .mtime = htole64(timespec_to_nsec(st.st_mtim)),
+                        .ctime = htole64(timespec_to_nsec(st.st_ctim)),
+                },
+                .end = UINT64_MAX,
+        };
+
+        s->file_current = true;
+        s->file_skipped = false;
+
+        if (!s->db_usable || !s->cache_chunks)
+                return 0;
+
+        previous = ca_seed_db_find(s, path);
+        if (previous &&
+            previous->device == f->header.device &&
+            previous->inode == f->header.inode &&
+            previous->size == f->header.size &&
+            previous->mtime == f->header.mtime &&
+            previous->ctime == f->header.ctime)
+                s->file_previous = previous;
+
+        return 0;
+}
+
+static int ca_seed_end_file(CaSeed *s) {
+        assert(s);
+
+        if (!s->file_current)
+                return 0;
+
+        s->files[s->n_files - 1].end = s->stream_offset;
+
+        s->file_current = s->file_skipped = false;
+        s->file_previous = NULL;
+
+        /* Without chunks there's nothing else that would complete the file */
+        if (!s->cache_chunks)
+                return ca_seed_flush_files(s, UINT64_MAX);
+
+        return 0;
+}
+
+/* If the previous run had a chunk starting at 'offset' in the payload of the current, unchanged file, all its chunks
+ * from there on are the same as we'd get now, as the chunker starts afresh after each cut. Takes them over, except for
+ * the last one, which continues into whatever follows the file, and makes the encoder continue where that one starts.
+ * 'available' is how much data from 'offset' on the encoder already generated. */
+static int ca_seed_skip_chunks(CaSeed *s, uint64_t offset, uint64_t available, uint64_t *ret_skipped) {
+        const CaSeedDbChunk *chunks;
+        size_t n, lo = 0, hi, i;
+        uint64_t end;
+        CaSeedFile *f;
+        int r;
+
+        assert(s);
+        assert(s->file_current);
+        assert(ret_skipped);
+
+        if (!s->file_previous)
+                return 0;
+
+        chunks = ca_seed_db_file_chunks(s->file_previous);
+        n = le64toh(s->file_previous->n_chunks);
+
+        hi = n;
+        while (lo < hi) {
+                size_t m = lo + (hi - lo) / 2;
+
+                if (le64toh(chunks[m].offset) < offset)
+                        lo = m + 1;
+                else
+                        hi = m;
+        }
+
+        if (lo + 1 >= n || le64toh(chunks[lo].offset) != offset)
+                return 0;
+
+        end = le64toh(chunks[n-1].offset);
+        if (end < offset + available)
+                return 0;
+
+        for (i = lo; i + 1 < n; i++)
+                if (le64toh(chunks[i].offset) + le64toh(chunks[i].size) != le64toh(chunks[i+1].offset))
+                        return 0;
+
+        r = ca_encoder_skip_payload(s->encoder, end);
+        if (r < 0)
+                return r;
+
+        f = s->files + s->n_files - 1;
+
+        for (i = lo; i + 1 < n; i++) {
+                r = ca_seed_file_add_chunk(f, le64toh(chunks[i].offset), le64toh(chunks[i].size), &chunks[i].id);
+                if (r < 0)
+                        return r;
+
+                r = ca_location_table_put(s->table, &chunks[i].id, CA_LOCATION_PAYLOAD, f->path, le64toh(chunks[i].offset), le64toh(chunks[i].size));
+                if (r < 0)
+                        return r;
+        }
+
+        s->file_skipped = true;
+        s->n_skipped_bytes += end - offset;
+
+        *ret_skipped = end - offset;
+        return 1;
+}
+
+static int ca_seed_finish_db(CaSeed *s) {
+        int r;
+
+        assert(s);
+
+        if (s->db_fd < 0)
+                return 0;
+
+        r = ca_seed_flush_files(s, UINT64_MAX);
+        if (r < 0)
+                return r;
+
+        r = ca_seed_write_db_buffer(s, true);
+        if (r < 0)
+                return r;
+
+        if (renameat(s->cache_fd, CA_SEED_DB_TEMPORARY_FILENAME, s->cache_fd, CA_SEED_DB_FILENAME) < 0)
+                return -errno;
+
+        s->db_fd = safe_close(s->db_fd);
+        ca_seed_unload_db(s);
+
+        return 0;
+}
+
 static int ca_seed_open(CaSeed *s) {
         int r;
 
@@ -193,68 +801,79 @@ static int ca_seed_open(CaSeed *s) {
                 if (r < 0)
                         return r;
 
+                if (s->name_cache) {
+                        r = ca_encoder_set_name_cache(s->encoder, s->name_cache);
+                        if (r < 0)
+                                return r;
+                }
+
                 s->base_fd = -1;
         }
 
-        if (s->cache_fd < 0) {
-                if (!s->cache_path) {
-                        if (asprintf(&s->cache_path, "/var/tmp/%" PRIx64 ".cased", random_u64()) < 0)
-                                return -ENOMEM;
+        if (!s->table) {
+                if (s->cache_fd < 0 && s->cache_path) {
+                        (void) mkdir(s->cache_path, 0777);
 
-                        s->remove_cache = true;
+                        s->cache_fd = open(s->cache_path, O_RDONLY|O_CLOEXEC|O_DIRECTORY|O_NOCTTY);
+                        if (s->cache_fd < 0)
+                                return -errno;
                 }
 
-                (void) mkdir(s->cache_path, 0777);
+                /* If somebody else is using the cache right now, we go without the database */
+                if (s->cache_fd >= 0) {
+                        r = ca_seed_open_db(s);
+                        if (r < 0)
+                                return r;
+                }
+
+                s->table = ca_location_table_new();
+                if (!s->table)
+                        return -ENOMEM;
 
-                s->cache_fd = open(s->cache_path, O_RDONLY|O_CLOEXEC|O_DIRECTORY|O_NOCTTY);
-                if (s->cache_fd < 0)
-                        return -errno;
+                if (s->cache_fd >= 0) {
+                        r = ca_location_table_set_spill_fd(s->table, s->cache_fd);
+                        if (r < 0)
+                                return r;
+                }
         }
 
         return 0;
 }
 
-static int ca_seed_write_cache_entry(CaSeed *s, CaLocation *location, const void *data, size_t l) {
-        char ids[CA_CHUNK_ID_FORMAT_MAX];
-        const char *t, *four, *combined;
-        CaChunkID id;
+static int ca_seed_make_chunk_id(CaSeed *s, const void *p, size_t l, CaChunkID *ret) {
+        int r;
+
+        assert(s);
+
+        r = ca_digest_ensure_allocated(&s->chunk_digest, s->chunk_digest_type);
+        if (r < 0)
+                return r;
+
+        return ca_chunk_id_make(s->chunk_digest, p, l, ret);
+}
+
+static int ca_seed_write_cache_entry(CaSeed *s, CaLocation *location, const void *data, size_t l, CaChunkID *ret_id) {
         int r;
 
         assert(s);
         assert(location);
         assert(data);
         assert(l > 0);
+        assert(ret_id);
 
-        r = ca_location_patch_size(&location, l);
+        r = ca_seed_make_chunk_id(s, data, l, ret_id);
         if (r < 0)
                 return r;
 
-        t = ca_location_format(location);
-        if (!t)
-                return -ENOMEM;
-
-        r = ca_chunk_id_make(&s->chunk_digest, data, l, &id);
+        r = ca_location_table_put(s->table, ret_id, location->designator, location->path, location->offset, l);
         if (r < 0)
                 return r;
 
-        if (!ca_chunk_id_format(&id, ids))
-                return -EINVAL;
-
-        four = strndupa(ids, 4);
-        combined = strjoina(four, "/", ids);
-
-        (void) mkdirat(s->cache_fd, four, 0777);
-
-        if (symlinkat(t, s->cache_fd, combined) < 0) {
-                if (errno != EEXIST)
-                        return -errno;
-        }
-
         return 0;
 }
 
 static int ca_seed_cache_chunks(CaSeed *s) {
-        uint64_t offset = 0;
+        uint64_t offset = 0, base;
         const void *p;
         size_t l;
         int r;
@@ -270,14 +889,35 @@ static int ca_seed_cache_chunks(CaSeed *s) {
         if (!s->cache_chunks)
                 return 0;
 
+        base = s->stream_offset;
+        s->stream_offset += l;
+
         while (l > 0) {
                 const void *chunk;
                 size_t chunk_size, k;
+                CaChunkID id;
 
                 if (!s->buffer_location) {
                         r = ca_encoder_current_location(s->encoder, offset, &s->buffer_location);
                         if (r < 0)
                                 return r;
+
+                        s->buffer_offset = base + offset;
+
+                        if (s->file_previous && s->buffer_location->designator == CA_LOCATION_PAYLOAD) {
+                                uint64_t skipped;
+
+                                r = ca_seed_skip_chunks(s, s->buffer_location->offset, l, &skipped);
+                                if (r < 0)
+                                        return r;
+                                if (r > 0) {
+                                        /* The encoder continues after the chunks we took over, hence drop the rest
+                                         * of the data */
+                                        s->buffer_location = ca_location_unref(s->buffer_location);
+                                        s->stream_offset = base + offset + skipped;
+                                        return 0;
+                                }
+                        }
                 }
 
                 k = ca_chunker_scan(&s->chunker, p, l);
@@ -299,7 +939,11 @@ static int ca_seed_cache_chunks(CaSeed *s) {
                         chunk_size = realloc_buffer_size(&s->buffer);
                 }
 
-                r = ca_seed_write_cache_entry(s, s->buffer_location, chunk, chunk_size);
+                r = ca_seed_write_cache_entry(s, s->buffer_location, chunk, chunk_size, &id);
+                if (r < 0)
+                        return r;
+
+                r = ca_seed_db_add_chunk(s, s->buffer_location, s->buffer_offset, chunk_size, &id);
                 if (r < 0)
                         return r;
 
@@ -316,6 +960,7 @@ static int ca_seed_cache_chunks(CaSeed *s) {
 }
 
 static int ca_seed_cache_final_chunk(CaSeed *s) {
+        CaChunkID id;
         int r;
 
         assert(s);
@@ -329,10 +974,14 @@ static int ca_seed_cache_final_chunk(CaSeed *s) {
         if (!s->buffer_location)
                 return 0;
 
-        r = ca_seed_write_cache_entry(s, s->buffer_location, realloc_buffer_data(&s->buffer), realloc_buffer_size(&s->buffer));
+        r = ca_seed_write_cache_entry(s, s->buffer_location, realloc_buffer_data(&s->buffer), realloc_buffer_size(&s->buffer), &id);
         if (r < 0)
                 return 0;
 
+        r = ca_seed_db_add_chunk(s, s->buffer_location, s->buffer_offset, realloc_buffer_size(&s->buffer), &id);
+        if (r < 0)
+                return r;
+
         realloc_buffer_empty(&s->buffer);
         s->buffer_location = ca_location_unref(s->buffer_location);
 
@@ -340,9 +989,6 @@ static int ca_seed_cache_final_chunk(CaSeed *s) {
 }
 
 static int ca_seed_cache_hardlink(CaSeed *s) {
-        const char *t, *four, *combined;
-        char v[CA_CHUNK_ID_FORMAT_MAX];
-        CaLocation *location = NULL;
         char *path = NULL;
         CaChunkID digest;
         mode_t mode;
@@ -361,45 +1007,33 @@ static int ca_seed_cache_hardlink(CaSeed *s) {
         if (!S_ISREG(mode))
                 return 0;
 
-        r = ca_encoder_get_hardlink_digest(s->encoder, &digest);
-        if (r < 0)
-                return r;
+        if (s->file_skipped) {
+                /* We didn't read all of the file, but it didn't change since the previous run, hence neither did
+                 * the digest */
+                if (ca_chunk_id_is_null(&s->file_previous->hardlink))
+                        return 0;
+
+                digest = s->file_previous->hardlink;
+        } else {
+                r = ca_encoder_get_hardlink_digest(s->encoder, &digest);
+                if (r < 0)
+                        return r;
+        }
 
         r = ca_encoder_current_path(s->encoder, &path);
         if (r < 0)
                 return r;
 
-        r = ca_location_new(path, CA_LOCATION_ENTRY, 0, UINT64_MAX, &location);
+        /* Hardlink entries are told apart from chunks by their unspecified size */
+        r = ca_location_table_put(s->table, &digest, CA_LOCATION_ENTRY, path, 0, UINT64_MAX);
         free(path);
         if (r < 0)
                 return r;
 
-        t = ca_location_format(location);
-        if (!t) {
-                r = -ENOMEM;
-                goto finish;
-        }
-
-        if (!ca_chunk_id_format(&digest, v)) {
-                r = -EINVAL;
-                goto finish;
-        }
+        if (s->file_current)
+                s->files[s->n_files - 1].header.hardlink = digest;
 
-        four = strndupa(v, 4);
-        combined = strjoina(four, "/", v);
-
-        (void) mkdirat(s->cache_fd, four, 0777);
-
-        if (symlinkat(t, s->cache_fd, combined) < 0 && errno != EEXIST) {
-                r = -errno;
-                goto finish;
-        }
-
-        r = 0;
-
-finish:
-        ca_location_unref(location);
-        return r;
+        return 0;
 }
 
 int ca_seed_step(CaSeed *s) {
@@ -431,10 +1065,18 @@ int ca_seed_step(CaSeed *s) {
 
                 case CA_ENCODER_FINISHED:
 
+                        r = ca_seed_end_file(s);
+                        if (r < 0)
+                                return r;
+
                         r = ca_seed_cache_final_chunk(s);
                         if (r < 0)
                                 return r;
 
+                        r = ca_seed_finish_db(s);
+                        if (r < 0)
+                                return r;
+
                         s->ready = true;
                         return CA_SEED_READY;
 
@@ -443,16 +1085,26 @@ int ca_seed_step(CaSeed *s) {
                 case CA_ENCODER_DONE_FILE:
                 case CA_ENCODER_PAYLOAD:
 
-                        r = ca_seed_cache_chunks(s);
-                        if (r < 0)
-                                return r;
+                        if (IN_SET(step, CA_ENCODER_PAYLOAD, CA_ENCODER_DONE_FILE)) {
+                                r = ca_seed_begin_file(s);
+                                if (r < 0)
+                                        return r;
+                        }
 
                         if (step == CA_ENCODER_DONE_FILE) {
                                 r = ca_seed_cache_hardlink(s);
                                 if (r < 0)
                                         return r;
+
+                                r = ca_seed_end_file(s);
+                                if (r < 0)
+                                        return r;
                         }
 
+                        r = ca_seed_cache_chunks(s);
+                        if (r < 0)
+                                return r;
+
                         return step == CA_ENCODER_NEXT_FILE ? CA_SEED_NEXT_FILE :
                                 step == CA_ENCODER_DONE_FILE ? CA_SEED_DONE_FILE : CA_SEED_STEP;
 
@@ -462,14 +1114,14 @@ int ca_seed_step(CaSeed *s) {
         }
 }
 
-int ca_seed_get(CaSeed *s,
+static int ca_seed_generate(
+                CaSeed *s,
                 const CaChunkID *chunk_id,
+                CaLocation *location,
                 const void **ret,
                 size_t *ret_size,
                 CaOrigin **ret_origin) {
 
-        char id[CA_CHUNK_ID_FORMAT_MAX], *target = NULL;
-        const char *four, *combined;
         CaFileRoot *root = NULL;
         CaOrigin *origin = NULL;
         CaLocation *l = NULL;
@@ -477,47 +1129,17 @@ int ca_seed_get(CaSeed *s,
         void *p = NULL;
         int r, step;
 
-        if (!s)
-                return -EINVAL;
-        if (!chunk_id)
-                return -EINVAL;
-        if (!ret)
-                return -EINVAL;
-        if (!ret_size)
-                return -EINVAL;
-        if (s->cache_fd < 0)
-                return -EUNATCH;
-        if (!s->cache_chunks)
-                return -ENOMEDIUM;
-
-        if (!ca_chunk_id_format(chunk_id, id))
-                return -EINVAL;
-
-        four = strndupa(id, 4);
-        combined = strjoina(four, "/", id);
-
-        r = readlinkat_malloc(s->cache_fd, combined, &target);
-        if (r < 0)
-                return r;
-
-        /* fprintf(stderr, "GOT %s → %s\n", combined, target); */
-
-        r = ca_location_parse(target, &l);
-        free(target);
-        if (r < 0)
-                return r;
-
-        if (l->size == UINT64_MAX) /* If the size is not specified, then this is a hardlink entry */
-                return -ENOENT;
+        assert(s);
+        assert(chunk_id);
+        assert(location);
+        assert(ret);
+        assert(ret_size);
 
-        if (l->size > s->chunker.chunk_size_max) {
-                ca_location_unref(l);
+        if (location->size > s->chunker.chunk_size_max)
                 return -EINVAL;
-        }
-        size = l->size;
+        size = location->size;
 
-        step = ca_encoder_seek_location(s->encoder, l);
-        l = ca_location_unref(l);
+        step = ca_encoder_seek_location(s->encoder, location);
         if (step == -ENXIO) /* location doesn't exist anymore? Then the seed has been modified */
                 return -ESTALE;
         if (step < 0)
@@ -588,7 +1210,7 @@ int ca_seed_get(CaSeed *s,
                         if (n >= size) {
                                 CaChunkID test_id;
 
-                                r = ca_chunk_id_make(&s->chunk_digest, p, size, &test_id);
+                                r = ca_seed_make_chunk_id(s, p, size, &test_id);
                                 if (r < 0)
                                         goto finish;
 
@@ -630,44 +1252,125 @@ finish:
         return r;
 }
 
-int ca_seed_has(CaSeed *s, const CaChunkID *chunk_id) {
-        char id[CA_CHUNK_ID_FORMAT_MAX];
-        const char *four, *combined;
+int ca_seed_get(CaSeed *s,
+                const CaChunkID *chunk_id,
+                const void **ret,
+                size_t *ret_size,
+                CaOrigin **ret_origin) {
+
+        CaLocation *l = NULL;
+        int r;
 
         if (!s)
                 return -EINVAL;
         if (!chunk_id)
                 return -EINVAL;
-        if (s->cache_fd < 0)
+        if (!ret)
+                return -EINVAL;
+        if (!ret_size)
+                return -EINVAL;
+        if (!s->table)
                 return -EUNATCH;
         if (!s->cache_chunks)
                 return -ENOMEDIUM;
 
-        if (!ca_chunk_id_format(chunk_id, id))
+        r = ca_location_table_get(s->table, chunk_id, &l);
+        if (r < 0)
+                return r;
+
+        if (l->size == UINT64_MAX) /* If the size is not specified, then this is a hardlink entry */
+                r = -ENOENT;
+        else
+                r = ca_seed_generate(s, chunk_id, l, ret, ret_size, ret_origin);
+
+        ca_location_unref(l);
+        return r;
+}
+
+int ca_seed_get_at(CaSeed *s,
+                   const CaChunkID *chunk_id,
+                   CaLocation *location,
+                   const void **ret,
+                   size_t *ret_size,
+                   CaOrigin **ret_origin) {
+        int r;
+
+        if (!s)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+        if (!location)
+                return -EINVAL;
+        if (location->size == UINT64_MAX)
                 return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+        if (!ret_size)
+                return -EINVAL;
+        if (!s->cache_chunks)
+                return -ENOMEDIUM;
 
-        four = strndupa(id, 4);
-        combined = strjoina(four, "/", id);
+        /* No need to index the seed for this, the encoder just needs to be set up */
+        r = ca_seed_open(s);
+        if (r < 0)
+                return r;
 
-        if (faccessat(s->cache_fd, combined, F_OK, AT_SYMLINK_NOFOLLOW) < 0) {
-                if (errno == ENOENT)
-                        return 0;
+        return ca_seed_generate(s, chunk_id, location, ret, ret_size, ret_origin);
+}
 
-                return -errno;
-        }
+int ca_seed_has(CaSeed *s, const CaChunkID *chunk_id) {
+        int r;
+
+        if (!s)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+        if (!s->table)
+                return -EUNATCH;
+        if (!s->cache_chunks)
+                return -ENOMEDIUM;
+
+        r = ca_location_table_get(s->table, chunk_id, NULL);
+        if (r == -ENOENT)
+                return 0;
+        if (r < 0)
+                return r;
 
         return 1;
 }
 
+int ca_seed_filter(CaSeed *s, const CaChunkID *chunk_id) {
+        /* The table is in memory, hence an exact answer is as cheap as an approximate one */
+        return ca_seed_has(s, chunk_id);
+}
+
+int ca_seed_enumerate(CaSeed *s, int (*callback)(const CaChunkID *id, void *userdata), void *userdata) {
+        if (!s)
+                return -EINVAL;
+        if (!callback)
+                return -EINVAL;
+        if (!s->table)
+                return -EUNATCH;
+
+        return ca_location_table_enumerate(s->table, callback, userdata);
+}
+
+int ca_seed_get_skipped_bytes(CaSeed *s, uint64_t *ret) {
+        if (!s)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        *ret = s->n_skipped_bytes;
+        return 0;
+}
+
 int ca_seed_get_hardlink_target(
                 CaSeed *s,
                 const CaChunkID *id,
                 char **ret) {
 
-        char v[CA_CHUNK_ID_FORMAT_MAX];
-        const char *four, *combined;
         CaLocation *l = NULL;
-        char *target;
         int r;
 
         if (!s)
@@ -676,23 +1379,12 @@ int ca_seed_get_hardlink_target(
                 return -EINVAL;
         if (!ret)
                 return -EINVAL;
-        if (s->cache_fd < 0)
+        if (!s->table)
                 return -EUNATCH;
         if (!s->cache_hardlink)
                 return -ENOMEDIUM;
 
-        if (!ca_chunk_id_format(id, v))
-                return -EINVAL;
-
-        four = strndupa(v, 4);
-        combined = strjoina(four, "/", v);
-
-        r = readlinkat_malloc(s->cache_fd, combined, &target);
-        if (r < 0)
-                return r;
-
-        r = ca_location_parse(target, &l);
-        free(target);
+        r = ca_location_table_get(s->table, id, &l);
         if (r < 0)
                 return r;
 
@@ -744,6 +1436,16 @@ int ca_seed_set_feature_flags(CaSeed *s, uint64_t flags) {
         return ca_feature_flags_normalize(flags, &s->feature_flags);
 }
 
+int ca_seed_set_chunk_digest(CaSeed *s, CaDigestType type) {
+        if (!s)
+                return -EINVAL;
+        if (type < 0 || type >= _CA_DIGEST_TYPE_MAX)
+                return -EINVAL;
+
+        s->chunk_digest_type = type;
+        return 0;
+}
+
 int ca_seed_set_chunk_size_min(CaSeed *s, size_t cmin) {
         if (!s)
                 return -EINVAL;
@@ -829,6 +1531,26 @@ int ca_seed_set_hardlink(CaSeed *s, bool b) {
         return 1;
 }
 
+int ca_seed_set_name_cache(CaSeed *s, CaNameCache *c) {
+        int r;
+
+        if (!s)
+                return -EINVAL;
+        if (!c)
+                return -EINVAL;
+
+        if (s->encoder) {
+                r = ca_encoder_set_name_cache(s->encoder, c);
+                if (r < 0)
+                        return r;
+        }
+
+        ca_name_cache_unref(s->name_cache);
+        s->name_cache = ca_name_cache_ref(c);
+
+        return 0;
+}
+
 int ca_seed_set_chunks(CaSeed *s, bool b) {
 
         if (!s)
@@ -1,9 +1,11 @@
 #ifndef foocaseedhfoo
 #define foocaseedhfoo
 
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include "cachunkid.h"
+#include "canamecache.h"
 #include "caorigin.h"
 
 typedef struct CaSeed CaSeed;
@@ -20,21 +22,39 @@ CaSeed *ca_seed_unref(CaSeed *s);
 
 int ca_seed_set_base_fd(CaSeed *s, int fd);
 int ca_seed_set_base_path(CaSeed *s, const char *path);
+int ca_seed_get_base_stat(CaSeed *s, struct stat *ret);
 
+/* A cache set explicitly persists, and is updated incrementally on the next run: the chunks of files that didn't
+ * change since are taken over without reading the files again. Without one, the chunk locations are only kept in
+ * memory. */
 int ca_seed_set_cache_fd(CaSeed *s, int fd);
 int ca_seed_set_cache_path(CaSeed *s, const char *path);
 
 int ca_seed_step(CaSeed *s);
 
 int ca_seed_get(CaSeed *s, const CaChunkID *chunk_id, const void **ret, size_t *ret_size, CaOrigin **ret_origin);
+
+/* Generates the data at the specified location, and returns it if it matches the chunk ID, -ESTALE otherwise. This
+ * works without indexing the seed first, i.e. without calling ca_seed_step(). */
+int ca_seed_get_at(CaSeed *s, const CaChunkID *chunk_id, CaLocation *location, const void **ret, size_t *ret_size, CaOrigin **ret_origin);
 int ca_seed_has(CaSeed *s, const CaChunkID *chunk_id);
 
+/* Returns 0 if the chunk is definitely not in the seed, > 0 if it probably is */
+int ca_seed_filter(CaSeed *s, const CaChunkID *chunk_id);
+
+/* Calls the callback for each chunk ID and hardlink digest known, in no particular order */
+int ca_seed_enumerate(CaSeed *s, int (*callback)(const CaChunkID *id, void *userdata), void *userdata);
+
+/* How much payload we didn't need to read, as a persistent cache already knew its chunks */
+int ca_seed_get_skipped_bytes(CaSeed *s, uint64_t *ret);
+
 int ca_seed_get_hardlink_target(CaSeed *s, const CaChunkID *id, char **ret);
 
 int ca_seed_current_path(CaSeed *seed, char **ret);
 int ca_seed_current_mode(CaSeed *seed, mode_t *ret);
 
 int ca_seed_set_feature_flags(CaSeed *s, uint64_t flags);
+int ca_seed_set_chunk_digest(CaSeed *s, CaDigestType type);
 
 int ca_seed_set_chunk_size_min(CaSeed *s, size_t cmin);
 int ca_seed_set_chunk_size_avg(CaSeed *s, size_t cavg);
@@ -43,6 +63,9 @@ int ca_seed_set_chunk_size_max(CaSeed *s, size_t cmax);
 int ca_seed_set_hardlink(CaSeed *s, bool b);
 int ca_seed_set_chunks(CaSeed *s, bool b);
 
+/* The cache for looking up user and group names the encoder shall use */
+int ca_seed_set_name_cache(CaSeed *s, CaNameCache *c);
+
 int ca_seed_get_file_root(CaSeed *s, CaFileRoot **ret);
 
 #endif
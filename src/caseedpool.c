@@ -0,0 +1,229 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "cachunkpipeline.h"
+#include "caseedpool.h"
+#include "gcrypt-util.h"
+#include "util.h"
+
+typedef struct CaSeedPoolEntry {
+        CaSeed *seed;
+        int result;
+        bool done;      /* Set by the worker, protected by the mutex */
+        bool collected; /* Only accessed by the caller's thread */
+} CaSeedPoolEntry;
+
+struct CaSeedPool {
+        pthread_mutex_t mutex;
+
+        pthread_t *threads;
+        unsigned n_threads;
+
+        CaSeedPoolEntry *entries;
+        size_t n_entries;
+        size_t next_entry; /* The next seed not yet picked up by a worker */
+
+        int notify_fd;
+
+        bool shutdown;
+};
+
+static bool ca_seed_pool_shutdown(CaSeedPool *p) {
+        bool b;
+
+        assert(p);
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        b = p->shutdown;
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        return b;
+}
+
+static void* ca_seed_pool_worker(void *userdata) {
+        CaSeedPool *p = userdata;
+
+        assert(p);
+
+        for (;;) {
+                CaSeedPoolEntry *e;
+                int r;
+
+                assert_se(pthread_mutex_lock(&p->mutex) == 0);
+                if (p->shutdown || p->next_entry >= p->n_entries) {
+                        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+                        break;
+                }
+                e = p->entries + p->next_entry++;
+                assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+                do {
+                        if (ca_seed_pool_shutdown(p)) {
+                                r = -ECANCELED;
+                                break;
+                        }
+
+                        r = ca_seed_step(e->seed);
+                } while (r > 0);
+
+                assert_se(pthread_mutex_lock(&p->mutex) == 0);
+                e->result = r;
+                e->done = true;
+                assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+                (void) eventfd_write(p->notify_fd, 1);
+        }
+
+        return NULL;
+}
+
+int ca_seed_pool_new(CaSeed **seeds, size_t n_seeds, unsigned n_threads, CaSeedPool **ret) {
+        sigset_t ss, saved_ss;
+        CaSeedPool *p;
+        size_t i;
+        int r;
+
+        if (!seeds && n_seeds > 0)
+                return -EINVAL;
+        if (n_threads > CA_CHUNK_PIPELINE_THREADS_MAX)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        if (n_threads == 0)
+                n_threads = ca_threads_auto();
+        if (n_threads > n_seeds)
+                n_threads = n_seeds;
+
+        p = new0(CaSeedPool, 1);
+        if (!p)
+                return -ENOMEM;
+
+        p->notify_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (p->notify_fd < 0) {
+                r = -errno;
+                free(p);
+                return r;
+        }
+
+        p->entries = new0(CaSeedPoolEntry, MAX(n_seeds, 1U));
+        p->threads = new0(pthread_t, MAX(n_threads, 1U));
+        if (!p->entries || !p->threads) {
+                safe_close(p->notify_fd);
+                free(p->entries);
+                free(p->threads);
+                free(p);
+                return -ENOMEM;
+        }
+
+        for (i = 0; i < n_seeds; i++)
+                p->entries[i].seed = seeds[i];
+        p->n_entries = n_seeds;
+
+        assert_se(pthread_mutex_init(&p->mutex, NULL) == 0);
+
+        /* libgcrypt initialization is not thread-safe, hence do it before we fork off any threads */
+        initialize_libgcrypt();
+
+        /* Make sure signals are only delivered to the main thread, not our workers */
+        assert_se(sigfillset(&ss) >= 0);
+        assert_se(pthread_sigmask(SIG_BLOCK, &ss, &saved_ss) == 0);
+
+        for (; p->n_threads < n_threads; p->n_threads++) {
+                r = pthread_create(p->threads + p->n_threads, NULL, ca_seed_pool_worker, p);
+                if (r != 0) {
+                        assert_se(pthread_sigmask(SIG_SETMASK, &saved_ss, NULL) == 0);
+                        ca_seed_pool_free(p);
+                        return -r;
+                }
+        }
+
+        assert_se(pthread_sigmask(SIG_SETMASK, &saved_ss, NULL) == 0);
+
+        *ret = p;
+        return 0;
+}
+
+CaSeedPool* ca_seed_pool_free(CaSeedPool *p) {
+        unsigned i;
+
+        if (!p)
+                return NULL;
+
+        /* Workers check for this between two steps of their seed, hence they'll exit quickly */
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        p->shutdown = true;
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        for (i = 0; i < p->n_threads; i++)
+                assert_se(pthread_join(p->threads[i], NULL) == 0);
+
+        assert_se(pthread_mutex_destroy(&p->mutex) == 0);
+
+        safe_close(p->notify_fd);
+        free(p->entries);
+        free(p->threads);
+
+        return mfree(p);
+}
+
+int ca_seed_pool_get_fd(CaSeedPool *p) {
+        if (!p)
+                return -EINVAL;
+
+        return p->notify_fd;
+}
+
+int ca_seed_pool_process(CaSeedPool *p) {
+        size_t i, n = 0;
+        eventfd_t v;
+        int r = 0;
+
+        if (!p)
+                return -EINVAL;
+
+        if (eventfd_read(p->notify_fd, &v) < 0 && errno != EAGAIN)
+                return -errno;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        for (i = 0; i < p->n_entries; i++) {
+                CaSeedPoolEntry *e = p->entries + i;
+
+                if (e->collected)
+                        continue;
+
+                if (!e->done) {
+                        n++;
+                        continue;
+                }
+
+                if (e->result < 0) {
+                        if (r == 0)
+                                r = e->result;
+                        continue;
+                }
+
+                e->collected = true;
+        }
+
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        if (r < 0)
+                return r;
+
+        return (int) MIN(n, (size_t) INT_MAX);
+}
+
+bool ca_seed_pool_is_done(CaSeedPool *p, size_t i) {
+        if (!p)
+                return false;
+        if (i >= p->n_entries)
+                return false;
+
+        return p->entries[i].collected;
+}
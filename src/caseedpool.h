@@ -0,0 +1,32 @@
+#ifndef foocaseedpoolhfoo
+#define foocaseedpoolhfoo
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "caseed.h"
+
+/* Indexes a number of seeds concurrently, each seed on a worker thread of its own, with its own encoder and chunker.
+ * While a seed is being indexed it belongs to its worker, and must not be touched by the caller. Once
+ * ca_seed_pool_process() collected it, it is the caller's again, and may be used for lookups. */
+
+typedef struct CaSeedPool CaSeedPool;
+
+/* The seeds are not taken possession of, and must stay around until the pool is freed. They are picked up by the
+ * workers in the order specified. Passing 0 as thread number picks a suitable number automatically. */
+int ca_seed_pool_new(CaSeed **seeds, size_t n_seeds, unsigned n_threads, CaSeedPool **ret);
+
+/* Aborts indexing of all seeds not finished yet, and waits for the workers to exit */
+CaSeedPool* ca_seed_pool_free(CaSeedPool *p);
+
+/* Becomes readable whenever a worker finished a seed */
+int ca_seed_pool_get_fd(CaSeedPool *p);
+
+/* Collects the seeds finished since the last invocation. Returns the first error a worker ran into, otherwise the
+ * number of seeds still being indexed. */
+int ca_seed_pool_process(CaSeedPool *p);
+
+/* Returns true if the seed has been collected, and may hence be used by the caller */
+bool ca_seed_pool_is_done(CaSeedPool *p, size_t i);
+
+#endif
@@ -1,10 +1,13 @@
 #include <fcntl.h>
-#include <lzma.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "cabloom.h"
 #include "cachunk.h"
 #include "castore.h"
+#include "castoreindex.h"
+#include "castorepack.h"
 #include "def.h"
 #include "realloc-buffer.h"
 #include "rm-rf.h"
@@ -13,12 +16,44 @@
 /* #undef EINVAL */
 /* #define EINVAL __LINE__ */
 
+/* Once this many lookups in a plain store found nothing, we scan the store directory for a filter of its chunks, which
+ * then answers most lookups of absent chunks without probing the file system */
+#define CA_STORE_FILTER_MISSES_MIN UINT64_C(1024)
+
+/* Compression state for converting chunks in memory. Used by one thread at a time, and kept around when idle, so that
+ * we don't have to set up the codec from scratch for every chunk. */
+typedef struct CaStoreCodec {
+        CaCompressionContext context;
+        ReallocBuffer buffer;
+} CaStoreCodec;
+
 struct CaStore {
         char *root;
         bool destroy;
         ReallocBuffer buffer;
 
         CaChunkCompression compression;
+        CaCompressionType compression_type;
+        int compression_level;
+
+        /* Protects the codecs array, the filter, and the initialization of the index and the pack store */
+        pthread_mutex_t mutex;
+
+        /* Idle codecs, there's one for each thread that ever converted a chunk concurrently */
+        CaStoreCodec **codecs;
+        size_t n_codecs, n_allocated_codecs;
+
+        int use_index; /* > 0: create the index if there's none, < 0: only use it if it exists already */
+        bool index_failed;
+        CaStoreIndex *index;
+
+        int use_pack; /* > 0: a pack store, 0: a directory of chunk files, < 0: not known yet */
+        CaStorePack *pack;
+
+        /* For stores without an index of their own, see ca_store_filter() */
+        CaBloom *filter;
+        bool filter_failed;
+        uint64_t n_misses;
 };
 
 CaStore* ca_store_new(void) {
@@ -28,7 +63,13 @@ CaStore* ca_store_new(void) {
         if (!store)
                 return NULL;
 
+        assert_se(pthread_mutex_init(&store->mutex, NULL) == 0);
+
+        store->use_index = -1;
+        store->use_pack = -1;
         store->compression = CA_CHUNK_COMPRESSED;
+        store->compression_type = CA_COMPRESSION_DEFAULT;
+        store->compression_level = CA_COMPRESSION_LEVEL_DEFAULT;
         return store;
 }
 
@@ -46,24 +87,61 @@ CaStore *ca_store_new_cache(void) {
                 return NULL;
         }
 
+        /* Nobody but us puts chunks into the cache, hence we can track all of them from the start */
+        s->filter = ca_bloom_new();
+        if (!s->filter) {
+                free(s->root);
+                free(s);
+                return NULL;
+        }
+
+        assert_se(pthread_mutex_init(&s->mutex, NULL) == 0);
+
         s->compression = CA_CHUNK_AS_IS;
+        s->compression_type = CA_COMPRESSION_DEFAULT;
+        s->compression_level = CA_COMPRESSION_LEVEL_DEFAULT;
         return s;
 }
 
+static CaStoreCodec* ca_store_codec_free(CaStoreCodec *c) {
+        if (!c)
+                return NULL;
+
+        ca_compression_done(&c->context);
+        realloc_buffer_free(&c->buffer);
+
+        return mfree(c);
+}
+
 CaStore* ca_store_unref(CaStore *store) {
+        size_t i;
+
         if (!store)
                 return NULL;
 
+        ca_store_pack_free(store->pack);
+
         if (store->destroy && store->root)
                 (void) rm_rf(store->root, REMOVE_ROOT|REMOVE_PHYSICAL);
 
         free(store->root);
         realloc_buffer_free(&store->buffer);
 
+        for (i = 0; i < store->n_codecs; i++)
+                ca_store_codec_free(store->codecs[i]);
+        free(store->codecs);
+
+        ca_store_index_free(store->index);
+        ca_bloom_free(store->filter);
+
+        assert_se(pthread_mutex_destroy(&store->mutex) == 0);
+
         return mfree(store);
 }
 
 int ca_store_set_path(CaStore *store, const char *path) {
+        const char *e;
+
         if (!store)
                 return -EINVAL;
         if (!path)
@@ -72,6 +150,15 @@ int ca_store_set_path(CaStore *store, const char *path) {
         if (store->root)
                 return -EBUSY;
 
+        e = startswith(path, CA_STORE_PACK_URL_PREFIX);
+        if (e) {
+                if (isempty(e))
+                        return -EINVAL;
+
+                path = e;
+                store->use_pack = 1;
+        }
+
         if (endswith(path, "/"))
                 store->root = strdup(path);
         else
@@ -94,6 +181,287 @@ int ca_store_set_compression(CaStore *store, CaChunkCompression c) {
         return 0;
 }
 
+int ca_store_set_compression_type(CaStore *store, CaCompressionType type) {
+        if (!store)
+                return -EINVAL;
+        if (type < 0)
+                return -EINVAL;
+        if (type >= _CA_COMPRESSION_TYPE_MAX)
+                return -EINVAL;
+
+        if (!ca_compression_type_supported(type))
+                return -EOPNOTSUPP;
+
+        store->compression_type = type;
+        return 0;
+}
+
+int ca_store_set_compression_level(CaStore *store, int level) {
+        if (!store)
+                return -EINVAL;
+
+        /* The level is validated against the codec when it is used, as the codec might be set only later */
+        store->compression_level = level;
+        return 0;
+}
+
+/* Returns the pack store object if this is a pack store, and NULL if it's a directory of chunk files */
+static int ca_store_get_pack(CaStore *store, bool create, CaStorePack **ret) {
+        int r = 0;
+
+        assert(store);
+        assert(ret);
+
+        if (store->use_pack == 0) {
+                *ret = NULL;
+                return 0;
+        }
+
+        assert_se(pthread_mutex_lock(&store->mutex) == 0);
+
+        if (!store->pack) {
+                r = ca_store_pack_open(store->root, create && store->use_pack > 0, &store->pack);
+                if (r == -ENOENT && store->use_pack < 0) {
+                        /* Without the marker file it's a directory of chunk files, unless the directory doesn't exist
+                         * yet, in which case we don't know yet */
+                        if (access(store->root, F_OK) >= 0)
+                                store->use_pack = 0;
+
+                        r = 0;
+                } else if (r >= 0)
+                        store->use_pack = 1;
+        }
+
+        *ret = store->pack;
+
+        assert_se(pthread_mutex_unlock(&store->mutex) == 0);
+
+        return r;
+}
+
+int ca_store_compact(CaStore *store) {
+        CaStorePack *pack;
+        int r;
+
+        if (!store)
+                return -EINVAL;
+        if (!store->root)
+                return -EUNATCH;
+
+        r = ca_store_get_pack(store, false, &pack);
+        if (r < 0)
+                return r;
+        if (!pack)
+                return -ENOTTY;
+
+        return ca_store_pack_compact(pack);
+}
+
+int ca_store_set_index(CaStore *store, bool b) {
+        if (!store)
+                return -EINVAL;
+
+        if (store->index)
+                return -EBUSY;
+
+        store->use_index = b;
+        return 0;
+}
+
+static CaStoreIndex* ca_store_get_index(CaStore *store) {
+        CaStoreIndex *index;
+        int r;
+
+        assert(store);
+
+        if (store->use_index == 0 || store->use_pack > 0)
+                return NULL;
+
+        /* The index is opened lazily, and possibly from one of the worker threads, hence lock */
+        assert_se(pthread_mutex_lock(&store->mutex) == 0);
+
+        if (!store->index && !store->index_failed) {
+                r = ca_store_index_open(store->root, store->use_index > 0, &store->index);
+                if (r == -ENOENT) {
+                        /* If we shall create the index, but the store doesn't exist yet, try again later, once it
+                         * does */
+                        if (store->use_index < 0)
+                                store->index_failed = true;
+                } else if (r < 0) {
+                        /* The index is just an optimization, continue without it */
+                        fprintf(stderr, "Failed to open chunk index of store %s, ignoring: %s\n", store->root, strerror(-r));
+                        store->index_failed = true;
+                }
+        }
+
+        index = store->index;
+
+        assert_se(pthread_mutex_unlock(&store->mutex) == 0);
+
+        return index;
+}
+
+int ca_store_rebuild_index(CaStore *store) {
+        CaStoreIndex *index;
+        CaStorePack *pack;
+        int r;
+
+        if (!store)
+                return -EINVAL;
+        if (!store->root)
+                return -EUNATCH;
+
+        /* Pack stores have their own indexes */
+        r = ca_store_get_pack(store, false, &pack);
+        if (r < 0 && r != -ENOENT)
+                return r;
+        if (pack || store->use_pack > 0)
+                return -ENOTTY;
+
+        index = ca_store_get_index(store);
+        if (!index)
+                return -ENOTTY;
+
+        return ca_store_index_rebuild(index);
+}
+
+static int ca_store_filter_add_one(const CaChunkID *id, void *userdata) {
+        return ca_bloom_add(userdata, id);
+}
+
+static int ca_store_filter_build(CaStore *store) {
+        CaBloom *filter;
+        int r;
+
+        assert(store);
+
+        filter = ca_bloom_new();
+        if (!filter)
+                return -ENOMEM;
+
+        r = ca_chunk_file_enumerate(store->root, ca_store_filter_add_one, filter);
+        if (r < 0 && r != -ENOENT) {
+                ca_bloom_free(filter);
+                return r;
+        }
+
+        store->filter = filter;
+        return 0;
+}
+
+int ca_store_filter(CaStore *store, const CaChunkID *chunk_id) {
+        CaStoreIndex *index;
+        CaStorePack *pack;
+        int r;
+
+        if (!store)
+                return -EINVAL;
+        if (!chunk_id)
+                return -EINVAL;
+        if (!store->root)
+                return -EUNATCH;
+
+        /* Pack stores and stores with an index can answer right away from memory */
+        r = ca_store_get_pack(store, false, &pack);
+        if (r == -ENOENT)
+                return 0;
+        if (r < 0)
+                return r;
+        if (pack)
+                return ca_store_pack_has(pack, chunk_id);
+
+        index = ca_store_get_index(store);
+        if (index)
+                return ca_store_index_lookup(index, chunk_id);
+
+        assert_se(pthread_mutex_lock(&store->mutex) == 0);
+
+        if (!store->filter && !store->filter_failed &&
+            __atomic_load_n(&store->n_misses, __ATOMIC_RELAXED) >= CA_STORE_FILTER_MISSES_MIN) {
+                r = ca_store_filter_build(store);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to build chunk filter of store %s, ignoring: %s\n", store->root, strerror(-r));
+                        store->filter_failed = true;
+                }
+        }
+
+        r = store->filter ? ca_bloom_test(store->filter, chunk_id) : -ENODATA;
+
+        assert_se(pthread_mutex_unlock(&store->mutex) == 0);
+
+        return r;
+}
+
+static void ca_store_filter_add(CaStore *store, const CaChunkID *chunk_id) {
+        assert(store);
+
+        assert_se(pthread_mutex_lock(&store->mutex) == 0);
+
+        if (store->filter && ca_bloom_add(store->filter, chunk_id) < 0) {
+                /* A filter missing a chunk would hide it, hence stop using it */
+                store->filter = ca_bloom_free(store->filter);
+                store->filter_failed = true;
+        }
+
+        assert_se(pthread_mutex_unlock(&store->mutex) == 0);
+}
+
+static void ca_store_count_miss(CaStore *store) {
+        assert(store);
+
+        /* May be called from several threads at once, but an exact count doesn't matter much */
+        (void) __atomic_add_fetch(&store->n_misses, 1, __ATOMIC_RELAXED);
+}
+
+static CaStoreCodec* ca_store_acquire_codec(CaStore *store) {
+        CaStoreCodec *c = NULL;
+
+        assert(store);
+
+        assert_se(pthread_mutex_lock(&store->mutex) == 0);
+        if (store->n_codecs > 0)
+                c = store->codecs[--store->n_codecs];
+        assert_se(pthread_mutex_unlock(&store->mutex) == 0);
+
+        if (!c)
+                c = new0(CaStoreCodec, 1);
+
+        return c;
+}
+
+static void ca_store_release_codec(CaStore *store, CaStoreCodec *c) {
+        assert(store);
+        assert(c);
+
+        realloc_buffer_empty(&c->buffer);
+
+        assert_se(pthread_mutex_lock(&store->mutex) == 0);
+        if (GREEDY_REALLOC(store->codecs, store->n_allocated_codecs, store->n_codecs + 1)) {
+                store->codecs[store->n_codecs++] = c;
+                c = NULL;
+        }
+        assert_se(pthread_mutex_unlock(&store->mutex) == 0);
+
+        ca_store_codec_free(c);
+}
+
+static int ca_store_convert(
+                CaStore *store,
+                CaStoreCodec *codec,
+                CaChunkCompression desired_compression,
+                const void *data,
+                size_t size) {
+
+        assert(store);
+        assert(codec);
+
+        if (desired_compression == CA_CHUNK_COMPRESSED)
+                return ca_compress(&codec->context, store->compression_type, store->compression_level, data, size, &codec->buffer);
+
+        assert(desired_compression == CA_CHUNK_UNCOMPRESSED);
+        return ca_decompress(&codec->context, data, size, &codec->buffer);
+}
+
 int ca_store_get(
                 CaStore *store,
                 const CaChunkID *chunk_id,
@@ -102,10 +470,16 @@ int ca_store_get(
                 size_t *ret_size,
                 CaChunkCompression *ret_effective_compression) {
 
+        CaChunkCompression effective_compression;
+        CaStorePack *pack;
         int r;
 
         if (!store)
                 return -EINVAL;
+        if (desired_compression < 0)
+                return -EINVAL;
+        if (desired_compression >= _CA_CHUNK_COMPRESSION_MAX)
+                return -EINVAL;
         if (!ret)
                 return -EINVAL;
         if (!ret_size)
@@ -113,26 +487,99 @@ int ca_store_get(
         if (!store->root)
                 return -EUNATCH;
 
+        r = ca_store_get_pack(store, false, &pack);
+        if (r < 0)
+                return r;
+
         realloc_buffer_empty(&store->buffer);
 
-        r = ca_chunk_file_load(AT_FDCWD, store->root, chunk_id, desired_compression, &store->buffer, ret_effective_compression);
+        if (pack)
+                r = ca_store_pack_get(pack, chunk_id, &store->buffer, &effective_compression);
+        else
+                r = ca_chunk_file_load(AT_FDCWD, store->root, chunk_id, CA_CHUNK_AS_IS, store->compression_type, store->compression_level, &store->buffer, &effective_compression);
+        if (r == -ENOENT)
+                ca_store_count_miss(store);
         if (r < 0)
                 return r;
 
+        if (desired_compression != CA_CHUNK_AS_IS && desired_compression != effective_compression) {
+                CaStoreCodec *codec;
+                ReallocBuffer t;
+
+                codec = ca_store_acquire_codec(store);
+                if (!codec)
+                        return -ENOMEM;
+
+                r = ca_store_convert(store, codec, desired_compression, realloc_buffer_data(&store->buffer), realloc_buffer_size(&store->buffer));
+                if (r >= 0) {
+                        /* Keep the converted chunk, and pass the old buffer on to the codec for the next time */
+                        t = store->buffer;
+                        store->buffer = codec->buffer;
+                        codec->buffer = t;
+
+                        effective_compression = desired_compression;
+                }
+
+                ca_store_release_codec(store, codec);
+
+                if (r < 0)
+                        return r;
+        }
+
         *ret = realloc_buffer_data(&store->buffer);
         *ret_size = realloc_buffer_size(&store->buffer);
 
-        return r;
+        if (ret_effective_compression)
+                *ret_effective_compression = effective_compression;
+
+        return 0;
 }
 
 int ca_store_has(CaStore *store, const CaChunkID *chunk_id) {
+        CaStoreIndex *index;
+        CaStorePack *pack;
+        int r;
 
         if (!store)
                 return -EINVAL;
         if (!store->root)
                 return -EUNATCH;
 
-        return ca_chunk_file_test(AT_FDCWD, store->root, chunk_id);
+        r = ca_store_get_pack(store, false, &pack);
+        if (r == -ENOENT)
+                return 0;
+        if (r < 0)
+                return r;
+        if (pack)
+                return ca_store_pack_has(pack, chunk_id);
+
+        r = ca_chunk_file_test(AT_FDCWD, store->root, chunk_id);
+        if (r == 0) {
+                /* If the chunk was removed behind our back, don't claim to have it next time */
+                index = ca_store_get_index(store);
+                if (index)
+                        (void) ca_store_index_remove(index, chunk_id);
+
+                ca_store_count_miss(store);
+        }
+
+        return r;
+}
+
+static int ca_store_save(
+                CaStore *store,
+                CaStorePack *pack,
+                const CaChunkID *chunk_id,
+                CaChunkCompression compression,
+                const void *data,
+                size_t size) {
+
+        assert(store);
+
+        if (pack)
+                return ca_store_pack_put(pack, chunk_id, compression, data, size);
+
+        return ca_chunk_file_save(AT_FDCWD, store->root, chunk_id, compression, compression, store->compression_type, store->compression_level, data, size);
 }
 
 int ca_store_put(
@@ -142,13 +589,89 @@ int ca_store_put(
                 const void *data,
                 size_t size) {
 
+        CaChunkCompression desired_compression;
+        CaStoreIndex *index = NULL;
+        CaStoreCodec *codec;
+        CaStorePack *pack;
+        int r;
+
         if (!store)
                 return -EINVAL;
+        if (effective_compression < 0)
+                return -EINVAL;
+        if (effective_compression >= _CA_CHUNK_COMPRESSION_MAX)
+                return -EINVAL;
+        if (effective_compression == CA_CHUNK_AS_IS)
+                return -EINVAL;
         if (!store->root)
                 return -EUNATCH;
 
-        if (mkdir(store->root, 0777) < 0 && errno != EEXIST)
-                return -errno;
+        r = ca_store_get_pack(store, true, &pack);
+        if (r < 0)
+                return r;
 
-        return ca_chunk_file_save(AT_FDCWD, store->root, chunk_id, effective_compression, store->compression, data, size);
+        if (pack) {
+                /* Don't bother converting the chunk if we have it already */
+                r = ca_store_pack_has(pack, chunk_id);
+                if (r < 0)
+                        return r;
+                if (r > 0)
+                        return -EEXIST;
+        } else {
+                index = ca_store_get_index(store);
+                if (index && ca_store_index_lookup(index, chunk_id) > 0) {
+                        /* Chunks might have been removed behind our back, and trusting the index here would leave
+                         * the store incomplete without anybody noticing before extracting. Hence check. */
+                        r = ca_chunk_file_test(AT_FDCWD, store->root, chunk_id);
+                        if (r < 0)
+                                return r;
+                        if (r > 0)
+                                return -EEXIST;
+
+                        (void) ca_store_index_remove(index, chunk_id);
+                }
+
+                if (mkdir(store->root, 0777) < 0 && errno != EEXIST)
+                        return -errno;
+        }
+
+        desired_compression = store->compression == CA_CHUNK_AS_IS ? effective_compression : store->compression;
+        if (desired_compression == effective_compression)
+                r = ca_store_save(store, pack, chunk_id, desired_compression, data, size);
+        else {
+                /* Don't bother converting the chunk if we have it already */
+                r = pack ? 0 : ca_chunk_file_test(AT_FDCWD, store->root, chunk_id);
+                if (r < 0)
+                        return r;
+                if (r > 0)
+                        r = -EEXIST;
+                else {
+                        /* Convert the chunk in memory with a codec we keep around, rather than setting up a new one
+                         * to stream through for each chunk */
+                        codec = ca_store_acquire_codec(store);
+                        if (!codec)
+                                return -ENOMEM;
+
+                        r = ca_store_convert(store, codec, desired_compression, data, size);
+                        if (r >= 0)
+                                r = ca_store_save(store, pack, chunk_id, desired_compression,
+                                                  realloc_buffer_data(&codec->buffer), realloc_buffer_size(&codec->buffer));
+
+                        ca_store_release_codec(store, codec);
+                }
+        }
+
+        if (!pack && (r >= 0 || r == -EEXIST)) {
+                /* If this is the first chunk in the store, we couldn't open the index before */
+                if (!index)
+                        index = ca_store_get_index(store);
+
+                /* Also add it if it already existed, as it might have been put there behind our back */
+                if (index)
+                        (void) ca_store_index_add(index, chunk_id);
+
+                ca_store_filter_add(store, chunk_id);
+        }
+
+        return r;
 }
@@ -2,6 +2,7 @@
 #define foocastorehfoo
 
 #include "cachunkid.h"
+#include "cacompression.h"
 #include "cautil.h"
 
 typedef struct CaStore CaStore;
@@ -12,6 +13,22 @@ CaStore* ca_store_unref(CaStore *store);
 
 int ca_store_set_path(CaStore *store, const char *path);
 int ca_store_set_compression(CaStore *store, CaChunkCompression c);
+int ca_store_set_compression_type(CaStore *store, CaCompressionType type);
+int ca_store_set_compression_level(CaStore *store, int level);
+
+/* Whether to keep an index of the chunks in the store, so that lookups don't need to probe the file system, see
+ * castoreindex.h. By default an existing index is used and kept up-to-date, but none is created. */
+int ca_store_set_index(CaStore *store, bool b);
+int ca_store_rebuild_index(CaStore *store);
+
+/* Merges the small packs of a pack store, see castorepack.h. Fails with -ENOTTY for other stores. */
+int ca_store_compact(CaStore *store);
+
+/* Tells cheaply whether a chunk might be in the store, without probing the file system: returns 0 if it definitely
+ * isn't, > 0 if it probably is, and -ENODATA if we can't tell. Pack stores and stores with an index answer from
+ * those, other stores from a Bloom filter built by scanning the store directory once enough lookups came up empty.
+ * Chunks put into the store by others after that are missed. */
+int ca_store_filter(CaStore *store, const CaChunkID *chunk_id);
 
 int ca_store_get(CaStore *store, const CaChunkID *chunk_id, CaChunkCompression desired_compression, const void **ret, size_t *ret_size, CaChunkCompression *ret_effective_compression);
 int ca_store_has(CaStore *store, const CaChunkID *chunk_id);
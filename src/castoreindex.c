@@ -0,0 +1,710 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cachunk.h"
+#include "castoreindex.h"
+#include "util.h"
+
+#define CA_STORE_INDEX_MAGIC UINT64_C(0x5d3e8c2b1f0a4769)
+
+#define CA_STORE_INDEX_BUCKETS_MIN UINT64_C(4096)
+
+/* We grow the table once it's 70% full, linear probing gets slow beyond that */
+#define CA_STORE_INDEX_IS_FULL(n_entries, n_buckets) ((n_entries) * 10 > (n_buckets) * 7)
+
+typedef struct CaStoreIndexHeader {
+        le64_t magic;
+        le64_t n_buckets;
+        le64_t n_entries;
+        le64_t sequence;
+} CaStoreIndexHeader;
+
+/* The file is the header followed by the buckets, each a chunk ID. Empty buckets are all zeroes, hence a freshly
+ * created, sparse file is an empty table. */
+typedef struct CaStoreIndexTable {
+        int fd;
+        void *map;
+        size_t map_size;
+        uint64_t n_buckets;
+} CaStoreIndexTable;
+
+struct CaStoreIndex {
+        pthread_mutex_t mutex;
+
+        char *root;
+        char *path;
+
+        bool writable;
+        CaStoreIndexTable table;
+};
+
+static CaStoreIndexHeader* table_header(CaStoreIndexTable *t) {
+        assert(t);
+        assert(t->map);
+
+        return t->map;
+}
+
+static CaChunkID* table_buckets(CaStoreIndexTable *t) {
+        assert(t);
+        assert(t->map);
+
+        return (CaChunkID*) ((uint8_t*) t->map + sizeof(CaStoreIndexHeader));
+}
+
+/* Lookups don't take the inter-process lock, hence writers tell them when they can't trust a miss: the sequence number
+ * is odd while entries are moved around, and stays odd for good once the table was replaced by a new file. */
+static uint64_t table_sequence(CaStoreIndexTable *t) {
+        return le64toh(__atomic_load_n(&table_header(t)->sequence, __ATOMIC_ACQUIRE));
+}
+
+static void table_begin_change(CaStoreIndexTable *t) {
+        CaStoreIndexHeader *h = table_header(t);
+
+        __atomic_store_n(&h->sequence, htole64(le64toh(h->sequence) + 1), __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void table_end_change(CaStoreIndexTable *t) {
+        CaStoreIndexHeader *h = table_header(t);
+
+        __atomic_store_n(&h->sequence, htole64(le64toh(h->sequence) + 1), __ATOMIC_RELEASE);
+}
+
+static void table_retire(CaStoreIndexTable *t) {
+        CaStoreIndexHeader *h = table_header(t);
+
+        __atomic_store_n(&h->sequence, htole64(le64toh(h->sequence) | 1), __ATOMIC_RELEASE);
+}
+
+static void table_close(CaStoreIndexTable *t) {
+        assert(t);
+
+        if (t->map)
+                (void) munmap(t->map, t->map_size);
+
+        safe_close(t->fd);
+
+        *t = (CaStoreIndexTable) {
+                .fd = -1,
+        };
+}
+
+static int table_map(CaStoreIndexTable *t, int fd, bool writable) {
+        const CaStoreIndexHeader *h;
+        struct stat st;
+        uint64_t n;
+        void *p;
+
+        assert(t);
+        assert(fd >= 0);
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+        if (!S_ISREG(st.st_mode))
+                return -EBADMSG;
+        if ((uint64_t) st.st_size < sizeof(CaStoreIndexHeader))
+                return -EBADMSG;
+        if ((uint64_t) st.st_size > SIZE_MAX)
+                return -EFBIG;
+
+        p = mmap(NULL, st.st_size, writable ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+                return -errno;
+
+        h = p;
+        n = le64toh(h->n_buckets);
+
+        if (le64toh(h->magic) != CA_STORE_INDEX_MAGIC ||
+            n < CA_STORE_INDEX_BUCKETS_MIN ||
+            (n & (n - 1)) != 0 ||
+            n > ((uint64_t) st.st_size - sizeof(CaStoreIndexHeader)) / sizeof(CaChunkID) ||
+            (uint64_t) st.st_size != sizeof(CaStoreIndexHeader) + n * sizeof(CaChunkID)) {
+                (void) munmap(p, st.st_size);
+                return -EBADMSG;
+        }
+
+        *t = (CaStoreIndexTable) {
+                .fd = fd,
+                .map = p,
+                .map_size = st.st_size,
+                .n_buckets = n,
+        };
+
+        return 0;
+}
+
+/* Returns > 0 and the bucket the ID is in if it is in the table, and 0 and the empty bucket it would go to otherwise */
+static int table_find(CaStoreIndexTable *t, const CaChunkID *id, CaChunkID **ret) {
+        CaChunkID *buckets;
+        uint64_t mask, k, n;
+
+        assert(t);
+        assert(id);
+        assert(ret);
+
+        buckets = table_buckets(t);
+        mask = t->n_buckets - 1;
+
+        /* Chunk IDs are cryptographic hashes, hence any part of them is as good a hash value as we can get */
+        k = le64toh(id->u64[0]) & mask;
+
+        for (n = 0; n < t->n_buckets; n++) {
+                CaChunkID *b = buckets + k;
+
+                if (ca_chunk_id_equal(b, id)) {
+                        *ret = b;
+                        return 1;
+                }
+
+                if (ca_chunk_id_is_null(b)) {
+                        *ret = b;
+                        return 0;
+                }
+
+                k = (k + 1) & mask;
+        }
+
+        *ret = NULL;
+        return 0;
+}
+
+/* Returns > 0 if the ID was added, 0 if it was in the table already, and -ENOSPC if the table needs to grow first */
+static int table_insert(CaStoreIndexTable *t, const CaChunkID *id) {
+        CaStoreIndexHeader *h;
+        CaChunkID *b;
+        uint64_t n;
+
+        assert(t);
+        assert(id);
+
+        if (table_find(t, id, &b) > 0)
+                return 0;
+
+        h = table_header(t);
+        n = le64toh(h->n_entries);
+
+        if (!b || CA_STORE_INDEX_IS_FULL(n + 1, t->n_buckets))
+                return -ENOSPC;
+
+        *b = *id;
+        h->n_entries = htole64(n + 1);
+
+        return 1;
+}
+
+/* Returns > 0 if the ID was removed, 0 if it wasn't in the table */
+static int table_remove(CaStoreIndexTable *t, const CaChunkID *id) {
+        CaStoreIndexHeader *h;
+        CaChunkID *buckets, *b;
+        uint64_t mask, i, j;
+
+        assert(t);
+        assert(id);
+
+        if (table_find(t, id, &b) <= 0)
+                return 0;
+
+        buckets = table_buckets(t);
+        mask = t->n_buckets - 1;
+
+        /* Without tombstones, move later entries of the same probe sequence back into the gap, so that lookups still
+         * find them. Lookups running meanwhile might miss one, hence they are told not to trust a miss. */
+        table_begin_change(t);
+
+        i = b - buckets;
+        j = i;
+
+        for (;;) {
+                uint64_t k;
+
+                j = (j + 1) & mask;
+                if (ca_chunk_id_is_null(buckets + j))
+                        break;
+
+                /* The bucket the entry would go to if there were no collisions */
+                k = le64toh(buckets[j].u64[0]) & mask;
+
+                /* Leave it if its home bucket lies cyclically within (i, j] */
+                if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                        continue;
+
+                buckets[i] = buckets[j];
+                i = j;
+        }
+
+        buckets[i] = (CaChunkID) {};
+
+        h = table_header(t);
+        h->n_entries = htole64(le64toh(h->n_entries) - 1);
+
+        table_end_change(t);
+
+        return 1;
+}
+
+/* Creates a new, empty table in a temporary file next to 'path' */
+static int table_create(const char *path, uint64_t n_buckets, CaStoreIndexTable *ret, char **ret_temporary) {
+        CaStoreIndexHeader h = {
+                .magic = htole64(CA_STORE_INDEX_MAGIC),
+                .n_buckets = htole64(n_buckets),
+        };
+        char *temporary;
+        int fd, r;
+
+        assert(path);
+        assert(ret);
+        assert(ret_temporary);
+
+        r = tempfn_random(path, &temporary);
+        if (r < 0)
+                return r;
+
+        fd = open(temporary, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC|O_NOCTTY, 0666);
+        if (fd < 0) {
+                r = -errno;
+                free(temporary);
+                return r;
+        }
+
+        if (ftruncate(fd, sizeof(CaStoreIndexHeader) + n_buckets * sizeof(CaChunkID)) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        r = loop_write(fd, &h, sizeof(h));
+        if (r < 0)
+                goto fail;
+
+        r = table_map(ret, fd, true);
+        if (r < 0)
+                goto fail;
+
+        *ret_temporary = temporary;
+        return 0;
+
+fail:
+        safe_close(fd);
+        (void) unlink(temporary);
+        free(temporary);
+        return r;
+}
+
+/* Creates a copy of the table twice the size in a new temporary file */
+static int table_grow(const char *path, CaStoreIndexTable *t, CaStoreIndexTable *ret, char **ret_temporary) {
+        CaStoreIndexTable n;
+        CaChunkID *buckets;
+        char *temporary;
+        uint64_t k;
+        int r;
+
+        assert(path);
+        assert(t);
+        assert(ret);
+        assert(ret_temporary);
+
+        r = table_create(path, t->n_buckets * 2, &n, &temporary);
+        if (r < 0)
+                return r;
+
+        buckets = table_buckets(t);
+        for (k = 0; k < t->n_buckets; k++) {
+                if (ca_chunk_id_is_null(buckets + k))
+                        continue;
+
+                r = table_insert(&n, buckets + k);
+                if (r < 0) {
+                        table_close(&n);
+                        (void) unlink(temporary);
+                        free(temporary);
+                        return r;
+                }
+        }
+
+        *ret = n;
+        *ret_temporary = temporary;
+
+        return 0;
+}
+
+static int ca_store_index_load(CaStoreIndex *i) {
+        CaStoreIndexTable t;
+        bool writable = true;
+        int fd, r;
+
+        assert(i);
+
+        fd = open(i->path, O_RDWR|O_CLOEXEC|O_NOCTTY);
+        if (fd < 0 && IN_SET(errno, EACCES, EPERM, EROFS)) {
+                fd = open(i->path, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+                writable = false;
+        }
+        if (fd < 0)
+                return -errno;
+
+        r = table_map(&t, fd, writable);
+        if (r < 0) {
+                safe_close(fd);
+                return r;
+        }
+
+        table_close(&i->table);
+        i->table = t;
+        i->writable = writable;
+
+        return 0;
+}
+
+/* Takes the inter-process lock on the index file, and makes sure it's still the current one */
+static int ca_store_index_lock(CaStoreIndex *i) {
+        int r;
+
+        assert(i);
+
+        for (;;) {
+                struct stat a, b;
+
+                if (flock(i->table.fd, LOCK_EX) < 0)
+                        return -errno;
+
+                if (fstat(i->table.fd, &a) < 0)
+                        return -errno;
+
+                if (stat(i->path, &b) < 0) {
+                        if (errno != ENOENT)
+                                return -errno;
+
+                        /* Somebody removed it, let's just continue with ours */
+                        return 0;
+                }
+
+                if (a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+                        /* A writer died while moving entries around. Whatever it left is what we have now. */
+                        if (i->writable && (table_sequence(&i->table) & 1))
+                                table_end_change(&i->table);
+
+                        return 0;
+                }
+
+                /* Somebody replaced it while we were waiting for the lock, switch over. This drops the lock on the old
+                 * one. */
+                r = ca_store_index_load(i);
+                if (r < 0)
+                        return r;
+        }
+}
+
+static void ca_store_index_unlock(CaStoreIndex *i) {
+        assert(i);
+
+        if (i->table.fd >= 0)
+                (void) flock(i->table.fd, LOCK_UN);
+}
+
+typedef struct CaStoreIndexScan {
+        CaStoreIndex *index;
+        CaStoreIndexTable *table;
+        char **temporary;
+} CaStoreIndexScan;
+
+static int ca_store_index_scan_one(const CaChunkID *id, void *userdata) {
+        CaStoreIndexScan *scan = userdata;
+        CaStoreIndexTable n;
+        char *n_temporary;
+        int r;
+
+        assert(id);
+        assert(scan);
+
+        r = table_insert(scan->table, id);
+        if (r != -ENOSPC)
+                return r;
+
+        r = table_grow(scan->index->path, scan->table, &n, &n_temporary);
+        if (r < 0)
+                return r;
+
+        table_close(scan->table);
+        (void) unlink(*scan->temporary);
+        free(*scan->temporary);
+
+        *scan->table = n;
+        *scan->temporary = n_temporary;
+
+        return table_insert(scan->table, id);
+}
+
+static int ca_store_index_scan(CaStoreIndex *i, CaStoreIndexTable *t, char **temporary) {
+        CaStoreIndexScan scan = {
+                .index = i,
+                .table = t,
+                .temporary = temporary,
+        };
+
+        assert(i);
+        assert(t);
+        assert(temporary);
+
+        return ca_chunk_file_enumerate(i->root, ca_store_index_scan_one, &scan);
+}
+
+int ca_store_index_rebuild(CaStoreIndex *i) {
+        CaStoreIndexTable t = { .fd = -1 };
+        char *temporary = NULL;
+        bool locked = false;
+        int r;
+
+        if (!i)
+                return -EINVAL;
+
+        assert_se(pthread_mutex_lock(&i->mutex) == 0);
+
+        /* Keep others from adding to the old index while we scan, as they'd add to the wrong file */
+        if (i->table.fd >= 0 && i->writable) {
+                r = ca_store_index_lock(i);
+                if (r < 0)
+                        goto finish;
+
+                locked = true;
+        }
+
+        r = table_create(i->path, CA_STORE_INDEX_BUCKETS_MIN, &t, &temporary);
+        if (r < 0)
+                goto finish;
+
+        r = ca_store_index_scan(i, &t, &temporary);
+        if (r < 0)
+                goto finish;
+
+        if (rename(temporary, i->path) < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        temporary = mfree(temporary);
+
+        /* Make others switch over, then drop the lock on the old one */
+        if (locked)
+                table_retire(&i->table);
+        table_close(&i->table);
+        i->table = t;
+        i->writable = true;
+        t = (CaStoreIndexTable) { .fd = -1 };
+        locked = false;
+
+        r = 0;
+
+finish:
+        if (temporary) {
+                (void) unlink(temporary);
+                free(temporary);
+        }
+
+        table_close(&t);
+
+        if (locked)
+                ca_store_index_unlock(i);
+
+        assert_se(pthread_mutex_unlock(&i->mutex) == 0);
+        return r;
+}
+
+int ca_store_index_open(const char *root, bool create, CaStoreIndex **ret) {
+        CaStoreIndex *i;
+        int r;
+
+        if (!root)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        i = new0(CaStoreIndex, 1);
+        if (!i)
+                return -ENOMEM;
+
+        assert_se(pthread_mutex_init(&i->mutex, NULL) == 0);
+        i->table.fd = -1;
+
+        i->root = strdup(root);
+        if (!i->root) {
+                r = -ENOMEM;
+                goto fail;
+        }
+
+        i->path = strjoin(root, endswith(root, "/") ? "" : "/", CA_STORE_INDEX_FILENAME, NULL);
+        if (!i->path) {
+                r = -ENOMEM;
+                goto fail;
+        }
+
+        r = ca_store_index_load(i);
+        if ((r == -ENOENT && create) || r == -EBADMSG)
+                r = ca_store_index_rebuild(i);
+        if (r < 0)
+                goto fail;
+
+        *ret = i;
+        return 0;
+
+fail:
+        ca_store_index_free(i);
+        return r;
+}
+
+CaStoreIndex* ca_store_index_free(CaStoreIndex *i) {
+        if (!i)
+                return NULL;
+
+        table_close(&i->table);
+
+        free(i->root);
+        free(i->path);
+
+        assert_se(pthread_mutex_destroy(&i->mutex) == 0);
+
+        return mfree(i);
+}
+
+int ca_store_index_lookup(CaStoreIndex *i, const CaChunkID *id) {
+        CaChunkID *b;
+        uint64_t seq;
+        int r;
+
+        if (!i)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+
+        /* We use the null ID to mark empty buckets, hence can't say anything about it */
+        if (ca_chunk_id_is_null(id))
+                return -EDOM;
+
+        assert_se(pthread_mutex_lock(&i->mutex) == 0);
+
+        seq = table_sequence(&i->table);
+        r = table_find(&i->table, id, &b);
+        if (r > 0)
+                goto finish;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ((seq & 1) == 0 && table_sequence(&i->table) == seq)
+                goto finish;
+
+        /* The table is being changed or was replaced. Look again under the lock, which switches to the new file. */
+        r = ca_store_index_lock(i);
+        if (r < 0)
+                goto finish;
+
+        r = table_find(&i->table, id, &b);
+
+        ca_store_index_unlock(i);
+
+finish:
+        assert_se(pthread_mutex_unlock(&i->mutex) == 0);
+        return r;
+}
+
+int ca_store_index_add(CaStoreIndex *i, const CaChunkID *id) {
+        CaStoreIndexTable t;
+        char *temporary = NULL;
+        int r;
+
+        if (!i)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+        if (ca_chunk_id_is_null(id))
+                return -EDOM;
+
+        assert_se(pthread_mutex_lock(&i->mutex) == 0);
+
+        if (!i->writable) {
+                r = -EROFS;
+                goto finish;
+        }
+
+        r = ca_store_index_lock(i);
+        if (r < 0)
+                goto finish;
+
+        r = table_insert(&i->table, id);
+        if (r != -ENOSPC)
+                goto unlock;
+
+        /* We hold the lock on the old file until we replaced it, so that nobody adds to it in the meantime */
+        r = table_grow(i->path, &i->table, &t, &temporary);
+        if (r < 0)
+                goto unlock;
+
+        r = table_insert(&t, id);
+        if (r >= 0 && rename(temporary, i->path) < 0)
+                r = -errno;
+        if (r < 0) {
+                (void) unlink(temporary);
+                table_close(&t);
+                goto unlock;
+        }
+
+        /* Make others switch over, then drop the lock on the old file */
+        table_retire(&i->table);
+        table_close(&i->table);
+        i->table = t;
+
+        r = 1;
+        goto finish;
+
+unlock:
+        ca_store_index_unlock(i);
+
+finish:
+        free(temporary);
+        assert_se(pthread_mutex_unlock(&i->mutex) == 0);
+        return r;
+}
+
+int ca_store_index_remove(CaStoreIndex *i, const CaChunkID *id) {
+        int r;
+
+        if (!i)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+        if (ca_chunk_id_is_null(id))
+                return -EDOM;
+
+        assert_se(pthread_mutex_lock(&i->mutex) == 0);
+
+        if (!i->writable) {
+                r = -EROFS;
+                goto finish;
+        }
+
+        r = ca_store_index_lock(i);
+        if (r < 0)
+                goto finish;
+
+        r = table_remove(&i->table, id);
+
+        ca_store_index_unlock(i);
+
+finish:
+        assert_se(pthread_mutex_unlock(&i->mutex) == 0);
+        return r;
+}
+
+uint64_t ca_store_index_entries(CaStoreIndex *i) {
+        uint64_t n;
+
+        if (!i)
+                return 0;
+
+        assert_se(pthread_mutex_lock(&i->mutex) == 0);
+        n = le64toh(table_header(&i->table)->n_entries);
+        assert_se(pthread_mutex_unlock(&i->mutex) == 0);
+
+        return n;
+}
@@ -0,0 +1,39 @@
+#ifndef foocastoreindexhfoo
+#define foocastoreindexhfoo
+
+#include <stdbool.h>
+
+#include "cachunkid.h"
+
+/* A persistent hash table of the IDs of the chunks in a local store directory, so that we can tell whether a chunk is
+ * in the store without probing the file system. It's an open addressing table with linear probing, kept in a file in
+ * the store directory and accessed via mmap(), hence lookups need no system calls at all. Chunks added behind our
+ * back (for example with cp or rsync) are only picked up by rebuilding it, which scans the directory. Chunks removed
+ * behind our back are dropped from it when noticed. */
+
+#define CA_STORE_INDEX_FILENAME ".chunk-index"
+
+typedef struct CaStoreIndex CaStoreIndex;
+
+/* Opens the index of the store directory 'root'. If there's none yet, builds it if 'create' is true, and fails with
+ * -ENOENT otherwise. */
+int ca_store_index_open(const char *root, bool create, CaStoreIndex **ret);
+CaStoreIndex* ca_store_index_free(CaStoreIndex *i);
+
+/* Returns > 0 if the chunk is in the index, 0 if not. Changes other processes are making, or made by replacing the
+ * index file, are taken into account, hence a miss can be trusted as long as the store's chunks were not touched behind
+ * the index' back. */
+int ca_store_index_lookup(CaStoreIndex *i, const CaChunkID *id);
+
+/* Returns > 0 if the chunk was added, 0 if it was in the index already */
+int ca_store_index_add(CaStoreIndex *i, const CaChunkID *id);
+
+/* Returns > 0 if the chunk was removed, 0 if it wasn't in the index */
+int ca_store_index_remove(CaStoreIndex *i, const CaChunkID *id);
+
+/* Throws away the index and builds a new one by scanning the store directory */
+int ca_store_index_rebuild(CaStoreIndex *i);
+
+uint64_t ca_store_index_entries(CaStoreIndex *i);
+
+#endif
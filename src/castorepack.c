@@ -0,0 +1,1663 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "castorepack.h"
+#include "util.h"
+
+#define CA_STORE_PACK_STATE_MAGIC UINT64_C(0x8d1c5a2e73b04f96)
+#define CA_STORE_PACK_RECORD_MAGIC UINT64_C(0x27e94b0c6d5a13f8)
+#define CA_STORE_PACK_INDEX_MAGIC UINT64_C(0xc4a3f1e805926d7b)
+
+#define CA_STORE_PACK_RECORD_COMPRESSED UINT64_C(1)
+
+#define CA_STORE_PACK_SLOTS_MIN ((size_t) 1024)
+
+/* The state file, mmap()ed shared by all readers and writers. Only written to with the lock on it taken. */
+typedef struct CaStorePackState {
+        le64_t magic;
+        le64_t generation;  /* Bumped whenever packs or their index files are added or removed */
+        le64_t active;      /* The number of the pack we append to, or 0 if there's none */
+        le64_t active_size; /* The size of the complete records in it */
+} CaStorePackState;
+
+/* Each chunk in a pack is one of these, followed by the chunk data */
+typedef struct CaStorePackRecord {
+        le64_t magic;
+        le64_t flags;
+        le64_t size;
+        CaChunkID id;
+} CaStorePackRecord;
+
+/* The index file of a pack is one of these, followed by the entries sorted by chunk ID */
+typedef struct CaStorePackIndexHeader {
+        le64_t magic;
+        le64_t n_entries;
+        le64_t pack_size;   /* The part of the pack the index covers */
+        le64_t reserved;
+} CaStorePackIndexHeader;
+
+typedef struct CaStorePackEntry {
+        CaChunkID id;
+        le64_t offset;      /* Of the record */
+        le64_t size;        /* Of the chunk data */
+} CaStorePackEntry;
+
+typedef struct CaStorePackFile {
+        uint64_t number;
+        int fd;
+        uint64_t size;      /* Up to where we know the records */
+
+        void *index_map;
+        size_t index_map_size;
+        const CaStorePackEntry *entries;
+        uint64_t n_entries;
+        uint64_t indexed_size;
+} CaStorePackFile;
+
+/* The records not covered by an index file are kept in an in-memory hash table */
+typedef struct CaStorePackSlot {
+        CaChunkID id;
+        size_t file;
+        uint64_t offset;
+        uint64_t size;
+} CaStorePackSlot;
+
+typedef struct CaStorePackTable {
+        CaStorePackSlot *slots;
+        size_t n_slots;
+        size_t n_used;
+} CaStorePackTable;
+
+struct CaStorePack {
+        pthread_mutex_t mutex;
+
+        char *root;
+        int state_fd;
+        CaStorePackState *state;
+        bool writable;
+
+        uint64_t size_max;
+
+        /* The packs as of this generation of the state, sorted by number */
+        uint64_t generation;
+        CaStorePackFile *files;
+        size_t n_files, n_allocated_files;
+
+        CaStorePackTable tail;
+        ReallocBuffer buffer;
+
+        /* Whether we appended records that aren't covered by the index file of the pack yet */
+        bool dirty;
+};
+
+static uint64_t state_read(const le64_t *field) {
+        return le64toh(__atomic_load_n(field, __ATOMIC_ACQUIRE));
+}
+
+static void state_write(le64_t *field, uint64_t value) {
+        __atomic_store_n(field, htole64(value), __ATOMIC_RELEASE);
+}
+
+static int pread_full(int fd, void *p, size_t l, uint64_t offset) {
+        uint8_t *q = p;
+
+        assert(fd >= 0);
+        assert(p || l == 0);
+
+        while (l > 0) {
+                ssize_t n;
+
+                n = pread(fd, q, l, offset);
+                if (n < 0)
+                        return -errno;
+                if (n == 0) /* Truncated */
+                        return -EBADMSG;
+
+                q += n;
+                l -= n;
+                offset += n;
+        }
+
+        return 0;
+}
+
+static int pwrite_full(int fd, const void *p, size_t l, uint64_t offset) {
+        const uint8_t *q = p;
+
+        assert(fd >= 0);
+        assert(p || l == 0);
+
+        while (l > 0) {
+                ssize_t n;
+
+                n = pwrite(fd, q, l, offset);
+                if (n < 0)
+                        return -errno;
+                if (n == 0)
+                        return -EIO;
+
+                q += n;
+                l -= n;
+                offset += n;
+        }
+
+        return 0;
+}
+
+static CaStorePackSlot* table_find(CaStorePackTable *t, const CaChunkID *id) {
+        size_t k, mask;
+
+        assert(t);
+        assert(id);
+
+        if (t->n_slots == 0)
+                return NULL;
+
+        /* Chunk IDs are cryptographic hashes, hence any part of them is as good a hash value as we can get */
+        mask = t->n_slots - 1;
+        k = (size_t) le64toh(id->u64[0]) & mask;
+
+        for (;;) {
+                CaStorePackSlot *s = t->slots + k;
+
+                if (ca_chunk_id_equal(&s->id, id))
+                        return s;
+                if (ca_chunk_id_is_null(&s->id))
+                        return NULL;
+
+                k = (k + 1) & mask;
+        }
+}
+
+static void table_put(CaStorePackTable *t, const CaStorePackSlot *slot) {
+        size_t k, mask;
+
+        assert(t);
+        assert(slot);
+
+        mask = t->n_slots - 1;
+        k = (size_t) le64toh(slot->id.u64[0]) & mask;
+
+        while (!ca_chunk_id_is_null(&t->slots[k].id)) {
+                if (ca_chunk_id_equal(&t->slots[k].id, &slot->id))
+                        return;
+
+                k = (k + 1) & mask;
+        }
+
+        t->slots[k] = *slot;
+        t->n_used++;
+}
+
+static int table_add(CaStorePackTable *t, const CaStorePackSlot *slot) {
+        assert(t);
+        assert(slot);
+        assert(!ca_chunk_id_is_null(&slot->id));
+
+        /* Keep the table at most 70% full, as linear probing gets slow beyond that */
+        if ((t->n_used + 1) * 10 > t->n_slots * 7) {
+                CaStorePackTable n = {};
+                size_t i;
+
+                n.n_slots = MAX(t->n_slots * 2, CA_STORE_PACK_SLOTS_MIN);
+                n.slots = new0(CaStorePackSlot, n.n_slots);
+                if (!n.slots)
+                        return -ENOMEM;
+
+                for (i = 0; i < t->n_slots; i++)
+                        if (!ca_chunk_id_is_null(&t->slots[i].id))
+                                table_put(&n, t->slots + i);
+
+                free(t->slots);
+                *t = n;
+        }
+
+        table_put(t, slot);
+        return 0;
+}
+
+static void table_clear(CaStorePackTable *t) {
+        assert(t);
+
+        free(t->slots);
+        *t = (CaStorePackTable) {};
+}
+
+static const CaStorePackEntry* file_find(const CaStorePackFile *f, const CaChunkID *id) {
+        uint64_t a = 0, b;
+
+        assert(f);
+        assert(id);
+
+        b = f->n_entries;
+        while (a < b) {
+                uint64_t m = a + (b - a) / 2;
+                int c;
+
+                c = memcmp(&f->entries[m].id, id, sizeof(CaChunkID));
+                if (c == 0)
+                        return f->entries + m;
+                if (c < 0)
+                        a = m + 1;
+                else
+                        b = m;
+        }
+
+        return NULL;
+}
+
+static void file_close(CaStorePackFile *f) {
+        assert(f);
+
+        if (f->index_map)
+                (void) munmap(f->index_map, f->index_map_size);
+
+        safe_close(f->fd);
+}
+
+static char* ca_store_pack_path(CaStorePack *p, uint64_t number, const char *suffix) {
+        char *path;
+
+        assert(p);
+        assert(suffix);
+
+        if (asprintf(&path, "%s%016" PRIx64 "%s", p->root, number, suffix) < 0)
+                return NULL;
+
+        return path;
+}
+
+static int ca_store_pack_file_fd(CaStorePack *p, CaStorePackFile *f) {
+        char *path;
+
+        assert(p);
+        assert(f);
+
+        if (f->fd >= 0)
+                return f->fd;
+
+        path = ca_store_pack_path(p, f->number, ".pack");
+        if (!path)
+                return -ENOMEM;
+
+        f->fd = open(path, (p->writable ? O_RDWR : O_RDONLY)|O_CLOEXEC|O_NOCTTY);
+        free(path);
+        if (f->fd < 0)
+                return -errno;
+
+        return f->fd;
+}
+
+static int ca_store_pack_file_load_index(CaStorePack *p, CaStorePackFile *f) {
+        const CaStorePackIndexHeader *h;
+        struct stat st;
+        char *path;
+        uint64_t n;
+        void *m;
+        int fd;
+
+        assert(p);
+        assert(f);
+
+        path = ca_store_pack_path(p, f->number, ".index");
+        if (!path)
+                return -ENOMEM;
+
+        fd = open(path, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+        free(path);
+        if (fd < 0)
+                return errno == ENOENT ? 0 : -errno;
+
+        if (fstat(fd, &st) < 0) {
+                safe_close(fd);
+                return -errno;
+        }
+
+        if ((uint64_t) st.st_size < sizeof(CaStorePackIndexHeader) || (uint64_t) st.st_size > SIZE_MAX) {
+                safe_close(fd);
+                return -EBADMSG;
+        }
+
+        m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        safe_close(fd);
+        if (m == MAP_FAILED)
+                return -errno;
+
+        h = m;
+        n = le64toh(h->n_entries);
+
+        if (le64toh(h->magic) != CA_STORE_PACK_INDEX_MAGIC ||
+            n > ((uint64_t) st.st_size - sizeof(CaStorePackIndexHeader)) / sizeof(CaStorePackEntry) ||
+            (uint64_t) st.st_size != sizeof(CaStorePackIndexHeader) + n * sizeof(CaStorePackEntry)) {
+                (void) munmap(m, st.st_size);
+                return -EBADMSG;
+        }
+
+        f->index_map = m;
+        f->index_map_size = st.st_size;
+        f->entries = (const CaStorePackEntry*) ((const uint8_t*) m + sizeof(CaStorePackIndexHeader));
+        f->n_entries = n;
+        f->indexed_size = f->size = le64toh(h->pack_size);
+
+        return 0;
+}
+
+/* Reads the records in the pack from where we know them up to 'end', and adds them to the tail table */
+static int ca_store_pack_file_scan(CaStorePack *p, size_t idx, uint64_t end) {
+        CaStorePackFile *f;
+        int fd, r;
+
+        assert(p);
+        assert(idx < p->n_files);
+
+        f = p->files + idx;
+
+        fd = ca_store_pack_file_fd(p, f);
+        if (fd < 0)
+                return fd;
+
+        while (f->size + sizeof(CaStorePackRecord) <= end) {
+                CaStorePackRecord h;
+                CaStorePackSlot slot;
+                uint64_t size;
+
+                r = pread_full(fd, &h, sizeof(h), f->size);
+                if (r == -EBADMSG)
+                        break;
+                if (r < 0)
+                        return r;
+
+                /* Stop at torn records, for example left behind by a writer that died */
+                size = le64toh(h.size);
+                if (le64toh(h.magic) != CA_STORE_PACK_RECORD_MAGIC ||
+                    size > end - f->size - sizeof(h) ||
+                    ca_chunk_id_is_null(&h.id))
+                        break;
+
+                slot = (CaStorePackSlot) {
+                        .id = h.id,
+                        .file = idx,
+                        .offset = f->size,
+                        .size = size,
+                };
+
+                r = table_add(&p->tail, &slot);
+                if (r < 0)
+                        return r;
+
+                f->size += sizeof(h) + size;
+        }
+
+        return 0;
+}
+
+static void ca_store_pack_reset(CaStorePack *p) {
+        size_t i;
+
+        assert(p);
+
+        for (i = 0; i < p->n_files; i++)
+                file_close(p->files + i);
+
+        p->n_files = 0;
+        table_clear(&p->tail);
+}
+
+static int file_compare(const void *a, const void *b) {
+        const CaStorePackFile *x = a, *y = b;
+
+        if (x->number < y->number)
+                return -1;
+        if (x->number > y->number)
+                return 1;
+
+        return 0;
+}
+
+static int ca_store_pack_list(CaStorePack *p) {
+        struct dirent *de;
+        DIR *d;
+        int r = 0;
+
+        assert(p);
+
+        d = opendir(p->root);
+        if (!d)
+                return -errno;
+
+        for (;;) {
+                char *e;
+                uint64_t number;
+
+                errno = 0;
+                de = readdir(d);
+                if (!de) {
+                        r = -errno;
+                        break;
+                }
+
+                /* Packs are named after their number, in 16 hex digits */
+                if (strlen(de->d_name) != 16 + 5 || !streq(de->d_name + 16, ".pack"))
+                        continue;
+
+                errno = 0;
+                number = strtoull(de->d_name, &e, 16);
+                if (errno != 0 || e != de->d_name + 16 || number == 0)
+                        continue;
+
+                if (!GREEDY_REALLOC(p->files, p->n_allocated_files, p->n_files + 1)) {
+                        r = -ENOMEM;
+                        break;
+                }
+
+                p->files[p->n_files++] = (CaStorePackFile) {
+                        .number = number,
+                        .fd = -1,
+                };
+        }
+
+        closedir(d);
+
+        if (r < 0)
+                return r;
+
+        if (p->n_files > 1)
+                qsort(p->files, p->n_files, sizeof(CaStorePackFile), file_compare);
+        return 0;
+}
+
+/* Forgets everything we know, and loads the current set of packs */
+static int ca_store_pack_reload(CaStorePack *p) {
+        int r;
+
+        assert(p);
+
+        for (;;) {
+                uint64_t generation, active, active_size;
+                size_t i;
+
+                generation = state_read(&p->state->generation);
+                active = state_read(&p->state->active);
+                active_size = state_read(&p->state->active_size);
+
+                ca_store_pack_reset(p);
+
+                r = ca_store_pack_list(p);
+                if (r < 0)
+                        return r;
+
+                for (i = 0; i < p->n_files; i++) {
+                        CaStorePackFile *f = p->files + i;
+                        uint64_t end;
+
+                        r = ca_store_pack_file_load_index(p, f);
+                        if (r < 0)
+                                break;
+
+                        if (f->number == active)
+                                end = active_size;
+                        else {
+                                struct stat st;
+                                int fd;
+
+                                /* The pack might have been removed in the meantime, in which case we'll load
+                                 * everything again below anyway */
+                                fd = ca_store_pack_file_fd(p, f);
+                                if (fd == -ENOENT)
+                                        continue;
+                                if (fd < 0) {
+                                        r = fd;
+                                        break;
+                                }
+
+                                if (fstat(fd, &st) < 0) {
+                                        r = -errno;
+                                        break;
+                                }
+
+                                end = st.st_size;
+                        }
+
+                        if (end > f->size) {
+                                r = ca_store_pack_file_scan(p, i, end);
+                                if (r < 0)
+                                        break;
+                        }
+                }
+
+                /* Somebody changed the set of packs while we were loading it? Then try again. */
+                if (state_read(&p->state->generation) == generation) {
+                        if (r < 0)
+                                return r;
+
+                        p->generation = generation;
+                        return 0;
+                }
+        }
+}
+
+/* Picks up whatever was changed by others since we last looked. Doesn't need a system call if nothing was. */
+static int ca_store_pack_refresh(CaStorePack *p) {
+        CaStorePackFile *f;
+        uint64_t active, end;
+
+        assert(p);
+
+        if (state_read(&p->state->generation) != p->generation)
+                return ca_store_pack_reload(p);
+
+        active = state_read(&p->state->active);
+        if (active == 0 || p->n_files == 0)
+                return 0;
+
+        f = p->files + p->n_files - 1;
+        if (f->number != active)
+                return 0;
+
+        end = state_read(&p->state->active_size);
+        if (end <= f->size)
+                return 0;
+
+        return ca_store_pack_file_scan(p, p->n_files - 1, end);
+}
+
+static bool ca_store_pack_lookup(CaStorePack *p, const CaChunkID *id, size_t *ret_file, uint64_t *ret_offset, uint64_t *ret_size) {
+        const CaStorePackSlot *slot;
+        size_t i;
+
+        assert(p);
+        assert(id);
+
+        slot = table_find(&p->tail, id);
+        if (slot) {
+                if (ret_file)
+                        *ret_file = slot->file;
+                if (ret_offset)
+                        *ret_offset = slot->offset;
+                if (ret_size)
+                        *ret_size = slot->size;
+
+                return true;
+        }
+
+        /* Newer packs first, they are more likely to have what we look for */
+        for (i = p->n_files; i > 0; i--) {
+                const CaStorePackEntry *e;
+
+                e = file_find(p->files + i - 1, id);
+                if (!e)
+                        continue;
+
+                if (ret_file)
+                        *ret_file = i - 1;
+                if (ret_offset)
+                        *ret_offset = le64toh(e->offset);
+                if (ret_size)
+                        *ret_size = le64toh(e->size);
+
+                return true;
+        }
+
+        return false;
+}
+
+static int ca_store_pack_find(CaStorePack *p, const CaChunkID *id, size_t *ret_file, uint64_t *ret_offset, uint64_t *ret_size) {
+        int r;
+
+        assert(p);
+        assert(id);
+
+        if (ca_store_pack_lookup(p, id, ret_file, ret_offset, ret_size))
+                return 1;
+
+        r = ca_store_pack_refresh(p);
+        if (r < 0)
+                return r;
+
+        return ca_store_pack_lookup(p, id, ret_file, ret_offset, ret_size);
+}
+
+static int ca_store_pack_lock(CaStorePack *p) {
+        int r;
+
+        assert(p);
+
+        if (!p->writable)
+                return -EROFS;
+
+        if (flock(p->state_fd, LOCK_EX) < 0)
+                return -errno;
+
+        r = ca_store_pack_refresh(p);
+        if (r < 0) {
+                (void) flock(p->state_fd, LOCK_UN);
+                return r;
+        }
+
+        return 0;
+}
+
+static void ca_store_pack_unlock(CaStorePack *p) {
+        assert(p);
+
+        (void) flock(p->state_fd, LOCK_UN);
+}
+
+static int entry_compare(const void *a, const void *b) {
+        const CaStorePackEntry *x = a, *y = b;
+
+        return memcmp(&x->id, &y->id, sizeof(CaChunkID));
+}
+
+/* Writes the list of packs with an index file, for readers that can't list the directory, for example via HTTP.
+ * Needs the lock. */
+static int ca_store_pack_write_manifest(CaStorePack *p) {
+        char *path = NULL, *temporary = NULL;
+        struct dirent *de;
+        FILE *f = NULL;
+        DIR *d;
+        int r;
+
+        assert(p);
+
+        d = opendir(p->root);
+        if (!d)
+                return -errno;
+
+        path = strjoin(p->root, CA_STORE_PACK_MANIFEST_FILENAME, NULL);
+        if (!path) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        r = tempfn_random(path, &temporary);
+        if (r < 0)
+                goto finish;
+
+        f = fopen(temporary, "wxe");
+        if (!f) {
+                r = -errno;
+                goto finish;
+        }
+
+        for (;;) {
+                errno = 0;
+                de = readdir(d);
+                if (!de) {
+                        r = -errno;
+                        break;
+                }
+
+                if (strlen(de->d_name) != 16 + 6 || !streq(de->d_name + 16, ".index"))
+                        continue;
+
+                fprintf(f, "%.16s\n", de->d_name);
+        }
+        if (r < 0)
+                goto finish;
+
+        if (fflush(f) != 0 || ferror(f)) {
+                r = errno > 0 ? -errno : -EIO;
+                goto finish;
+        }
+
+        if (rename(temporary, path) < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        temporary = mfree(temporary);
+        r = 0;
+
+finish:
+        closedir(d);
+
+        if (f)
+                fclose(f);
+
+        if (temporary) {
+                (void) unlink(temporary);
+                free(temporary);
+        }
+
+        free(path);
+        return r;
+}
+
+static int ca_store_pack_write_index(CaStorePack *p, uint64_t number, CaStorePackEntry *entries, size_t n_entries, uint64_t pack_size) {
+        CaStorePackIndexHeader h = {
+                .magic = htole64(CA_STORE_PACK_INDEX_MAGIC),
+                .n_entries = htole64(n_entries),
+                .pack_size = htole64(pack_size),
+        };
+        char *path, *temporary = NULL;
+        int fd = -1, r;
+
+        assert(p);
+        assert(entries || n_entries == 0);
+
+        if (n_entries > 1)
+                qsort(entries, n_entries, sizeof(CaStorePackEntry), entry_compare);
+
+        path = ca_store_pack_path(p, number, ".index");
+        if (!path)
+                return -ENOMEM;
+
+        r = tempfn_random(path, &temporary);
+        if (r < 0)
+                goto finish;
+
+        fd = open(temporary, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC|O_NOCTTY, 0666);
+        if (fd < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        r = loop_write(fd, &h, sizeof(h));
+        if (r < 0)
+                goto finish;
+
+        r = loop_write(fd, entries, n_entries * sizeof(CaStorePackEntry));
+        if (r < 0)
+                goto finish;
+
+        if (rename(temporary, path) < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        temporary = mfree(temporary);
+
+        r = ca_store_pack_write_manifest(p);
+
+finish:
+        safe_close(fd);
+
+        if (temporary) {
+                (void) unlink(temporary);
+                free(temporary);
+        }
+
+        free(path);
+        return r;
+}
+
+/* Writes the index file of a pack, covering everything we know of it */
+static int ca_store_pack_seal(CaStorePack *p, size_t idx) {
+        CaStorePackEntry *entries;
+        CaStorePackFile *f;
+        size_t n = 0, i;
+        int r;
+
+        assert(p);
+        assert(idx < p->n_files);
+
+        f = p->files + idx;
+
+        entries = new(CaStorePackEntry, f->n_entries + p->tail.n_used);
+        if (!entries)
+                return -ENOMEM;
+
+        if (f->n_entries > 0) {
+                memcpy(entries, f->entries, f->n_entries * sizeof(CaStorePackEntry));
+                n = f->n_entries;
+        }
+
+        for (i = 0; i < p->tail.n_slots; i++) {
+                const CaStorePackSlot *s = p->tail.slots + i;
+
+                if (ca_chunk_id_is_null(&s->id) || s->file != idx)
+                        continue;
+
+                entries[n++] = (CaStorePackEntry) {
+                        .id = s->id,
+                        .offset = htole64(s->offset),
+                        .size = htole64(s->size),
+                };
+        }
+
+        r = ca_store_pack_write_index(p, f->number, entries, n, f->size);
+        free(entries);
+
+        return r;
+}
+
+/* Seals the pack we append to, if it has records not covered by its index file yet. It isn't necessarily the last
+ * one, as compacting puts the merged packs after it. Needs the lock. Returns > 0 if it sealed the pack. */
+static int ca_store_pack_seal_active(CaStorePack *p) {
+        uint64_t active;
+        size_t i;
+        int r;
+
+        assert(p);
+
+        active = state_read(&p->state->active);
+        if (active == 0)
+                return 0;
+
+        for (i = p->n_files; i > 0; i--) {
+                CaStorePackFile *f = p->files + i - 1;
+
+                if (f->number != active)
+                        continue;
+
+                if (f->size <= f->indexed_size)
+                        return 0;
+
+                r = ca_store_pack_seal(p, i - 1);
+                if (r < 0)
+                        return r;
+
+                return 1;
+        }
+
+        return 0;
+}
+
+static int ca_store_pack_create_file(CaStorePack *p, uint64_t *number, int *ret_fd) {
+        int fd;
+
+        assert(p);
+        assert(number);
+        assert(ret_fd);
+
+        /* A writer that died in the middle of things might have left one behind, hence look for a free number */
+        for (;;) {
+                char *path;
+
+                path = ca_store_pack_path(p, *number, ".pack");
+                if (!path)
+                        return -ENOMEM;
+
+                fd = open(path, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC|O_NOCTTY, 0666);
+                free(path);
+                if (fd >= 0)
+                        break;
+                if (errno != EEXIST)
+                        return -errno;
+
+                (*number)++;
+        }
+
+        *ret_fd = fd;
+        return 0;
+}
+
+/* Seals the pack we append to, and starts a new one. Needs the lock. */
+static int ca_store_pack_start(CaStorePack *p) {
+        uint64_t number;
+        int fd, r;
+
+        assert(p);
+
+        r = ca_store_pack_seal_active(p);
+        if (r < 0)
+                return r;
+
+        number = p->n_files > 0 ? p->files[p->n_files - 1].number + 1 : 1;
+
+        r = ca_store_pack_create_file(p, &number, &fd);
+        if (r < 0)
+                return r;
+        safe_close(fd);
+
+        state_write(&p->state->active, number);
+        state_write(&p->state->active_size, 0);
+        state_write(&p->state->generation, state_read(&p->state->generation) + 1);
+
+        p->dirty = false;
+
+        return ca_store_pack_reload(p);
+}
+
+int ca_store_pack_open(const char *root, bool create, CaStorePack **ret) {
+        CaStorePack *p;
+        struct stat st;
+        char *path;
+        void *m;
+        int r;
+
+        if (!root)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        p = new0(CaStorePack, 1);
+        if (!p)
+                return -ENOMEM;
+
+        assert_se(pthread_mutex_init(&p->mutex, NULL) == 0);
+        p->state_fd = -1;
+        p->size_max = CA_STORE_PACK_SIZE_MAX_DEFAULT;
+
+        p->root = endswith(root, "/") ? strdup(root) : strjoin(root, "/", NULL);
+        if (!p->root) {
+                r = -ENOMEM;
+                goto fail;
+        }
+
+        if (create && mkdir(root, 0777) < 0 && errno != EEXIST) {
+                r = -errno;
+                goto fail;
+        }
+
+        path = strjoina(p->root, CA_STORE_PACK_STATE_FILENAME);
+
+        p->state_fd = open(path, O_RDWR|O_CLOEXEC|O_NOCTTY|(create ? O_CREAT : 0), 0666);
+        if (p->state_fd < 0 && !create && IN_SET(errno, EACCES, EPERM, EROFS))
+                p->state_fd = open(path, O_RDONLY|O_CLOEXEC|O_NOCTTY);
+        else
+                p->writable = true;
+        if (p->state_fd < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        if (fstat(p->state_fd, &st) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        if ((uint64_t) st.st_size < sizeof(CaStorePackState)) {
+                CaStorePackState s = {
+                        .magic = htole64(CA_STORE_PACK_STATE_MAGIC),
+                };
+
+                /* A new store, or one that is just being created by somebody else */
+                if (!p->writable) {
+                        r = -EBADMSG;
+                        goto fail;
+                }
+
+                if (flock(p->state_fd, LOCK_EX) < 0) {
+                        r = -errno;
+                        goto fail;
+                }
+
+                r = fstat(p->state_fd, &st) < 0 ? -errno : 0;
+                if (r >= 0 && (uint64_t) st.st_size < sizeof(CaStorePackState))
+                        r = pwrite_full(p->state_fd, &s, sizeof(s), 0);
+
+                (void) flock(p->state_fd, LOCK_UN);
+
+                if (r < 0)
+                        goto fail;
+        }
+
+        m = mmap(NULL, sizeof(CaStorePackState), p->writable ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, p->state_fd, 0);
+        if (m == MAP_FAILED) {
+                r = -errno;
+                goto fail;
+        }
+        p->state = m;
+
+        if (le64toh(p->state->magic) != CA_STORE_PACK_STATE_MAGIC) {
+                r = -EBADMSG;
+                goto fail;
+        }
+
+        r = ca_store_pack_reload(p);
+        if (r < 0)
+                goto fail;
+
+        *ret = p;
+        return 0;
+
+fail:
+        ca_store_pack_free(p);
+        return r;
+}
+
+CaStorePack* ca_store_pack_free(CaStorePack *p) {
+        if (!p)
+                return NULL;
+
+        if (p->dirty)
+                (void) ca_store_pack_flush(p);
+
+        ca_store_pack_reset(p);
+        free(p->files);
+        realloc_buffer_free(&p->buffer);
+
+        if (p->state)
+                (void) munmap(p->state, sizeof(CaStorePackState));
+        safe_close(p->state_fd);
+
+        free(p->root);
+
+        assert_se(pthread_mutex_destroy(&p->mutex) == 0);
+
+        return mfree(p);
+}
+
+int ca_store_pack_set_size_max(CaStorePack *p, uint64_t size) {
+        if (!p)
+                return -EINVAL;
+        if (size < sizeof(CaStorePackRecord))
+                return -EINVAL;
+
+        p->size_max = size;
+        return 0;
+}
+
+int ca_store_pack_has(CaStorePack *p, const CaChunkID *id) {
+        int r;
+
+        if (!p)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        r = ca_store_pack_find(p, id, NULL, NULL, NULL);
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        return r;
+}
+
+int ca_store_pack_get(CaStorePack *p, const CaChunkID *id, ReallocBuffer *buffer, CaChunkCompression *ret_compression) {
+        const CaStorePackRecord *h;
+        uint64_t offset, size;
+        size_t idx;
+        void *q;
+        int fd, r;
+
+        if (!p)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+        if (!buffer)
+                return -EINVAL;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        r = ca_store_pack_find(p, id, &idx, &offset, &size);
+        if (r < 0)
+                goto finish;
+        if (r == 0) {
+                r = -ENOENT;
+                goto finish;
+        }
+
+        if (size > CA_CHUNK_SIZE_LIMIT_MAX) {
+                r = -EBADMSG;
+                goto finish;
+        }
+
+        fd = ca_store_pack_file_fd(p, p->files + idx);
+        if (fd < 0) {
+                r = fd;
+                goto finish;
+        }
+
+        realloc_buffer_empty(buffer);
+
+        q = realloc_buffer_acquire(buffer, sizeof(CaStorePackRecord) + size);
+        if (!q) {
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        /* Read the record header along with the data, to verify we got what we wanted */
+        r = pread_full(fd, q, sizeof(CaStorePackRecord) + size, offset);
+        if (r < 0)
+                goto finish;
+
+        h = q;
+        if (le64toh(h->magic) != CA_STORE_PACK_RECORD_MAGIC ||
+            le64toh(h->size) != size ||
+            !ca_chunk_id_equal(&h->id, id)) {
+                r = -EBADMSG;
+                goto finish;
+        }
+
+        if (ret_compression)
+                *ret_compression = (le64toh(h->flags) & CA_STORE_PACK_RECORD_COMPRESSED) ? CA_CHUNK_COMPRESSED : CA_CHUNK_UNCOMPRESSED;
+
+        r = realloc_buffer_advance(buffer, sizeof(CaStorePackRecord));
+
+finish:
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+        return r;
+}
+
+int ca_store_pack_put(CaStorePack *p, const CaChunkID *id, CaChunkCompression compression, const void *data, size_t size) {
+        CaStorePackRecord h;
+        CaStorePackSlot slot;
+        CaStorePackFile *f;
+        uint64_t active, end;
+        int fd, r;
+
+        if (!p)
+                return -EINVAL;
+        if (!id || ca_chunk_id_is_null(id))
+                return -EINVAL;
+        if (!IN_SET(compression, CA_CHUNK_UNCOMPRESSED, CA_CHUNK_COMPRESSED))
+                return -EINVAL;
+        if (!data && size > 0)
+                return -EINVAL;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        r = ca_store_pack_lock(p);
+        if (r < 0)
+                goto finish;
+
+        r = ca_store_pack_find(p, id, NULL, NULL, NULL);
+        if (r < 0)
+                goto unlock;
+        if (r > 0) {
+                r = -EEXIST;
+                goto unlock;
+        }
+
+        active = state_read(&p->state->active);
+        end = state_read(&p->state->active_size);
+
+        if (active == 0 || p->n_files == 0 || p->files[p->n_files - 1].number != active ||
+            (end > 0 && end + sizeof(h) + size > p->size_max)) {
+                r = ca_store_pack_start(p);
+                if (r < 0)
+                        goto unlock;
+
+                end = 0;
+        }
+
+        f = p->files + p->n_files - 1;
+
+        fd = ca_store_pack_file_fd(p, f);
+        if (fd < 0) {
+                r = fd;
+                goto unlock;
+        }
+
+        h = (CaStorePackRecord) {
+                .magic = htole64(CA_STORE_PACK_RECORD_MAGIC),
+                .flags = htole64(compression == CA_CHUNK_COMPRESSED ? CA_STORE_PACK_RECORD_COMPRESSED : 0),
+                .size = htole64(size),
+                .id = *id,
+        };
+
+        /* The record only becomes visible to others once we update the size in the state, hence it doesn't matter
+         * that we write it in two steps */
+        r = pwrite_full(fd, &h, sizeof(h), end);
+        if (r < 0)
+                goto unlock;
+
+        r = pwrite_full(fd, data, size, end + sizeof(h));
+        if (r < 0)
+                goto unlock;
+
+        slot = (CaStorePackSlot) {
+                .id = *id,
+                .file = p->n_files - 1,
+                .offset = end,
+                .size = size,
+        };
+
+        r = table_add(&p->tail, &slot);
+        if (r < 0)
+                goto unlock;
+
+        f->size = end + sizeof(h) + size;
+        state_write(&p->state->active_size, f->size);
+        p->dirty = true;
+
+        r = 0;
+
+unlock:
+        ca_store_pack_unlock(p);
+
+finish:
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+        return r;
+}
+
+int ca_store_pack_flush(CaStorePack *p) {
+        int r;
+
+        if (!p)
+                return -EINVAL;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        if (!p->dirty) {
+                r = 0;
+                goto finish;
+        }
+
+        r = ca_store_pack_lock(p);
+        if (r < 0)
+                goto finish;
+
+        r = ca_store_pack_seal_active(p);
+        if (r < 0)
+                goto unlock;
+
+        /* Tell the others to switch over to the index */
+        if (r > 0)
+                state_write(&p->state->generation, state_read(&p->state->generation) + 1);
+
+        p->dirty = false;
+        r = 0;
+
+unlock:
+        ca_store_pack_unlock(p);
+
+finish:
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+        return r;
+}
+
+static bool ca_store_pack_file_has(CaStorePack *p, size_t idx, const CaChunkID *id) {
+        const CaStorePackSlot *slot;
+
+        assert(p);
+        assert(idx < p->n_files);
+        assert(id);
+
+        if (file_find(p->files + idx, id))
+                return true;
+
+        slot = table_find(&p->tail, id);
+        return slot && slot->file == idx;
+}
+
+typedef struct CaStorePackOutput {
+        uint64_t number;
+        int fd;
+        uint64_t size;
+        CaStorePackEntry *entries;
+        size_t n_entries, n_allocated_entries;
+} CaStorePackOutput;
+
+static int ca_store_pack_output_finish(CaStorePack *p, CaStorePackOutput *o) {
+        int r = 0;
+
+        assert(p);
+        assert(o);
+
+        if (o->fd >= 0) {
+                r = ca_store_pack_write_index(p, o->number, o->entries, o->n_entries, o->size);
+                o->fd = safe_close(o->fd);
+        }
+
+        o->n_entries = 0;
+        return r;
+}
+
+int ca_store_pack_compact(CaStorePack *p) {
+        CaStorePackOutput o = { .fd = -1 };
+        CaStorePackTable written = {};
+        bool *merge = NULL, merge_active = false;
+        uint64_t active;
+        size_t n_merge = 0, n_new = 0, i;
+        int r;
+
+        if (!p)
+                return -EINVAL;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        r = ca_store_pack_lock(p);
+        if (r < 0)
+                goto finish;
+
+        if (p->n_files < 2) {
+                r = 0;
+                goto unlock;
+        }
+
+        merge = new0(bool, p->n_files);
+        if (!merge) {
+                r = -ENOMEM;
+                goto unlock;
+        }
+
+        active = state_read(&p->state->active);
+
+        for (i = 0; i < p->n_files; i++) {
+                if (p->files[i].size >= p->size_max / 2)
+                        continue;
+
+                merge[i] = true;
+                n_merge++;
+
+                if (p->files[i].number == active)
+                        merge_active = true;
+        }
+
+        if (n_merge < 2) {
+                r = 0;
+                goto unlock;
+        }
+
+        /* If we keep the pack we append to, make sure it has an index file covering all of it. Otherwise, once the
+         * next put starts a new pack after the merged ones, it would be left without, and never be listed in the
+         * manifest. */
+        if (!merge_active) {
+                r = ca_store_pack_seal_active(p);
+                if (r < 0)
+                        goto unlock;
+
+                p->dirty = false;
+        }
+
+        o.number = p->files[p->n_files - 1].number + 1;
+
+        /* Copy all records over into new packs, and seal them */
+        for (i = 0; i < p->n_files; i++) {
+                CaStorePackFile *f = p->files + i;
+                uint64_t offset = 0;
+                int fd;
+
+                if (!merge[i])
+                        continue;
+
+                fd = ca_store_pack_file_fd(p, f);
+                if (fd < 0) {
+                        r = fd;
+                        goto unlock;
+                }
+
+                while (offset + sizeof(CaStorePackRecord) <= f->size) {
+                        CaStorePackRecord h;
+                        CaStorePackSlot slot;
+                        uint64_t size;
+                        size_t j;
+                        bool skip = false;
+
+                        r = pread_full(fd, &h, sizeof(h), offset);
+                        if (r == -EBADMSG)
+                                break;
+                        if (r < 0)
+                                goto unlock;
+
+                        size = le64toh(h.size);
+                        if (le64toh(h.magic) != CA_STORE_PACK_RECORD_MAGIC ||
+                            size > f->size - offset - sizeof(h) ||
+                            ca_chunk_id_is_null(&h.id))
+                                break;
+
+                        /* Drop duplicates, we might have them if somebody put a chunk in concurrently */
+                        if (table_find(&written, &h.id))
+                                skip = true;
+                        for (j = 0; j < p->n_files && !skip; j++)
+                                if (!merge[j] && ca_store_pack_file_has(p, j, &h.id))
+                                        skip = true;
+
+                        if (!skip) {
+                                if (o.fd >= 0 && o.size > 0 && o.size + sizeof(h) + size > p->size_max) {
+                                        r = ca_store_pack_output_finish(p, &o);
+                                        if (r < 0)
+                                                goto unlock;
+
+                                        o.number++;
+                                }
+
+                                if (o.fd < 0) {
+                                        r = ca_store_pack_create_file(p, &o.number, &o.fd);
+                                        if (r < 0)
+                                                goto unlock;
+
+                                        o.size = 0;
+                                        n_new++;
+                                }
+
+                                if (!realloc_buffer_acquire(&p->buffer, sizeof(h) + size)) {
+                                        r = -ENOMEM;
+                                        goto unlock;
+                                }
+
+                                r = pread_full(fd, realloc_buffer_data(&p->buffer), sizeof(h) + size, offset);
+                                if (r < 0)
+                                        goto unlock;
+
+                                r = pwrite_full(o.fd, realloc_buffer_data(&p->buffer), sizeof(h) + size, o.size);
+                                if (r < 0)
+                                        goto unlock;
+
+                                if (!GREEDY_REALLOC(o.entries, o.n_allocated_entries, o.n_entries + 1)) {
+                                        r = -ENOMEM;
+                                        goto unlock;
+                                }
+
+                                o.entries[o.n_entries++] = (CaStorePackEntry) {
+                                        .id = h.id,
+                                        .offset = htole64(o.size),
+                                        .size = htole64(size),
+                                };
+
+                                slot = (CaStorePackSlot) {
+                                        .id = h.id,
+                                };
+
+                                r = table_add(&written, &slot);
+                                if (r < 0)
+                                        goto unlock;
+
+                                o.size += sizeof(h) + size;
+                        }
+
+                        offset += sizeof(h) + size;
+                }
+        }
+
+        /* If we merged the pack we appended to, continue with the last new one. It's sealed, but that's fine, we
+         * just write its index again. */
+        if (merge_active) {
+                state_write(&p->state->active, n_new > 0 ? o.number : 0);
+                state_write(&p->state->active_size, n_new > 0 ? o.size : 0);
+        }
+
+        r = ca_store_pack_output_finish(p, &o);
+        if (r < 0)
+                goto unlock;
+
+        /* From here on readers will pick up the new packs. Those which still have the old ones open can continue to
+         * read from them until they notice. */
+        state_write(&p->state->generation, state_read(&p->state->generation) + 1);
+
+        for (i = 0; i < p->n_files; i++) {
+                char *path;
+
+                if (!merge[i])
+                        continue;
+
+                path = ca_store_pack_path(p, p->files[i].number, ".index");
+                if (path)
+                        (void) unlink(path);
+                free(path);
+
+                path = ca_store_pack_path(p, p->files[i].number, ".pack");
+                if (path)
+                        (void) unlink(path);
+                free(path);
+        }
+
+        if (merge_active)
+                p->dirty = false;
+
+        r = ca_store_pack_write_manifest(p);
+        if (r < 0)
+                goto unlock;
+
+        r = ca_store_pack_reload(p);
+        if (r >= 0)
+                r = (int) (n_merge - n_new);
+
+unlock:
+        if (r < 0 && o.fd >= 0) {
+                char *path;
+
+                /* Remove the pack we were writing, the earlier ones are complete and only duplicate chunks */
+                path = ca_store_pack_path(p, o.number, ".pack");
+                if (path)
+                        (void) unlink(path);
+                free(path);
+        }
+
+        safe_close(o.fd);
+        free(o.entries);
+        table_clear(&written);
+        free(merge);
+
+        ca_store_pack_unlock(p);
+
+finish:
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        return r;
+}
+
+uint64_t ca_store_pack_n_packs(CaStorePack *p) {
+        uint64_t n;
+
+        if (!p)
+                return 0;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        (void) ca_store_pack_refresh(p);
+        n = p->n_files;
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        return n;
+}
+
+int ca_store_pack_parse_manifest(const void *p, size_t size, uint64_t **ret, size_t *ret_n) {
+        const char *q = p, *e;
+        uint64_t *numbers = NULL;
+        size_t n = 0, n_allocated = 0;
+
+        if (!p && size > 0)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+        if (!ret_n)
+                return -EINVAL;
+
+        for (e = q + size; q < e;) {
+                const char *nl;
+                uint64_t number = 0;
+                size_t i;
+
+                nl = memchr(q, '\n', e - q);
+                if (!nl || nl - q != 16) {
+                        free(numbers);
+                        return -EBADMSG;
+                }
+
+                for (i = 0; i < 16; i++) {
+                        int k;
+
+                        k = unhexchar(q[i]);
+                        if (k < 0) {
+                                free(numbers);
+                                return -EBADMSG;
+                        }
+
+                        number = (number << 4) | (uint64_t) k;
+                }
+
+                if (!GREEDY_REALLOC(numbers, n_allocated, n + 1)) {
+                        free(numbers);
+                        return -ENOMEM;
+                }
+
+                numbers[n++] = number;
+                q = nl + 1;
+        }
+
+        *ret = numbers;
+        *ret_n = n;
+        return 0;
+}
+
+int ca_store_pack_index_validate(const void *p, size_t size) {
+        const CaStorePackIndexHeader *h = p;
+        uint64_t n;
+
+        if (!p)
+                return -EINVAL;
+
+        if (size < sizeof(CaStorePackIndexHeader))
+                return -EBADMSG;
+
+        n = le64toh(h->n_entries);
+        if (le64toh(h->magic) != CA_STORE_PACK_INDEX_MAGIC ||
+            n > (size - sizeof(CaStorePackIndexHeader)) / sizeof(CaStorePackEntry) ||
+            size != sizeof(CaStorePackIndexHeader) + n * sizeof(CaStorePackEntry))
+                return -EBADMSG;
+
+        return 0;
+}
+
+int ca_store_pack_index_find(const void *p, size_t size, const CaChunkID *id, uint64_t *ret_offset, uint64_t *ret_size) {
+        const CaStorePackIndexHeader *h = p;
+        const CaStorePackEntry *e;
+        CaStorePackFile f;
+
+        if (!p)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+        if (!ret_offset)
+                return -EINVAL;
+        if (!ret_size)
+                return -EINVAL;
+
+        /* The index is assumed to have been validated with ca_store_pack_index_validate() already */
+        f = (CaStorePackFile) {
+                .entries = (const CaStorePackEntry*) ((const uint8_t*) p + sizeof(CaStorePackIndexHeader)),
+                .n_entries = le64toh(h->n_entries),
+        };
+
+        e = file_find(&f, id);
+        if (!e)
+                return -ENOENT;
+
+        *ret_offset = le64toh(e->offset);
+        *ret_size = sizeof(CaStorePackRecord) + le64toh(e->size);
+        return 0;
+}
+
+int ca_store_pack_parse_record(
+                const void *p,
+                size_t size,
+                const CaChunkID *id,
+                const void **ret_data,
+                size_t *ret_size,
+                CaChunkCompression *ret_compression) {
+
+        const CaStorePackRecord *h = p;
+
+        if (!p)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+        if (!ret_data)
+                return -EINVAL;
+        if (!ret_size)
+                return -EINVAL;
+
+        if (size < sizeof(CaStorePackRecord))
+                return -EBADMSG;
+
+        if (le64toh(h->magic) != CA_STORE_PACK_RECORD_MAGIC ||
+            le64toh(h->size) != size - sizeof(CaStorePackRecord) ||
+            !ca_chunk_id_equal(&h->id, id))
+                return -EBADMSG;
+
+        *ret_data = (const uint8_t*) p + sizeof(CaStorePackRecord);
+        *ret_size = size - sizeof(CaStorePackRecord);
+
+        if (ret_compression)
+                *ret_compression = (le64toh(h->flags) & CA_STORE_PACK_RECORD_COMPRESSED) ? CA_CHUNK_COMPRESSED : CA_CHUNK_UNCOMPRESSED;
+
+        return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef foocastorepackhfoo
+#define foocastorepackhfoo
+
+#include <stdbool.h>
+
+#include "cachunk.h"
+#include "cachunkid.h"
+#include "realloc-buffer.h"
+
+/* A chunk store that appends chunks to a few large pack files, rather than keeping one file per chunk. Each pack is
+ * accompanied by an index file, a table of the chunk IDs in it and their offsets, sorted by ID so that it can be
+ * binary searched right where it's mmap()ed. Records appended after the index was last written are found by reading
+ * the pack's tail.
+ *
+ * Any number of processes may read concurrently, writers take turns via a lock on the state file. The state file
+ * also marks the directory as a pack store, and is mmap()ed by everybody, so that readers notice new chunks without
+ * any system calls. */
+
+#define CA_STORE_PACK_STATE_FILENAME "casync.pack"
+
+/* Lists the packs that have an index file, one per line, for readers that can't list the directory, for example via
+ * HTTP. Updated by writers whenever an index file is written or removed. Pack N is stored in N.pack, its index in
+ * N.index, both with N in 16 hex digits. */
+#define CA_STORE_PACK_MANIFEST_FILENAME "casync.packs"
+
+/* Store locators with this prefix refer to pack stores, for example "pack:///var/lib/backup.castr" */
+#define CA_STORE_PACK_URL_PREFIX "pack://"
+
+#define CA_STORE_PACK_SIZE_MAX_DEFAULT (UINT64_C(1024)*UINT64_C(1024)*UINT64_C(1024))
+
+typedef struct CaStorePack CaStorePack;
+
+/* Opens the pack store in directory 'root'. If the directory isn't one yet, turns it into one if 'create' is true,
+ * and fails with -ENOENT otherwise. */
+int ca_store_pack_open(const char *root, bool create, CaStorePack **ret);
+CaStorePack* ca_store_pack_free(CaStorePack *p);
+
+/* Once a pack reaches this size, a new one is started */
+int ca_store_pack_set_size_max(CaStorePack *p, uint64_t size);
+
+int ca_store_pack_has(CaStorePack *p, const CaChunkID *id);
+int ca_store_pack_get(CaStorePack *p, const CaChunkID *id, ReallocBuffer *buffer, CaChunkCompression *ret_compression);
+int ca_store_pack_put(CaStorePack *p, const CaChunkID *id, CaChunkCompression compression, const void *data, size_t size);
+
+/* Writes the index of the pack we are appending to, so that readers don't need to read its tail. Called implicitly
+ * when freeing the object. */
+int ca_store_pack_flush(CaStorePack *p);
+
+/* Merges all packs smaller than half the maximum size into as few packs as possible, dropping duplicate chunks and
+ * torn records on the way. Returns the number of packs removed. */
+int ca_store_pack_compact(CaStorePack *p);
+
+uint64_t ca_store_pack_n_packs(CaStorePack *p);
+
+/* For readers accessing a pack store via some other means than the file system. They retrieve the manifest, the
+ * index files of the packs listed in it, and then the records of the chunks they are interested in. */
+int ca_store_pack_parse_manifest(const void *p, size_t size, uint64_t **ret, size_t *ret_n);
+int ca_store_pack_index_validate(const void *p, size_t size);
+
+/* Returns offset and size of the record of the chunk in the pack, header included */
+int ca_store_pack_index_find(const void *p, size_t size, const CaChunkID *id, uint64_t *ret_offset, uint64_t *ret_size);
+
+/* Verifies the record is the one of the chunk, and returns its data */
+int ca_store_pack_parse_record(const void *p, size_t size, const CaChunkID *id, const void **ret_data, size_t *ret_size, CaChunkCompression *ret_compression);
+
+#endif
@@ -0,0 +1,310 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "castorewriter.h"
+#include "realloc-buffer.h"
+#include "util.h"
+
+typedef struct CaStoreWriteJob {
+        ReallocBuffer buffer;
+        CaChunkID id;
+        int result;
+        bool done;
+} CaStoreWriteJob;
+
+struct CaStoreWriter {
+        pthread_mutex_t mutex;
+        pthread_cond_t work_cond; /* signalled when a new job was queued, or we shall shut down */
+        pthread_cond_t done_cond; /* signalled when a job was written */
+
+        pthread_t *threads;
+        unsigned n_threads;
+
+        CaStore *primary, *secondary;
+
+        /* A ring buffer of jobs, like in CaChunkPipeline: 'head' is the oldest job not collected yet, 'dispatch' the
+         * next job not yet picked up by a thread, 'tail' the next free slot. Jobs may finish in any order, but are
+         * collected in order. */
+        CaStoreWriteJob jobs[CA_STORE_WRITER_QUEUE_MAX];
+        uint64_t head, dispatch, tail;
+
+        /* Only accessed by the thread that enqueues and collects */
+        size_t queued_bytes;
+
+        bool shutdown;
+};
+
+static CaStoreWriteJob *ca_store_writer_job(CaStoreWriter *w, uint64_t seq) {
+        assert(w);
+
+        return w->jobs + (seq % CA_STORE_WRITER_QUEUE_MAX);
+}
+
+static int ca_store_writer_write(CaStoreWriter *w, CaStoreWriteJob *j) {
+        bool reused = false;
+        int r;
+
+        assert(w);
+        assert(j);
+
+        if (w->primary) {
+                r = ca_store_put(w->primary, &j->id, CA_CHUNK_UNCOMPRESSED, realloc_buffer_data(&j->buffer), realloc_buffer_size(&j->buffer));
+                if (r == -EEXIST)
+                        reused = true;
+                else if (r < 0)
+                        return r;
+        }
+
+        if (w->secondary) {
+                r = ca_store_put(w->secondary, &j->id, CA_CHUNK_UNCOMPRESSED, realloc_buffer_data(&j->buffer), realloc_buffer_size(&j->buffer));
+                if (r < 0 && r != -EEXIST)
+                        return r;
+        }
+
+        return reused;
+}
+
+static void* ca_store_writer_thread(void *userdata) {
+        CaStoreWriter *w = userdata;
+
+        assert(w);
+
+        assert_se(pthread_mutex_lock(&w->mutex) == 0);
+
+        for (;;) {
+                CaStoreWriteJob *j;
+                int r;
+
+                while (!w->shutdown && w->dispatch >= w->tail)
+                        assert_se(pthread_cond_wait(&w->work_cond, &w->mutex) == 0);
+
+                /* Finish what's queued before shutting down, the chunks are referenced by the index already */
+                if (w->dispatch >= w->tail)
+                        break;
+
+                j = ca_store_writer_job(w, w->dispatch++);
+
+                assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+                r = ca_store_writer_write(w, j);
+                assert_se(pthread_mutex_lock(&w->mutex) == 0);
+
+                j->result = r;
+                j->done = true;
+
+                assert_se(pthread_cond_broadcast(&w->done_cond) == 0);
+        }
+
+        assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+
+        return NULL;
+}
+
+int ca_store_writer_new(unsigned n_threads, CaStore *primary, CaStore *secondary, CaStoreWriter **ret) {
+        CaStoreWriter *w;
+        sigset_t ss, saved_ss;
+        int r;
+
+        if (n_threads < 1)
+                return -EINVAL;
+        if (!primary && !secondary)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        w = new0(CaStoreWriter, 1);
+        if (!w)
+                return -ENOMEM;
+
+        w->primary = primary;
+        w->secondary = secondary;
+
+        w->threads = new0(pthread_t, n_threads);
+        if (!w->threads) {
+                free(w);
+                return -ENOMEM;
+        }
+
+        assert_se(pthread_mutex_init(&w->mutex, NULL) == 0);
+        assert_se(pthread_cond_init(&w->work_cond, NULL) == 0);
+        assert_se(pthread_cond_init(&w->done_cond, NULL) == 0);
+
+        /* Make sure signals are only delivered to the main thread */
+        assert_se(sigfillset(&ss) >= 0);
+        assert_se(pthread_sigmask(SIG_BLOCK, &ss, &saved_ss) == 0);
+
+        for (; w->n_threads < n_threads; w->n_threads++) {
+                r = pthread_create(w->threads + w->n_threads, NULL, ca_store_writer_thread, w);
+                if (r != 0) {
+                        assert_se(pthread_sigmask(SIG_SETMASK, &saved_ss, NULL) == 0);
+                        ca_store_writer_free(w);
+                        return -r;
+                }
+        }
+
+        assert_se(pthread_sigmask(SIG_SETMASK, &saved_ss, NULL) == 0);
+
+        *ret = w;
+        return 0;
+}
+
+CaStoreWriter* ca_store_writer_free(CaStoreWriter *w) {
+        unsigned i;
+        size_t k;
+
+        if (!w)
+                return NULL;
+
+        assert_se(pthread_mutex_lock(&w->mutex) == 0);
+        w->shutdown = true;
+        assert_se(pthread_cond_broadcast(&w->work_cond) == 0);
+        assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+
+        for (i = 0; i < w->n_threads; i++)
+                assert_se(pthread_join(w->threads[i], NULL) == 0);
+
+        assert_se(pthread_cond_destroy(&w->done_cond) == 0);
+        assert_se(pthread_cond_destroy(&w->work_cond) == 0);
+        assert_se(pthread_mutex_destroy(&w->mutex) == 0);
+
+        for (k = 0; k < CA_STORE_WRITER_QUEUE_MAX; k++)
+                realloc_buffer_free(&w->jobs[k].buffer);
+
+        free(w->threads);
+
+        return mfree(w);
+}
+
+bool ca_store_writer_is_full(CaStoreWriter *w) {
+        assert(w);
+
+        return w->tail - w->head >= CA_STORE_WRITER_QUEUE_MAX ||
+                w->queued_bytes >= CA_STORE_WRITER_BYTES_MAX;
+}
+
+size_t ca_store_writer_queued(CaStoreWriter *w) {
+        assert(w);
+
+        return (size_t) (w->tail - w->head);
+}
+
+int ca_store_writer_put(CaStoreWriter *w, const CaChunkID *id, const void *data, size_t size) {
+        CaStoreWriteJob *j;
+        uint64_t seq;
+
+        if (!w)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+        if (!data)
+                return -EINVAL;
+        if (size == 0)
+                return -EINVAL;
+
+        if (ca_store_writer_is_full(w))
+                return -EAGAIN;
+
+        /* Runs of the same chunk are common, don't write it more than once at a time. The IDs of queued jobs are
+         * never changed by the threads, hence no need to lock for this. */
+        for (seq = w->head; seq < w->tail; seq++)
+                if (ca_chunk_id_equal(&ca_store_writer_job(w, seq)->id, id))
+                        return 1;
+
+        j = ca_store_writer_job(w, w->tail);
+
+        realloc_buffer_empty(&j->buffer);
+        if (!realloc_buffer_append(&j->buffer, data, size))
+                return -ENOMEM;
+
+        j->id = *id;
+        j->result = 0;
+        j->done = false;
+
+        w->queued_bytes += size;
+
+        assert_se(pthread_mutex_lock(&w->mutex) == 0);
+        w->tail++;
+        assert_se(pthread_cond_signal(&w->work_cond) == 0);
+        assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+
+        return 0;
+}
+
+int ca_store_writer_wait(CaStoreWriter *w, const CaChunkID *id) {
+        CaStoreWriteJob *j = NULL;
+        uint64_t seq;
+        int r;
+
+        if (!w)
+                return -EINVAL;
+        if (!id)
+                return -EINVAL;
+
+        /* Each chunk is queued at most once, see ca_store_writer_put() */
+        for (seq = w->head; seq < w->tail; seq++)
+                if (ca_chunk_id_equal(&ca_store_writer_job(w, seq)->id, id)) {
+                        j = ca_store_writer_job(w, seq);
+                        break;
+                }
+        if (!j)
+                return 0;
+
+        assert_se(pthread_mutex_lock(&w->mutex) == 0);
+
+        while (!j->done)
+                assert_se(pthread_cond_wait(&w->done_cond, &w->mutex) == 0);
+
+        r = j->result;
+
+        assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+
+        return r < 0 ? r : 1;
+}
+
+int ca_store_writer_collect(CaStoreWriter *w, bool wait, uint64_t *ret_reused) {
+        uint64_t n_reused = 0;
+        int r = 0;
+
+        if (!w)
+                return -EINVAL;
+
+        if (w->head >= w->tail)
+                return 0;
+
+        assert_se(pthread_mutex_lock(&w->mutex) == 0);
+
+        while (w->head < w->tail) {
+                CaStoreWriteJob *j;
+
+                j = ca_store_writer_job(w, w->head);
+
+                if (!j->done) {
+                        if (!wait)
+                                break;
+
+                        assert_se(pthread_cond_wait(&w->done_cond, &w->mutex) == 0);
+                        continue;
+                }
+
+                /* Only wait for the oldest one, pick up the others only if they are done already */
+                wait = false;
+
+                if (j->result < 0 && r == 0)
+                        r = j->result;
+                else if (j->result > 0)
+                        n_reused++;
+
+                w->queued_bytes -= realloc_buffer_size(&j->buffer);
+                w->head++;
+        }
+
+        assert_se(pthread_mutex_unlock(&w->mutex) == 0);
+
+        if (ret_reused)
+                *ret_reused += n_reused;
+
+        if (r < 0)
+                return r;
+
+        return 1;
+}
@@ -0,0 +1,44 @@
+#ifndef foocastorewriterhfoo
+#define foocastorewriterhfoo
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "cachunk.h"
+#include "castore.h"
+
+/* Writes chunks to one or two stores on background threads, so that the caller can continue encoding and chunking
+ * while the chunks are compressed and persisted. The number of outstanding writes is limited, and once that is
+ * reached ca_store_writer_put() refuses more until some writes finished. */
+
+typedef struct CaStoreWriter CaStoreWriter;
+
+#define CA_STORE_WRITER_THREADS_DEFAULT 4U
+#define CA_STORE_WRITER_QUEUE_MAX 64U
+#define CA_STORE_WRITER_BYTES_MAX ((size_t) (64U*1024U*1024U))
+
+/* Chunks are written to 'primary' and 'secondary', either of which may be NULL. Only chunks that existed in 'primary'
+ * already are counted as reused. Both stores must stay around until the writer is freed. */
+int ca_store_writer_new(unsigned n_threads, CaStore *primary, CaStore *secondary, CaStoreWriter **ret);
+
+/* Waits for all outstanding writes, discarding their results */
+CaStoreWriter* ca_store_writer_free(CaStoreWriter *w);
+
+/* Enqueues a copy of the specified chunk. Returns -EAGAIN if too many writes are outstanding already, in which case
+ * the caller should collect finished writes first. Returns > 0 if the same chunk is being written already, in which
+ * case it is not enqueued again. */
+int ca_store_writer_put(CaStoreWriter *w, const CaChunkID *id, const void *data, size_t size);
+
+/* Dequeues finished writes, oldest first. If 'wait' is true, waits for the oldest write to finish. Returns the first
+ * error of a failed write, 0 if nothing was outstanding and > 0 otherwise. Adds the number of chunks that already
+ * existed in the primary store to *ret_reused. */
+int ca_store_writer_collect(CaStoreWriter *w, bool wait, uint64_t *ret_reused);
+
+/* Waits until the queued write of the specified chunk, if there is one, is finished, without dequeuing it. Returns 0 if
+ * the chunk is not queued, > 0 if it was written, and the error otherwise. */
+int ca_store_writer_wait(CaStoreWriter *w, const CaChunkID *id);
+
+bool ca_store_writer_is_full(CaStoreWriter *w);
+size_t ca_store_writer_queued(CaStoreWriter *w);
+
+#endif
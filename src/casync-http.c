@@ -3,11 +3,30 @@
 
 #include "caprotocol.h"
 #include "caremote.h"
+#include "castorepack.h"
 #include "realloc-buffer.h"
 #include "util.h"
 
+/* How many chunks to download in parallel by default */
+#define MAX_ACTIVE_CHUNKS_DEFAULT 16U
+
+/* Upper limit for --max-active-chunks= */
+#define MAX_ACTIVE_CHUNKS_MAX 1024U
+
+/* From pack stores we request the records of a number of chunks from the same pack at once, up to this many chunks
+ * and about this many bytes */
+#define PACK_REQUEST_CHUNKS_MAX 128U
+#define PACK_REQUEST_SIZE_MAX (UINT64_C(16)*UINT64_C(1024)*UINT64_C(1024))
+
+/* Records closer to each other than this are requested as a single range, taking the data between them along */
+#define PACK_RANGE_GAP_MAX (UINT64_C(64)*UINT64_C(1024))
+
+/* A server not supporting range requests sends the whole pack, accept that only up to this size */
+#define PACK_RESPONSE_SIZE_MAX ((size_t) (64U*1024U*1024U))
+
 static bool arg_verbose = false;
 static curl_off_t arg_rate_limit_bps = 0;
+static unsigned arg_max_active_chunks = MAX_ACTIVE_CHUNKS_DEFAULT;
 
 static enum {
         ARG_PROTOCOL_HTTP,
@@ -16,6 +35,50 @@ static enum {
         _ARG_PROTOCOL_INVALID = -1,
 } arg_protocol = _ARG_PROTOCOL_INVALID;
 
+typedef struct ChunkTransferItem {
+        CaChunkID id;
+        uint64_t offset; /* Location of the chunk's record in the pack, if there is one */
+        uint64_t size;   /* Size of the record, or 0 if the chunk isn't in any pack */
+} ChunkTransferItem;
+
+/* A contiguous part of a pack we received */
+typedef struct ChunkTransferPiece {
+        uint64_t offset;
+        const uint8_t *data;
+        size_t size;
+} ChunkTransferPiece;
+
+typedef struct ChunkTransfer {
+        CURL *curl;
+        ReallocBuffer buffer;
+        char *url;
+        char *range;       /* The ranges requested from the pack, or NULL when getting a chunk file */
+        uint64_t pack;     /* The pack the chunks are requested from, or 0 when getting a chunk file */
+        uint64_t range_offset; /* Where the response starts in the pack, if it's not multipart */
+        ChunkTransferItem *items;
+        size_t n_items;
+        size_t n_put;      /* How many of the items have been passed on already */
+        ChunkTransferPiece *pieces;
+        size_t n_pieces, n_allocated_pieces;
+        uint64_t sequence; /* Order in which the transfers have been started */
+        bool active:1;     /* Transfer is running */
+        bool done:1;       /* Transfer is complete, chunks need to be passed on */
+} ChunkTransfer;
+
+typedef struct PackIndex {
+        uint64_t number;
+        ReallocBuffer index;
+} PackIndex;
+
+typedef struct ChunkStore {
+        const char *url;
+        CURL *curl;         /* For retrieving the manifest and the indexes */
+        PackIndex *packs;   /* Empty unless this is a pack store */
+        size_t n_packs;
+        CaChunkID held;     /* Request already dequeued, but for a different pack than the previous ones */
+        bool have_held;
+} ChunkStore;
+
 typedef enum ProcessUntil {
         PROCESS_UNTIL_WRITTEN,
         PROCESS_UNTIL_CAN_PUT_CHUNK,
@@ -254,6 +317,67 @@ static char *chunk_url(const char *store_url, const CaChunkID *id) {
         return buffer;
 }
 
+static char *store_file_url(const char *store_url, const char *name) {
+        char *buffer;
+        size_t n;
+
+        /* Same as chunk_url(), but for a file in the top-level directory of the store */
+
+        n = strcspn(store_url, "?;");
+        while (n > 0 && store_url[n-1] == '/')
+                n--;
+
+        buffer = new(char, n + 1 + strlen(name) + 1);
+        if (!buffer)
+                return NULL;
+
+        strcpy(mempcpy(mempcpy(buffer, store_url, n), "/", 1), name);
+
+        return buffer;
+}
+
+static int configure_curl(CURL *curl, unsigned n_parallel) {
+        assert(curl);
+        assert(n_parallel > 0);
+
+        if (curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L) != CURLE_OK) {
+                fprintf(stderr, "Failed to turn on location following.\n");
+                return -EIO;
+        }
+
+        if (curl_easy_setopt(curl, CURLOPT_PROTOCOLS, arg_protocol == ARG_PROTOCOL_FTP ? CURLPROTO_FTP : CURLPROTO_HTTP|CURLPROTO_HTTPS) != CURLE_OK) {
+                fprintf(stderr, "Failed to limit protocols to HTTP/HTTPS/FTP.\n");
+                return -EIO;
+        }
+
+        if (arg_rate_limit_bps > 0) {
+                /* The limit applies to each transfer individually, hence split it up between the parallel ones */
+                curl_off_t limit = MAX(arg_rate_limit_bps / (curl_off_t) n_parallel, (curl_off_t) 1);
+
+                if (curl_easy_setopt(curl, CURLOPT_MAX_SEND_SPEED_LARGE, limit) != CURLE_OK) {
+                        fprintf(stderr, "Failed to set CURL send speed limit.\n");
+                        return -EIO;
+                }
+
+                if (curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, limit) != CURLE_OK) {
+                        fprintf(stderr, "Failed to set CURL receive speed limit.\n");
+                        return -EIO;
+                }
+        }
+
+        if (n_parallel > 1) {
+                /* Multiplex transfers over a single HTTP/2 connection where the server supports it, rather than
+                 * opening a connection for each. Older libcurl or servers fall back to HTTP/1.1, hence ignore
+                 * failures here. */
+                (void) curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+                (void) curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+        }
+
+        /* (void) curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L); */
+
+        return 0;
+}
+
 static int acquire_file(CaRemote *rr,
                         CURL *curl,
                         const char *url,
@@ -324,251 +448,1048 @@ static int acquire_file(CaRemote *rr,
         return 1;
 }
 
-static int run(int argc, char *argv[]) {
-        const char *base_url, *archive_url, *index_url, *wstore_url;
-        size_t n_stores = 0, current_store = 0;
-        char *url_buffer = NULL;
-        CURL *curl = NULL;
-        ReallocBuffer chunk_buffer = {};
-        CaRemote *rr = NULL;
-        long protocol_status;
-        int r;
+static size_t write_buffer(const void *buffer, size_t size, size_t nmemb, void *userdata) {
+        ReallocBuffer *b = userdata;
+        size_t product;
 
-        if (argc < 5) {
-                fprintf(stderr, "Expected at least 5 arguments.\n");
-                return -EINVAL;
-        }
+        product = size * nmemb;
 
-        /* fprintf(stderr, "base=%s archive=%s index=%s wstore=%s\n", argv[1], argv[2], argv[3], argv[4]); */
+        if (!realloc_buffer_append(b, buffer, product)) {
+                log_oom();
+                return 0;
+        }
 
-        base_url = empty_or_dash_to_null(argv[1]);
-        archive_url = empty_or_dash_to_null(argv[2]);
-        index_url = empty_or_dash_to_null(argv[3]);
-        wstore_url = empty_or_dash_to_null(argv[4]);
+        return product;
+}
 
-        n_stores = !!wstore_url + (argc - 5);
+/* Retrieves a small file into memory. Unlike acquire_file() a failure HTTP status isn't fatal, it's up to the caller
+ * to decide what to do about it. */
+static int acquire_buffer(CURL *curl, const char *url, ReallocBuffer *buffer, long *ret_protocol_status) {
+        assert(curl);
+        assert(url);
+        assert(buffer);
+        assert(ret_protocol_status);
 
-        if (base_url) {
-                fprintf(stderr, "Pushing/pulling to base via HTTP not yet supported.\n");
-                return -EOPNOTSUPP;
+        if (curl_easy_setopt(curl, CURLOPT_URL, url) != CURLE_OK) {
+                fprintf(stderr, "Failed to set CURL URL to: %s\n", url);
+                return -EIO;
         }
 
-        if (!archive_url && !index_url && n_stores == 0) {
-                fprintf(stderr, "Nothing to do.\n");
-                return -EINVAL;
+        if (curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_buffer) != CURLE_OK) {
+                fprintf(stderr, "Failed to set CURL callback function.\n");
+                return -EIO;
         }
 
-        rr = ca_remote_new();
-        if (!rr) {
-                r = log_oom();
-                goto finish;
+        if (curl_easy_setopt(curl, CURLOPT_WRITEDATA, buffer) != CURLE_OK) {
+                fprintf(stderr, "Failed to set CURL private data.\n");
+                return -EIO;
         }
 
-        r = ca_remote_set_local_feature_flags(rr,
-                                              (n_stores > 0 ? CA_PROTOCOL_READABLE_STORE : 0) |
-                                              (index_url ? CA_PROTOCOL_READABLE_INDEX : 0) |
-                                              (archive_url ? CA_PROTOCOL_READABLE_ARCHIVE : 0));
-        if (r < 0) {
-                fprintf(stderr, "Failed to set feature flags: %s\n", strerror(-r));
-                goto finish;
-        }
+        if (arg_verbose)
+                fprintf(stderr, "Acquiring %s...\n", url);
 
-        r = ca_remote_set_io_fds(rr, STDIN_FILENO, STDOUT_FILENO);
-        if (r < 0) {
-                fprintf(stderr, "Failed to set I/O file descriptors: %s\n", strerror(-r));
-                goto finish;
+        realloc_buffer_empty(buffer);
+
+        if (curl_easy_perform(curl) != CURLE_OK) {
+                fprintf(stderr, "Failed to acquire %s\n", url);
+                realloc_buffer_free(buffer);
+                return -EIO;
         }
 
-        curl = curl_easy_init();
-        if (!curl) {
-                r = log_oom();
-                goto finish;
+        if (curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, ret_protocol_status) != CURLE_OK) {
+                fprintf(stderr, "Failed to query response code\n");
+                realloc_buffer_free(buffer);
+                return -EIO;
         }
 
-        if (curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L) != CURLE_OK) {
-                fprintf(stderr, "Failed to turn on location following.\n");
-                r = -EIO;
-                goto finish;
+        return 0;
+}
+
+static void chunk_transfer_done(ChunkTransfer *t) {
+        assert(t);
+
+        realloc_buffer_empty(&t->buffer);
+        t->url = mfree(t->url);
+        t->range = mfree(t->range);
+        t->n_items = t->n_put = t->n_pieces = 0;
+        t->pack = 0;
+        t->active = t->done = false;
+}
+
+static size_t write_range(const void *buffer, size_t size, size_t nmemb, void *userdata) {
+        ReallocBuffer *range_buffer = userdata;
+        size_t product;
+
+        product = size * nmemb;
+
+        /* A server that doesn't do range requests sends us the whole pack, don't let that eat up all memory */
+        if (product > PACK_RESPONSE_SIZE_MAX - realloc_buffer_size(range_buffer)) {
+                fprintf(stderr, "Range response too large, server doesn't support range requests?\n");
+                return 0;
         }
 
-        if (curl_easy_setopt(curl, CURLOPT_PROTOCOLS, arg_protocol == ARG_PROTOCOL_FTP ? CURLPROTO_FTP : CURLPROTO_HTTP|CURLPROTO_HTTPS) != CURLE_OK) {
-                fprintf(stderr, "Failed to limit protocols to HTTP/HTTPS/FTP.\n");
-                r = -EIO;
-                goto finish;
+        if (!realloc_buffer_append(range_buffer, buffer, product)) {
+                log_oom();
+                return 0;
         }
 
-        if (arg_rate_limit_bps > 0) {
-                if (curl_easy_setopt(curl, CURLOPT_MAX_SEND_SPEED_LARGE, arg_rate_limit_bps) != CURLE_OK) {
-                        fprintf(stderr, "Failed to set CURL send speed limit.\n");
-                        r = -EIO;
-                        goto finish;
-                }
+        return product;
+}
 
-                if (curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, arg_rate_limit_bps) != CURLE_OK) {
-                        fprintf(stderr, "Failed to set CURL receive speed limit.\n");
-                        r = -EIO;
-                        goto finish;
-                }
-        }
+static int parse_content_range(const void *p, size_t l, uint64_t *ret_start, uint64_t *ret_end) {
+        uint64_t start, end;
+        char s[128];
 
-        /* (void) curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L); */
+        assert(p);
+        assert(ret_start);
+        assert(ret_end);
 
-        if (archive_url) {
-                r = acquire_file(rr, curl, archive_url, write_archive);
-                if (r < 0)
-                        goto finish;
-                if (r == 0)
-                        goto flush;
+        /* Parses a Content-Range header line, for example "Content-Range: bytes 100-199/1000" */
 
-                r = write_archive_eof(rr);
-                if (r < 0)
-                        goto finish;
-        }
+        if (l >= sizeof(s))
+                return -EBADMSG;
 
-        if (index_url) {
-                r = acquire_file(rr, curl, index_url, write_index);
-                if (r < 0)
-                        goto finish;
-                if (r == 0)
-                        goto flush;
+        memcpy(s, p, l);
+        s[l] = 0;
 
-                r = write_index_eof(rr);
-                if (r < 0)
-                        goto finish;
-        }
+        if (strncasecmp(s, "Content-Range:", strlen("Content-Range:")) != 0)
+                return -ENOENT;
 
-        for (;;) {
-                const char *store_url;
-                CaChunkID id;
+        if (sscanf(s + strlen("Content-Range:"), " bytes %" SCNu64 "-%" SCNu64, &start, &end) != 2 || start > end)
+                return -EBADMSG;
 
-                if (n_stores == 0)  /* No stores? Then we did all we could do */
-                        break;
+        *ret_start = start;
+        *ret_end = end;
+        return 0;
+}
 
-                r = process_remote(rr, PROCESS_UNTIL_HAVE_REQUEST);
-                if (r == -EPIPE) {
-                        r = 0;
-                        goto finish;
-                }
-                if (r < 0)
-                        goto finish;
+static size_t write_header(const void *buffer, size_t size, size_t nmemb, void *userdata) {
+        ChunkTransfer *t = userdata;
+        size_t product;
+        uint64_t end;
 
-                r = ca_remote_next_request(rr, &id);
-                if (r == -ENODATA)
-                        continue;
-                if (r < 0) {
-                        fprintf(stderr, "Failed to determine next chunk to get: %s\n", strerror(-r));
-                        goto finish;
-                }
+        product = size * nmemb;
 
-                current_store = current_store % n_stores;
-                if (wstore_url)
-                        store_url = current_store == 0 ? wstore_url : argv[current_store + 5 - 1];
-                else
-                        store_url = argv[current_store + 5];
-                /* current_store++; */
+        /* We only need this for responses that aren't multipart/byteranges, i.e. carry a single range */
+        (void) parse_content_range(buffer, product, &t->range_offset, &end);
 
-                free(url_buffer);
-                url_buffer = chunk_url(store_url, &id);
-                if (!url_buffer) {
-                        r = log_oom();
-                        goto finish;
-                }
+        return product;
+}
 
-                if (curl_easy_setopt(curl, CURLOPT_URL, url_buffer) != CURLE_OK) {
-                        fprintf(stderr, "Failed to set CURL URL to: %s\n", index_url);
-                        r = -EIO;
-                        goto finish;
-                }
+static int chunk_transfer_add_piece(ChunkTransfer *t, uint64_t offset, const uint8_t *data, size_t size) {
+        assert(t);
 
-                if (curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_chunk) != CURLE_OK) {
-                        fprintf(stderr, "Failed to set CURL callback function.\n");
-                        r = -EIO;
-                        goto finish;
-                }
+        if (!GREEDY_REALLOC(t->pieces, t->n_allocated_pieces, t->n_pieces + 1))
+                return -ENOMEM;
 
-                if (curl_easy_setopt(curl, CURLOPT_WRITEDATA, &chunk_buffer) != CURLE_OK) {
-                        fprintf(stderr, "Failed to set CURL private data.\n");
-                        r = -EIO;
-                        goto finish;
-                }
+        t->pieces[t->n_pieces++] = (ChunkTransferPiece) {
+                .offset = offset,
+                .data = data,
+                .size = size,
+        };
 
-                if (arg_rate_limit_bps > 0) {
-                        if (curl_easy_setopt(curl, CURLOPT_MAX_SEND_SPEED_LARGE, arg_rate_limit_bps) != CURLE_OK) {
-                                fprintf(stderr, "Failed to set CURL send speed limit.\n");
-                                r = -EIO;
-                                goto finish;
-                        }
+        return 0;
+}
 
-                        if (curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, arg_rate_limit_bps) != CURLE_OK) {
-                                fprintf(stderr, "Failed to set CURL receive speed limit.\n");
-                                r = -EIO;
-                                goto finish;
-                        }
-                }
+static int chunk_transfer_parse_multipart(ChunkTransfer *t, const char *content_type) {
+        const uint8_t *p, *e;
+        char *delimiter;
+        const char *b;
+        size_t n;
+        int r;
 
-                if (arg_verbose)
-                        fprintf(stderr, "Acquiring %s...\n", url_buffer);
+        assert(t);
+        assert(content_type);
+
+        b = strstr(content_type, "boundary=");
+        if (!b)
+                return -EBADMSG;
+        b += strlen("boundary=");
+
+        if (*b == '"') {
+                b++;
+                n = strcspn(b, "\"");
+        } else
+                n = strcspn(b, "; \t");
+        if (n == 0)
+                return -EBADMSG;
+
+        delimiter = new(char, 2 + n + 1);
+        if (!delimiter)
+                return -ENOMEM;
+        strcpy(mempcpy(mempcpy(delimiter, "--", 2), b, n), "");
+        n += 2;
+
+        p = realloc_buffer_data(&t->buffer);
+        e = p + realloc_buffer_size(&t->buffer);
+
+        /* Each part starts with the delimiter line, followed by its headers, an empty line and the data. The data
+         * length is known from the Content-Range header, hence we don't need to look for the delimiter in the data. */
+        for (;;) {
+                const uint8_t *headers_end, *l;
+                uint64_t start = UINT64_MAX, end = 0;
 
-                if (curl_easy_perform(curl) != CURLE_OK) {
-                        fprintf(stderr, "Failed to acquire %s\n", url_buffer);
-                        r = -EIO;
-                        goto finish;
+                p = memmem(p, e - p, delimiter, n);
+                if (!p) {
+                        r = -EBADMSG;
+                        break;
                 }
+                p += n;
 
-                if (curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &protocol_status) != CURLE_OK) {
-                        fprintf(stderr, "Failed to query response code\n");
-                        r = -EIO;
-                        goto finish;
+                if (e - p >= 2 && p[0] == '-' && p[1] == '-') { /* The closing delimiter */
+                        r = 0;
+                        break;
                 }
 
-                r = process_remote(rr, PROCESS_UNTIL_CAN_PUT_CHUNK);
-                if (r == -EPIPE) {
-                        r = 0;
-                        goto finish;
+                headers_end = memmem(p, e - p, "\r\n\r\n", 4);
+                if (!headers_end) {
+                        r = -EBADMSG;
+                        break;
                 }
-                if (r < 0)
-                        goto finish;
 
-                if ((IN_SET(arg_protocol, ARG_PROTOCOL_HTTP, ARG_PROTOCOL_HTTPS) && protocol_status == 200) ||
-                    (arg_protocol == ARG_PROTOCOL_FTP && (protocol_status >= 200 && protocol_status <= 299))) {
+                for (l = p; l < headers_end;) {
+                        const uint8_t *nl;
 
-                        r = ca_remote_put_chunk(rr, &id, CA_CHUNK_COMPRESSED, realloc_buffer_data(&chunk_buffer), realloc_buffer_size(&chunk_buffer));
-                        if (r < 0) {
-                                fprintf(stderr, "Failed to write chunk: %s\n", strerror(-r));
-                                goto finish;
-                        }
+                        nl = memmem(l, headers_end - l, "\r\n", 2);
+                        if (!nl)
+                                nl = headers_end;
 
-                } else {
-                        if (arg_verbose)
-                                fprintf(stderr, "HTTP/FTP server failure %li while requesting %s.\n", protocol_status, url_buffer);
+                        (void) parse_content_range(l, nl - l, &start, &end);
 
-                        r = ca_remote_put_missing(rr, &id);
-                        if (r < 0) {
-                                fprintf(stderr, "Failed to write missing message: %s\n", strerror(-r));
-                                goto finish;
-                        }
+                        l = nl + 2;
+                }
+                if (start == UINT64_MAX) {
+                        r = -EBADMSG;
+                        break;
                 }
 
-                realloc_buffer_empty(&chunk_buffer);
-
-                r = process_remote(rr, PROCESS_UNTIL_WRITTEN);
-                if (r == -EPIPE) {
-                        r = 0;
-                        goto finish;
+                p = headers_end + 4;
+                if (end - start + 1 > (uint64_t) (e - p)) {
+                        r = -EBADMSG;
+                        break;
                 }
+
+                r = chunk_transfer_add_piece(t, start, p, end - start + 1);
                 if (r < 0)
-                        goto finish;
+                        break;
+
+                p += end - start + 1;
         }
 
-flush:
-        r = process_remote(rr, PROCESS_UNTIL_FINISHED);
+        free(delimiter);
+        return r;
+}
 
-finish:
-        if (curl)
-                curl_easy_cleanup(curl);
+/* Called once a transfer from a pack completed, figures out which parts of the pack we got */
+static int chunk_transfer_parse_ranges(ChunkTransfer *t) {
+        const char *content_type = NULL;
+        long protocol_status;
+
+        assert(t);
+        assert(t->pack != 0);
+
+        if (curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &protocol_status) != CURLE_OK) {
+                fprintf(stderr, "Failed to query response code\n");
+                return -EIO;
+        }
+
+        /* The pack is gone, probably compacted since we read the manifest. Then all chunks are missing. */
+        if (!IN_SET(protocol_status, 200, 206)) {
+                if (arg_verbose)
+                        fprintf(stderr, "HTTP server failure %li while requesting %s.\n", protocol_status, t->url);
+
+                return 0;
+        }
+
+        /* The server ignored the ranges, and sent the whole pack */
+        if (protocol_status == 200)
+                return chunk_transfer_add_piece(t, 0, realloc_buffer_data(&t->buffer), realloc_buffer_size(&t->buffer));
+
+        (void) curl_easy_getinfo(t->curl, CURLINFO_CONTENT_TYPE, &content_type);
+        if (content_type && startswith(content_type, "multipart/byteranges"))
+                return chunk_transfer_parse_multipart(t, content_type);
+
+        /* A single range, possibly the server merged ours */
+        if (t->range_offset == UINT64_MAX)
+                return -EBADMSG;
+
+        return chunk_transfer_add_piece(t, t->range_offset, realloc_buffer_data(&t->buffer), realloc_buffer_size(&t->buffer));
+}
+
+static int item_compare(const void *a, const void *b) {
+        const ChunkTransferItem *x = a, *y = b;
+
+        if (x->offset < y->offset)
+                return -1;
+        if (x->offset > y->offset)
+                return 1;
+
+        return 0;
+}
+
+static int chunk_store_lookup(ChunkStore *store, const CaChunkID *id, uint64_t *ret_pack, uint64_t *ret_offset, uint64_t *ret_size) {
+        size_t i;
+        int r;
+
+        assert(store);
+        assert(id);
+
+        /* Later packs are the result of compaction, hence more likely to stay around */
+        for (i = store->n_packs; i > 0; i--) {
+                PackIndex *p = store->packs + i - 1;
+
+                r = ca_store_pack_index_find(realloc_buffer_data(&p->index), realloc_buffer_size(&p->index), id, ret_offset, ret_size);
+                if (r == -ENOENT)
+                        continue;
+                if (r < 0)
+                        return r;
+
+                *ret_pack = p->number;
+                return 1;
+        }
+
+        return 0;
+}
+
+/* Dequeues the next requests from the remote into the transfer. From a directory of chunk files that's a single
+ * chunk, from a pack store as many as we can get in one request from the same pack. Returns 0 if there was no
+ * request. */
+static int chunk_transfer_fill(CaRemote *rr, ChunkStore *store, ChunkTransfer *t) {
+        uint64_t requested = 0;
+        int r;
+
+        assert(rr);
+        assert(store);
+        assert(t);
+        assert(t->n_items == 0);
+
+        while (t->n_items < (store->n_packs > 0 ? PACK_REQUEST_CHUNKS_MAX : 1)) {
+                ChunkTransferItem item = {};
+                uint64_t pack = 0;
+
+                if (store->have_held) {
+                        item.id = store->held;
+                        store->have_held = false;
+                } else {
+                        r = ca_remote_has_pending_requests(rr);
+                        if (r < 0)
+                                return r;
+                        if (r == 0)
+                                break;
+
+                        r = ca_remote_next_request(rr, &item.id);
+                        if (r == -ENODATA)
+                                break;
+                        if (r < 0)
+                                return r;
+                }
+
+                if (store->n_packs > 0) {
+                        r = chunk_store_lookup(store, &item.id, &pack, &item.offset, &item.size);
+                        if (r < 0)
+                                return r;
+
+                        /* Belongs into a different pack, or doesn't fit anymore? Then leave it to the next transfer. */
+                        if (r > 0 && t->pack != 0 && (pack != t->pack || requested + item.size > PACK_REQUEST_SIZE_MAX)) {
+                                store->held = item.id;
+                                store->have_held = true;
+                                break;
+                        }
+
+                        if (r > 0) {
+                                t->pack = pack;
+                                requested += item.size;
+                        }
+                }
+
+                t->items[t->n_items++] = item;
+        }
+
+        return t->n_items > 0;
+}
 
-        free(url_buffer);
-        realloc_buffer_free(&chunk_buffer);
+static int chunk_transfer_build_range(ChunkTransfer *t) {
+        ReallocBuffer b = {};
+        uint64_t start = 0, end = 0;
+        bool have = false;
+        size_t i;
+
+        assert(t);
+
+        /* Requests the records of the chunks, merging those close to each other into a single range */
+
+        qsort(t->items, t->n_items, sizeof(ChunkTransferItem), item_compare);
+
+        for (i = 0; i <= t->n_items; i++) {
+                ChunkTransferItem *item = i < t->n_items ? t->items + i : NULL;
+
+                if (item && item->size == 0) /* Not in any pack */
+                        continue;
+
+                if (item && have && item->offset <= end + PACK_RANGE_GAP_MAX) {
+                        end = MAX(end, item->offset + item->size);
+                        continue;
+                }
+
+                if (have) {
+                        char s[2 * DECIMAL_STR_MAX(uint64_t) + 3];
+
+                        snprintf(s, sizeof(s), "%s%" PRIu64 "-%" PRIu64, realloc_buffer_size(&b) > 0 ? "," : "", start, end - 1);
+                        if (!realloc_buffer_append(&b, s, strlen(s))) {
+                                realloc_buffer_free(&b);
+                                return -ENOMEM;
+                        }
+                }
+
+                if (item) {
+                        start = item->offset;
+                        end = item->offset + item->size;
+                        have = true;
+                }
+        }
+
+        if (!realloc_buffer_append(&b, "", 1)) {
+                realloc_buffer_free(&b);
+                return -ENOMEM;
+        }
+
+        t->range = realloc_buffer_steal(&b);
+        return t->range ? 0 : -ENOMEM;
+}
+
+static int chunk_transfer_start(CURLM *multi, ChunkStore *store, ChunkTransfer *t, uint64_t sequence) {
+        char name[16 + 5 + 1];
+        int r;
+
+        assert(multi);
+        assert(store);
+        assert(t);
+        assert(t->n_items > 0);
+        assert(!t->active && !t->done);
+
+        t->sequence = sequence;
+
+        if (store->n_packs == 0)
+                t->url = chunk_url(store->url, &t->items[0].id);
+        else if (t->pack == 0) {
+                /* None of the chunks is in any pack, no need to ask anybody */
+                t->done = true;
+                return 0;
+        } else {
+                snprintf(name, sizeof(name), "%016" PRIx64 ".pack", t->pack);
+                t->url = store_file_url(store->url, name);
+        }
+        if (!t->url)
+                return log_oom();
+
+        if (t->pack != 0) {
+                r = chunk_transfer_build_range(t);
+                if (r < 0)
+                        return log_oom();
+        }
+
+        t->range_offset = UINT64_MAX;
+
+        if (curl_easy_setopt(t->curl, CURLOPT_URL, t->url) != CURLE_OK) {
+                fprintf(stderr, "Failed to set CURL URL to: %s\n", t->url);
+                return -EIO;
+        }
+
+        if (curl_easy_setopt(t->curl, CURLOPT_RANGE, t->range) != CURLE_OK) {
+                fprintf(stderr, "Failed to set CURL range.\n");
+                return -EIO;
+        }
+
+        if (curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, t->pack != 0 ? write_range : write_chunk) != CURLE_OK) {
+                fprintf(stderr, "Failed to set CURL callback function.\n");
+                return -EIO;
+        }
+
+        if (curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, &t->buffer) != CURLE_OK) {
+                fprintf(stderr, "Failed to set CURL private data.\n");
+                return -EIO;
+        }
+
+        if (curl_easy_setopt(t->curl, CURLOPT_PRIVATE, t) != CURLE_OK) {
+                fprintf(stderr, "Failed to set CURL private pointer.\n");
+                return -EIO;
+        }
+
+        if (arg_verbose) {
+                if (t->range)
+                        fprintf(stderr, "Acquiring %zu chunks from %s...\n", t->n_items, t->url);
+                else
+                        fprintf(stderr, "Acquiring %s...\n", t->url);
+        }
+
+        if (curl_multi_add_handle(multi, t->curl) != CURLM_OK) {
+                fprintf(stderr, "Failed to start acquiring %s\n", t->url);
+                return -EIO;
+        }
+
+        t->active = true;
+
+        return 0;
+}
+
+static int chunk_transfer_put_pack_item(CaRemote *rr, ChunkTransfer *t, const ChunkTransferItem *item) {
+        CaChunkCompression compression;
+        const void *data;
+        size_t i, size;
+        int r;
+
+        assert(rr);
+        assert(t);
+        assert(item);
+
+        for (i = 0; i < t->n_pieces; i++) {
+                const ChunkTransferPiece *p = t->pieces + i;
+
+                if (item->size == 0)
+                        break;
+                if (item->offset < p->offset || item->offset - p->offset > p->size || item->size > p->size - (item->offset - p->offset))
+                        continue;
+
+                r = ca_store_pack_parse_record(p->data + (item->offset - p->offset), item->size, &item->id, &data, &size, &compression);
+                if (r < 0) {
+                        if (arg_verbose)
+                                fprintf(stderr, "Record of chunk in %s is invalid: %s\n", t->url, strerror(-r));
+                        break;
+                }
+
+                r = ca_remote_put_chunk(rr, &item->id, compression, data, size);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to write chunk: %s\n", strerror(-r));
+                        return r;
+                }
+
+                return 0;
+        }
+
+        r = ca_remote_put_missing(rr, &item->id);
+        if (r < 0) {
+                fprintf(stderr, "Failed to write missing message: %s\n", strerror(-r));
+                return r;
+        }
+
+        return 0;
+}
+
+/* Passes on the next chunk of a completed transfer */
+static int chunk_transfer_put(CaRemote *rr, ChunkTransfer *t) {
+        const ChunkTransferItem *item;
+        long protocol_status;
+        int r;
+
+        assert(rr);
+        assert(t);
+        assert(t->done);
+        assert(t->n_put < t->n_items);
+
+        item = t->items + t->n_put;
+
+        if (t->url && t->pack == 0) {
+                if (curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &protocol_status) != CURLE_OK) {
+                        fprintf(stderr, "Failed to query response code\n");
+                        return -EIO;
+                }
+
+                if ((IN_SET(arg_protocol, ARG_PROTOCOL_HTTP, ARG_PROTOCOL_HTTPS) && protocol_status == 200) ||
+                    (arg_protocol == ARG_PROTOCOL_FTP && (protocol_status >= 200 && protocol_status <= 299))) {
+
+                        r = ca_remote_put_chunk(rr, &item->id, CA_CHUNK_COMPRESSED, realloc_buffer_data(&t->buffer), realloc_buffer_size(&t->buffer));
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to write chunk: %s\n", strerror(-r));
+                                return r;
+                        }
+
+                } else {
+                        if (arg_verbose)
+                                fprintf(stderr, "HTTP/FTP server failure %li while requesting %s.\n", protocol_status, t->url);
+
+                        r = ca_remote_put_missing(rr, &item->id);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to write missing message: %s\n", strerror(-r));
+                                return r;
+                        }
+                }
+        } else {
+                r = chunk_transfer_put_pack_item(rr, t, item);
+                if (r < 0)
+                        return r;
+        }
+
+        if (++t->n_put >= t->n_items)
+                chunk_transfer_done(t);
+
+        return 0;
+}
+
+static int chunk_store_load_packs(ChunkStore *store) {
+        ReallocBuffer buffer = {};
+        uint64_t *numbers = NULL;
+        size_t n = 0, i;
+        long protocol_status;
+        char *url;
+        int r;
+
+        assert(store);
+
+        /* A pack store announces its packs in a manifest, look for that. If there's none, it's a directory of chunk
+         * files. */
+
+        if (arg_protocol == ARG_PROTOCOL_FTP)
+                return 0;
+
+        url = store_file_url(store->url, CA_STORE_PACK_MANIFEST_FILENAME);
+        if (!url)
+                return log_oom();
+
+        r = acquire_buffer(store->curl, url, &buffer, &protocol_status);
+        free(url);
+        if (r < 0)
+                goto finish;
+        if (protocol_status != 200) {
+                r = 0;
+                goto finish;
+        }
+
+        r = ca_store_pack_parse_manifest(realloc_buffer_data(&buffer), realloc_buffer_size(&buffer), &numbers, &n);
+        if (r < 0) {
+                fprintf(stderr, "Failed to parse pack manifest: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        store->packs = new0(PackIndex, MAX(n, 1U));
+        if (!store->packs) {
+                r = log_oom();
+                goto finish;
+        }
+
+        for (i = 0; i < n; i++) {
+                char name[16 + 6 + 1];
+                PackIndex *p = store->packs + store->n_packs;
+
+                snprintf(name, sizeof(name), "%016" PRIx64 ".index", numbers[i]);
+
+                url = store_file_url(store->url, name);
+                if (!url) {
+                        r = log_oom();
+                        goto finish;
+                }
+
+                r = acquire_buffer(store->curl, url, &p->index, &protocol_status);
+                free(url);
+                if (r < 0)
+                        goto finish;
+
+                /* Removed since the manifest was written? */
+                if (protocol_status != 200) {
+                        realloc_buffer_free(&p->index);
+                        continue;
+                }
+
+                r = ca_store_pack_index_validate(realloc_buffer_data(&p->index), realloc_buffer_size(&p->index));
+                if (r < 0) {
+                        fprintf(stderr, "Index of pack %s is invalid: %s\n", name, strerror(-r));
+                        realloc_buffer_free(&p->index);
+                        goto finish;
+                }
+
+                p->number = numbers[i];
+                store->n_packs++;
+        }
+
+        if (arg_verbose)
+                fprintf(stderr, "Store is a pack store with %zu packs.\n", store->n_packs);
+
+        r = 0;
+
+finish:
+        realloc_buffer_free(&buffer);
+        free(numbers);
+
+        return r;
+}
+
+static int acquire_chunks(CaRemote *rr, const char *store_url) {
+        ChunkTransfer *transfers = NULL;
+        ChunkStore store = {
+                .url = store_url,
+        };
+        uint64_t sequence = 0;
+        CURLM *multi = NULL;
+        unsigned i;
+        int r;
+
+        assert(rr);
+        assert(store_url);
+
+        /* Keeps up to arg_max_active_chunks GET requests in flight at the same time. New requests are only dequeued
+         * from the remote when a slot is free, so that high priority requests coming in meanwhile still take
+         * precedence over low priority ones that are queued already. Completed chunks are passed on in the order
+         * they were requested in. */
+
+        store.curl = curl_easy_init();
+        if (!store.curl)
+                return log_oom();
+
+        r = configure_curl(store.curl, 1);
+        if (r < 0)
+                goto finish;
+
+        r = chunk_store_load_packs(&store);
+        if (r < 0)
+                goto finish;
+
+        multi = curl_multi_init();
+        if (!multi) {
+                r = log_oom();
+                goto finish;
+        }
+
+        (void) curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+        if (curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long) arg_max_active_chunks) != CURLM_OK) {
+                fprintf(stderr, "Failed to limit number of CURL connections.\n");
+                r = -EIO;
+                goto finish;
+        }
+
+        transfers = new0(ChunkTransfer, arg_max_active_chunks);
+        if (!transfers) {
+                r = log_oom();
+                goto finish;
+        }
+
+        for (i = 0; i < arg_max_active_chunks; i++) {
+                ChunkTransfer *t = transfers + i;
+
+                t->items = new(ChunkTransferItem, store.n_packs > 0 ? PACK_REQUEST_CHUNKS_MAX : 1);
+                if (!t->items) {
+                        r = log_oom();
+                        goto finish;
+                }
+
+                t->curl = curl_easy_init();
+                if (!t->curl) {
+                        r = log_oom();
+                        goto finish;
+                }
+
+                r = configure_curl(t->curl, arg_max_active_chunks);
+                if (r < 0)
+                        goto finish;
+
+                if (curl_easy_setopt(t->curl, CURLOPT_HEADERFUNCTION, write_header) != CURLE_OK ||
+                    curl_easy_setopt(t->curl, CURLOPT_HEADERDATA, t) != CURLE_OK) {
+                        fprintf(stderr, "Failed to set CURL header callback function.\n");
+                        r = -EIO;
+                        goto finish;
+                }
+        }
+
+        for (;;) {
+                struct curl_waitfd waitfds[2] = {};
+                unsigned n_waitfds = 0;
+                bool progress = false;
+                short input_events, output_events;
+                int input_fd, output_fd, running;
+                CURLMsg *msg;
+                int left;
+
+                /* Let the remoting engine process its input and output first */
+                for (;;) {
+                        r = ca_remote_step(rr);
+                        if (r == -EPIPE || r == CA_REMOTE_FINISHED) {
+                                r = 0;
+                                goto finish;
+                        }
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to process remoting engine: %s\n", strerror(-r));
+                                goto finish;
+                        }
+                        if (r == CA_REMOTE_POLL)
+                                break;
+                }
+
+                /* Pass on completed chunks, oldest first, as long as the remote takes them */
+                for (;;) {
+                        ChunkTransfer *oldest = NULL;
+
+                        for (i = 0; i < arg_max_active_chunks; i++)
+                                if (transfers[i].done && (!oldest || transfers[i].sequence < oldest->sequence))
+                                        oldest = transfers + i;
+                        if (!oldest)
+                                break;
+
+                        r = ca_remote_can_put_chunk(rr);
+                        if (r == -EPIPE) {
+                                r = 0;
+                                goto finish;
+                        }
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to determine whether we can add a chunk to the buffer: %s\n", strerror(-r));
+                                goto finish;
+                        }
+                        if (r == 0)
+                                break;
+
+                        r = chunk_transfer_put(rr, oldest);
+                        if (r < 0)
+                                goto finish;
+
+                        progress = true;
+                }
+
+                /* Fill the free slots with new requests */
+                for (i = 0; i < arg_max_active_chunks; i++) {
+                        ChunkTransfer *t = transfers + i;
+
+                        if (t->active || t->done)
+                                continue;
+
+                        r = chunk_transfer_fill(rr, &store, t);
+                        if (r == -EPIPE) {
+                                r = 0;
+                                goto finish;
+                        }
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to determine next chunk to get: %s\n", strerror(-r));
+                                goto finish;
+                        }
+                        if (r == 0)
+                                break;
+
+                        r = chunk_transfer_start(multi, &store, t, sequence++);
+                        if (r < 0)
+                                goto finish;
+
+                        if (t->done)
+                                progress = true;
+                }
+
+                if (curl_multi_perform(multi, &running) != CURLM_OK) {
+                        fprintf(stderr, "Failed to process CURL transfers.\n");
+                        r = -EIO;
+                        goto finish;
+                }
+
+                while ((msg = curl_multi_info_read(multi, &left))) {
+                        ChunkTransfer *t;
+                        char *p;
+
+                        if (msg->msg != CURLMSG_DONE)
+                                continue;
+
+                        if (curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &p) != CURLE_OK) {
+                                fprintf(stderr, "Failed to query CURL private pointer.\n");
+                                r = -EIO;
+                                goto finish;
+                        }
+                        t = (ChunkTransfer*) p;
+
+                        if (msg->data.result != CURLE_OK && t->pack == 0) {
+                                fprintf(stderr, "Failed to acquire %s: %s\n", t->url, curl_easy_strerror(msg->data.result));
+                                r = -EIO;
+                                goto finish;
+                        }
+
+                        (void) curl_multi_remove_handle(multi, t->curl);
+                        t->active = false;
+                        t->done = true;
+
+                        if (t->pack != 0) {
+                                /* If we can't make sense of what we got from a pack, all chunks requested are
+                                 * reported missing, and the next store in line gets a chance */
+                                if (msg->data.result != CURLE_OK) {
+                                        if (arg_verbose)
+                                                fprintf(stderr, "Failed to acquire %s: %s\n", t->url, curl_easy_strerror(msg->data.result));
+                                } else {
+                                        r = chunk_transfer_parse_ranges(t);
+                                        if (r == -ENOMEM) {
+                                                log_oom();
+                                                goto finish;
+                                        }
+                                        if (r < 0 && arg_verbose)
+                                                fprintf(stderr, "Failed to parse response for %s: %s\n", t->url, strerror(-r));
+                                }
+                        }
+
+                        progress = true;
+                }
+
+                if (progress)
+                        continue;
+
+                /* Nothing happened, hence wait for the remote's pipes or our transfers */
+                r = ca_remote_get_io_fds(rr, &input_fd, &output_fd);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to get remote I/O file descriptors: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                r = ca_remote_get_io_events(rr, &input_events, &output_events);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to get remote I/O events: %s\n", strerror(-r));
+                        goto finish;
+                }
+
+                if (input_events != 0)
+                        waitfds[n_waitfds++] = (struct curl_waitfd) {
+                                .fd = input_fd,
+                                .events = CURL_WAIT_POLLIN,
+                        };
+                if (output_events != 0)
+                        waitfds[n_waitfds++] = (struct curl_waitfd) {
+                                .fd = output_fd,
+                                .events = CURL_WAIT_POLLOUT,
+                        };
+
+                if (curl_multi_wait(multi, waitfds, n_waitfds, 1000, NULL) != CURLM_OK) {
+                        fprintf(stderr, "Failed to wait for CURL transfers.\n");
+                        r = -EIO;
+                        goto finish;
+                }
+        }
+
+finish:
+        if (transfers) {
+                for (i = 0; i < arg_max_active_chunks; i++) {
+                        if (transfers[i].curl) {
+                                if (transfers[i].active)
+                                        (void) curl_multi_remove_handle(multi, transfers[i].curl);
+
+                                curl_easy_cleanup(transfers[i].curl);
+                        }
+
+                        realloc_buffer_free(&transfers[i].buffer);
+                        free(transfers[i].url);
+                        free(transfers[i].range);
+                        free(transfers[i].items);
+                        free(transfers[i].pieces);
+                }
+
+                free(transfers);
+        }
+
+        curl_multi_cleanup(multi);
+
+        for (i = 0; i < store.n_packs; i++)
+                realloc_buffer_free(&store.packs[i].index);
+        free(store.packs);
+
+        if (store.curl)
+                curl_easy_cleanup(store.curl);
+
+        return r;
+}
+
+static int run(int argc, char *argv[]) {
+        const char *base_url, *archive_url, *index_url, *wstore_url;
+        size_t n_stores = 0;
+        CURL *curl = NULL;
+        CaRemote *rr = NULL;
+        int r;
+
+        if (argc < 5) {
+                fprintf(stderr, "Expected at least 5 arguments.\n");
+                return -EINVAL;
+        }
+
+        /* fprintf(stderr, "base=%s archive=%s index=%s wstore=%s\n", argv[1], argv[2], argv[3], argv[4]); */
+
+        base_url = empty_or_dash_to_null(argv[1]);
+        archive_url = empty_or_dash_to_null(argv[2]);
+        index_url = empty_or_dash_to_null(argv[3]);
+        wstore_url = empty_or_dash_to_null(argv[4]);
+
+        n_stores = !!wstore_url + (argc - 5);
+
+        if (base_url) {
+                fprintf(stderr, "Pushing/pulling to base via HTTP not yet supported.\n");
+                return -EOPNOTSUPP;
+        }
+
+        if (!archive_url && !index_url && n_stores == 0) {
+                fprintf(stderr, "Nothing to do.\n");
+                return -EINVAL;
+        }
+
+        rr = ca_remote_new();
+        if (!rr) {
+                r = log_oom();
+                goto finish;
+        }
+
+        r = ca_remote_set_local_feature_flags(rr,
+                                              (n_stores > 0 ? CA_PROTOCOL_READABLE_STORE : 0) |
+                                              (index_url ? CA_PROTOCOL_READABLE_INDEX : 0) |
+                                              (archive_url ? CA_PROTOCOL_READABLE_ARCHIVE : 0));
+        if (r < 0) {
+                fprintf(stderr, "Failed to set feature flags: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        r = ca_remote_set_io_fds(rr, STDIN_FILENO, STDOUT_FILENO);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set I/O file descriptors: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        curl = curl_easy_init();
+        if (!curl) {
+                r = log_oom();
+                goto finish;
+        }
+
+        r = configure_curl(curl, 1);
+        if (r < 0)
+                goto finish;
+
+        if (archive_url) {
+                r = acquire_file(rr, curl, archive_url, write_archive);
+                if (r < 0)
+                        goto finish;
+                if (r == 0)
+                        goto flush;
+
+                r = write_archive_eof(rr);
+                if (r < 0)
+                        goto finish;
+        }
+
+        if (index_url) {
+                r = acquire_file(rr, curl, index_url, write_index);
+                if (r < 0)
+                        goto finish;
+                if (r == 0)
+                        goto flush;
+
+                r = write_index_eof(rr);
+                if (r < 0)
+                        goto finish;
+        }
+
+        if (n_stores > 0) {
+                r = process_remote(rr, PROCESS_UNTIL_HAVE_REQUEST);
+                if (r == -EPIPE) {
+                        r = 0;
+                        goto finish;
+                }
+                if (r < 0)
+                        goto finish;
+
+                r = acquire_chunks(rr, wstore_url ?: argv[5]);
+                goto finish;
+        }
+
+flush:
+        r = process_remote(rr, PROCESS_UNTIL_FINISHED);
+
+finish:
+        if (curl)
+                curl_easy_cleanup(curl);
 
         ca_remote_unref(rr);
 
@@ -582,13 +1503,14 @@ static void help(void) {
 static int parse_argv(int argc, char *argv[]) {
 
         static const struct option options[] = {
-                { "help",           no_argument,       NULL, 'h'                },
-                { "verbose",        no_argument,       NULL, 'v'                },
-                { "rate-limit-bps", required_argument, NULL, 'l'                },
+                { "help",              no_argument,       NULL, 'h' },
+                { "verbose",           no_argument,       NULL, 'v' },
+                { "rate-limit-bps",    required_argument, NULL, 'l' },
+                { "max-active-chunks", required_argument, NULL, 'm' },
                 {}
         };
 
-        int c;
+        int c, r;
 
         assert(argc >= 0);
         assert(argv);
@@ -623,6 +1545,16 @@ static int parse_argv(int argc, char *argv[]) {
                         arg_rate_limit_bps = strtoll(optarg, NULL, 10);
                         break;
 
+                case 'm':
+                        r = safe_atou(optarg, &arg_max_active_chunks);
+                        if (r < 0 || arg_max_active_chunks == 0) {
+                                fprintf(stderr, "Failed to parse --max-active-chunks= parameter: %s\n", optarg);
+                                return -EINVAL;
+                        }
+
+                        arg_max_active_chunks = MIN(arg_max_active_chunks, MAX_ACTIVE_CHUNKS_MAX);
+                        break;
+
                 case '?':
                         return -EINVAL;
 
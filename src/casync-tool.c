@@ -10,6 +10,7 @@
 #include <time.h>
 
 #include "cachunk.h"
+#include "cachunkpipeline.h"
 #include "caformat-util.h"
 #include "caformat.h"
 #include "cafuse.h"
@@ -42,13 +43,21 @@ static bool arg_delete = true;
 static bool arg_undo_immutable = false;
 static bool arg_recursive = true;
 static bool arg_seed_output = true;
+static bool arg_seed_output_lazy = false;
 static char *arg_store = NULL;
 static char **arg_extra_stores = NULL;
 static char **arg_seeds = NULL;
+static char *arg_seed_cache = NULL;
 static size_t arg_chunk_size_min = 0;
 static size_t arg_chunk_size_avg = 0;
 static size_t arg_chunk_size_max = 0;
 static uint64_t arg_rate_limit_bps = UINT64_MAX;
+static unsigned arg_max_active_chunks = 0;
+static unsigned arg_threads = 0;
+static CaDigestType arg_digest = CA_DIGEST_DEFAULT;
+static CaCompressionType arg_compression = CA_COMPRESSION_DEFAULT;
+static int arg_compression_level = CA_COMPRESSION_LEVEL_DEFAULT;
+static int arg_store_index = -1;
 static uint64_t arg_with = 0;
 static uint64_t arg_without = 0;
 static uid_t arg_uid_shift = 0, arg_uid_range = 0x10000U;
@@ -65,18 +74,39 @@ static void help(void) {
 #if HAVE_FUSE
                "%1$s [OPTIONS...] mount [ARCHIVE|ARCHIVE_INDEX] PATH\n"
 #endif
-               "%1$s [OPTIONS...] mkdev [BLOB|BLOB_INDEX] [NODE]\n\n"
+               "%1$s [OPTIONS...] mkdev [BLOB|BLOB_INDEX] [NODE]\n"
+               "%1$s [OPTIONS...] rebuild-index [STORE]\n"
+               "%1$s [OPTIONS...] compact [STORE]\n\n"
                "Content-Addressable Data Synchronization Tool\n\n"
                "  -h --help                  Show this help\n"
                "  -v --verbose               Show terse status information during runtime\n"
                "     --store=PATH            The primary chunk store to use\n"
+               "                             (pack://PATH for a pack store)\n"
                "     --extra-store=PATH      Additional chunk store to look for chunks in\n"
                "     --chunk-size=[MIN:]AVG[:MAX]\n"
                "                             The minimal/average/maximum number of bytes in a\n"
                "                             chunk\n"
                "     --seed=PATH             Additional file or directory to use as seed\n"
+               "     --seed-cache=PATH       Keep seed caches in this directory, and update\n"
+               "                             them incrementally on the next run\n"
                "     --rate-limit-bps=LIMIT  Maximum bandwidth in bytes/s for remote\n"
                "                             communication\n"
+               "     --max-active-chunks=N   Number of chunks to download in parallel from\n"
+               "                             HTTP and FTP stores\n"
+               "     --threads=N|auto        Number of threads to hash, compress and store\n"
+               "                             chunks with when creating an index, or to index\n"
+               "                             seeds with when extracting (default: hash on the\n"
+               "                             main thread, compress and store in the\n"
+               "                             background; 1: no additional threads)\n"
+               "     --digest=DIGEST         Pick digest algorithm for chunk IDs when creating\n"
+               "                             an index (sha256 or blake2b-256)\n"
+               "     --compression=CODEC[:LEVEL]\n"
+               "                             Pick codec (and level) to compress chunks with\n"
+               "                             when creating an index (xz or zstd)\n"
+               "     --store-index=BOOL      Build and use an index of the chunks in local\n"
+               "                             stores (default: use it if there's one); after\n"
+               "                             adding chunks behind casync's back, update it\n"
+               "                             with rebuild-index\n"
                "     --exclude-nodump=no     Don't exclude files with chattr(1)'s +d 'nodump'\n"
                "                             flag when creating archive\n"
                "     --exclude-submounts=yes Exclude submounts when creating archive\n"
@@ -89,6 +119,8 @@ static void help(void) {
                "                             'immutable' flag when extracting\n"
                "     --seed-output=no        Don't implicitly add pre-existing output as seed\n"
                "                             when extracting\n"
+               "     --seed-output=lazy      Don't index pre-existing output up front, only\n"
+               "                             look at the old version of each file extracted\n"
                "     --recursive=no          List non-recursively\n"
 #if HAVE_FUSE
                "     --mkdir=no              Don't automatically create mount directory if it\n"
@@ -243,7 +275,9 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_EXTRA_STORE,
                 ARG_CHUNK_SIZE,
                 ARG_SEED,
+                ARG_SEED_CACHE,
                 ARG_RATE_LIMIT_BPS,
+                ARG_MAX_ACTIVE_CHUNKS,
                 ARG_WITH,
                 ARG_WITHOUT,
                 ARG_WHAT,
@@ -259,6 +293,10 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_UID_RANGE,
                 ARG_RECURSIVE,
                 ARG_MKDIR,
+                ARG_THREADS,
+                ARG_DIGEST,
+                ARG_COMPRESSION,
+                ARG_STORE_INDEX,
         };
 
         static const struct option options[] = {
@@ -268,7 +306,9 @@ static int parse_argv(int argc, char *argv[]) {
                 { "extra-store",       required_argument, NULL, ARG_EXTRA_STORE       },
                 { "chunk-size",        required_argument, NULL, ARG_CHUNK_SIZE        },
                 { "seed",              required_argument, NULL, ARG_SEED              },
+                { "seed-cache",        required_argument, NULL, ARG_SEED_CACHE        },
                 { "rate-limit-bps",    required_argument, NULL, ARG_RATE_LIMIT_BPS    },
+                { "max-active-chunks", required_argument, NULL, ARG_MAX_ACTIVE_CHUNKS },
                 { "with",              required_argument, NULL, ARG_WITH              },
                 { "without",           required_argument, NULL, ARG_WITHOUT           },
                 { "what",              required_argument, NULL, ARG_WHAT              },
@@ -284,6 +324,10 @@ static int parse_argv(int argc, char *argv[]) {
                 { "uid-range",         required_argument, NULL, ARG_UID_RANGE         },
                 { "recursive",         required_argument, NULL, ARG_RECURSIVE         },
                 { "mkdir",             required_argument, NULL, ARG_MKDIR             },
+                { "threads",           required_argument, NULL, ARG_THREADS           },
+                { "digest",            required_argument, NULL, ARG_DIGEST            },
+                { "compression",       required_argument, NULL, ARG_COMPRESSION       },
+                { "store-index",       required_argument, NULL, ARG_STORE_INDEX       },
                 {}
         };
 
@@ -345,6 +389,18 @@ static int parse_argv(int argc, char *argv[]) {
 
                         break;
 
+                case ARG_SEED_CACHE: {
+                        char *p;
+
+                        p = strdup(optarg);
+                        if (!p)
+                                return log_oom();
+
+                        free(arg_seed_cache);
+                        arg_seed_cache = p;
+                        break;
+                }
+
                 case ARG_RATE_LIMIT_BPS:
                         r = parse_size(optarg, &arg_rate_limit_bps);
                         if (r < 0) {
@@ -358,6 +414,15 @@ static int parse_argv(int argc, char *argv[]) {
 
                         break;
 
+                case ARG_MAX_ACTIVE_CHUNKS:
+                        r = safe_atou(optarg, &arg_max_active_chunks);
+                        if (r < 0 || arg_max_active_chunks == 0) {
+                                fprintf(stderr, "Failed to parse --max-active-chunks= parameter: %s\n", optarg);
+                                return -EINVAL;
+                        }
+
+                        break;
+
                 case ARG_WITH: {
                         uint64_t u;
 
@@ -473,6 +538,12 @@ static int parse_argv(int argc, char *argv[]) {
                         break;
 
                 case ARG_SEED_OUTPUT:
+                        if (streq(optarg, "lazy")) {
+                                arg_seed_output = false;
+                                arg_seed_output_lazy = true;
+                                break;
+                        }
+
                         r = parse_boolean(optarg);
                         if (r < 0) {
                                 fprintf(stderr, "Failed to parse --seed-output= parameter: %s\n", optarg);
@@ -480,6 +551,7 @@ static int parse_argv(int argc, char *argv[]) {
                         }
 
                         arg_seed_output = r;
+                        arg_seed_output_lazy = false;
                         break;
 
                 case ARG_MKDIR:
@@ -550,6 +622,87 @@ static int parse_argv(int argc, char *argv[]) {
                         arg_recursive = r;
                         break;
 
+                case ARG_THREADS:
+                        if (streq(optarg, "auto")) {
+                                arg_threads = ca_threads_auto();
+                                break;
+                        }
+
+                        r = safe_atou(optarg, &arg_threads);
+                        if (r < 0 || arg_threads == 0) {
+                                fprintf(stderr, "Failed to parse --threads= parameter: %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        if (arg_threads > CA_CHUNK_PIPELINE_THREADS_MAX) {
+                                fprintf(stderr, "Number of threads must be <= %u.\n", CA_CHUNK_PIPELINE_THREADS_MAX);
+                                return -ERANGE;
+                        }
+
+                        break;
+
+                case ARG_DIGEST: {
+                        CaDigestType t;
+
+                        t = ca_digest_type_from_string(optarg);
+                        if (t < 0) {
+                                fprintf(stderr, "Failed to parse --digest= parameter: %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        if (!ca_digest_type_supported(t)) {
+                                fprintf(stderr, "Digest %s is not supported by the libgcrypt version in use.\n", optarg);
+                                return -EOPNOTSUPP;
+                        }
+
+                        arg_digest = t;
+                        break;
+                }
+
+                case ARG_COMPRESSION: {
+                        int level = CA_COMPRESSION_LEVEL_DEFAULT;
+                        CaCompressionType t;
+                        const char *colon, *name;
+
+                        colon = strchr(optarg, ':');
+                        if (colon) {
+                                r = safe_atoi(colon + 1, &level);
+                                if (r < 0) {
+                                        fprintf(stderr, "Failed to parse compression level: %s\n", colon + 1);
+                                        return r;
+                                }
+
+                                name = strndupa(optarg, colon - optarg);
+                        } else
+                                name = optarg;
+
+                        t = ca_compression_type_from_string(name);
+                        if (t < 0) {
+                                fprintf(stderr, "Failed to parse --compression= parameter: %s\n", optarg);
+                                return -EINVAL;
+                        }
+                        if (!ca_compression_type_supported(t)) {
+                                fprintf(stderr, "Compression codec %s is not supported by this build.\n", name);
+                                return -EOPNOTSUPP;
+                        }
+                        if (level != CA_COMPRESSION_LEVEL_DEFAULT && ca_compression_level_valid(t, level) <= 0) {
+                                fprintf(stderr, "Compression level %i is out of range for %s.\n", level, name);
+                                return -ERANGE;
+                        }
+
+                        arg_compression = t;
+                        arg_compression_level = level;
+                        break;
+                }
+
+                case ARG_STORE_INDEX:
+                        r = parse_boolean(optarg);
+                        if (r < 0) {
+                                fprintf(stderr, "Failed to parse --store-index= parameter: %s\n", optarg);
+                                return r;
+                        }
+
+                        arg_store_index = r;
+                        break;
+
                 case '?':
                         return -EINVAL;
 
@@ -622,12 +775,54 @@ static int set_default_store(const char *index_path) {
         return 1;
 }
 
+static int load_store_index(CaSync *s) {
+        int r;
+
+        assert(s);
+
+        if (arg_store_index < 0)
+                return 0;
+
+        r = ca_sync_set_store_index(s, arg_store_index);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set store index mode: %s\n", strerror(-r));
+                return r;
+        }
+
+        return 0;
+}
+
+static int load_seed_cache(CaSync *s) {
+        int r;
+
+        assert(s);
+
+        if (!arg_seed_cache)
+                return 0;
+
+        r = ca_sync_set_seed_cache_path(s, arg_seed_cache);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set seed cache path: %s\n", strerror(-r));
+                return r;
+        }
+
+        return 0;
+}
+
 static int load_seeds_and_extra_stores(CaSync *s) {
         char **i;
         int r;
 
         assert(s);
 
+        r = load_store_index(s);
+        if (r < 0)
+                return r;
+
+        r = load_seed_cache(s);
+        if (r < 0)
+                return r;
+
         STRV_FOREACH(i, arg_extra_stores) {
                 r = ca_sync_add_store_auto(s, *i);
                 if (r < 0)
@@ -808,7 +1003,7 @@ static int verbose_print_path(CaSync *s, const char *verb) {
 }
 
 static int verbose_print_done_make(CaSync *s) {
-        uint64_t n_chunks = UINT64_MAX, size = UINT64_MAX, n_reused = UINT64_MAX, covering;
+        uint64_t n_chunks = UINT64_MAX, size = UINT64_MAX, n_reused = UINT64_MAX, covering, n_zero, n_holes, n_name_hits;
         char buffer[128];
         int r;
 
@@ -880,11 +1075,41 @@ static int verbose_print_done_make(CaSync *s) {
         if (size != UINT64_MAX && n_chunks != UINT64_MAX)
                 fprintf(stderr, "Effective average chunk size: %s\n", format_bytes(buffer, sizeof(buffer), size/n_chunks));
 
+        r = ca_sync_get_zero_chunks(s, &n_zero);
+        if (!IN_SET(r, -ENODATA, -ENOTTY)) {
+                if (r < 0) {
+                        fprintf(stderr, "Failed to determine number of all-zero chunks: %s\n", strerror(-r));
+                        return r;
+                }
+
+                fprintf(stderr, "All-zero chunks skipped: %" PRIu64 "\n", n_zero);
+        }
+
+        r = ca_sync_get_hole_bytes(s, &n_holes);
+        if (!IN_SET(r, -ENODATA, -ENOTTY)) {
+                if (r < 0) {
+                        fprintf(stderr, "Failed to determine number of hole bytes: %s\n", strerror(-r));
+                        return r;
+                }
+
+                fprintf(stderr, "Bytes in holes not read: %" PRIu64 "\n", n_holes);
+        }
+
+        r = ca_sync_get_name_cache_hits(s, &n_name_hits);
+        if (!IN_SET(r, -ENODATA, -ENOTTY)) {
+                if (r < 0) {
+                        fprintf(stderr, "Failed to determine number of name cache hits: %s\n", strerror(-r));
+                        return r;
+                }
+
+                fprintf(stderr, "User/group name lookups served from cache: %" PRIu64 "\n", n_name_hits);
+        }
+
         return 1;
 }
 
 static int verbose_print_done_extract(CaSync *s) {
-        uint64_t n_bytes;
+        uint64_t n_bytes, n_lookups;
         int r;
 
         if (!arg_verbose)
@@ -920,6 +1145,96 @@ static int verbose_print_done_extract(CaSync *s) {
                 fprintf(stderr, "Bytes cloned through hardlinks: %" PRIu64 "\n", n_bytes);
         }
 
+        r = ca_sync_get_output_seed_bytes(s, &n_bytes);
+        if (!IN_SET(r, -ENODATA, -ENOTTY)) {
+                if (r < 0) {
+                        fprintf(stderr, "Failed to determine number of bytes taken from output: %s\n", strerror(-r));
+                        return r;
+                }
+
+                fprintf(stderr, "Bytes taken from old files in output: %" PRIu64 "\n", n_bytes);
+        }
+
+        r = ca_sync_get_filter_skips(s, &n_lookups);
+        if (!IN_SET(r, -ENODATA, -ENOTTY)) {
+                if (r < 0) {
+                        fprintf(stderr, "Failed to determine number of chunk lookups skipped: %s\n", strerror(-r));
+                        return r;
+                }
+
+                fprintf(stderr, "Chunk lookups skipped by filters: %" PRIu64 "\n", n_lookups);
+        }
+
+        r = ca_sync_get_filter_false_positives(s, &n_lookups);
+        if (!IN_SET(r, -ENODATA, -ENOTTY)) {
+                if (r < 0) {
+                        fprintf(stderr, "Failed to determine number of filter false positives: %s\n", strerror(-r));
+                        return r;
+                }
+
+                fprintf(stderr, "Filter false positives: %" PRIu64 "\n", n_lookups);
+        }
+
+        r = ca_sync_get_prefetch_requests(s, &n_lookups);
+        if (!IN_SET(r, -ENODATA, -ENOTTY)) {
+                if (r < 0) {
+                        fprintf(stderr, "Failed to determine number of prefetched chunks: %s\n", strerror(-r));
+                        return r;
+                }
+
+                fprintf(stderr, "Chunks prefetched: %" PRIu64 "\n", n_lookups);
+        }
+
+        r = ca_sync_get_prefetch_duplicates(s, &n_lookups);
+        if (!IN_SET(r, -ENODATA, -ENOTTY)) {
+                if (r < 0) {
+                        fprintf(stderr, "Failed to determine number of repeated chunks not prefetched again: %s\n", strerror(-r));
+                        return r;
+                }
+
+                fprintf(stderr, "Repeated chunks not prefetched again: %" PRIu64 "\n", n_lookups);
+        }
+
+        r = ca_sync_get_zero_chunks(s, &n_lookups);
+        if (!IN_SET(r, -ENODATA, -ENOTTY)) {
+                if (r < 0) {
+                        fprintf(stderr, "Failed to determine number of all-zero chunks: %s\n", strerror(-r));
+                        return r;
+                }
+
+                fprintf(stderr, "All-zero chunks skipped: %" PRIu64 "\n", n_lookups);
+        }
+
+        r = ca_sync_get_chunk_cache_hits(s, &n_lookups);
+        if (!IN_SET(r, -ENODATA, -ENOTTY)) {
+                if (r < 0) {
+                        fprintf(stderr, "Failed to determine number of chunk cache hits: %s\n", strerror(-r));
+                        return r;
+                }
+
+                fprintf(stderr, "Chunk cache hits: %" PRIu64 "\n", n_lookups);
+        }
+
+        r = ca_sync_get_chunk_cache_misses(s, &n_lookups);
+        if (!IN_SET(r, -ENODATA, -ENOTTY)) {
+                if (r < 0) {
+                        fprintf(stderr, "Failed to determine number of chunk cache misses: %s\n", strerror(-r));
+                        return r;
+                }
+
+                fprintf(stderr, "Chunk cache misses: %" PRIu64 "\n", n_lookups);
+        }
+
+        r = ca_sync_get_name_cache_hits(s, &n_lookups);
+        if (!IN_SET(r, -ENODATA, -ENOTTY)) {
+                if (r < 0) {
+                        fprintf(stderr, "Failed to determine number of name cache hits: %s\n", strerror(-r));
+                        return r;
+                }
+
+                fprintf(stderr, "User/group name lookups served from cache: %" PRIu64 "\n", n_lookups);
+        }
+
         return 1;
 }
 
@@ -1127,6 +1442,42 @@ static int verb_make(int argc, char *argv[]) {
                 }
         }
 
+        if (arg_max_active_chunks > 0) {
+                r = ca_sync_set_max_active_chunks(s, arg_max_active_chunks);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set number of parallel downloads: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
+        r = ca_sync_set_threads(s, arg_threads);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set number of threads: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        r = ca_sync_set_chunk_digest(s, arg_digest);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set chunk digest: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        r = ca_sync_set_compression_type(s, arg_compression);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set compression codec: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        r = ca_sync_set_compression_level(s, arg_compression_level);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set compression level: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        r = load_store_index(s);
+        if (r < 0)
+                goto finish;
+
         r = ca_sync_set_base_fd(s, input_fd);
         if (r < 0) {
                 fprintf(stderr, "Failed to set sync base: %s\n", strerror(-r));
@@ -1441,10 +1792,20 @@ static int verb_extract(int argc, char *argv[]) {
                         goto finish;
 
                 if (arg_seed_output) {
+                        r = load_seed_cache(s);
+                        if (r < 0)
+                                goto finish;
+
                         r = ca_sync_add_seed_path(s, output);
                         if (r < 0 && r != -ENOENT)
                                 fprintf(stderr, "Failed to add existing file as seed %s, ignoring: %s\n", output, strerror(-r));
                 }
+
+                r = ca_sync_set_lazy_output_seed(s, arg_seed_output_lazy);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to configure lazy output seed: %s\n", strerror(-r));
+                        goto finish;
+                }
         }
 
         if (arg_rate_limit_bps != UINT64_MAX) {
@@ -1455,6 +1816,14 @@ static int verb_extract(int argc, char *argv[]) {
                 }
         }
 
+        if (arg_max_active_chunks > 0) {
+                r = ca_sync_set_max_active_chunks(s, arg_max_active_chunks);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set number of parallel downloads: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
         if (seek_path) {
                 if (output_fd >= 0)
                         r = ca_sync_set_boundary_fd(s, output_fd);
@@ -1514,6 +1883,14 @@ static int verb_extract(int argc, char *argv[]) {
         if (r < 0)
                 goto finish;
 
+        if (arg_threads > 0) {
+                r = ca_sync_set_threads(s, arg_threads);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set number of threads: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
         r = load_feature_flags(s, 0);
         if (r < 0)
                 goto finish;
@@ -1815,6 +2192,14 @@ static int verb_list(int argc, char *argv[]) {
         if (r < 0)
                 goto finish;
 
+        if (arg_max_active_chunks > 0) {
+                r = ca_sync_set_max_active_chunks(s, arg_max_active_chunks);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set number of parallel downloads: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
         if (operation == LIST_ARCHIVE) {
                 if (input_fd >= 0)
                         r = ca_sync_set_archive_fd(s, input_fd);
@@ -2463,6 +2848,14 @@ static int verb_digest(int argc, char *argv[]) {
         if (r < 0)
                 goto finish;
 
+        if (arg_max_active_chunks > 0) {
+                r = ca_sync_set_max_active_chunks(s, arg_max_active_chunks);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set number of parallel downloads: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
         if (operation == DIGEST_DIRECTORY || (operation == DIGEST_BLOB && input_fd >= 0))
                 r = ca_sync_set_base_fd(s, input_fd);
         else if (IN_SET(operation, DIGEST_ARCHIVE_INDEX, DIGEST_BLOB_INDEX)) {
@@ -2728,6 +3121,14 @@ static int verb_mount(int argc, char *argv[]) {
                 }
         }
 
+        if (arg_max_active_chunks > 0) {
+                r = ca_sync_set_max_active_chunks(s, arg_max_active_chunks);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set number of parallel downloads: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
         if (operation == MOUNT_ARCHIVE) {
                 if (input_fd >= 0)
                         r = ca_sync_set_archive_fd(s, input_fd);
@@ -2856,6 +3257,14 @@ static int verb_mkdev(int argc, char *argv[]) {
                 }
         }
 
+        if (arg_max_active_chunks > 0) {
+                r = ca_sync_set_max_active_chunks(s, arg_max_active_chunks);
+                if (r < 0) {
+                        fprintf(stderr, "Failed to set number of parallel downloads: %s\n", strerror(-r));
+                        goto finish;
+                }
+        }
+
         if (operation == MKDEV_BLOB) {
                 if (input_fd >= 0)
                         r = ca_sync_set_archive_fd(s, input_fd);
@@ -3784,6 +4193,104 @@ finish:
         return r;
 }
 
+static int open_local_store(int argc, char *argv[], CaStore **ret) {
+        const char *path;
+        CaStore *store;
+        int r;
+
+        assert(ret);
+
+        if (argc > 2) {
+                fprintf(stderr, "A store path expected.\n");
+                return -EINVAL;
+        }
+
+        if (argc > 1)
+                path = argv[1];
+        else if (arg_store)
+                path = arg_store;
+        else
+                path = "default.castr";
+
+        if (ca_classify_locator(path) != CA_LOCATOR_PATH) {
+                fprintf(stderr, "Store %s is not a local store.\n", path);
+                return -EINVAL;
+        }
+
+        store = ca_store_new();
+        if (!store)
+                return log_oom();
+
+        r = ca_store_set_path(store, path);
+        if (r < 0) {
+                fprintf(stderr, "Failed to set store path %s: %s\n", path, strerror(-r));
+                ca_store_unref(store);
+                return r;
+        }
+
+        *ret = store;
+        return 0;
+}
+
+static int verb_rebuild_index(int argc, char *argv[]) {
+        CaStore *store = NULL;
+        int r;
+
+        r = open_local_store(argc, argv, &store);
+        if (r < 0)
+                return r;
+
+        r = ca_store_set_index(store, true);
+        if (r < 0) {
+                fprintf(stderr, "Failed to enable chunk index: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        r = ca_store_rebuild_index(store);
+        if (r == -ENOTTY) {
+                fprintf(stderr, "Store has no chunk index, pack stores keep their own.\n");
+                goto finish;
+        }
+        if (r < 0) {
+                fprintf(stderr, "Failed to rebuild chunk index: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        r = 0;
+
+finish:
+        ca_store_unref(store);
+        return r;
+}
+
+static int verb_compact(int argc, char *argv[]) {
+        CaStore *store = NULL;
+        int r;
+
+        r = open_local_store(argc, argv, &store);
+        if (r < 0)
+                return r;
+
+        r = ca_store_compact(store);
+        if (r == -ENOTTY) {
+                fprintf(stderr, "Store is not a pack store, nothing to compact.\n");
+                goto finish;
+        }
+        if (r < 0) {
+                fprintf(stderr, "Failed to compact store: %s\n", strerror(-r));
+                goto finish;
+        }
+
+        if (arg_verbose)
+                fprintf(stderr, "Packs removed: %i\n", r);
+
+        r = 0;
+
+finish:
+        ca_store_unref(store);
+        return r;
+}
+
 static int dispatch_verb(int argc, char *argv[]) {
         int r;
 
@@ -3807,6 +4314,10 @@ static int dispatch_verb(int argc, char *argv[]) {
                 r = verb_mkdev(argc, argv);
         else if (streq(argv[0], "mount"))
                 r = verb_mount(argc, argv);
+        else if (streq(argv[0], "rebuild-index"))
+                r = verb_rebuild_index(argc, argv);
+        else if (streq(argv[0], "compact"))
+                r = verb_compact(argc, argv);
         else if (streq(argv[0], "pull")) /* "Secret" verb, only to be called by ssh-based remoting. */
                 r = verb_pull(argc, argv);
         else if (streq(argv[0], "push")) /* Same here. */
@@ -3838,6 +4349,7 @@ finish:
         free(arg_store);
         strv_free(arg_extra_stores);
         strv_free(arg_seeds);
+        free(arg_seed_cache);
 
         return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -1,19 +1,25 @@
 #include <fcntl.h>
-#include <gcrypt.h>
 #include <sys/poll.h>
 #include <sys/stat.h>
 
 #include "cachunk.h"
+#include "cachunkcache.h"
 #include "cachunker.h"
+#include "cachunkpipeline.h"
 #include "cadecoder.h"
+#include "cadirprefetch.h"
 #include "caencoder.h"
 #include "caformat-util.h"
 #include "caformat.h"
 #include "caindex.h"
+#include "canamecache.h"
+#include "caprefetch.h"
 #include "caprotocol.h"
 #include "caremote.h"
 #include "caseed.h"
+#include "caseedpool.h"
 #include "castore.h"
+#include "castorewriter.h"
 #include "casync.h"
 #include "def.h"
 #include "realloc-buffer.h"
@@ -33,6 +39,17 @@ typedef enum CaDirection {
         CA_SYNC_DECODE,
 } CaDirection;
 
+/* The number of distinct sizes of all-zero chunks we remember the IDs of */
+#define CA_SYNC_ZERO_CHUNKS_MAX 8U
+
+/* How much file payload to read at once when encoding */
+#define CA_SYNC_PAYLOAD_READ_SIZE ((size_t) (1024U*1024U))
+
+typedef struct CaSyncZeroChunk {
+        CaChunkID id;
+        size_t size;
+} CaSyncZeroChunk;
+
 typedef struct CaSync {
         CaDirection direction;
         bool started;
@@ -56,6 +73,20 @@ typedef struct CaSync {
         size_t n_rstores;
         CaStore *cache_store;
 
+        /* Recently used chunks from the stores, decompressed */
+        CaChunkCache *chunk_cache;
+        uint64_t chunk_cache_size;
+
+        /* User and group names, shared by the encoder or decoder and the seeds */
+        CaNameCache *name_cache;
+
+        /* IDs of all-zero chunks, so that we needn't hash, store or fetch those again and again */
+        CaSyncZeroChunk zero_chunks[CA_SYNC_ZERO_CHUNKS_MAX];
+        size_t n_zero_chunks, zero_chunks_next;
+        void *zero_buffer;
+        size_t zero_buffer_size;
+        uint64_t n_zero_chunk_hits;
+
         CaRemote *remote_wstore;
         CaRemote **remote_rstores;
         size_t n_remote_rstores;
@@ -64,6 +95,19 @@ typedef struct CaSync {
         CaSeed **seeds;
         size_t n_seeds;
         size_t current_seed; /* The seed we are currently indexing */
+        char *seed_cache_path; /* Where seeds added by path keep their persistent caches */
+
+        /* With more than one seed they are indexed concurrently, and decoding only waits for those we extract
+         * into */
+        CaSeedPool *seed_pool;
+        bool *seed_blocking;
+        size_t n_pending_seeds;
+        struct stat target_stat; /* What we extract into, st_ino is 0 if unknown */
+
+        /* What we extract into, used as seed without indexing it: a chunk that goes into the payload of a file is
+         * looked for at the same offset of the file that is there already */
+        CaSeed *output_seed;
+        uint64_t n_output_seed_bytes;
         bool index_flags_propagated;
 
         int base_fd;
@@ -82,18 +126,37 @@ typedef struct CaSync {
         ReallocBuffer archive_buffer;
         ReallocBuffer compress_buffer;
 
-        gcry_md_hd_t chunk_digest;
+        CaDigestType chunk_digest_type;
+        CaDigest *chunk_digest;
+
+        CaCompressionType compression_type;
+        int compression_level;
+        CaCompressionContext compression_context;
+
+        unsigned n_threads;
+        CaChunkPipeline *pipeline;
+        CaStoreWriter *store_writer;
 
         bool archive_eof;
         bool remote_index_eof;
 
         size_t rate_limit_bps;
+        unsigned max_active_chunks;
+
+        int store_index;
 
         uint64_t feature_flags;
 
         uint64_t n_written_chunks;
         uint64_t n_reused_chunks;
-        uint64_t n_prefetched_chunks;
+
+        /* Chunks requested from the remote store ahead of the decoder */
+        CaPrefetch *prefetch;
+        bool prefetch_stalled;
+
+        /* Local lookups of chunks that seed and store filters told us to skip, and those they wrongly let through */
+        uint64_t n_filter_skips;
+        uint64_t n_filter_false_positives;
 
         uint64_t archive_size;
 
@@ -105,6 +168,7 @@ typedef struct CaSync {
         bool delete:1;
         bool payload:1;
         bool undo_immutable:1;
+        bool lazy_output_seed:1;
 
         bool archive_digest:1;
         bool hardlink_digest:1;
@@ -138,6 +202,11 @@ static CaSync *ca_sync_new(void) {
         s->reflink = true;
         s->delete = true;
         s->payload = true;
+        s->chunk_digest_type = CA_DIGEST_DEFAULT;
+        s->compression_type = CA_COMPRESSION_DEFAULT;
+        s->compression_level = CA_COMPRESSION_LEVEL_DEFAULT;
+        s->store_index = -1;
+        s->chunk_cache_size = CA_CHUNK_CACHE_SIZE_DEFAULT;
 
         return s;
 }
@@ -406,8 +475,13 @@ CaSync *ca_sync_unref(CaSync *s) {
         if (!s)
                 return NULL;
 
+        /* Stop the workers first, they might still access the stores */
+        ca_chunk_pipeline_free(s->pipeline);
+        ca_store_writer_free(s->store_writer);
+
         ca_encoder_unref(s->encoder);
         ca_decoder_unref(s->decoder);
+        ca_name_cache_unref(s->name_cache);
 
         ca_store_unref(s->wstore);
         for (i = 0; i < s->n_rstores; i++)
@@ -420,9 +494,15 @@ CaSync *ca_sync_unref(CaSync *s) {
                 ca_remote_unref(s->remote_rstores[i]);
         free(s->remote_rstores);
 
+        /* The workers need to be gone before the seeds are */
+        ca_seed_pool_free(s->seed_pool);
+        free(s->seed_blocking);
+
         for (i = 0; i < s->n_seeds; i++)
                 ca_seed_unref(s->seeds[i]);
         free(s->seeds);
+        ca_seed_unref(s->output_seed);
+        free(s->seed_cache_path);
 
         safe_close(s->base_fd);
         safe_close(s->boundary_fd);
@@ -443,6 +523,9 @@ CaSync *ca_sync_unref(CaSync *s) {
 
         ca_index_unref(s->index);
         ca_remote_unref(s->remote_index);
+        ca_prefetch_free(s->prefetch);
+        ca_chunk_cache_free(s->chunk_cache);
+        free(s->zero_buffer);
 
         ca_remote_unref(s->remote_archive);
 
@@ -450,10 +533,11 @@ CaSync *ca_sync_unref(CaSync *s) {
         realloc_buffer_free(&s->index_buffer);
         realloc_buffer_free(&s->archive_buffer);
         realloc_buffer_free(&s->compress_buffer);
+        ca_compression_done(&s->compression_context);
 
         ca_file_root_unref(s->archive_root);
 
-        gcry_md_close(s->chunk_digest);
+        ca_digest_free(s->chunk_digest);
         free(s);
 
         return NULL;
@@ -468,6 +552,106 @@ int ca_sync_set_rate_limit_bps(CaSync *s, size_t rate_limit_bps) {
         return 0;
 }
 
+int ca_sync_set_max_active_chunks(CaSync *s, unsigned n) {
+        if (!s)
+                return -EINVAL;
+
+        s->max_active_chunks = n;
+
+        return 0;
+}
+
+int ca_sync_set_threads(CaSync *s, unsigned n) {
+        if (!s)
+                return -EINVAL;
+        if (n > CA_CHUNK_PIPELINE_THREADS_MAX)
+                return -ERANGE;
+
+        if (s->started)
+                return -EBUSY;
+
+        s->n_threads = n;
+        return 0;
+}
+
+int ca_sync_set_chunk_digest(CaSync *s, CaDigestType type) {
+        if (!s)
+                return -EINVAL;
+        if (type < 0 || type >= _CA_DIGEST_TYPE_MAX)
+                return -EINVAL;
+
+        /* When decoding the digest is determined by the index */
+        if (s->direction != CA_SYNC_ENCODE)
+                return -ENOTTY;
+        if (s->started)
+                return -EBUSY;
+
+        if (!ca_digest_type_supported(type))
+                return -EOPNOTSUPP;
+
+        s->chunk_digest_type = type;
+        return 0;
+}
+
+int ca_sync_get_chunk_digest(CaSync *s, CaDigestType *ret) {
+        if (!s)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        *ret = s->chunk_digest_type;
+        return 0;
+}
+
+int ca_sync_set_compression_type(CaSync *s, CaCompressionType type) {
+        if (!s)
+                return -EINVAL;
+        if (type < 0 || type >= _CA_COMPRESSION_TYPE_MAX)
+                return -EINVAL;
+
+        if (s->started)
+                return -EBUSY;
+
+        if (!ca_compression_type_supported(type))
+                return -EOPNOTSUPP;
+
+        s->compression_type = type;
+        return 0;
+}
+
+int ca_sync_set_compression_level(CaSync *s, int level) {
+        if (!s)
+                return -EINVAL;
+
+        if (s->started)
+                return -EBUSY;
+
+        s->compression_level = level;
+        return 0;
+}
+
+int ca_sync_set_store_index(CaSync *s, bool b) {
+        if (!s)
+                return -EINVAL;
+
+        if (s->started)
+                return -EBUSY;
+
+        s->store_index = b;
+        return 0;
+}
+
+int ca_sync_set_chunk_cache_size(CaSync *s, uint64_t size) {
+        if (!s)
+                return -EINVAL;
+
+        if (s->started)
+                return -EBUSY;
+
+        s->chunk_cache_size = size;
+        return 0;
+}
+
 int ca_sync_set_feature_flags(CaSync *s, uint64_t flags) {
         if (!s)
                 return -EINVAL;
@@ -611,6 +795,12 @@ int ca_sync_set_index_remote(CaSync *s, const char *url) {
                         return r;
         }
 
+        if (s->max_active_chunks > 0) {
+                r = ca_remote_set_max_active_chunks(s->remote_index, s->max_active_chunks);
+                if (r < 0)
+                        return r;
+        }
+
         r = ca_remote_set_index_url(s->remote_index, url);
         if (r < 0)
                 return r;
@@ -965,6 +1155,12 @@ int ca_sync_set_store_remote(CaSync *s, const char *url) {
                         return r;
         }
 
+        if (s->max_active_chunks > 0) {
+                r = ca_remote_set_max_active_chunks(s->remote_wstore, s->max_active_chunks);
+                if (r < 0)
+                        return r;
+        }
+
         r = ca_remote_set_store_url(s->remote_wstore, url);
         if (r < 0)
                 return r;
@@ -1038,6 +1234,14 @@ int ca_sync_add_store_remote(CaSync *s, const char *url) {
         if (!remote)
                 return -ENOMEM;
 
+        if (s->max_active_chunks > 0) {
+                r = ca_remote_set_max_active_chunks(remote, s->max_active_chunks);
+                if (r < 0) {
+                        ca_remote_unref(remote);
+                        return r;
+                }
+        }
+
         r = ca_remote_set_store_url(remote, url);
         if (r < 0) {
                 ca_remote_unref(remote);
@@ -1114,6 +1318,117 @@ int ca_sync_add_seed_fd(CaSync *s, int fd) {
         return 0;
 }
 
+int ca_sync_set_lazy_output_seed(CaSync *s, bool b) {
+        if (!s)
+                return -EINVAL;
+        if (s->direction != CA_SYNC_DECODE)
+                return -ENOTTY;
+        if (s->started)
+                return -EBUSY;
+
+        s->lazy_output_seed = b;
+        return 0;
+}
+
+static int ca_sync_open_output_seed(CaSync *s) {
+        CaSeed *seed;
+        int r;
+
+        assert(s);
+
+        seed = ca_seed_new();
+        if (!seed)
+                return -ENOMEM;
+
+        if (s->base_fd >= 0) {
+                int fd;
+
+                /* The directory we extract into exists already, and the decoder is going to take possession
+                 * of its fd, hence let the seed use a copy of it */
+                fd = fcntl(s->base_fd, F_DUPFD_CLOEXEC, 3);
+                if (fd < 0) {
+                        ca_seed_unref(seed);
+                        return -errno;
+                }
+
+                r = ca_seed_set_base_fd(seed, fd);
+                if (r < 0)
+                        safe_close(fd);
+        } else
+                r = ca_seed_set_base_path(seed, s->base_path);
+        if (r == -ENOENT) { /* Nothing there yet, hence nothing to reuse */
+                ca_seed_unref(seed);
+                return 0;
+        }
+        if (r < 0) {
+                ca_seed_unref(seed);
+                return r;
+        }
+
+        r = ca_seed_set_hardlink(seed, false);
+        if (r < 0) {
+                ca_seed_unref(seed);
+                return r;
+        }
+
+        s->output_seed = seed;
+        return 0;
+}
+
+int ca_sync_set_seed_cache_path(CaSync *s, const char *path) {
+        char *p;
+
+        if (!s)
+                return -EINVAL;
+        if (!path)
+                return -EINVAL;
+
+        p = strdup(path);
+        if (!p)
+                return -ENOMEM;
+
+        free(s->seed_cache_path);
+        s->seed_cache_path = p;
+
+        return 0;
+}
+
+static int ca_sync_seed_cache_path(CaSync *s, const char *path, char **ret) {
+        char ids[CA_CHUNK_ID_FORMAT_MAX];
+        CaDigest *digest = NULL;
+        char *canonical;
+        CaChunkID id;
+        int r;
+
+        assert(s);
+        assert(path);
+        assert(ret);
+
+        /* Each seed gets its own cache below the directory, named after the hash of its canonical path */
+        canonical = realpath(path, NULL);
+        if (!canonical)
+                return -errno;
+
+        r = ca_digest_new(CA_DIGEST_SHA256, &digest);
+        if (r >= 0)
+                r = ca_chunk_id_make(digest, canonical, strlen(canonical), &id);
+        ca_digest_free(digest);
+        free(canonical);
+        if (r < 0)
+                return r;
+
+        if (!ca_chunk_id_format(&id, ids))
+                return -EINVAL;
+
+        (void) mkdir(s->seed_cache_path, 0777);
+
+        *ret = strjoin(s->seed_cache_path, "/", ids, ".cased", NULL);
+        if (!*ret)
+                return -ENOMEM;
+
+        return 0;
+}
+
 int ca_sync_add_seed_path(CaSync *s, const char *path) {
         CaSeed *seed;
         int r;
@@ -1137,10 +1452,54 @@ int ca_sync_add_seed_path(CaSync *s, const char *path) {
                 return r;
         }
 
+        if (s->seed_cache_path) {
+                char *cache_path = NULL;
+
+                r = ca_sync_seed_cache_path(s, path, &cache_path);
+                if (r >= 0) {
+                        r = ca_seed_set_cache_path(seed, cache_path);
+                        free(cache_path);
+                }
+                if (r < 0) {
+                        ca_seed_unref(seed);
+                        return r;
+                }
+        }
+
         s->seeds[s->n_seeds++] = seed;
         return 0;
 }
 
+static int ca_sync_store_chunk(void *userdata, const CaChunkID *id, const void *p, size_t l) {
+        CaSync *s = userdata;
+        bool reused = false;
+        int r;
+
+        assert(s);
+        assert(id);
+        assert(p || l == 0);
+
+        /* Writes the chunk to the stores. Note that this is called from the worker threads if we have any, hence
+         * must not touch any state of the CaSync object besides the (thread-safe) store objects. Returns > 0 if
+         * the chunk already existed in the primary store. */
+
+        if (s->wstore) {
+                r = ca_store_put(s->wstore, id, CA_CHUNK_UNCOMPRESSED, p, l);
+                if (r == -EEXIST)
+                        reused = true;
+                else if (r < 0)
+                        return r;
+        }
+
+        if (s->cache_store) {
+                r = ca_store_put(s->cache_store, id, CA_CHUNK_UNCOMPRESSED, p, l);
+                if (r < 0 && r != -EEXIST)
+                        return r;
+        }
+
+        return reused;
+}
+
 static int ca_sync_start(CaSync *s) {
         size_t i;
         int r;
@@ -1150,6 +1509,12 @@ static int ca_sync_start(CaSync *s) {
         if (s->started)
                 return 0;
 
+        if (!s->name_cache) {
+                s->name_cache = ca_name_cache_new();
+                if (!s->name_cache)
+                        return -ENOMEM;
+        }
+
         if (s->direction == CA_SYNC_ENCODE && s->archive_path && s->archive_fd < 0) {
                 if (!s->temporary_archive_path) {
                         r = tempfn_random(s->archive_path, &s->temporary_archive_path);
@@ -1193,10 +1558,31 @@ static int ca_sync_start(CaSync *s) {
                 r = ca_encoder_set_uid_range(s->encoder, s->uid_range);
                 if (r < 0)
                         return r;
+                r = ca_encoder_set_name_cache(s->encoder, s->name_cache);
+                if (r < 0)
+                        return r;
+
+                /* We read everything from beginning to end, hence use large reads */
+                r = ca_encoder_set_payload_read_size(s->encoder, CA_SYNC_PAYLOAD_READ_SIZE);
+                if (r < 0)
+                        return r;
+
+                if (s->n_threads != 1) {
+                        r = ca_encoder_set_prefetch_threads(s->encoder, s->n_threads > 1 ? MIN(s->n_threads, CA_DIR_PREFETCH_THREADS_MAX) : CA_DIR_PREFETCH_THREADS_DEFAULT);
+                        if (r < 0)
+                                return r;
+                }
         }
 
         if (s->direction == CA_SYNC_DECODE && !s->decoder) {
 
+                /* Open what we extract into as seed before we start replacing it */
+                if (s->lazy_output_seed && !s->output_seed && (s->base_fd >= 0 || s->base_path)) {
+                        r = ca_sync_open_output_seed(s);
+                        if (r < 0)
+                                return r;
+                }
+
                 if (s->boundary_fd < 0 && s->boundary_path) {
 
                         if (mkdir(s->boundary_path, 0777) < 0 && errno != EEXIST)
@@ -1266,6 +1652,9 @@ static int ca_sync_start(CaSync *s) {
 
                 if (s->boundary_fd >= 0) {
 
+                        if (fstat(s->boundary_fd, &s->target_stat) < 0)
+                                return -errno;
+
                         r = ca_decoder_set_boundary_fd(s->decoder, s->boundary_fd);
                         if (r < 0)
                                 return r;
@@ -1274,6 +1663,9 @@ static int ca_sync_start(CaSync *s) {
 
                 } else  if (s->base_fd >= 0) {
 
+                        if (fstat(s->base_fd, &s->target_stat) < 0)
+                                return -errno;
+
                         r = ca_decoder_set_base_fd(s->decoder, s->base_fd);
                         if (r < 0)
                                 return r;
@@ -1319,6 +1711,9 @@ static int ca_sync_start(CaSync *s) {
                 r = ca_decoder_set_uid_range(s->decoder, s->uid_range);
                 if (r < 0)
                         return r;
+                r = ca_decoder_set_name_cache(s->decoder, s->name_cache);
+                if (r < 0)
+                        return r;
         }
 
         if (s->remote_index && !s->index) {
@@ -1383,7 +1778,7 @@ static int ca_sync_start(CaSync *s) {
                 if (s->direction == CA_SYNC_ENCODE) {
                         /* Propagate the chunk size to the index we generate */
 
-                        r = ca_index_set_feature_flags(s->index, s->feature_flags);
+                        r = ca_index_set_feature_flags(s->index, s->feature_flags | ca_feature_flags_from_digest_type(s->chunk_digest_type));
                         if (r < 0)
                                 return r;
 
@@ -1411,29 +1806,98 @@ static int ca_sync_start(CaSync *s) {
                         return r;
         }
 
-        for (i = 0; i < s->n_seeds; i++) {
-                /* Tell seeders whether to calculate hardlink and/or chunk seeds */
+        if (s->compression_level != CA_COMPRESSION_LEVEL_DEFAULT) {
+                r = ca_compression_level_valid(s->compression_type, s->compression_level);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        return -ERANGE;
+        }
 
-                r = ca_seed_set_hardlink(s->seeds[i], s->hardlink);
+        if (s->wstore) {
+                r = ca_store_set_compression_type(s->wstore, s->compression_type);
                 if (r < 0)
                         return r;
 
-                r = ca_seed_set_chunks(s->seeds[i], !!s->index);
+                r = ca_store_set_compression_level(s->wstore, s->compression_level);
                 if (r < 0)
                         return r;
-        }
 
-        s->started = true;
+                if (s->store_index >= 0) {
+                        r = ca_store_set_index(s->wstore, s->store_index);
+                        if (r < 0)
+                                return r;
+                }
+        }
 
-        return 1;
-}
+        if (s->store_index >= 0)
+                for (i = 0; i < s->n_rstores; i++) {
+                        r = ca_store_set_index(s->rstores[i], s->store_index);
+                        if (r < 0)
+                                return r;
+                }
 
-static int ca_sync_write_archive(CaSync *s, const void *p, size_t l) {
-        assert(s);
-        assert(p || l == 0);
+        if (s->cache_store) {
+                r = ca_store_set_compression_type(s->cache_store, s->compression_type);
+                if (r < 0)
+                        return r;
 
-        if (s->archive_fd < 0)
-                return 0;
+                r = ca_store_set_compression_level(s->cache_store, s->compression_level);
+                if (r < 0)
+                        return r;
+        }
+
+        for (i = 0; i < s->n_seeds; i++) {
+                /* Tell seeders whether to calculate hardlink and/or chunk seeds */
+
+                r = ca_seed_set_hardlink(s->seeds[i], s->hardlink);
+                if (r < 0)
+                        return r;
+
+                r = ca_seed_set_chunks(s->seeds[i], !!s->index);
+                if (r < 0)
+                        return r;
+
+                r = ca_seed_set_name_cache(s->seeds[i], s->name_cache);
+                if (r < 0)
+                        return r;
+        }
+
+        if (s->direction == CA_SYNC_ENCODE &&
+            s->n_threads > 1 &&
+            !s->pipeline &&
+            (s->wstore || s->cache_store || s->index)) {
+
+                /* Hash, compress and store chunks on worker threads, while we continue encoding and chunking */
+                r = ca_chunk_pipeline_new(s->n_threads, s->chunk_digest_type, ca_sync_store_chunk, s, &s->pipeline);
+                if (r < 0)
+                        return r;
+        }
+
+        if (s->direction == CA_SYNC_ENCODE &&
+            s->n_threads != 1 &&
+            !s->pipeline &&
+            !s->store_writer &&
+            (s->wstore || s->cache_store)) {
+
+                /* Compress and write chunks to the stores in the background, while we continue encoding, chunking
+                 * and hashing */
+                r = ca_store_writer_new(CA_STORE_WRITER_THREADS_DEFAULT, s->wstore, s->cache_store, &s->store_writer);
+                if (r < 0)
+                        return r;
+        }
+
+        s->started = true;
+
+        return 1;
+}
+
+static int ca_sync_write_archive(CaSync *s, const void *p, size_t l) {
+        assert(s);
+        assert(p || l == 0);
+
+        if (s->archive_fd < 0)
+                return 0;
 
         return loop_write(s->archive_fd, p, l);
 }
@@ -1448,43 +1912,262 @@ static int ca_sync_write_remote_archive(CaSync *s, const void *p, size_t l) {
         return ca_remote_put_archive(s->remote_archive, p, l);
 }
 
-static int ca_sync_write_one_chunk(CaSync *s, const void *p, size_t l) {
+static int ca_sync_get_zero_buffer(CaSync *s, size_t l, const void **ret) {
+        void *p;
+
+        assert(s);
+        assert(ret);
+
+        if (l > s->zero_buffer_size) {
+                p = calloc(l, 1);
+                if (!p)
+                        return -ENOMEM;
+
+                free(s->zero_buffer);
+                s->zero_buffer = p;
+                s->zero_buffer_size = l;
+        }
+
+        *ret = s->zero_buffer;
+        return 0;
+}
+
+static CaSyncZeroChunk* ca_sync_find_zero_chunk_by_size(CaSync *s, size_t l) {
+        size_t i;
+
+        assert(s);
+
+        for (i = 0; i < s->n_zero_chunks; i++)
+                if (s->zero_chunks[i].size == l)
+                        return s->zero_chunks + i;
+
+        return NULL;
+}
+
+static CaSyncZeroChunk* ca_sync_find_zero_chunk_by_id(CaSync *s, const CaChunkID *id) {
+        size_t i;
+
+        assert(s);
+        assert(id);
+
+        for (i = 0; i < s->n_zero_chunks; i++)
+                if (ca_chunk_id_equal(&s->zero_chunks[i].id, id))
+                        return s->zero_chunks + i;
+
+        return NULL;
+}
+
+static void ca_sync_add_zero_chunk(CaSync *s, const CaChunkID *id, size_t l) {
+        assert(s);
+        assert(id);
+
+        if (ca_sync_find_zero_chunk_by_size(s, l))
+                return;
+
+        /* Most images only ever have a couple of sizes of zero chunks, hence simply replace the oldest entry if
+         * we run out of space */
+        s->zero_chunks[s->zero_chunks_next] = (CaSyncZeroChunk) {
+                .id = *id,
+                .size = l,
+        };
+
+        s->zero_chunks_next = (s->zero_chunks_next + 1) % CA_SYNC_ZERO_CHUNKS_MAX;
+        s->n_zero_chunks = MIN(s->n_zero_chunks + 1, CA_SYNC_ZERO_CHUNKS_MAX);
+}
+
+static int ca_sync_learn_zero_chunk(CaSync *s, const CaChunkID *id, const void *p, size_t l) {
+        assert(s);
+        assert(id);
+
+        /* Called for chunks we retrieved from a store, to recognize all-zero chunks of sizes we don't know yet */
+
+        if (l < CA_CHUNK_SIZE_LIMIT_MIN)
+                return 0;
+        if (ca_sync_find_zero_chunk_by_size(s, l))
+                return 0;
+        if (!memeqzero(p, l))
+                return 0;
+
+        ca_sync_add_zero_chunk(s, id, l);
+        return 1;
+}
+
+static int ca_sync_index_chunk(CaSync *s, const CaChunkID *id, size_t l, bool reused) {
+        assert(s);
+        assert(id);
+
+        s->n_written_chunks++;
+
+        if (reused)
+                s->n_reused_chunks++;
+
+        if (s->index)
+                return ca_index_write_chunk(s->index, id, l);
+
+        return 0;
+}
+
+static int ca_sync_collect_chunk(CaSync *s, bool wait) {
         CaChunkID id;
-        int r;
+        int r, result;
+        size_t l;
 
         assert(s);
-        assert(p || l == 0);
+        assert(s->pipeline);
 
-        r = ca_sync_make_chunk_id(s, p, l, &id);
+        /* Dequeues the next chunk processed by the workers, in the original order, and adds it to the index */
+
+        r = ca_chunk_pipeline_get(s->pipeline, wait, &id, &l, &result);
+        if (r <= 0)
+                return r;
+
+        r = ca_sync_index_chunk(s, &id, l, result > 0);
         if (r < 0)
                 return r;
 
-        s->n_written_chunks++;
+        return 1;
+}
 
-        if (s->wstore) {
-                r = ca_store_put(s->wstore, &id, CA_CHUNK_UNCOMPRESSED, p, l);
-                if (r == -EEXIST)
-                        s->n_reused_chunks++;
-                else if (r < 0)
+static int ca_sync_collect_chunks(CaSync *s, bool wait) {
+        int r;
+
+        assert(s);
+
+        if (!s->pipeline)
+                return 0;
+
+        for (;;) {
+                r = ca_sync_collect_chunk(s, wait);
+                if (r == -EAGAIN || r == 0)
+                        return 0;
+                if (r < 0)
                         return r;
         }
+}
 
-        if (s->cache_store) {
-                r = ca_store_put(s->cache_store, &id, CA_CHUNK_UNCOMPRESSED, p, l);
-                if (r < 0 && r != -EEXIST)
+static int ca_sync_queue_store_chunk(CaSync *s, const CaChunkID *id, const void *p, size_t l) {
+        int r;
+
+        assert(s);
+        assert(id);
+
+        /* Like ca_sync_store_chunk(), but hands the chunk to the background writer if we have one. Chunks that turn
+         * out to exist in the store already are counted as reused once the writer is done with them. */
+
+        if (!s->store_writer)
+                return ca_sync_store_chunk(s, id, p, l);
+
+        while (ca_store_writer_is_full(s->store_writer)) {
+                r = ca_store_writer_collect(s->store_writer, true, &s->n_reused_chunks);
+                if (r < 0)
                         return r;
         }
 
-        if (s->index) {
-                r = ca_index_write_chunk(s->index, &id, l);
+        r = ca_store_writer_put(s->store_writer, id, p, l);
+        if (r < 0)
+                return r;
+        if (r > 0) /* Being written already */
+                return !!s->wstore;
+
+        r = ca_store_writer_collect(s->store_writer, false, &s->n_reused_chunks);
+        if (r < 0)
+                return r;
+
+        return 0;
+}
+
+static int ca_sync_flush_store_writes(CaSync *s) {
+        int r;
+
+        assert(s);
+
+        if (!s->store_writer)
+                return 0;
+
+        do {
+                r = ca_store_writer_collect(s->store_writer, true, &s->n_reused_chunks);
                 if (r < 0)
                         return r;
-        }
+        } while (r > 0);
 
         return 0;
 }
 
+static int ca_sync_write_one_chunk(CaSync *s, const void *p, size_t l) {
+        CaChunkID id;
+        int r, reused;
+
+        assert(s);
+        assert(p || l == 0);
+
+        if (l >= CA_CHUNK_SIZE_LIMIT_MIN && memeqzero(p, l)) {
+                CaSyncZeroChunk *z;
+
+                /* All-zero chunks are frequent in disk images. Calculate their ID and store them only the first time
+                 * we come across one of a specific size. */
+                z = ca_sync_find_zero_chunk_by_size(s, l);
+                if (z) {
+                        id = z->id;
+                        reused = !!s->wstore;
+                        s->n_zero_chunk_hits++;
+                } else {
+                        r = ca_sync_make_chunk_id(s, p, l, &id);
+                        if (r < 0)
+                                return r;
+
+                        reused = ca_sync_queue_store_chunk(s, &id, p, l);
+                        if (reused < 0)
+                                return reused;
+
+                        ca_sync_add_zero_chunk(s, &id, l);
+                }
+
+                if (!s->pipeline)
+                        return ca_sync_index_chunk(s, &id, l, reused > 0);
+
+                /* Queue it up behind the chunks still being processed, so that the index stays in order */
+                while (ca_chunk_pipeline_is_full(s->pipeline)) {
+                        r = ca_sync_collect_chunk(s, true);
+                        if (r < 0)
+                                return r;
+                }
+
+                r = ca_chunk_pipeline_put_done(s->pipeline, &id, l, reused);
+                if (r < 0)
+                        return r;
+
+                return ca_sync_collect_chunks(s, false);
+        }
+
+        if (s->pipeline) {
+                /* If the queue is full, wait for the oldest chunk to be done, so that we have a free slot */
+                while (ca_chunk_pipeline_is_full(s->pipeline)) {
+                        r = ca_sync_collect_chunk(s, true);
+                        if (r < 0)
+                                return r;
+                }
+
+                r = ca_chunk_pipeline_put(s->pipeline, p, l);
+                if (r < 0)
+                        return r;
+
+                /* Pick up whatever is already done, without waiting */
+                return ca_sync_collect_chunks(s, false);
+        }
+
+        r = ca_sync_make_chunk_id(s, p, l, &id);
+        if (r < 0)
+                return r;
+
+        reused = ca_sync_queue_store_chunk(s, &id, p, l);
+        if (reused < 0)
+                return reused;
+
+        return ca_sync_index_chunk(s, &id, l, reused > 0);
+}
+
 static int ca_sync_write_chunks(CaSync *s, const void *p, size_t l) {
+        bool zero;
         int r;
 
         assert(s);
@@ -1493,11 +2176,18 @@ static int ca_sync_write_chunks(CaSync *s, const void *p, size_t l) {
         if (!s->wstore && !s->cache_store && !s->index)
                 return 0;
 
+        /* Holes in sparse files and preallocated images come in long runs of zeroes, which the chunker can skip over
+         * without hashing every byte */
+        zero = l > 0 && memeqzero(p, l);
+
         while (l > 0) {
                 const void *chunk;
                 size_t chunk_size, k;
 
-                k = ca_chunker_scan(&s->chunker, p, l);
+                if (zero)
+                        k = ca_chunker_scan_zeroes(&s->chunker, l);
+                else
+                        k = ca_chunker_scan(&s->chunker, p, l);
                 if (k == (size_t) -1) {
                         if (!realloc_buffer_append(&s->buffer, p, l))
                                 return -ENOMEM;
@@ -1536,6 +2226,15 @@ static int ca_sync_write_final_chunk(CaSync *s) {
         if (!s->wstore && !s->cache_store && !s->index)
                 return 0;
 
+        /* Wait for all chunks still being processed by the workers, and written in the background */
+        r = ca_sync_collect_chunks(s, true);
+        if (r < 0)
+                return r;
+
+        r = ca_sync_flush_store_writes(s);
+        if (r < 0)
+                return r;
+
         if (realloc_buffer_size(&s->buffer) == 0)
                 return 0;
 
@@ -1543,6 +2242,14 @@ static int ca_sync_write_final_chunk(CaSync *s) {
         if (r < 0)
                 return r;
 
+        r = ca_sync_collect_chunks(s, true);
+        if (r < 0)
+                return r;
+
+        r = ca_sync_flush_store_writes(s);
+        if (r < 0)
+                return r;
+
         if (s->index) {
                 r = ca_index_write_eof(s->index);
                 if (r < 0)
@@ -1680,15 +2387,112 @@ static bool ca_sync_shall_seed(CaSync *s) {
         return true;
 }
 
+static bool ca_sync_seed_parallel(CaSync *s) {
+        assert(s);
+
+        return s->n_seeds > 1 && s->n_threads != 1;
+}
+
 static bool ca_sync_seed_ready(CaSync *s) {
         assert(s);
 
         if (!ca_sync_shall_seed(s))
                 return true;
 
+        if (ca_sync_seed_parallel(s))
+                return s->seed_pool && s->n_pending_seeds == 0;
+
         return s->current_seed >= s->n_seeds;
 }
 
+static bool ca_sync_seed_decode_ready(CaSync *s) {
+        size_t i;
+
+        assert(s);
+
+        if (!ca_sync_shall_seed(s))
+                return true;
+        if (!ca_sync_seed_parallel(s))
+                return ca_sync_seed_ready(s);
+
+        /* Seeds indexed in the background are used once they are ready, until then we fall back to the stores */
+        if (!s->seed_pool)
+                return false;
+
+        for (i = 0; i < s->n_seeds; i++)
+                if (s->seed_blocking[i] && !ca_seed_pool_is_done(s->seed_pool, i))
+                        return false;
+
+        return true;
+}
+
+static bool ca_sync_seed_usable(CaSync *s, size_t i) {
+        assert(s);
+        assert(i < s->n_seeds);
+
+        if (!ca_sync_seed_parallel(s))
+                return true;
+
+        return s->seed_pool && ca_seed_pool_is_done(s->seed_pool, i);
+}
+
+static int ca_sync_get_from_output(
+                CaSync *s,
+                const CaChunkID *chunk_id,
+                const void **ret,
+                uint64_t *ret_size,
+                CaOrigin **ret_origin) {
+
+        uint64_t offset, left;
+        CaLocation *location;
+        size_t l;
+        char *path;
+        int r;
+
+        assert(s);
+        assert(chunk_id);
+        assert(ret);
+        assert(ret_size);
+
+        if (!s->output_seed)
+                return 0;
+
+        /* If we just seeked, we don't know where the chunk starts */
+        if (s->next_chunk_size == UINT64_MAX || s->chunk_skip > 0)
+                return 0;
+
+        /* Only a chunk that lies entirely in the payload of the file being decoded can be found at the same offset of
+         * the old version of the file */
+        r = ca_decoder_get_payload_request(s->decoder, &offset, &left);
+        if (r == -ENODATA)
+                return 0;
+        if (r < 0)
+                return r;
+        if (left != UINT64_MAX && s->next_chunk_size > left)
+                return 0;
+
+        r = ca_decoder_current_path(s->decoder, &path);
+        if (r < 0)
+                return r;
+
+        r = ca_location_new(path, CA_LOCATION_PAYLOAD, offset, s->next_chunk_size, &location);
+        free(path);
+        if (r < 0)
+                return r;
+
+        r = ca_seed_get_at(s->output_seed, chunk_id, location, ret, &l, ret_origin);
+        ca_location_unref(location);
+        if (r == -ENOMEM)
+                return r;
+        if (r < 0) /* Whatever is in the way, changed data or a file that is gone, the stores have the chunk */
+                return 0;
+
+        s->n_output_seed_bytes += l;
+
+        *ret_size = l;
+        return 1;
+}
+
 static int ca_sync_process_decoder_request(CaSync *s) {
         int r;
 
@@ -1730,10 +2534,18 @@ static int ca_sync_process_decoder_request(CaSync *s) {
                 /* If we haven't indexed all seeds yet, then let's not start decoding yet. If we came this far, we know
                  * that the index header has been read at least, hence the seeders can be initialized with the index'
                  * chunk size, hence let's wait for them to complete. */
-                if (!ca_sync_seed_ready(s))
+                if (!ca_sync_seed_decode_ready(s))
                         return CA_SYNC_POLL;
 
-                r = ca_sync_get(s, &s->next_chunk, CA_CHUNK_UNCOMPRESSED, &p, &chunk_size, NULL, &origin);
+                /* Similar, the chunk digest used by the index needs to be known before we can validate chunks */
+                if (!s->index_flags_propagated)
+                        return CA_SYNC_STEP;
+
+                r = ca_sync_get_from_output(s, &s->next_chunk, &p, &chunk_size, &origin);
+                if (r == 0)
+                        r = ca_sync_get(s, &s->next_chunk, CA_CHUNK_UNCOMPRESSED, &p, &chunk_size, NULL, &origin);
+                if (IN_SET(r, -EAGAIN, -EALREADY))
+                        s->prefetch_stalled = true;
                 if (r == -EAGAIN) /* Don't have this right now, but requested it now */
                         return CA_SYNC_STEP;
                 if (r == -EALREADY) /* Don't have this right now, but it was already enqueued. */
@@ -1767,6 +2579,14 @@ static int ca_sync_process_decoder_request(CaSync *s) {
                 if (r < 0)
                         return r;
 
+                if (s->prefetch) {
+                        r = ca_prefetch_put_consumed(s->prefetch, chunk_size, s->prefetch_stalled, now(CLOCK_MONOTONIC));
+                        if (r < 0)
+                                return r;
+
+                        s->prefetch_stalled = false;
+                }
+
                 return CA_SYNC_STEP;
         }
 
@@ -1951,6 +2771,9 @@ static int ca_sync_try_hardlink(CaSync *s) {
                 CaFileRoot *root;
                 char *p;
 
+                if (!ca_sync_seed_usable(s, i))
+                        continue;
+
                 r = ca_seed_get_hardlink_target(s->seeds[i], &digest, &p);
                 if (r == -ENOENT)
                         continue;
@@ -2043,12 +2866,44 @@ static CaSeed *ca_sync_current_seed(CaSync *s) {
         if (!ca_sync_shall_seed(s))
                 return NULL;
 
+        if (ca_sync_seed_parallel(s)) /* The seeds belong to the workers while they are indexed */
+                return NULL;
+
         if (s->current_seed >= s->n_seeds)
                 return NULL;
 
         return s->seeds[s->current_seed];
 }
 
+static int ca_sync_start_seed_pool(CaSync *s) {
+        struct stat st;
+        size_t i;
+        int r;
+
+        assert(s);
+        assert(!s->seed_pool);
+
+        s->seed_blocking = new0(bool, s->n_seeds);
+        if (!s->seed_blocking)
+                return -ENOMEM;
+
+        /* A seed we extract into changes under our feet once decoding begins, hence decoding has to wait for it */
+        for (i = 0; i < s->n_seeds && s->target_stat.st_ino != 0; i++) {
+                r = ca_seed_get_base_stat(s->seeds[i], &st);
+                if (r < 0)
+                        return r;
+
+                s->seed_blocking[i] = st.st_dev == s->target_stat.st_dev && st.st_ino == s->target_stat.st_ino;
+        }
+
+        r = ca_seed_pool_new(s->seeds, s->n_seeds, s->n_threads, &s->seed_pool);
+        if (r < 0)
+                return r;
+
+        s->n_pending_seeds = s->n_seeds;
+        return 0;
+}
+
 static int ca_sync_seed_step(CaSync *s) {
         int r;
 
@@ -2060,6 +2915,24 @@ static int ca_sync_seed_step(CaSync *s) {
         if (s->index && !s->index_flags_propagated) /* Index flags/chunk sizes not propagated to the seeds yet. Let's wait until then */
                 return CA_SYNC_POLL;
 
+        if (ca_sync_seed_parallel(s)) {
+                if (!s->seed_pool) {
+                        r = ca_sync_start_seed_pool(s);
+                        if (r < 0)
+                                return r;
+                }
+
+                if (s->n_pending_seeds == 0)
+                        return CA_SYNC_POLL;
+
+                r = ca_seed_pool_process(s->seed_pool);
+                if (r < 0)
+                        return r;
+
+                s->n_pending_seeds = r;
+                return CA_SYNC_POLL;
+        }
+
         for (;;) {
                 CaSeed *seed;
 
@@ -2141,7 +3014,9 @@ static CaRemote *ca_sync_current_remote(CaSync *s) {
 }
 
 static int ca_sync_remote_prefetch(CaSync *s) {
-        uint64_t available, saved, requested = 0;
+        uint64_t available, saved, position, requested = 0;
+        CaIndexChunk chunks[64];
+        size_t n, k;
         int r;
 
         assert(s);
@@ -2156,44 +3031,78 @@ static int ca_sync_remote_prefetch(CaSync *s) {
         if (!ca_sync_seed_ready(s))
                 return CA_SYNC_POLL;
 
+        if (!s->prefetch) {
+                s->prefetch = ca_prefetch_new();
+                if (!s->prefetch)
+                        return -ENOMEM;
+        }
+
+        /* Requests the chunks within a window ahead of the decoder we don't have locally yet, each only once. The
+         * window moves along with the decoder, and is limited in size, so that we neither pile up requests for the
+         * whole image, nor let the pipe to the remote run dry. */
+
         r = ca_index_get_available_chunks(s->index, &available);
         if (r == -ENODATA || r == -EAGAIN)
                 return CA_SYNC_POLL;
         if (r < 0)
                 return r;
-        if (s->n_prefetched_chunks >= available) /* Already prefetched all we have */
-                return CA_SYNC_POLL;
 
         r = ca_index_get_position(s->index, &saved);
         if (r < 0)
                 return r;
 
-        r = ca_index_set_position(s->index, s->n_prefetched_chunks);
+        /* If the decoder is waiting for a chunk, the index is positioned after it already */
+        position = saved;
+        if (s->next_chunk_valid && position > 0)
+                position--;
+
+        r = ca_prefetch_advance(s->prefetch, position);
         if (r < 0)
                 return r;
 
-        for (;;) {
-                CaChunkID id;
+        if (ca_prefetch_full(s->prefetch))
+                return CA_SYNC_POLL;
+
+        if (ca_prefetch_next(s->prefetch) >= available) /* Already prefetched all we have */
+                return CA_SYNC_POLL;
 
-                r = ca_index_read_chunk(s->index, &id, NULL, NULL);
+        r = ca_index_set_position(s->index, ca_prefetch_next(s->prefetch));
+        if (r < 0)
+                return r;
+
+        while (!ca_prefetch_full(s->prefetch)) {
+                r = ca_index_read_chunks(s->index, chunks, MIN(ELEMENTSOF(chunks), available - ca_prefetch_next(s->prefetch)), &n);
                 if (r == 0 || r == -EAGAIN)
                         break;
                 if (r < 0)
                         return r;
 
-                s->n_prefetched_chunks++;
+                for (k = 0; k < n && !ca_prefetch_full(s->prefetch); k++) {
+                        bool request = false;
 
-                r = ca_sync_has_local(s, &id);
-                if (r < 0)
-                        return r;
-                if (r > 0)
-                        continue;
+                        r = ca_prefetch_is_requested(s->prefetch, &chunks[k].id);
+                        if (r < 0)
+                                return r;
+                        if (r == 0) {
+                                r = ca_sync_has_local(s, &chunks[k].id);
+                                if (r < 0)
+                                        return r;
 
-                r = ca_remote_request_async(s->remote_wstore, &id, false);
-                if (r < 0)
-                        return r;
+                                request = r == 0;
+                        }
+
+                        if (request) {
+                                r = ca_remote_request_async(s->remote_wstore, &chunks[k].id, false);
+                                if (r < 0)
+                                        return r;
+
+                                requested++;
+                        }
 
-                requested ++;
+                        r = ca_prefetch_push(s->prefetch, &chunks[k].id, chunks[k].size, request);
+                        if (r < 0)
+                                return r;
+                }
         }
 
         r = ca_index_set_position(s->index, saved);
@@ -2271,6 +3180,14 @@ static int ca_sync_remote_push_chunk(CaSync *s) {
         if (r < 0)
                 return r;
 
+        /* The index references chunks as soon as they are queued for writing, hence the remote side might ask for
+         * one that isn't in the cache store yet */
+        if (s->store_writer) {
+                r = ca_store_writer_wait(s->store_writer, &id);
+                if (r < 0)
+                        return r;
+        }
+
         r = ca_sync_get_local(s, &id, CA_CHUNK_COMPRESSED, &p, &l, NULL, NULL);
         if (r == -ENOENT) {
                 r = ca_remote_put_missing(s->remote_wstore, &id);
@@ -2392,8 +3309,41 @@ static int ca_sync_remote_step(CaSync *s) {
         return CA_SYNC_POLL;
 }
 
+static int ca_sync_propagate_to_seed(
+                CaSeed *seed,
+                uint64_t flags,
+                CaDigestType digest_type,
+                size_t cmin,
+                size_t cavg,
+                size_t cmax) {
+
+        int r;
+
+        assert(seed);
+
+        /* The digest is not a property of the archive, hence don't pass it on as feature flag */
+        r = ca_seed_set_feature_flags(seed, flags & ~CA_FORMAT_BLAKE2B_256);
+        if (r < 0)
+                return r;
+
+        r = ca_seed_set_chunk_digest(seed, digest_type);
+        if (r < 0)
+                return r;
+
+        r = ca_seed_set_chunk_size_min(seed, cmin);
+        if (r < 0)
+                return r;
+
+        r = ca_seed_set_chunk_size_avg(seed, cavg);
+        if (r < 0)
+                return r;
+
+        return ca_seed_set_chunk_size_max(seed, cmax);
+}
+
 static int ca_sync_propagate_index_flags(CaSync *s) {
         size_t cmin, cavg, cmax;
+        CaDigestType digest_type;
         uint64_t flags;
         size_t i;
         int r;
@@ -2401,9 +3351,9 @@ static int ca_sync_propagate_index_flags(CaSync *s) {
         assert(s);
 
         /* If we read the header of the index file, make sure to propagate the flags and chunk size stored in it to the
-         * seeds. */
+         * seeds, and the chunk digest to everything that calculates chunk IDs. */
 
-        if (!ca_sync_shall_seed(s))
+        if (s->direction != CA_SYNC_DECODE)
                 return CA_SYNC_POLL;
 
         if (!s->index || s->index_flags_propagated) /* The flags/chunk size is already propagated */
@@ -2412,34 +3362,71 @@ static int ca_sync_propagate_index_flags(CaSync *s) {
         r = ca_index_get_feature_flags(s->index, &flags);
         if (r == -ENODATA) /* haven't read enough from the index header yet, let's wait */
                 return CA_SYNC_POLL;
-
-        r = ca_index_get_chunk_size_min(s->index, &cmin);
         if (r < 0)
                 return r;
 
-        r = ca_index_get_chunk_size_avg(s->index, &cavg);
-        if (r < 0)
-                return r;
+        digest_type = ca_feature_flags_to_digest_type(flags);
+        if (digest_type < 0)
+                return -EOPNOTSUPP;
+        if (!ca_digest_type_supported(digest_type))
+                return -EOPNOTSUPP;
+
+        s->chunk_digest_type = digest_type;
+
+        if (s->remote_wstore) {
+                r = ca_remote_set_digest_type(s->remote_wstore, digest_type);
+                if (r < 0)
+                        return r;
+        }
+
+        for (i = 0; i < s->n_remote_rstores; i++) {
+                r = ca_remote_set_digest_type(s->remote_rstores[i], digest_type);
+                if (r < 0)
+                        return r;
+        }
 
+        /* Images are typically chunked in maximum-sized chunks wherever they are all zeroes, hence calculate the ID
+         * of that one right-away, so that we never have to retrieve it */
         r = ca_index_get_chunk_size_max(s->index, &cmax);
         if (r < 0)
                 return r;
 
-        for (i = 0; i < s->n_seeds; i++) {
+        if (!ca_sync_find_zero_chunk_by_size(s, cmax)) {
+                CaChunkID id;
+                const void *p;
 
-                r = ca_seed_set_feature_flags(s->seeds[i], flags);
+                r = ca_sync_get_zero_buffer(s, cmax, &p);
                 if (r < 0)
                         return r;
 
-                r = ca_seed_set_chunk_size_min(s->seeds[i], cmin);
+                r = ca_sync_make_chunk_id(s, p, cmax, &id);
                 if (r < 0)
                         return r;
 
-                r = ca_seed_set_chunk_size_avg(s->seeds[i], cavg);
+                ca_sync_add_zero_chunk(s, &id, cmax);
+        }
+
+        if (!ca_sync_shall_seed(s) && !s->output_seed) {
+                s->index_flags_propagated = true;
+                return CA_SYNC_STEP;
+        }
+
+        r = ca_index_get_chunk_size_min(s->index, &cmin);
+        if (r < 0)
+                return r;
+
+        r = ca_index_get_chunk_size_avg(s->index, &cavg);
+        if (r < 0)
+                return r;
+
+        for (i = 0; i < s->n_seeds; i++) {
+                r = ca_sync_propagate_to_seed(s->seeds[i], flags, digest_type, cmin, cavg, cmax);
                 if (r < 0)
                         return r;
+        }
 
-                r = ca_seed_set_chunk_size_max(s->seeds[i], cmax);
+        if (s->output_seed) {
+                r = ca_sync_propagate_to_seed(s->output_seed, flags, digest_type, cmin, cavg, cmax);
                 if (r < 0)
                         return r;
         }
@@ -2492,6 +3479,115 @@ int ca_sync_step(CaSync *s) {
         return ca_sync_step_encode(s);
 }
 
+/* Looks up a chunk in a local store, unless its filter tells us that it's not there anyway */
+static int ca_sync_store_get(
+                CaSync *s,
+                CaStore *store,
+                const CaChunkID *chunk_id,
+                CaChunkCompression desired_compression,
+                const void **ret,
+                size_t *ret_size,
+                CaChunkCompression *ret_effective_compression) {
+
+        int f, r;
+
+        assert(s);
+        assert(store);
+
+        f = ca_store_filter(store, chunk_id);
+        if (f == 0) {
+                s->n_filter_skips++;
+                return -ENOENT;
+        }
+
+        r = ca_store_get(store, chunk_id, desired_compression, ret, ret_size, ret_effective_compression);
+        if (r == -ENOENT && f > 0)
+                s->n_filter_false_positives++;
+        if (r < 0)
+                return r;
+
+        if (desired_compression == CA_CHUNK_UNCOMPRESSED)
+                (void) ca_sync_learn_zero_chunk(s, chunk_id, *ret, *ret_size);
+
+        if (s->chunk_cache && desired_compression == CA_CHUNK_UNCOMPRESSED) {
+                int k;
+
+                k = ca_chunk_cache_put(s->chunk_cache, chunk_id, *ret, *ret_size);
+                if (k < 0)
+                        return k;
+        }
+
+        return r;
+}
+
+static int ca_sync_store_has(CaSync *s, CaStore *store, const CaChunkID *chunk_id) {
+        int f, r;
+
+        assert(s);
+        assert(store);
+
+        f = ca_store_filter(store, chunk_id);
+        if (f == 0) {
+                s->n_filter_skips++;
+                return 0;
+        }
+
+        r = ca_store_has(store, chunk_id);
+        if (r == 0 && f > 0)
+                s->n_filter_false_positives++;
+
+        return r;
+}
+
+static int ca_sync_get_zero_chunk(
+                CaSync *s,
+                const CaChunkID *chunk_id,
+                CaChunkCompression desired_compression,
+                const void **ret,
+                size_t *ret_size,
+                CaChunkCompression *ret_effective_compression) {
+
+        CaSyncZeroChunk *z;
+        const void *p;
+        int r;
+
+        assert(s);
+        assert(chunk_id);
+        assert(ret);
+        assert(ret_size);
+
+        z = ca_sync_find_zero_chunk_by_id(s, chunk_id);
+        if (!z)
+                return -ENOENT;
+
+        r = ca_sync_get_zero_buffer(s, z->size, &p);
+        if (r < 0)
+                return r;
+
+        if (desired_compression == CA_CHUNK_COMPRESSED) {
+                realloc_buffer_empty(&s->compress_buffer);
+
+                r = ca_compress(&s->compression_context, s->compression_type, s->compression_level, p, z->size, &s->compress_buffer);
+                if (r < 0)
+                        return r;
+
+                *ret = realloc_buffer_data(&s->compress_buffer);
+                *ret_size = realloc_buffer_size(&s->compress_buffer);
+
+                if (ret_effective_compression)
+                        *ret_effective_compression = CA_CHUNK_COMPRESSED;
+        } else {
+                *ret = p;
+                *ret_size = z->size;
+
+                if (ret_effective_compression)
+                        *ret_effective_compression = CA_CHUNK_UNCOMPRESSED;
+        }
+
+        s->n_zero_chunk_hits++;
+        return 0;
+}
+
 int ca_sync_get_local(
                 CaSync *s,
                 const CaChunkID *chunk_id,
@@ -2513,12 +3609,33 @@ int ca_sync_get_local(
         if (!ret_size)
                 return -EINVAL;
 
+        r = ca_sync_get_zero_chunk(s, chunk_id, desired_compression, ret, ret_size, ret_effective_compression);
+        if (r >= 0) {
+                if (ret_origin)
+                        *ret_origin = NULL;
+                return r;
+        }
+        if (r != -ENOENT)
+                return r;
+
         for (i = 0; i < s->n_seeds; i++) {
                 CaOrigin *origin = NULL;
                 const void *p;
                 size_t l;
+                int f;
+
+                if (!ca_sync_seed_usable(s, i))
+                        continue;
+
+                f = ca_seed_filter(s->seeds[i], chunk_id);
+                if (f == 0) {
+                        s->n_filter_skips++;
+                        continue;
+                }
 
                 r = ca_seed_get(s->seeds[i], chunk_id, &p, &l, ret_origin ? &origin : NULL);
+                if (r == -ENOENT && f > 0)
+                        s->n_filter_false_positives++;
                 if (r == -ESTALE) {
                         fprintf(stderr, "Chunk cache is not up-to-date, ignoring.\n");
                         continue;
@@ -2535,7 +3652,7 @@ int ca_sync_get_local(
                 if (desired_compression == CA_CHUNK_COMPRESSED) {
                         realloc_buffer_empty(&s->compress_buffer);
 
-                        r = ca_compress(p, l, &s->compress_buffer);
+                        r = ca_compress(&s->compression_context, s->compression_type, s->compression_level, p, l, &s->compress_buffer);
                         if (r < 0) {
                                 ca_origin_unref(origin);
                                 return r;
@@ -2559,8 +3676,30 @@ int ca_sync_get_local(
                 return r;
         }
 
+        /* Decompressing a chunk is expensive, hence keep the ones we used recently around, in case they are needed
+         * again, as is the case for runs of zeroes in images for example. Chunks from seeds aren't cached, as we want
+         * to know their origin. */
+        if (desired_compression == CA_CHUNK_UNCOMPRESSED && s->chunk_cache_size > 0) {
+                if (!s->chunk_cache) {
+                        s->chunk_cache = ca_chunk_cache_new(s->chunk_cache_size);
+                        if (!s->chunk_cache)
+                                return -ENOMEM;
+                }
+
+                r = ca_chunk_cache_get(s->chunk_cache, chunk_id, ret, ret_size);
+                if (r >= 0) {
+                        if (ret_effective_compression)
+                                *ret_effective_compression = CA_CHUNK_UNCOMPRESSED;
+                        if (ret_origin)
+                                *ret_origin = NULL;
+                        return r;
+                }
+                if (r != -ENOENT)
+                        return r;
+        }
+
         if (s->wstore) {
-                r = ca_store_get(s->wstore, chunk_id, desired_compression, ret, ret_size, ret_effective_compression);
+                r = ca_sync_store_get(s, s->wstore, chunk_id, desired_compression, ret, ret_size, ret_effective_compression);
                 if (r >= 0) {
                         if (ret_origin)
                                 *ret_origin = NULL;
@@ -2571,7 +3710,7 @@ int ca_sync_get_local(
         }
 
         if (s->cache_store) {
-                r = ca_store_get(s->cache_store, chunk_id, desired_compression, ret, ret_size, ret_effective_compression);
+                r = ca_sync_store_get(s, s->cache_store, chunk_id, desired_compression, ret, ret_size, ret_effective_compression);
                 if (r >= 0) {
                         if (ret_origin)
                                 *ret_origin = NULL;
@@ -2582,7 +3721,7 @@ int ca_sync_get_local(
         }
 
         for (i = 0; i < s->n_rstores; i++) {
-                r = ca_store_get(s->rstores[i], chunk_id, desired_compression, ret, ret_size, ret_effective_compression);
+                r = ca_sync_store_get(s, s->rstores[i], chunk_id, desired_compression, ret, ret_size, ret_effective_compression);
                 if (r >= 0) {
                         if (ret_origin)
                                 *ret_origin = NULL;
@@ -2595,6 +3734,27 @@ int ca_sync_get_local(
         return -ENOENT;
 }
 
+static int ca_sync_remember_remote_chunk(
+                CaSync *s,
+                const CaChunkID *chunk_id,
+                CaChunkCompression compression,
+                const void *p,
+                size_t l) {
+
+        assert(s);
+        assert(chunk_id);
+
+        if (compression != CA_CHUNK_UNCOMPRESSED)
+                return 0;
+
+        (void) ca_sync_learn_zero_chunk(s, chunk_id, p, l);
+
+        if (!s->chunk_cache)
+                return 0;
+
+        return ca_chunk_cache_put(s->chunk_cache, chunk_id, p, l);
+}
+
 int ca_sync_get(CaSync *s,
                 const CaChunkID *chunk_id,
                 CaChunkCompression desired_compression,
@@ -2604,7 +3764,7 @@ int ca_sync_get(CaSync *s,
                 CaOrigin **ret_origin) {
 
         size_t i;
-        int r;
+        int r, k;
 
         if (!s)
                 return -EINVAL;
@@ -2622,6 +3782,10 @@ int ca_sync_get(CaSync *s,
         if (s->remote_wstore) {
                 r = ca_remote_request(s->remote_wstore, chunk_id, true, desired_compression, ret, ret_size, ret_effective_compression);
                 if (r >= 0) {
+                        k = ca_sync_remember_remote_chunk(s, chunk_id, desired_compression, *ret, *ret_size);
+                        if (k < 0)
+                                return k;
+
                         if (ret_origin)
                                 *ret_origin = NULL;
                         return r;
@@ -2633,6 +3797,10 @@ int ca_sync_get(CaSync *s,
         for (i = 0; i < s->n_remote_rstores; i++) {
                 r = ca_remote_request(s->remote_rstores[i], chunk_id, true, desired_compression, ret, ret_size, ret_effective_compression);
                 if (r >= 0) {
+                        k = ca_sync_remember_remote_chunk(s, chunk_id, desired_compression, *ret, *ret_size);
+                        if (k < 0)
+                                return k;
+
                         if (ret_origin)
                                 *ret_origin = NULL;
                         return r;
@@ -2654,26 +3822,42 @@ int ca_sync_has_local(CaSync *s, const CaChunkID *chunk_id) {
         if (!chunk_id)
                 return -EINVAL;
 
+        if (ca_sync_find_zero_chunk_by_id(s, chunk_id))
+                return 1;
+
         for (i = 0; i < s->n_seeds; i++) {
+                int f;
+
+                if (!ca_sync_seed_usable(s, i))
+                        continue;
+
+                f = ca_seed_filter(s->seeds[i], chunk_id);
+                if (f == 0) {
+                        s->n_filter_skips++;
+                        continue;
+                }
+
                 r = ca_seed_has(s->seeds[i], chunk_id);
+                if (r == 0 && f > 0)
+                        s->n_filter_false_positives++;
                 if (r != 0)
                         return r;
         }
 
         if (s->wstore) {
-                r = ca_store_has(s->wstore, chunk_id);
+                r = ca_sync_store_has(s, s->wstore, chunk_id);
                 if (r != 0)
                         return r;
         }
 
         if (s->cache_store) {
-                r = ca_store_has(s->cache_store, chunk_id);
+                r = ca_sync_store_has(s, s->cache_store, chunk_id);
                 if (r != 0)
                         return r;
         }
 
         for (i = 0; i < s->n_rstores; i++) {
-                r = ca_store_has(s->rstores[i], chunk_id);
+                r = ca_sync_store_has(s, s->rstores[i], chunk_id);
                 if (r != 0)
                         return r;
         }
@@ -2682,6 +3866,8 @@ int ca_sync_has_local(CaSync *s, const CaChunkID *chunk_id) {
 }
 
 int ca_sync_make_chunk_id(CaSync *s, const void *p, size_t l, CaChunkID *ret) {
+        int r;
+
         if (!s)
                 return -EINVAL;
         if (!p && l > 0)
@@ -2689,7 +3875,11 @@ int ca_sync_make_chunk_id(CaSync *s, const void *p, size_t l, CaChunkID *ret) {
         if (!ret)
                 return -EINVAL;
 
-        return ca_chunk_id_make(&s->chunk_digest, p, l, ret);
+        r = ca_digest_ensure_allocated(&s->chunk_digest, s->chunk_digest_type);
+        if (r < 0)
+                return r;
+
+        return ca_chunk_id_make(s->chunk_digest, p, l, ret);
 }
 
 int ca_sync_get_archive_digest(CaSync *s, CaChunkID *ret) {
@@ -3027,22 +4217,27 @@ static int ca_sync_add_pollfd(CaRemote *rr, struct pollfd *pollfd) {
 int ca_sync_poll(CaSync *s, uint64_t timeout_nsec, const sigset_t *ss) {
         struct pollfd *pollfd;
         size_t i, n = 0;
+        bool seeding;
         int r;
 
         if (!s)
                 return -EINVAL;
 
+        seeding = s->seed_pool && s->n_pending_seeds > 0;
+
         if (!s->remote_archive &&
             !s->remote_index &&
             !s->remote_wstore &&
-            s->n_remote_rstores == 0)
+            s->n_remote_rstores == 0 &&
+            !seeding)
                 return -EUNATCH;
 
         pollfd = newa(struct pollfd,
                       !!s->remote_archive +
                       !!s->remote_index +
                       !!s->remote_wstore +
-                      s->n_remote_rstores);
+                      s->n_remote_rstores +
+                      seeding);
 
         r = ca_sync_add_pollfd(s->remote_archive, pollfd);
         if (r < 0)
@@ -3067,6 +4262,13 @@ int ca_sync_poll(CaSync *s, uint64_t timeout_nsec, const sigset_t *ss) {
                 n += r;
         }
 
+        if (seeding) {
+                pollfd[n++] = (struct pollfd) {
+                        .fd = ca_seed_pool_get_fd(s->seed_pool),
+                        .events = POLLIN,
+                };
+        }
+
         if (timeout_nsec != UINT64_MAX) {
                 struct timespec ts;
 
@@ -3388,6 +4590,148 @@ int ca_sync_get_hardlink_bytes(CaSync *s, uint64_t *ret) {
         return ca_decoder_get_hardlink_bytes(s->decoder, ret);
 }
 
+int ca_sync_get_output_seed_bytes(CaSync *s, uint64_t *ret) {
+        if (!s)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        if (s->direction != CA_SYNC_DECODE)
+                return -ENOTTY;
+        if (!s->output_seed)
+                return -ENODATA;
+
+        *ret = s->n_output_seed_bytes;
+        return 0;
+}
+
+int ca_sync_get_filter_skips(CaSync *s, uint64_t *ret) {
+        if (!s)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        if (s->direction != CA_SYNC_DECODE)
+                return -ENOTTY;
+
+        *ret = s->n_filter_skips;
+        return 0;
+}
+
+int ca_sync_get_filter_false_positives(CaSync *s, uint64_t *ret) {
+        if (!s)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        if (s->direction != CA_SYNC_DECODE)
+                return -ENOTTY;
+
+        *ret = s->n_filter_false_positives;
+        return 0;
+}
+
+int ca_sync_get_prefetch_requests(CaSync *s, uint64_t *ret) {
+        if (!s)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        if (s->direction != CA_SYNC_DECODE)
+                return -ENOTTY;
+        if (!s->prefetch)
+                return -ENODATA;
+
+        *ret = ca_prefetch_get_requested(s->prefetch);
+        return 0;
+}
+
+int ca_sync_get_prefetch_duplicates(CaSync *s, uint64_t *ret) {
+        if (!s)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        if (s->direction != CA_SYNC_DECODE)
+                return -ENOTTY;
+        if (!s->prefetch)
+                return -ENODATA;
+
+        *ret = ca_prefetch_get_duplicates(s->prefetch);
+        return 0;
+}
+
+int ca_sync_get_zero_chunks(CaSync *s, uint64_t *ret) {
+        if (!s)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        /* When decoding the ID of the largest all-zero chunk is always known, hence whether we know any IDs says
+         * nothing about whether the archive had any */
+        if (s->n_zero_chunk_hits == 0)
+                return -ENODATA;
+
+        *ret = s->n_zero_chunk_hits;
+        return 0;
+}
+
+int ca_sync_get_hole_bytes(CaSync *s, uint64_t *ret) {
+        if (!s)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        if (s->direction != CA_SYNC_ENCODE)
+                return -ENOTTY;
+
+        if (!s->encoder) {
+                *ret = 0;
+                return 0;
+        }
+
+        return ca_encoder_get_hole_bytes(s->encoder, ret);
+}
+
+int ca_sync_get_name_cache_hits(CaSync *s, uint64_t *ret) {
+        if (!s)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        if (!s->name_cache)
+                return -ENODATA;
+
+        *ret = ca_name_cache_get_hits(s->name_cache);
+        return 0;
+}
+
+int ca_sync_get_chunk_cache_hits(CaSync *s, uint64_t *ret) {
+        if (!s)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        if (!s->chunk_cache)
+                return -ENODATA;
+
+        *ret = ca_chunk_cache_get_hits(s->chunk_cache);
+        return 0;
+}
+
+int ca_sync_get_chunk_cache_misses(CaSync *s, uint64_t *ret) {
+        if (!s)
+                return -EINVAL;
+        if (!ret)
+                return -EINVAL;
+
+        if (!s->chunk_cache)
+                return -ENODATA;
+
+        *ret = ca_chunk_cache_get_misses(s->chunk_cache);
+        return 0;
+}
+
 int ca_sync_enable_archive_digest(CaSync *s, bool b) {
         int r;
 
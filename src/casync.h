@@ -31,6 +31,34 @@ CaSync *ca_sync_unref(CaSync *sync);
 
 int ca_sync_set_rate_limit_bps(CaSync *s, size_t rate_limit_bps);
 
+/* How many chunks to download in parallel from HTTP and FTP stores, 0 for the default. Needs to be set before the
+ * stores. */
+int ca_sync_set_max_active_chunks(CaSync *s, unsigned n);
+
+/* Number of worker threads to hash, compress and store chunks on when encoding, and to read directory entries ahead
+ * of the encoder on. 1 means everything is done on the calling thread. 0, the default, hashes chunks on the calling
+ * thread, but compresses and stores them on CA_STORE_WRITER_THREADS_DEFAULT background threads, and reads directory
+ * entries on CA_DIR_PREFETCH_THREADS_DEFAULT. When decoding, the number of threads to index seeds on, if there's more than one seed: 1 means
+ * they are indexed one after the other on the calling thread, 0 picks a suitable number. */
+int ca_sync_set_threads(CaSync *s, unsigned n);
+
+/* The hash function to calculate chunk IDs with. Only settable when encoding, when decoding the index' choice is
+ * used. */
+int ca_sync_set_chunk_digest(CaSync *s, CaDigestType type);
+int ca_sync_get_chunk_digest(CaSync *s, CaDigestType *ret);
+
+/* The codec and level to compress chunks with when writing them to a store or sending them to a remote. Readers
+ * detect the codec automatically. */
+int ca_sync_set_compression_type(CaSync *s, CaCompressionType type);
+int ca_sync_set_compression_level(CaSync *s, int level);
+
+/* Whether to build and use an index of the chunks in local stores. By default an index is only used if the store has
+ * one already. */
+int ca_sync_set_store_index(CaSync *s, bool b);
+
+/* How many bytes of recently used chunks to keep around decompressed, 0 turns the cache off */
+int ca_sync_set_chunk_cache_size(CaSync *s, uint64_t size);
+
 int ca_sync_set_feature_flags(CaSync *s, uint64_t flags);
 int ca_sync_get_feature_flags(CaSync *s, uint64_t *ret);
 int ca_sync_get_covering_feature_flags(CaSync *s, uint64_t *ret);
@@ -83,6 +111,14 @@ int ca_sync_add_store_auto(CaSync *sync, const char *locator);
 int ca_sync_add_seed_fd(CaSync *sync, int fd);
 int ca_sync_add_seed_path(CaSync *sync, const char *path);
 
+/* Keep the caches of seeds added by path afterwards in subdirectories of this directory, and update them incrementally
+ * on the next run */
+int ca_sync_set_seed_cache_path(CaSync *sync, const char *path);
+
+/* Use what we extract into as seed too, but without indexing it up front: whenever a chunk goes into the payload of a
+ * file, the same range of the file that is there already is tried first */
+int ca_sync_set_lazy_output_seed(CaSync *sync, bool b);
+
 int ca_sync_step(CaSync *sync);
 int ca_sync_poll(CaSync *s, uint64_t timeout_nsec, const sigset_t *ss);
 
@@ -131,6 +167,31 @@ int ca_sync_get_payload(CaSync *s, const void **ret, size_t *ret_size);
 int ca_sync_get_punch_holes_bytes(CaSync *s, uint64_t *ret);
 int ca_sync_get_reflink_bytes(CaSync *s, uint64_t *ret);
 int ca_sync_get_hardlink_bytes(CaSync *s, uint64_t *ret);
+int ca_sync_get_output_seed_bytes(CaSync *s, uint64_t *ret);
+
+/* How often a seed or store filter let us skip looking for a chunk, and how often it claimed to have a chunk that
+ * then wasn't there */
+int ca_sync_get_filter_skips(CaSync *s, uint64_t *ret);
+int ca_sync_get_filter_false_positives(CaSync *s, uint64_t *ret);
+
+/* How many chunks were requested from the remote store ahead of the decoder, and how many repeated ones weren't
+ * requested again */
+int ca_sync_get_prefetch_requests(CaSync *s, uint64_t *ret);
+int ca_sync_get_prefetch_duplicates(CaSync *s, uint64_t *ret);
+
+/* How many all-zero chunks were neither hashed, stored nor retrieved, as their ID was known already. Returns -ENODATA
+ * if there were none. */
+int ca_sync_get_zero_chunks(CaSync *s, uint64_t *ret);
+
+/* How many bytes were in holes of sparse files we encoded, and hence not read */
+int ca_sync_get_hole_bytes(CaSync *s, uint64_t *ret);
+
+/* How many user and group name lookups were answered without asking the user database */
+int ca_sync_get_name_cache_hits(CaSync *s, uint64_t *ret);
+
+/* How often a chunk was found in the cache of decompressed chunks, and how often it had to be retrieved from a store */
+int ca_sync_get_chunk_cache_hits(CaSync *s, uint64_t *ret);
+int ca_sync_get_chunk_cache_misses(CaSync *s, uint64_t *ret);
 
 int ca_sync_enable_hardlink_digest(CaSync *s, bool b);
 int ca_sync_enable_payload_digest(CaSync *s, bool b);
@@ -97,6 +97,10 @@ CaLocatorClass ca_classify_locator(const char *s) {
         if (isempty(s))
                 return _CA_LOCATOR_CLASS_INVALID;
 
+        /* Pack stores are local, see castorepack.h */
+        if (startswith(s, "pack://"))
+                return CA_LOCATOR_PATH;
+
         if (ca_is_url(s))
                 return CA_LOCATOR_URL;
 
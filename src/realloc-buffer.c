@@ -82,7 +82,7 @@ void *realloc_buffer_acquire0(ReallocBuffer *b, size_t size) {
         }
 
         na = b->allocated * 2;
-        if (na <= b->allocated) /* overflow? */
+        if (na < b->allocated) /* overflow? */
                 return NULL;
 
         ns = MAX(na, size);
@@ -147,6 +147,20 @@ fallback:
         return 0; /* Return == 0 if we could only write out zeroes */
 }
 
+bool memeqzero(const void *p, size_t l) {
+        const uint8_t *q = p;
+        size_t i;
+
+        for (i = 0; i < l && i < 16; i++)
+                if (q[i] != 0)
+                        return false;
+
+        if (l <= 16)
+                return true;
+
+        return memcmp(q, q + 16, l - 16) == 0;
+}
+
 int loop_write_with_holes(int fd, const void *p, size_t l, uint64_t *ret_punched) {
         const uint8_t *q, *start = p, *zero_start = NULL;
         uint64_t n_punched = 0;
@@ -155,6 +169,18 @@ int loop_write_with_holes(int fd, const void *p, size_t l, uint64_t *ret_punched
         /* Write out the specified data much like loop_write(), but try to punch holes for any longer series of zero
          * bytes, thus creating sparse files if possible. */
 
+        /* Entire blocks of zeroes are common in disk images, hence check for them quickly */
+        if (l >= HOLE_MIN && memeqzero(p, l)) {
+                r = write_zeroes(fd, l);
+                if (r < 0)
+                        return r;
+
+                if (ret_punched)
+                        *ret_punched = r > 0 ? l : 0;
+
+                return 0;
+        }
+
         for (q = p; q < (const uint8_t*) p + l; q++) {
 
                 if (*q == 0) {
@@ -7,6 +7,7 @@
 #include <inttypes.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -92,6 +93,10 @@ int loop_write(int fd, const void *p, size_t l);
 int loop_write_block(int fd, const void *p, size_t l);
 ssize_t loop_read(int fd, void *p, size_t l);
 
+/* Returns true if all bytes are zero. After checking the first few bytes itself, it compares the memory with itself
+ * shifted by that much, which lets the (vectorized) memcmp() do most of the work. */
+bool memeqzero(const void *p, size_t l);
+
 int write_zeroes(int fd, size_t l);
 int loop_write_with_holes(int fd, const void *p, size_t l, uint64_t *ret_punched);
 
@@ -0,0 +1,42 @@
+#ifndef foochunkerreferencehfoo
+#define foochunkerreferencehfoo
+
+#include "cachunker.h"
+
+/* A straightforward implementation of the chunking algorithm, rolling the hash over every single byte and checking
+ * for a border after each one. This is how ca_chunker_scan() used to work. It takes a number of shortcuts now, but
+ * must find exactly the same chunk borders as this. Shared by test-cachunker and test-cachunker-benchmark. */
+static inline size_t ca_chunker_reference_scan(CaChunker *c, const uint8_t *p, size_t n) {
+        size_t k;
+        uint32_t v;
+
+        for (k = 0; k < n; k++) {
+                if (c->window_size < CA_CHUNKER_WINDOW_SIZE) {
+                        c->window[c->window_size++] = p[k];
+                        c->chunk_size++;
+
+                        if (c->window_size < CA_CHUNKER_WINDOW_SIZE)
+                                continue;
+
+                        v = ca_chunker_start(c, c->window, CA_CHUNKER_WINDOW_SIZE);
+                } else {
+                        size_t idx = c->chunk_size % CA_CHUNKER_WINDOW_SIZE;
+
+                        v = ca_chunker_roll(c, c->window[idx], p[k]);
+                        c->window[idx] = p[k];
+                        c->chunk_size++;
+                }
+
+                if (c->chunk_size >= c->chunk_size_max ||
+                    (c->chunk_size >= c->chunk_size_min && v % c->discriminator == c->discriminator - 1)) {
+                        c->h = 0;
+                        c->chunk_size = 0;
+                        c->window_size = 0;
+                        return k + 1;
+                }
+        }
+
+        return (size_t) -1;
+}
+
+#endif
@@ -2,7 +2,7 @@
 
 PORT = 4321
 
-import http.server, socketserver, os, sys, socket, time
+import http.server, socketserver, os, sys, socket, time, io
 
 os.chdir(sys.argv[1])
 
@@ -22,6 +22,50 @@ def send_notify(text):
     fd.connect("\0" + e[1:] if e[0] == '@' else e)
     fd.send(bytes(text, 'utf-8'))
 
+class RangeRequestHandler(http.server.SimpleHTTPRequestHandler):
+    """Adds support for byte range requests, as used for pack stores, with single and multipart responses"""
+
+    def send_head(self):
+        ranges = self.headers.get("Range")
+        path = self.translate_path(self.path)
+
+        if ranges is None or not ranges.startswith("bytes=") or not os.path.isfile(path):
+            return super().send_head()
+
+        with open(path, "rb") as f:
+            data = f.read()
+
+        parts = []
+        for r in ranges[6:].split(","):
+            start, end = r.strip().split("-")
+            start, end = int(start), min(int(end), len(data) - 1)
+            if start > end:
+                self.send_error(416)
+                return None
+            parts.append((start, end))
+
+        self.send_response(206)
+
+        if len(parts) == 1:
+            start, end = parts[0]
+            body = data[start:end+1]
+            self.send_header("Content-Type", "application/octet-stream")
+            self.send_header("Content-Range", "bytes %i-%i/%i" % (start, end, len(data)))
+        else:
+            boundary = "CASYNC_RANGE_BOUNDARY"
+            body = b""
+            for start, end in parts:
+                body += bytes("\r\n--%s\r\nContent-Type: application/octet-stream\r\nContent-Range: bytes %i-%i/%i\r\n\r\n" %
+                              (boundary, start, end, len(data)), "utf-8")
+                body += data[start:end+1]
+            body += bytes("\r\n--%s--\r\n" % boundary, "utf-8")
+            self.send_header("Content-Type", "multipart/byteranges; boundary=" + boundary)
+
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+
+        return io.BytesIO(body)
+
 class AllowReuseAddressServer(socketserver.TCPServer):
     allow_reuse_address = True
 
@@ -29,6 +73,6 @@ class AllowReuseAddressServer(socketserver.TCPServer):
         super().server_activate()
         send_notify("READY=1")
 
-httpd = AllowReuseAddressServer(("", PORT), http.server.SimpleHTTPRequestHandler)
+httpd = AllowReuseAddressServer(("", PORT), RangeRequestHandler)
 
 httpd.serve_forever()
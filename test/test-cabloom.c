@@ -0,0 +1,110 @@
+#include <stdio.h>
+
+#include "cabloom.h"
+#include "cachunk.h"
+#include "castore.h"
+#include "rm-rf.h"
+#include "util.h"
+
+/* Enough to make the filter grow a couple of times beyond its initial size */
+#define N_ENTRIES 100000U
+
+static void make_id(CaDigest *digest, unsigned i, CaChunkID *ret) {
+        assert_se(ca_chunk_id_make(digest, &i, sizeof(i), ret) >= 0);
+}
+
+static void test_bloom(CaDigest *digest) {
+        unsigned i, n_false_positives = 0;
+        CaChunkID id;
+        CaBloom *b;
+
+        assert_se(b = ca_bloom_new());
+        assert_se(ca_bloom_entries(b) == 0);
+
+        make_id(digest, 0, &id);
+        assert_se(!ca_bloom_test(b, &id));
+
+        for (i = 0; i < N_ENTRIES; i++) {
+                make_id(digest, i, &id);
+                assert_se(ca_bloom_add(b, &id) >= 0);
+        }
+
+        assert_se(ca_bloom_entries(b) == N_ENTRIES);
+
+        /* No false negatives, ever */
+        for (i = 0; i < N_ENTRIES; i++) {
+                make_id(digest, i, &id);
+                assert_se(ca_bloom_test(b, &id));
+        }
+
+        for (i = N_ENTRIES; i < 2 * N_ENTRIES; i++) {
+                make_id(digest, i, &id);
+                if (ca_bloom_test(b, &id))
+                        n_false_positives++;
+        }
+
+        printf("%u false positives in %u tests, filter size %" PRIu64 " bytes\n", n_false_positives, N_ENTRIES, ca_bloom_size(b));
+
+        /* About 1% per layer, and there are a few */
+        assert_se(n_false_positives < N_ENTRIES / 20);
+
+        ca_bloom_free(b);
+}
+
+static void test_store(CaDigest *digest, const char *path) {
+        static const char data[] = "chunk data";
+        CaChunkID id, other;
+        CaStore *store;
+        unsigned i;
+
+        make_id(digest, 0, &id);
+        make_id(digest, 1, &other);
+
+        assert_se(store = ca_store_new());
+        assert_se(ca_store_set_path(store, path) >= 0);
+        assert_se(ca_store_put(store, &id, CA_CHUNK_UNCOMPRESSED, data, sizeof(data)) >= 0);
+
+        /* Until enough lookups failed, there's no filter */
+        assert_se(ca_store_filter(store, &other) == -ENODATA);
+
+        for (i = 0; i < 2000; i++) {
+                make_id(digest, N_ENTRIES + i, &other);
+                assert_se(ca_store_has(store, &other) == 0);
+        }
+
+        /* Now the store directory has been scanned */
+        make_id(digest, 1, &other);
+        assert_se(ca_store_filter(store, &id) > 0);
+        assert_se(ca_store_filter(store, &other) == 0);
+
+        /* And chunks we put later are tracked too */
+        assert_se(ca_store_put(store, &other, CA_CHUNK_UNCOMPRESSED, data, sizeof(data)) >= 0);
+        assert_se(ca_store_filter(store, &other) > 0);
+
+        ca_store_unref(store);
+
+        /* The cache store knows all its chunks from the start */
+        assert_se(store = ca_store_new_cache());
+        assert_se(ca_store_filter(store, &id) == 0);
+        assert_se(ca_store_put(store, &id, CA_CHUNK_UNCOMPRESSED, data, sizeof(data)) >= 0);
+        assert_se(ca_store_filter(store, &id) > 0);
+        ca_store_unref(store);
+}
+
+int main(int argc, char *argv[]) {
+        CaDigest *digest;
+        char *path;
+
+        assert_se(ca_digest_new(CA_DIGEST_DEFAULT, &digest) >= 0);
+
+        test_bloom(digest);
+
+        assert_se(asprintf(&path, "/var/tmp/test-cabloom.%" PRIx64 "/", random_u64()) >= 0);
+        test_store(digest, path);
+        (void) rm_rf(path, REMOVE_ROOT|REMOVE_PHYSICAL);
+        free(path);
+
+        ca_digest_free(digest);
+
+        return 0;
+}
@@ -4,7 +4,7 @@
 #include "def.h"
 /* #include "util.h" */
 
-static void test_chunk_file(void) {
+static void test_chunk_file(CaCompressionType type, int level) {
         uint8_t buffer[BUFFER_SIZE*4];
         ReallocBuffer rb = {}, rb2 = {};
         char path[] = "/var/tmp/chunk-test.XXXXXX";
@@ -16,20 +16,20 @@ static void test_chunk_file(void) {
         assert_se(fd >= 0);
         assert_se(unlink(path) >= 0);
 
-        r = ca_save_and_compress_fd(fd, buffer, sizeof(buffer));
+        r = ca_save_and_compress_fd(fd, type, level, buffer, sizeof(buffer));
         assert_se(r >= 0);
 
         assert_se(lseek(fd, 0, SEEK_SET) == 0);
 
         r = ca_load_and_decompress_fd(fd, &rb);
-        safe_close(r >= 0);
+        assert_se(r >= 0);
 
         assert_se(realloc_buffer_size(&rb) == sizeof(buffer));
         assert_se(memcmp(realloc_buffer_data(&rb), buffer, sizeof(buffer)) == 0);
 
         realloc_buffer_empty(&rb);
 
-        r = ca_compress(buffer, sizeof(buffer), &rb);
+        r = ca_compress(NULL, type, level, buffer, sizeof(buffer), &rb);
         assert_se(r >= 0);
 
         assert_se(lseek(fd, 0, SEEK_SET) == 0);
@@ -42,10 +42,10 @@ static void test_chunk_file(void) {
 
         assert_se(lseek(fd, 0, SEEK_SET) == 0);
 
-        r = ca_load_and_compress_fd(fd, &rb);
+        r = ca_load_and_compress_fd(fd, type, level, &rb);
         assert_se(r >= 0);
 
-        r = ca_decompress(realloc_buffer_data(&rb), realloc_buffer_size(&rb), &rb2);
+        r = ca_decompress(NULL, realloc_buffer_data(&rb), realloc_buffer_size(&rb), &rb2);
         assert_se(r >= 0);
 
         assert_se(realloc_buffer_size(&rb2) == sizeof(buffer));
@@ -57,9 +57,93 @@ static void test_chunk_file(void) {
         safe_close(fd);
 }
 
+static void test_detect(void) {
+        uint8_t buffer[BUFFER_SIZE];
+        ReallocBuffer rb = {}, rb2 = {};
+        CaCompressionType t, found;
+
+        assert_se(dev_urandom(buffer, sizeof(buffer)) >= 0);
+
+        for (t = 0; t < _CA_COMPRESSION_TYPE_MAX; t++) {
+                if (!ca_compression_type_supported(t))
+                        continue;
+
+                realloc_buffer_empty(&rb);
+                realloc_buffer_empty(&rb2);
+
+                assert_se(ca_compress(NULL, t, CA_COMPRESSION_LEVEL_DEFAULT, buffer, sizeof(buffer), &rb) >= 0);
+
+                assert_se(ca_compression_detect(realloc_buffer_data(&rb), realloc_buffer_size(&rb), &found) >= 0);
+                assert_se(found == t);
+                assert_se(ca_compression_detect(realloc_buffer_data(&rb), 1, &found) == -EAGAIN);
+
+                /* The decompressor figures out the codec by itself */
+                assert_se(ca_decompress(NULL, realloc_buffer_data(&rb), realloc_buffer_size(&rb), &rb2) >= 0);
+                assert_se(realloc_buffer_size(&rb2) == sizeof(buffer));
+                assert_se(memcmp(realloc_buffer_data(&rb2), buffer, sizeof(buffer)) == 0);
+
+                /* Truncated data must be refused */
+                realloc_buffer_empty(&rb2);
+                assert_se(ca_decompress(NULL, realloc_buffer_data(&rb), realloc_buffer_size(&rb) - 1, &rb2) < 0);
+        }
+
+        /* Uncompressed data is refused */
+        realloc_buffer_empty(&rb2);
+        memset(buffer, 'x', sizeof(buffer));
+        assert_se(ca_compression_detect(buffer, sizeof(buffer), &found) == -EBADMSG);
+        assert_se(ca_decompress(NULL, buffer, sizeof(buffer), &rb2) == -EBADMSG);
+
+        assert_se(ca_compress(NULL, CA_COMPRESSION_XZ, 10, buffer, sizeof(buffer), &rb) == -ERANGE);
+
+        realloc_buffer_free(&rb);
+        realloc_buffer_free(&rb2);
+}
+
+static void test_context_reuse(void) {
+        CaCompressionContext context = {};
+        uint8_t buffer[BUFFER_SIZE*2];
+        ReallocBuffer rb = {}, rb2 = {};
+        unsigned i;
+
+        assert_se(dev_urandom(buffer, sizeof(buffer) / 2) >= 0);
+        memset(buffer + sizeof(buffer) / 2, 'a', sizeof(buffer) / 2);
+
+        /* Use the same context for compression and decompression, with alternating codecs, and make sure it survives
+         * an aborted stream */
+        for (i = 0; i < 8; i++) {
+                CaCompressionType t = (i / 2) % 2 == 0 || !ca_compression_type_supported(CA_COMPRESSION_ZSTD) ? CA_COMPRESSION_XZ : CA_COMPRESSION_ZSTD;
+
+                realloc_buffer_empty(&rb);
+                realloc_buffer_empty(&rb2);
+
+                assert_se(ca_compress(&context, t, CA_COMPRESSION_LEVEL_DEFAULT, buffer, sizeof(buffer), &rb) >= 0);
+                assert_se(ca_decompress(&context, realloc_buffer_data(&rb), realloc_buffer_size(&rb), &rb2) >= 0);
+
+                assert_se(realloc_buffer_size(&rb2) == sizeof(buffer));
+                assert_se(memcmp(realloc_buffer_data(&rb2), buffer, sizeof(buffer)) == 0);
+
+                realloc_buffer_empty(&rb2);
+                assert_se(ca_decompress(&context, realloc_buffer_data(&rb), realloc_buffer_size(&rb) / 2, &rb2) < 0);
+        }
+
+        ca_compression_done(&context);
+
+        realloc_buffer_free(&rb);
+        realloc_buffer_free(&rb2);
+}
+
 int main(int argc, char *argv[]) {
 
-        test_chunk_file();
+        test_chunk_file(CA_COMPRESSION_XZ, CA_COMPRESSION_LEVEL_DEFAULT);
+        test_chunk_file(CA_COMPRESSION_XZ, 1);
+
+        if (ca_compression_type_supported(CA_COMPRESSION_ZSTD)) {
+                test_chunk_file(CA_COMPRESSION_ZSTD, CA_COMPRESSION_LEVEL_DEFAULT);
+                test_chunk_file(CA_COMPRESSION_ZSTD, 19);
+        }
+
+        test_detect();
+        test_context_reuse();
 
         return 0;
 }
@@ -0,0 +1,84 @@
+#include <stdio.h>
+
+#include "cachunkcache.h"
+#include "util.h"
+
+#define CHUNK_SIZE 1024U
+#define N_CHUNKS 1000U
+
+static void make_id(CaDigest *digest, unsigned i, CaChunkID *ret) {
+        assert_se(ca_chunk_id_make(digest, &i, sizeof(i), ret) >= 0);
+}
+
+static void make_data(unsigned i, uint8_t *ret) {
+        memset(ret, i & 0xFF, CHUNK_SIZE);
+}
+
+static void test_cache(CaDigest *digest) {
+        uint8_t data[CHUNK_SIZE], expected[CHUNK_SIZE];
+        CaChunkCache *c;
+        CaChunkID id;
+        const void *p;
+        size_t l;
+        unsigned i;
+
+        /* Room for 100 chunks */
+        assert_se(c = ca_chunk_cache_new(100 * CHUNK_SIZE));
+
+        make_id(digest, 0, &id);
+        assert_se(ca_chunk_cache_get(c, &id, &p, &l) == -ENOENT);
+        assert_se(ca_chunk_cache_get_misses(c) == 1);
+
+        for (i = 0; i < N_CHUNKS; i++) {
+                make_id(digest, i, &id);
+                make_data(i, data);
+                assert_se(ca_chunk_cache_put(c, &id, data, sizeof(data)) > 0);
+                assert_se(ca_chunk_cache_put(c, &id, data, sizeof(data)) == 0);
+
+                /* Keep using the first chunk, so that it's never the least recently used one */
+                make_id(digest, 0, &id);
+                assert_se(ca_chunk_cache_get(c, &id, &p, &l) >= 0);
+        }
+
+        assert_se(ca_chunk_cache_get_size(c) == 100 * CHUNK_SIZE);
+        assert_se(ca_chunk_cache_get_hits(c) == N_CHUNKS);
+
+        /* The 99 most recently added ones are there, along with the first one */
+        for (i = 0; i < N_CHUNKS; i++) {
+                int r;
+
+                make_id(digest, i, &id);
+                r = ca_chunk_cache_get(c, &id, &p, &l);
+
+                if (i == 0 || i >= N_CHUNKS - 99) {
+                        assert_se(r >= 0);
+                        assert_se(l == CHUNK_SIZE);
+
+                        make_data(i, expected);
+                        assert_se(memcmp(p, expected, l) == 0);
+                } else
+                        assert_se(r == -ENOENT);
+        }
+
+        assert_se(ca_chunk_cache_get_hits(c) == N_CHUNKS + 100);
+        assert_se(ca_chunk_cache_get_misses(c) == 1 + N_CHUNKS - 100);
+
+        /* Too large to be cached at all */
+        make_id(digest, N_CHUNKS, &id);
+        assert_se(ca_chunk_cache_put(c, &id, data, 100 * CHUNK_SIZE + 1) == 0);
+        assert_se(ca_chunk_cache_get_size(c) == 100 * CHUNK_SIZE);
+
+        ca_chunk_cache_free(c);
+}
+
+int main(int argc, char *argv[]) {
+        CaDigest *digest;
+
+        assert_se(ca_digest_new(CA_DIGEST_DEFAULT, &digest) >= 0);
+
+        test_cache(digest);
+
+        ca_digest_free(digest);
+
+        return 0;
+}
@@ -0,0 +1,74 @@
+#include <stdio.h>
+
+#include "cachunker.h"
+#include "cachunker-reference.h"
+#include "util.h"
+
+#define DATA_SIZE_DEFAULT (256U*1024U*1024U)
+#define BUFFER_SIZE (128U*1024U)
+
+static void run(const char *name, size_t (*scan)(CaChunker *c, const uint8_t *p, size_t n), const uint8_t *data, size_t size, size_t avg) {
+        CaChunker chunker = CA_CHUNKER_INIT;
+        size_t offset, n_chunks = 0;
+        uint64_t start, end;
+        double t;
+
+        assert_se(ca_chunker_set_size(&chunker, 0, avg, 0) >= 0);
+
+        start = now(CLOCK_MONOTONIC);
+
+        /* Feed the data in fixed size blocks, like the encoder does */
+        for (offset = 0; offset < size; offset += BUFFER_SIZE) {
+                const uint8_t *p = data + offset;
+                size_t n = MIN(size - offset, BUFFER_SIZE);
+
+                for (;;) {
+                        size_t k;
+
+                        k = scan(&chunker, p, n);
+                        if (k == (size_t) -1)
+                                break;
+
+                        n_chunks++;
+                        p += k, n -= k;
+                }
+        }
+
+        end = now(CLOCK_MONOTONIC);
+
+        t = (double) (end - start) / 1e9;
+
+        printf("%-8s avg=%8zu: %8zu chunks in %6.3f s, %6.3f GB/s\n",
+               name, avg, n_chunks, t, (double) size / 1e9 / t);
+}
+
+static size_t fast_scan(CaChunker *c, const uint8_t *p, size_t n) {
+        return ca_chunker_scan(c, p, n);
+}
+
+int main(int argc, char *argv[]) {
+        static const size_t avgs[] = { 16*1024, CA_CHUNK_SIZE_AVG_DEFAULT, 256*1024 };
+        size_t size = DATA_SIZE_DEFAULT, i;
+        uint8_t *data;
+
+        /* Optionally takes the amount of data to chunk in MiB */
+        if (argc > 1) {
+                unsigned mib;
+
+                assert_se(safe_atou(argv[1], &mib) >= 0);
+                assert_se(mib > 0);
+                size = (size_t) mib * 1024U * 1024U;
+        }
+
+        assert_se(data = new(uint8_t, size));
+        assert_se(dev_urandom(data, size) >= 0);
+
+        for (i = 0; i < ELEMENTSOF(avgs); i++) {
+                run("naive", ca_chunker_reference_scan, data, size, avgs[i]);
+                run("scan", fast_scan, data, size, avgs[i]);
+        }
+
+        free(data);
+
+        return 0;
+}
@@ -1,8 +1,10 @@
 #include <assert.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <string.h>
 
 #include "cachunker.h"
+#include "cachunker-reference.h"
 #include "util.h"
 
 static void test_rolling(void) {
@@ -87,6 +89,91 @@ finish:
         (void) close(fd);
 }
 
+typedef enum ScanMode {
+        SCAN_REFERENCE,
+        SCAN_REGULAR,
+        SCAN_ZEROES, /* use ca_chunker_scan_zeroes() for pieces that are all zero */
+} ScanMode;
+
+static void split(CaChunker *c, ScanMode mode, const uint8_t *data, size_t size, size_t *borders, size_t *n_borders) {
+        size_t offset = 0, acc = 0, n = 0;
+
+        while (offset < size) {
+                size_t piece, k;
+
+                /* Feed the data in randomly sized pieces, to exercise the state kept between invocations */
+                piece = MIN(size - offset, 1 + random_u64() % (3 * c->chunk_size_avg));
+
+                while (piece > 0) {
+                        if (mode == SCAN_REFERENCE)
+                                k = ca_chunker_reference_scan(c, data + offset, piece);
+                        else if (mode == SCAN_ZEROES && memeqzero(data + offset, piece))
+                                k = ca_chunker_scan_zeroes(c, piece);
+                        else
+                                k = ca_chunker_scan(c, data + offset, piece);
+
+                        if (k == (size_t) -1) {
+                                offset += piece;
+                                acc += piece;
+                                break;
+                        }
+
+                        assert_se(k <= piece);
+
+                        acc += k;
+                        assert_se(acc >= c->chunk_size_min);
+                        assert_se(acc <= c->chunk_size_max);
+
+                        offset += k;
+                        piece -= k;
+                        acc = 0;
+
+                        assert_se(n < *n_borders);
+                        borders[n++] = offset;
+                }
+        }
+
+        *n_borders = n;
+}
+
+static void test_scan_identical(size_t min_size, size_t avg_size, size_t max_size) {
+        CaChunker x = CA_CHUNKER_INIT, y, z;
+        size_t size, *a, *b, *c, n_a, n_b, n_c;
+        uint8_t *data;
+
+        assert_se(ca_chunker_set_size(&x, min_size, avg_size, max_size) >= 0);
+        y = z = x;
+
+        size = 64 * x.chunk_size_avg;
+        assert_se(data = new(uint8_t, size));
+        assert_se(dev_urandom(data, size) >= 0);
+
+        /* Some stretches of constant data, so that we also hit the maximum chunk size */
+        memset(data, 0, x.chunk_size_min + 3);
+        memset(data + size / 4, 0, 2 * x.chunk_size_max + 7);
+        memset(data + size / 2, 0, 5 * x.chunk_size_max + 11);
+
+        n_a = n_b = n_c = size / x.chunk_size_min + 1;
+        assert_se(a = new(size_t, n_a));
+        assert_se(b = new(size_t, n_b));
+        assert_se(c = new(size_t, n_c));
+
+        split(&x, SCAN_REFERENCE, data, size, a, &n_a);
+        split(&y, SCAN_REGULAR, data, size, b, &n_b);
+        split(&z, SCAN_ZEROES, data, size, c, &n_c);
+
+        assert_se(n_a > 0);
+        assert_se(n_a == n_b);
+        assert_se(memcmp(a, b, n_a * sizeof(size_t)) == 0);
+        assert_se(n_a == n_c);
+        assert_se(memcmp(a, c, n_a * sizeof(size_t)) == 0);
+
+        free(a);
+        free(b);
+        free(c);
+        free(data);
+}
+
 static int test_set_size(void) {
         struct CaChunker x = CA_CHUNKER_INIT, y = CA_CHUNKER_INIT;
 
@@ -146,5 +233,10 @@ int main(int argc, char *argv[]) {
         test_chunk();
         test_set_size();
 
+        test_scan_identical(0, 0, 0);
+        test_scan_identical(1024, 4*1024, 16*1024);
+        test_scan_identical(16, 64, 256);
+        test_scan_identical(64*1024, 256*1024, 1024*1024);
+
         return 0;
 }
@@ -0,0 +1,185 @@
+#include <stdio.h>
+
+#include "cachunk.h"
+#include "cachunker.h"
+#include "cachunkpipeline.h"
+#include "castore.h"
+#include "rm-rf.h"
+#include "util.h"
+
+#define DATA_SIZE_DEFAULT (8U*1024U*1024U)
+
+typedef struct Chunk {
+        size_t offset;
+        size_t size;
+        CaChunkID id;
+} Chunk;
+
+static int store_chunk(void *userdata, const CaChunkID *id, const void *p, size_t l) {
+        CaStore *store = userdata;
+        int r;
+
+        r = ca_store_put(store, id, CA_CHUNK_UNCOMPRESSED, p, l);
+        if (r == -EEXIST)
+                return 1;
+        if (r < 0)
+                return r;
+
+        return 0;
+}
+
+static void make_data(uint8_t *data, size_t size) {
+        size_t i;
+
+        /* Half random, half compressible data, so that the compressor has something to chew on */
+        assert_se(dev_urandom(data, size / 2) >= 0);
+
+        for (i = size / 2; i < size; i++)
+                data[i] = "casync"[(i / 7) % 6] ^ (uint8_t) (i >> 12);
+}
+
+static size_t split_chunks(const uint8_t *data, size_t size, Chunk **ret) {
+        CaChunker chunker = CA_CHUNKER_INIT;
+        Chunk *chunks = NULL;
+        size_t n = 0, allocated = 0, offset = 0;
+
+        while (offset < size) {
+                size_t k;
+
+                k = ca_chunker_scan(&chunker, data + offset, size - offset);
+                if (k == (size_t) -1)
+                        k = size - offset;
+
+                assert_se(GREEDY_REALLOC(chunks, allocated, n + 1));
+                chunks[n].offset = offset;
+                chunks[n].size = k;
+                n++;
+
+                offset += k;
+        }
+
+        *ret = chunks;
+        return n;
+}
+
+static void calculate_ids(const uint8_t *data, Chunk *chunks, size_t n) {
+        CaDigest *digest;
+        size_t i;
+
+        assert_se(ca_digest_new(CA_DIGEST_DEFAULT, &digest) >= 0);
+
+        for (i = 0; i < n; i++)
+                assert_se(ca_chunk_id_make(digest, data + chunks[i].offset, chunks[i].size, &chunks[i].id) >= 0);
+
+        ca_digest_free(digest);
+}
+
+static void run(const uint8_t *data, size_t size, const Chunk *chunks, size_t n_chunks, unsigned n_threads) {
+        CaChunkPipeline *pipeline;
+        CaStore *store;
+        char *path;
+        size_t i, j = 0;
+        uint64_t start, end;
+
+        assert_se(asprintf(&path, "/var/tmp/test-cachunkpipeline.%" PRIx64, random_u64()) >= 0);
+
+        assert_se(store = ca_store_new());
+        assert_se(ca_store_set_path(store, path) >= 0);
+
+        assert_se(ca_chunk_pipeline_new(n_threads, CA_DIGEST_DEFAULT, store_chunk, store, &pipeline) >= 0);
+
+        start = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < n_chunks; i++) {
+
+                while (ca_chunk_pipeline_is_full(pipeline)) {
+                        CaChunkID id;
+                        size_t l;
+
+                        assert_se(ca_chunk_pipeline_get(pipeline, true, &id, &l, NULL) > 0);
+
+                        /* Chunks must come out in the order we put them in */
+                        assert_se(ca_chunk_id_equal(&id, &chunks[j].id));
+                        assert_se(l == chunks[j].size);
+                        j++;
+                }
+
+                /* Every now and then pretend we processed a chunk ourselves, it must still come out in order */
+                if (i % 7 == 3) {
+                        int r;
+
+                        r = store_chunk(store, &chunks[i].id, data + chunks[i].offset, chunks[i].size);
+                        assert_se(r >= 0);
+                        assert_se(ca_chunk_pipeline_put_done(pipeline, &chunks[i].id, chunks[i].size, r) >= 0);
+                } else
+                        assert_se(ca_chunk_pipeline_put(pipeline, data + chunks[i].offset, chunks[i].size) >= 0);
+        }
+
+        for (;;) {
+                CaChunkID id;
+                size_t l;
+                int r;
+
+                r = ca_chunk_pipeline_get(pipeline, true, &id, &l, NULL);
+                assert_se(r >= 0);
+                if (r == 0)
+                        break;
+
+                assert_se(ca_chunk_id_equal(&id, &chunks[j].id));
+                assert_se(l == chunks[j].size);
+                j++;
+        }
+
+        end = now(CLOCK_MONOTONIC);
+
+        assert_se(j == n_chunks);
+        assert_se(ca_chunk_pipeline_queued(pipeline) == 0);
+
+        for (i = 0; i < n_chunks; i++)
+                assert_se(ca_store_has(store, &chunks[i].id) > 0);
+
+        printf("%3u threads: %zu chunks in %6.2f s, %7.2f MiB/s\n",
+               n_threads, n_chunks,
+               (double) (end - start) / 1e9,
+               (double) size / 1024.0 / 1024.0 / ((double) (end - start) / 1e9));
+
+        ca_chunk_pipeline_free(pipeline);
+        ca_store_unref(store);
+
+        (void) rm_rf(path, REMOVE_ROOT|REMOVE_PHYSICAL);
+        free(path);
+}
+
+int main(int argc, char *argv[]) {
+        size_t size = DATA_SIZE_DEFAULT, n_chunks;
+        unsigned n_threads, max_threads;
+        Chunk *chunks;
+        uint8_t *data;
+
+        /* Optionally takes the amount of data to process in MiB, for benchmarking throughput scaling */
+        if (argc > 1) {
+                unsigned mib;
+
+                assert_se(safe_atou(argv[1], &mib) >= 0);
+                assert_se(mib > 0);
+                size = (size_t) mib * 1024U * 1024U;
+        }
+
+        assert_se(data = new(uint8_t, size));
+        make_data(data, size);
+
+        n_chunks = split_chunks(data, size, &chunks);
+        calculate_ids(data, chunks, n_chunks);
+
+        max_threads = MAX(ca_threads_auto(), 2U);
+
+        for (n_threads = 1; n_threads < max_threads; n_threads *= 2)
+                run(data, size, chunks, n_chunks, n_threads);
+
+        run(data, size, chunks, n_chunks, max_threads);
+
+        free(chunks);
+        free(data);
+
+        return 0;
+}
@@ -0,0 +1,176 @@
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "cachunk.h"
+#include "cachunker.h"
+#include "caencoder.h"
+#include "caformat.h"
+#include "realloc-buffer.h"
+#include "util.h"
+
+typedef struct Chunk {
+        size_t offset;
+        size_t size;
+} Chunk;
+
+/* Serializes the specified directory tree into a catar stream in memory, so that we benchmark on the same data that
+ * ends up in a chunk store. */
+static void encode(const char *path, ReallocBuffer *ret) {
+        CaEncoder *e;
+        uint64_t flags;
+        int fd;
+
+        fd = open(path, O_RDONLY|O_CLOEXEC|O_DIRECTORY|O_NOCTTY);
+        assert_se(fd >= 0);
+
+        assert_se(e = ca_encoder_new());
+        assert_se(ca_encoder_set_base_fd(e, fd) >= 0);
+
+        flags = CA_FORMAT_WITH_BEST|CA_FORMAT_EXCLUDE_NODUMP;
+        if (geteuid() != 0)
+                flags &= ~CA_FORMAT_WITH_PRIVILEGED;
+        assert_se(ca_encoder_set_feature_flags(e, flags) >= 0);
+
+        for (;;) {
+                const void *p;
+                size_t l;
+                int step;
+
+                step = ca_encoder_step(e);
+                assert_se(step >= 0);
+
+                if (step == CA_ENCODER_FINISHED)
+                        break;
+
+                if (!IN_SET(step, CA_ENCODER_NEXT_FILE, CA_ENCODER_DONE_FILE, CA_ENCODER_PAYLOAD, CA_ENCODER_DATA))
+                        continue;
+
+                if (ca_encoder_get_data(e, &p, &l) < 0)
+                        continue;
+
+                assert_se(realloc_buffer_append(ret, p, l));
+        }
+
+        ca_encoder_unref(e);
+}
+
+static size_t split_chunks(const uint8_t *data, size_t size, Chunk **ret) {
+        CaChunker chunker = CA_CHUNKER_INIT;
+        Chunk *chunks = NULL;
+        size_t n = 0, allocated = 0, offset = 0;
+
+        while (offset < size) {
+                size_t k;
+
+                k = ca_chunker_scan(&chunker, data + offset, size - offset);
+                if (k == (size_t) -1)
+                        k = size - offset;
+
+                assert_se(GREEDY_REALLOC(chunks, allocated, n + 1));
+                chunks[n].offset = offset;
+                chunks[n].size = k;
+                n++;
+
+                offset += k;
+        }
+
+        *ret = chunks;
+        return n;
+}
+
+/* Compresses and decompresses each chunk, and returns the time that took. If 'context' is NULL a new codec is set up
+ * for each chunk, otherwise the context is reused. */
+static void round_trip(
+                CaCompressionContext *context,
+                CaCompressionType type,
+                int level,
+                const uint8_t *data,
+                const Chunk *chunks,
+                size_t n_chunks,
+                uint64_t *ret_ctime,
+                uint64_t *ret_dtime,
+                uint64_t *ret_csize) {
+
+        ReallocBuffer compressed = {}, decompressed = {};
+        uint64_t ctime = 0, dtime = 0, csize = 0;
+        size_t i;
+
+        for (i = 0; i < n_chunks; i++) {
+                uint64_t a, b, c;
+
+                realloc_buffer_empty(&compressed);
+                realloc_buffer_empty(&decompressed);
+
+                a = now(CLOCK_MONOTONIC);
+                assert_se(ca_compress(context, type, level, data + chunks[i].offset, chunks[i].size, &compressed) >= 0);
+                b = now(CLOCK_MONOTONIC);
+                assert_se(ca_decompress(context, realloc_buffer_data(&compressed), realloc_buffer_size(&compressed), &decompressed) >= 0);
+                c = now(CLOCK_MONOTONIC);
+
+                assert_se(realloc_buffer_size(&decompressed) == chunks[i].size);
+                assert_se(memcmp(realloc_buffer_data(&decompressed), data + chunks[i].offset, chunks[i].size) == 0);
+
+                ctime += b - a;
+                dtime += c - b;
+                csize += realloc_buffer_size(&compressed);
+        }
+
+        *ret_ctime = ctime;
+        *ret_dtime = dtime;
+        *ret_csize = csize;
+
+        realloc_buffer_free(&compressed);
+        realloc_buffer_free(&decompressed);
+}
+
+static void run(CaCompressionType type, int level, const uint8_t *data, size_t size, const Chunk *chunks, size_t n_chunks) {
+        CaCompressionContext context = {};
+        uint64_t ctime, dtime, csize, fresh_ctime, fresh_dtime;
+        char level_str[DECIMAL_STR_MAX(int) + 1]; /* Also fits "default" */
+
+        if (!ca_compression_type_supported(type))
+                return;
+
+        round_trip(NULL, type, level, data, chunks, n_chunks, &fresh_ctime, &fresh_dtime, &csize);
+        round_trip(&context, type, level, data, chunks, n_chunks, &ctime, &dtime, &csize);
+
+        ca_compression_done(&context);
+
+        if (level == CA_COMPRESSION_LEVEL_DEFAULT)
+                strcpy(level_str, "default");
+        else
+                snprintf(level_str, sizeof(level_str), "%i", level);
+
+        printf("%-4s %-7s ratio %5.3f  compress %8.2f MB/s  decompress %8.2f MB/s  chunks/s new context %8.1f, reused %8.1f\n",
+               ca_compression_type_to_string(type), level_str,
+               (double) csize / (double) size,
+               (double) size / 1e6 / ((double) ctime / 1e9),
+               (double) size / 1e6 / ((double) dtime / 1e9),
+               (double) n_chunks / ((double) (fresh_ctime + fresh_dtime) / 1e9),
+               (double) n_chunks / ((double) (ctime + dtime) / 1e9));
+}
+
+int main(int argc, char *argv[]) {
+        static const int zstd_levels[] = { 1, 3, 9, 19 };
+        ReallocBuffer buffer = {};
+        size_t n_chunks, i;
+        Chunk *chunks;
+
+        /* Takes the directory to benchmark on, the test-files corpus by default */
+        encode(argc > 1 ? argv[1] : "test-files", &buffer);
+
+        n_chunks = split_chunks(realloc_buffer_data(&buffer), realloc_buffer_size(&buffer), &chunks);
+
+        printf("%zu bytes in %zu chunks\n", realloc_buffer_size(&buffer), n_chunks);
+
+        run(CA_COMPRESSION_XZ, CA_COMPRESSION_LEVEL_DEFAULT, realloc_buffer_data(&buffer), realloc_buffer_size(&buffer), chunks, n_chunks);
+        run(CA_COMPRESSION_XZ, 1, realloc_buffer_data(&buffer), realloc_buffer_size(&buffer), chunks, n_chunks);
+
+        for (i = 0; i < ELEMENTSOF(zstd_levels); i++)
+                run(CA_COMPRESSION_ZSTD, zstd_levels[i], realloc_buffer_data(&buffer), realloc_buffer_size(&buffer), chunks, n_chunks);
+
+        free(chunks);
+        realloc_buffer_free(&buffer);
+
+        return 0;
+}
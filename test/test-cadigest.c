@@ -0,0 +1,101 @@
+#include <stdio.h>
+
+#include "cachunkid.h"
+#include "cadigest.h"
+#include "util.h"
+
+#define DATA_SIZE_DEFAULT (64U*1024U*1024U)
+#define CHUNK_SIZE (64U*1024U)
+
+static void test_vector(CaDigestType t, const char *data, const char *expected) {
+        char buffer[CA_CHUNK_ID_FORMAT_MAX];
+        CaDigest *d;
+        CaChunkID id;
+
+        assert_se(ca_digest_new(t, &d) >= 0);
+        assert_se(ca_digest_get_type(d) == t);
+        assert_se(ca_digest_get_size(d) == sizeof(CaChunkID));
+
+        /* Calculate it twice, to make sure the object is properly reset in between */
+        assert_se(ca_chunk_id_make(d, "foobar", 6, &id) >= 0);
+        assert_se(ca_chunk_id_make(d, data, strlen(data), &id) >= 0);
+        assert_se(streq(ca_chunk_id_format(&id, buffer), expected));
+
+        ca_digest_free(d);
+}
+
+static void test_type(void) {
+        CaDigest *d = NULL;
+
+        assert_se(ca_digest_type_from_string("sha256") == CA_DIGEST_SHA256);
+        assert_se(ca_digest_type_from_string("blake2b-256") == CA_DIGEST_BLAKE2B_256);
+        assert_se(ca_digest_type_from_string("md5") == _CA_DIGEST_TYPE_INVALID);
+        assert_se(streq(ca_digest_type_to_string(CA_DIGEST_SHA256), "sha256"));
+        assert_se(!ca_digest_type_to_string(_CA_DIGEST_TYPE_MAX));
+
+        assert_se(ca_digest_ensure_allocated(&d, CA_DIGEST_SHA256) > 0);
+        assert_se(ca_digest_ensure_allocated(&d, CA_DIGEST_SHA256) == 0);
+        assert_se(ca_digest_get_type(d) == CA_DIGEST_SHA256);
+
+        if (ca_digest_type_supported(CA_DIGEST_BLAKE2B_256)) {
+                assert_se(ca_digest_ensure_allocated(&d, CA_DIGEST_BLAKE2B_256) > 0);
+                assert_se(ca_digest_get_type(d) == CA_DIGEST_BLAKE2B_256);
+        }
+
+        ca_digest_free(d);
+}
+
+static void benchmark(CaDigestType t, const uint8_t *data, size_t size) {
+        CaDigest *d;
+        uint64_t start, end;
+        size_t offset;
+        CaChunkID id;
+
+        assert_se(ca_digest_new(t, &d) >= 0);
+
+        start = now(CLOCK_MONOTONIC);
+
+        for (offset = 0; offset < size; offset += CHUNK_SIZE)
+                assert_se(ca_chunk_id_make(d, data + offset, MIN(size - offset, CHUNK_SIZE), &id) >= 0);
+
+        end = now(CLOCK_MONOTONIC);
+
+        printf("%-12s %7.2f MiB/s\n",
+               ca_digest_type_to_string(t),
+               (double) size / 1024.0 / 1024.0 / ((double) (end - start) / 1e9));
+
+        ca_digest_free(d);
+}
+
+int main(int argc, char *argv[]) {
+        size_t size = DATA_SIZE_DEFAULT;
+        CaDigestType t;
+        uint8_t *data;
+
+        test_type();
+
+        test_vector(CA_DIGEST_SHA256, "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+
+        if (ca_digest_type_supported(CA_DIGEST_BLAKE2B_256))
+                test_vector(CA_DIGEST_BLAKE2B_256, "abc", "bddd813c634239723171ef3fee98579b94964e3bb1cb3e427262c8c068d52319");
+
+        /* Optionally takes the amount of data to hash in MiB, for comparing the throughput of the algorithms */
+        if (argc > 1) {
+                unsigned mib;
+
+                assert_se(safe_atou(argv[1], &mib) >= 0);
+                assert_se(mib > 0);
+                size = (size_t) mib * 1024U * 1024U;
+        }
+
+        assert_se(data = new(uint8_t, size));
+        assert_se(dev_urandom(data, size) >= 0);
+
+        for (t = 0; t < _CA_DIGEST_TYPE_MAX; t++)
+                if (ca_digest_type_supported(t))
+                        benchmark(t, data, size);
+
+        free(data);
+
+        return 0;
+}
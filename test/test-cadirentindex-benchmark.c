@@ -0,0 +1,176 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "cadirentindex.h"
+#include "caencoder.h"
+#include "calocation.h"
+#include "rm-rf.h"
+#include "util.h"
+
+/* How many names to look up by seeking the encoder, each of which opens the entry */
+#define N_SEEKS 100000U
+
+static int compare_names(const void *a, const void *b) {
+        return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+static char **make_names(unsigned n) {
+        char **names;
+        unsigned i;
+
+        /* Names as found in a Maildir, which is where directories get that large */
+        assert_se(names = new0(char*, n));
+        for (i = 0; i < n; i++)
+                assert_se(asprintf(names + i, "%u.M%uP%u.example.com,S=%u:2,S",
+                                   1500000000U + i * 7U, i * 31U % 1000000U, 1000U + i % 30000U, 1000U + i % 77777U) >= 0);
+
+        qsort(names, n, sizeof(char*), compare_names);
+        return names;
+}
+
+static unsigned *make_order(unsigned n) {
+        unsigned *order, i;
+
+        /* Look the names up in random order, as with readdir() on most file systems */
+        assert_se(order = new(unsigned, n));
+        for (i = 0; i < n; i++)
+                order[i] = i;
+
+        for (i = n - 1; i > 0; i--) {
+                unsigned j = random_u64() % (i + 1), t;
+
+                t = order[i];
+                order[i] = order[j];
+                order[j] = t;
+        }
+
+        return order;
+}
+
+static void lookup_bsearch(char **names, const unsigned *order, unsigned n) {
+        uint64_t start, t;
+        unsigned i;
+
+        start = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < n; i++) {
+                char **found;
+
+                found = bsearch(names + order[i], names, n, sizeof(char*), compare_names);
+                assert_se(found == names + order[i]);
+        }
+
+        t = now(CLOCK_MONOTONIC) - start;
+        printf("bsearch: %.3f s for %u lookups\n", (double) t / 1e9, n);
+}
+
+static void lookup_index(char **names, const unsigned *order, unsigned n) {
+        uint64_t start, t_build, t_lookup;
+        CaDirentIndex *x;
+        unsigned i;
+
+        start = now(CLOCK_MONOTONIC);
+
+        assert_se(x = ca_dirent_index_new(n));
+        for (i = 0; i < n; i++)
+                assert_se(ca_dirent_index_put(x, names[i], i) > 0);
+
+        t_build = now(CLOCK_MONOTONIC) - start;
+        start = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < n; i++) {
+                size_t idx;
+
+                assert_se(ca_dirent_index_get(x, names[order[i]], &idx) >= 0);
+                assert_se(idx == order[i]);
+        }
+
+        t_lookup = now(CLOCK_MONOTONIC) - start;
+
+        printf("index: %.3f s to build, %.3f s for %u lookups, %zu KiB\n",
+               (double) t_build / 1e9, (double) t_lookup / 1e9, n, ca_dirent_index_size(x) / 1024);
+
+        ca_dirent_index_free(x);
+}
+
+static void populate(const char *tree, char **names, unsigned n) {
+        unsigned i;
+        int dfd;
+
+        assert_se(mkdir(tree, 0777) >= 0);
+        dfd = open(tree, O_RDONLY|O_CLOEXEC|O_DIRECTORY);
+        assert_se(dfd >= 0);
+
+        for (i = 0; i < n; i++) {
+                int fd;
+
+                fd = openat(dfd, names[i], O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+                assert_se(fd >= 0);
+                safe_close(fd);
+        }
+
+        safe_close(dfd);
+}
+
+static void seek_encoder(const char *tree, char **names, const unsigned *order, unsigned n) {
+        uint64_t start, t;
+        CaEncoder *e;
+        unsigned i;
+        int fd;
+
+        fd = open(tree, O_RDONLY|O_CLOEXEC|O_DIRECTORY);
+        assert_se(fd >= 0);
+
+        assert_se(e = ca_encoder_new());
+        assert_se(ca_encoder_set_base_fd(e, fd) >= 0);
+        assert_se(ca_encoder_step(e) >= 0);
+
+        start = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < MIN(n, N_SEEKS); i++) {
+                CaLocation *l;
+
+                assert_se(ca_location_new(names[order[i]], CA_LOCATION_ENTRY, 0, 1, &l) >= 0);
+                assert_se(ca_encoder_seek_location(e, l) >= 0);
+                ca_location_unref(l);
+        }
+
+        t = now(CLOCK_MONOTONIC) - start;
+        printf("encoder: %.3f s for %u seeks\n", (double) t / 1e9, MIN(n, N_SEEKS));
+
+        ca_encoder_unref(e);
+}
+
+int main(int argc, char *argv[]) {
+        unsigned n = 500000, i, *order;
+        char **names, *tree;
+
+        /* Pass the number of directory entries, for example 2000000 */
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &n) >= 0);
+        assert_se(n > 0);
+
+        names = make_names(n);
+        order = make_order(n);
+
+        printf("%u entries\n", n);
+
+        lookup_bsearch(names, order, n);
+        lookup_index(names, order, n);
+
+        assert_se(asprintf(&tree, "/var/tmp/test-cadirentindex-benchmark.%" PRIx64, random_u64()) >= 0);
+        populate(tree, names, n);
+
+        seek_encoder(tree, names, order, n);
+
+        (void) rm_rf(tree, REMOVE_ROOT|REMOVE_PHYSICAL);
+        free(tree);
+
+        for (i = 0; i < n; i++)
+                free(names[i]);
+        free(names);
+        free(order);
+
+        return 0;
+}
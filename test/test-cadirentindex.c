@@ -0,0 +1,66 @@
+#include <stdio.h>
+
+#include "cadirentindex.h"
+#include "util.h"
+
+/* Enough to make the index grow a couple of times beyond its initial size */
+#define N_ENTRIES 10000U
+
+static void test_index(size_t n_expected) {
+        char **names;
+        CaDirentIndex *x;
+        size_t idx, size;
+        unsigned i;
+
+        assert_se(names = new0(char*, N_ENTRIES));
+        for (i = 0; i < N_ENTRIES; i++)
+                assert_se(asprintf(names + i, "file%u", i) >= 0);
+
+        assert_se(x = ca_dirent_index_new(n_expected));
+        assert_se(ca_dirent_index_entries(x) == 0);
+        assert_se(ca_dirent_index_get(x, "file0", NULL) == -ENOENT);
+
+        for (i = 0; i < N_ENTRIES; i++)
+                assert_se(ca_dirent_index_put(x, names[i], i) > 0);
+
+        assert_se(ca_dirent_index_entries(x) == N_ENTRIES);
+
+        /* The entry that is there already is left alone */
+        assert_se(ca_dirent_index_put(x, "file7", 4711) == 0);
+        assert_se(ca_dirent_index_entries(x) == N_ENTRIES);
+
+        for (i = 0; i < N_ENTRIES; i++) {
+                char name[32];
+
+                snprintf(name, sizeof(name), "file%u", i);
+                assert_se(ca_dirent_index_get(x, name, &idx) >= 0);
+                assert_se(idx == i);
+        }
+
+        assert_se(ca_dirent_index_get(x, "file", NULL) == -ENOENT);
+        assert_se(ca_dirent_index_get(x, "file10000", NULL) == -ENOENT);
+        assert_se(ca_dirent_index_get(x, "", NULL) == -ENOENT);
+
+        assert_se(ca_dirent_index_put(x, "toobig", (size_t) UINT32_MAX + 1) == -EOVERFLOW);
+
+        size = ca_dirent_index_size(x);
+        assert_se(size >= N_ENTRIES * sizeof(void*));
+        printf("%u entries, %zu bytes\n", N_ENTRIES, size);
+
+        assert_se(!ca_dirent_index_free(x));
+
+        for (i = 0; i < N_ENTRIES; i++)
+                free(names[i]);
+        free(names);
+}
+
+int main(int argc, char *argv[]) {
+
+        test_index(0);
+        test_index(N_ENTRIES);
+
+        assert_se(ca_dirent_index_entries(NULL) == 0);
+        assert_se(ca_dirent_index_size(NULL) == 0);
+
+        return 0;
+}
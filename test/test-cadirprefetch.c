@@ -0,0 +1,151 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "cadirprefetch.h"
+#include "rm-rf.h"
+#include "util.h"
+
+#define N_ENTRIES 200U
+
+static void make_tree(char **ret_path) {
+        unsigned i;
+        int dfd;
+
+        assert_se(asprintf(ret_path, "/var/tmp/test-cadirprefetch.%" PRIx64, random_u64()) >= 0);
+        assert_se(mkdir(*ret_path, 0777) >= 0);
+
+        dfd = open(*ret_path, O_RDONLY|O_CLOEXEC|O_DIRECTORY);
+        assert_se(dfd >= 0);
+
+        for (i = 0; i < N_ENTRIES; i++) {
+                char name[32];
+                int fd;
+
+                snprintf(name, sizeof(name), "%04u", i);
+
+                switch (i % 4) {
+
+                case 0:
+                        fd = openat(dfd, name, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+                        assert_se(fd >= 0);
+                        safe_close(fd);
+                        break;
+
+                case 1:
+                        assert_se(mkdirat(dfd, name, 0755) >= 0);
+                        break;
+
+                case 2:
+                        assert_se(symlinkat("0000", dfd, name) >= 0);
+                        break;
+
+                case 3:
+                        assert_se(mkfifoat(dfd, name, 0644) >= 0);
+                        break;
+                }
+        }
+
+        safe_close(dfd);
+}
+
+static void check_entry(CaDirPrefetchWindow *w, int dfd, struct dirent **dirents, size_t idx) {
+        struct stat st, expected_st;
+        int fd = -1, expected_fd = -1, r;
+
+        r = ca_dir_prefetch_window_take(w, idx, &fd, &st);
+        if (r == -ENOENT)
+                r = ca_open_dirent(dfd, dirents[idx], &fd, &st);
+        assert_se(r >= 0);
+
+        assert_se(ca_dir_prefetch_window_advance(w, idx + 1) >= 0);
+
+        assert_se(ca_open_dirent(dfd, dirents[idx], &expected_fd, &expected_st) >= 0);
+
+        assert_se(st.st_ino == expected_st.st_ino);
+        assert_se(st.st_mode == expected_st.st_mode);
+        assert_se((fd >= 0) == (expected_fd >= 0));
+
+        if (fd >= 0) {
+                struct stat fst;
+
+                assert_se(fstat(fd, &fst) >= 0);
+                assert_se(fst.st_ino == st.st_ino);
+        }
+
+        safe_close(fd);
+        safe_close(expected_fd);
+}
+
+static void test_window(unsigned n_threads) {
+        struct dirent **dirents = NULL;
+        CaDirPrefetchWindow *w;
+        CaDirPrefetch *p;
+        char *path;
+        int dfd, n, i;
+        size_t k;
+
+        make_tree(&path);
+
+        dfd = open(path, O_RDONLY|O_CLOEXEC|O_DIRECTORY);
+        assert_se(dfd >= 0);
+
+        n = scandir(path, &dirents, NULL, alphasort);
+        assert_se(n >= (int) N_ENTRIES);
+
+        assert_se(ca_dir_prefetch_new(n_threads, &p) >= 0);
+        assert_se(ca_dir_prefetch_window_new(p, dfd, dirents, n, &w) >= 0);
+
+        /* In order, as the encoder does it */
+        for (k = 0; k < (size_t) n; k++)
+                check_entry(w, dfd, dirents, k);
+
+        /* Jump back and then forward again, as seeking does */
+        check_entry(w, dfd, dirents, 3);
+        check_entry(w, dfd, dirents, 4);
+        check_entry(w, dfd, dirents, 150);
+        check_entry(w, dfd, dirents, 10);
+
+        /* Entries that vanished before they were queued must fail like they would without prefetching */
+        assert_se(ca_dir_prefetch_window_advance(w, 20) >= 0);
+        assert_se(unlinkat(dfd, dirents[20 + CA_DIR_PREFETCH_WINDOW + 8]->d_name, 0) >= 0);
+
+        for (k = 20; k < 20 + 2 * CA_DIR_PREFETCH_WINDOW; k++) {
+                struct stat st;
+                int fd = -1, r;
+
+                r = ca_dir_prefetch_window_take(w, k, &fd, &st);
+                if (r == -ENOENT)
+                        r = ca_open_dirent(dfd, dirents[k], &fd, &st);
+                assert_se(k == 20 + CA_DIR_PREFETCH_WINDOW + 8 ? r == -ENOENT : r >= 0);
+                safe_close(fd);
+
+                assert_se(ca_dir_prefetch_window_advance(w, k + 1) >= 0);
+        }
+
+        /* Free the window with entries still in flight */
+        assert_se(ca_dir_prefetch_window_advance(w, 120) >= 0);
+        assert_se(!ca_dir_prefetch_window_free(w));
+
+        printf("%u threads: %" PRIu64 " hits, %" PRIu64 " misses\n",
+               n_threads, ca_dir_prefetch_get_hits(p), ca_dir_prefetch_get_misses(p));
+
+        assert_se(!ca_dir_prefetch_free(p));
+
+        for (i = 0; i < n; i++)
+                free(dirents[i]);
+        free(dirents);
+
+        safe_close(dfd);
+
+        (void) rm_rf(path, REMOVE_ROOT|REMOVE_PHYSICAL);
+        free(path);
+}
+
+int main(int argc, char *argv[]) {
+
+        test_window(1);
+        test_window(CA_DIR_PREFETCH_THREADS_DEFAULT);
+
+        return 0;
+}
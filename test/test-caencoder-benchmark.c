@@ -0,0 +1,202 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "cachunkid.h"
+#include "cadirprefetch.h"
+#include "caencoder.h"
+#include "caformat.h"
+#include "def.h"
+#include "rm-rf.h"
+#include "util.h"
+
+/* How many files to put into each directory of the generated tree */
+#define FILES_PER_DIR 1000U
+
+/* The size of the large file to encode */
+#define BLOB_SIZE (256U*1024U*1024U)
+
+static uint64_t feature_flags(void) {
+        uint64_t flags = CA_FORMAT_WITH_BEST;
+
+        if (geteuid() != 0)
+                flags &= ~CA_FORMAT_WITH_PRIVILEGED;
+
+        return flags;
+}
+
+static void populate(const char *tree, unsigned n_files) {
+        char buf[4096];
+        int tfd, dfd = -1;
+        unsigned i;
+
+        assert_se(mkdir(tree, 0777) >= 0);
+        tfd = open(tree, O_RDONLY|O_CLOEXEC|O_DIRECTORY);
+        assert_se(tfd >= 0);
+        memset(buf, 'x', sizeof(buf));
+
+        for (i = 0; i < n_files; i++) {
+                char name[32];
+                int fd;
+
+                if (i % FILES_PER_DIR == 0) {
+                        snprintf(name, sizeof(name), "%04u", i / FILES_PER_DIR);
+
+                        dfd = safe_close(dfd);
+                        assert_se(mkdirat(tfd, name, 0777) >= 0);
+                        dfd = openat(tfd, name, O_RDONLY|O_CLOEXEC|O_DIRECTORY);
+                        assert_se(dfd >= 0);
+                }
+
+                /* Mostly small regular files, with a few symlinks in between */
+                snprintf(name, sizeof(name), "file-%u", i);
+                if (i % 16 == 7) {
+                        assert_se(symlinkat("file-0", dfd, name) >= 0);
+                        continue;
+                }
+
+                fd = openat(dfd, name, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+                assert_se(fd >= 0);
+                assert_se(loop_write(fd, buf, i % sizeof(buf)) >= 0);
+                safe_close(fd);
+        }
+
+        safe_close(dfd);
+        safe_close(tfd);
+}
+
+static void populate_blob(const char *path) {
+        uint8_t buf[BUFFER_SIZE];
+        size_t n;
+        int fd;
+
+        fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+        assert_se(fd >= 0);
+
+        for (n = 0; n < BLOB_SIZE; n += sizeof(buf)) {
+                assert_se(dev_urandom(buf, sizeof(buf)) >= 0);
+                assert_se(loop_write(fd, buf, sizeof(buf)) >= 0);
+        }
+
+        safe_close(fd);
+}
+
+static uint64_t run(CaEncoder *e, CaChunkID *ret_digest) {
+        uint64_t start;
+
+        start = now(CLOCK_MONOTONIC);
+
+        for (;;) {
+                const void *p;
+                size_t sz;
+                int r;
+
+                r = ca_encoder_step(e);
+                assert_se(r >= 0);
+
+                if (r == CA_ENCODER_FINISHED)
+                        break;
+
+                r = ca_encoder_get_data(e, &p, &sz);
+                assert_se(r >= 0 || r == -ENODATA);
+        }
+
+        assert_se(ca_encoder_get_archive_digest(e, ret_digest) >= 0);
+
+        return now(CLOCK_MONOTONIC) - start;
+}
+
+static void encode_tree(const char *tree, unsigned n_threads, CaChunkID *ret_digest) {
+        uint64_t t, hits = 0;
+        CaEncoder *e;
+        int fd;
+
+        fd = open(tree, O_RDONLY|O_CLOEXEC|O_DIRECTORY);
+        assert_se(fd >= 0);
+
+        assert_se(e = ca_encoder_new());
+        assert_se(ca_encoder_set_base_fd(e, fd) >= 0);
+        assert_se(ca_encoder_set_feature_flags(e, feature_flags()) >= 0);
+        assert_se(ca_encoder_set_prefetch_threads(e, n_threads) >= 0);
+        assert_se(ca_encoder_enable_archive_digest(e, true) >= 0);
+
+        t = run(e, ret_digest);
+        (void) ca_encoder_get_prefetch_hits(e, &hits);
+
+        printf("%u threads: %.3f s, %" PRIu64 " entries prefetched\n", n_threads, (double) t / 1e9, hits);
+
+        ca_encoder_unref(e);
+}
+
+static void encode_blob(const char *path, size_t read_size, CaChunkID *ret_digest) {
+        CaEncoder *e;
+        uint64_t t;
+        int fd;
+
+        fd = open(path, O_RDONLY|O_CLOEXEC);
+        assert_se(fd >= 0);
+
+        assert_se(e = ca_encoder_new());
+        assert_se(ca_encoder_set_base_fd(e, fd) >= 0);
+        assert_se(ca_encoder_set_payload_read_size(e, read_size) >= 0);
+        assert_se(ca_encoder_enable_archive_digest(e, true) >= 0);
+
+        t = run(e, ret_digest);
+
+        printf("%zu KiB reads: %.3f s, %.1f MiB/s\n", read_size / 1024, (double) t / 1e9,
+               (double) BLOB_SIZE / 1024.0 / 1024.0 / ((double) t / 1e9));
+
+        ca_encoder_unref(e);
+}
+
+int main(int argc, char *argv[]) {
+        static const unsigned threads[] = { 0, 1, 4, CA_DIR_PREFETCH_THREADS_DEFAULT, 16 };
+        static const size_t read_sizes[] = {
+                4096,
+                CA_ENCODER_PAYLOAD_READ_SIZE_DEFAULT,
+                256U*1024U,
+                1024U*1024U,
+                4U*1024U*1024U,
+        };
+        CaChunkID expected, digest;
+        unsigned n_files = 100000, i;
+        char *tree, *blob;
+
+        /* Pass the number of files to generate, for example 1000000 */
+        if (argc > 1)
+                assert_se(safe_atou(argv[1], &n_files) >= 0);
+
+        assert_se(asprintf(&tree, "/var/tmp/test-caencoder-benchmark.%" PRIx64, random_u64()) >= 0);
+        populate(tree, n_files);
+
+        printf("%u files\n", n_files);
+
+        /* The first run also gets the tree into the page cache, so that all runs see the same conditions */
+        encode_tree(tree, 0, &expected);
+
+        for (i = 0; i < ELEMENTSOF(threads); i++) {
+                encode_tree(tree, threads[i], &digest);
+                assert_se(ca_chunk_id_equal(&digest, &expected));
+        }
+
+        (void) rm_rf(tree, REMOVE_ROOT|REMOVE_PHYSICAL);
+
+        assert_se(blob = strjoin(tree, ".blob", NULL));
+        populate_blob(blob);
+
+        printf("%u MiB file\n", BLOB_SIZE / 1024U / 1024U);
+
+        encode_blob(blob, CA_ENCODER_PAYLOAD_READ_SIZE_DEFAULT, &expected);
+
+        for (i = 0; i < ELEMENTSOF(read_sizes); i++) {
+                encode_blob(blob, read_sizes[i], &digest);
+                assert_se(ca_chunk_id_equal(&digest, &expected));
+        }
+
+        assert_se(unlink(blob) >= 0);
+
+        free(tree);
+        free(blob);
+
+        return 0;
+}
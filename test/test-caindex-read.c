@@ -0,0 +1,245 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "caindex.h"
+#include "util.h"
+
+/* Enough items to span a couple of read-ahead blocks */
+#define N_CHUNKS 5000U
+
+#define CHUNK_SIZE_MIN 16U
+#define CHUNK_SIZE_AVG 64U
+#define CHUNK_SIZE_MAX 256U
+
+static void make_index(const char *path, CaIndexChunk *chunks) {
+        uint64_t offset = 0;
+        CaIndex *index;
+        unsigned i;
+
+        assert_se(index = ca_index_new_write());
+        assert_se(ca_index_set_path(index, path) >= 0);
+        assert_se(ca_index_set_chunk_size_min(index, CHUNK_SIZE_MIN) >= 0);
+        assert_se(ca_index_set_chunk_size_avg(index, CHUNK_SIZE_AVG) >= 0);
+        assert_se(ca_index_set_chunk_size_max(index, CHUNK_SIZE_MAX) >= 0);
+        assert_se(ca_index_open(index) >= 0);
+
+        for (i = 0; i < N_CHUNKS; i++) {
+                assert_se(dev_urandom(&chunks[i].id, sizeof(chunks[i].id)) >= 0);
+                chunks[i].size = CHUNK_SIZE_MIN + random_u64() % (CHUNK_SIZE_MAX - CHUNK_SIZE_MIN + 1);
+                offset += chunks[i].size;
+                chunks[i].offset_end = offset;
+
+                assert_se(ca_index_write_chunk(index, &chunks[i].id, chunks[i].size) >= 0);
+        }
+
+        assert_se(ca_index_write_eof(index) >= 0);
+        assert_se(ca_index_install(index) >= 0);
+        ca_index_unref(index);
+}
+
+static void check_chunk(const CaIndexChunk *a, const CaIndexChunk *b) {
+        assert_se(ca_chunk_id_equal(&a->id, &b->id));
+        assert_se(a->offset_end == b->offset_end);
+        assert_se(a->size == b->size);
+}
+
+static void test_read_chunks(const char *path, const CaIndexChunk *chunks) {
+        CaIndexChunk batch[7];
+        CaIndex *index;
+        unsigned i = 0;
+        size_t n, k;
+        int r;
+
+        assert_se(index = ca_index_new_read());
+        assert_se(ca_index_set_path(index, path) >= 0);
+        assert_se(ca_index_open(index) >= 0);
+
+        for (;;) {
+                r = ca_index_read_chunks(index, batch, ELEMENTSOF(batch), &n);
+                assert_se(r >= 0);
+                if (r == 0) {
+                        assert_se(n == 0);
+                        break;
+                }
+
+                assert_se(n > 0);
+                assert_se(i + n <= N_CHUNKS);
+
+                for (k = 0; k < n; k++)
+                        check_chunk(batch + k, chunks + i + k);
+
+                i += n;
+        }
+
+        assert_se(i == N_CHUNKS);
+
+        ca_index_unref(index);
+}
+
+static void test_set_position(const char *path, const CaIndexChunk *chunks) {
+        static const unsigned positions[] = { 4000, 4001, 4100, 10, 0, 4999, 2 };
+        CaIndexChunk c;
+        CaIndex *index;
+        unsigned i;
+
+        assert_se(index = ca_index_new_read());
+        assert_se(ca_index_set_path(index, path) >= 0);
+        assert_se(ca_index_open(index) >= 0);
+
+        /* Jump around, forward within what we read ahead, and beyond it, and back */
+        for (i = 0; i < ELEMENTSOF(positions); i++) {
+                uint64_t p;
+
+                assert_se(ca_index_set_position(index, positions[i]) >= 0);
+                assert_se(ca_index_read_chunk(index, &c.id, &c.offset_end, &c.size) > 0);
+
+                assert_se(ca_chunk_id_equal(&c.id, &chunks[positions[i]].id));
+                assert_se(c.offset_end == chunks[positions[i]].offset_end);
+
+                assert_se(ca_index_get_position(index, &p) >= 0);
+                assert_se(p == positions[i] + 1);
+        }
+
+        /* We are at the end now */
+        assert_se(ca_index_set_position(index, N_CHUNKS) >= 0);
+        assert_se(ca_index_read_chunk(index, NULL, NULL, NULL) == 0);
+
+        ca_index_unref(index);
+}
+
+static void check_seek(CaIndex *index, const CaIndexChunk *chunks, uint64_t offset, unsigned expected) {
+        uint64_t skip, start;
+        CaIndexChunk c;
+
+        start = expected > 0 ? chunks[expected - 1].offset_end : 0;
+
+        assert_se(ca_index_seek(index, offset, &skip) >= 0);
+        assert_se(skip == offset - start);
+
+        assert_se(ca_index_read_chunk(index, &c.id, &c.offset_end, &c.size) > 0);
+        check_chunk(&c, chunks + expected);
+}
+
+static void test_seek(const char *path, const CaIndexChunk *chunks) {
+        uint64_t size = chunks[N_CHUNKS - 1].offset_end, offset;
+        CaIndex *index;
+        unsigned i;
+
+        assert_se(index = ca_index_new_read());
+        assert_se(ca_index_set_path(index, path) >= 0);
+        assert_se(ca_index_open(index) >= 0);
+
+        /* Every chunk, from its first to its last byte */
+        for (i = 0; i < N_CHUNKS; i++) {
+                check_seek(index, chunks, chunks[i].offset_end - chunks[i].size, i);
+                check_seek(index, chunks, chunks[i].offset_end - 1, i);
+        }
+
+        /* And randomly, backwards too */
+        for (i = 0; i < 1000; i++) {
+                unsigned k = 0;
+
+                offset = random_u64() % size;
+                while (chunks[k].offset_end <= offset)
+                        k++;
+
+                check_seek(index, chunks, offset, k);
+        }
+
+        assert_se(ca_index_seek(index, size, NULL) == -ENXIO);
+        assert_se(ca_index_seek(index, UINT64_MAX, NULL) == -ENXIO);
+
+        ca_index_unref(index);
+}
+
+static void read_file(const char *path, char **ret, size_t *ret_size) {
+        struct stat st;
+        char *data;
+        int fd;
+
+        fd = open(path, O_RDONLY|O_CLOEXEC);
+        assert_se(fd >= 0);
+        assert_se(fstat(fd, &st) >= 0);
+
+        assert_se(data = new(char, st.st_size));
+        assert_se(loop_read(fd, data, st.st_size) == st.st_size);
+        safe_close(fd);
+
+        *ret = data;
+        *ret_size = st.st_size;
+}
+
+static void test_seek_incremental(const char *path, const CaIndexChunk *chunks) {
+        uint64_t size = chunks[N_CHUNKS - 1].offset_end;
+        CaIndex *index;
+        char *data;
+        size_t l;
+
+        read_file(path, &data, &l);
+
+        assert_se(index = ca_index_new_incremental_read());
+        assert_se(ca_index_open(index) >= 0);
+
+        /* Not even the header is there yet */
+        assert_se(ca_index_seek(index, 0, NULL) == -EAGAIN);
+
+        /* Feed half of the file, the first half of the chunks are available then */
+        assert_se(ca_index_incremental_write(index, data, l / 2) >= 0);
+        check_seek(index, chunks, 0, 0);
+        check_seek(index, chunks, chunks[N_CHUNKS / 4].offset_end, N_CHUNKS / 4 + 1);
+        assert_se(ca_index_seek(index, size - 1, NULL) == -EAGAIN);
+
+        assert_se(ca_index_incremental_write(index, data + l / 2, l - l / 2) >= 0);
+        assert_se(ca_index_incremental_eof(index) >= 0);
+        check_seek(index, chunks, size - 1, N_CHUNKS - 1);
+        check_seek(index, chunks, 0, 0);
+        assert_se(ca_index_seek(index, size, NULL) == -ENXIO);
+
+        ca_index_unref(index);
+        free(data);
+}
+
+static void test_trailing_garbage(const char *path) {
+        CaIndex *index;
+        int fd, r;
+
+        fd = open(path, O_WRONLY|O_APPEND|O_CLOEXEC);
+        assert_se(fd >= 0);
+        assert_se(loop_write(fd, "x", 1) >= 0);
+        safe_close(fd);
+
+        assert_se(index = ca_index_new_read());
+        assert_se(ca_index_set_path(index, path) >= 0);
+        assert_se(ca_index_open(index) >= 0);
+
+        do
+                r = ca_index_read_chunk(index, NULL, NULL, NULL);
+        while (r > 0);
+
+        assert_se(r == -EBADMSG);
+
+        ca_index_unref(index);
+}
+
+int main(int argc, char *argv[]) {
+        CaIndexChunk *chunks;
+        char *path;
+
+        assert_se(chunks = new(CaIndexChunk, N_CHUNKS));
+        assert_se(asprintf(&path, "/var/tmp/test-caindex-read.%" PRIx64 ".caidx", random_u64()) >= 0);
+
+        make_index(path, chunks);
+
+        test_read_chunks(path, chunks);
+        test_set_position(path, chunks);
+        test_seek(path, chunks);
+        test_seek_incremental(path, chunks);
+        test_trailing_garbage(path);
+
+        (void) unlink(path);
+        free(path);
+        free(chunks);
+
+        return 0;
+}
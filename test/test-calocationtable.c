@@ -0,0 +1,113 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "cachunk.h"
+#include "calocationtable.h"
+#include "rm-rf.h"
+#include "util.h"
+
+/* Enough to make the table grow a couple of times beyond its initial size */
+#define N_ENTRIES 100000U
+#define N_PATHS 100U
+
+static void make_id(CaDigest *digest, unsigned i, CaChunkID *ret) {
+        assert_se(ca_chunk_id_make(digest, &i, sizeof(i), ret) >= 0);
+}
+
+static int count_entry(const CaChunkID *id, void *userdata) {
+        unsigned *n = userdata;
+
+        (*n)++;
+        return 0;
+}
+
+static void test_table(CaDigest *digest, const char *spill) {
+        CaLocationTable *t;
+        CaLocation *l;
+        CaChunkID id;
+        unsigned i, n = 0;
+        uint64_t size;
+
+        assert_se(t = ca_location_table_new());
+        if (spill) {
+                int fd;
+
+                assert_se((fd = open(spill, O_RDONLY|O_CLOEXEC|O_DIRECTORY)) >= 0);
+                assert_se(ca_location_table_set_spill_fd(t, fd) >= 0);
+                safe_close(fd);
+        }
+
+        make_id(digest, 0, &id);
+        assert_se(ca_location_table_get(t, &id, NULL) == -ENOENT);
+
+        for (i = 0; i < N_ENTRIES; i++) {
+                char path[32];
+
+                snprintf(path, sizeof(path), "dir/file%u", i % N_PATHS);
+
+                make_id(digest, i, &id);
+                assert_se(ca_location_table_put(t, &id, CA_LOCATION_PAYLOAD, path, i, i + 1) > 0);
+        }
+
+        assert_se(ca_location_table_entries(t) == N_ENTRIES);
+
+        /* The first entry for an ID stays */
+        make_id(digest, 7, &id);
+        assert_se(ca_location_table_put(t, &id, CA_LOCATION_ENTRY, "other", 0, UINT64_MAX) == 0);
+        assert_se(ca_location_table_entries(t) == N_ENTRIES);
+
+        for (i = 0; i < N_ENTRIES; i++) {
+                char path[32];
+
+                snprintf(path, sizeof(path), "dir/file%u", i % N_PATHS);
+
+                make_id(digest, i, &id);
+                assert_se(ca_location_table_get(t, &id, &l) >= 0);
+                assert_se(l->designator == CA_LOCATION_PAYLOAD);
+                assert_se(streq(l->path, path));
+                assert_se(l->offset == i);
+                assert_se(l->size == i + 1);
+                ca_location_unref(l);
+        }
+
+        make_id(digest, N_ENTRIES, &id);
+        assert_se(ca_location_table_get(t, &id, &l) == -ENOENT);
+
+        assert_se(ca_location_table_put(t, &id, CA_LOCATION_VOID, NULL, 0, 4711) > 0);
+        assert_se(ca_location_table_get(t, &id, &l) >= 0);
+        assert_se(l->designator == CA_LOCATION_VOID);
+        assert_se(!l->path);
+        assert_se(l->size == 4711);
+        ca_location_unref(l);
+
+        assert_se(ca_location_table_enumerate(t, count_entry, &n) >= 0);
+        assert_se(n == N_ENTRIES + 1);
+
+        /* Each path is stored only once, hence that's about the size of the slots only, of which at least a third
+         * is in use */
+        size = ca_location_table_size(t);
+        printf("%u entries in %" PRIu64 " bytes\n", N_ENTRIES + 1, size);
+        assert_se(size < (N_ENTRIES + 1) * 3U * 64U);
+
+        ca_location_table_free(t);
+}
+
+int main(int argc, char *argv[]) {
+        CaDigest *digest;
+        char *path;
+
+        assert_se(ca_digest_new(CA_DIGEST_DEFAULT, &digest) >= 0);
+
+        test_table(digest, NULL);
+
+        assert_se(asprintf(&path, "/var/tmp/test-calocationtable.%" PRIx64, random_u64()) >= 0);
+        assert_se(mkdir(path, 0777) >= 0);
+        test_table(digest, path);
+        (void) rm_rf(path, REMOVE_ROOT|REMOVE_PHYSICAL);
+        free(path);
+
+        ca_digest_free(digest);
+
+        return 0;
+}
@@ -0,0 +1,87 @@
+#include <stdio.h>
+
+#include "canamecache.h"
+#include "util.h"
+
+/* An ID and a name no sane user database knows */
+#define UNKNOWN_ID ((uint32_t) 4242424242U)
+#define UNKNOWN_NAME "test-canamecache-does-not-exist"
+
+static void test_users(CaNameCache *c) {
+        char *name;
+        uid_t uid;
+
+        assert_se(ca_name_cache_uid_to_name(c, 0, &name) > 0);
+        assert_se(streq(name, "root"));
+        free(name);
+
+        assert_se(ca_name_cache_get_hits(c) == 0);
+        assert_se(ca_name_cache_get_misses(c) == 1);
+
+        assert_se(ca_name_cache_uid_to_name(c, 0, &name) > 0);
+        assert_se(streq(name, "root"));
+        free(name);
+
+        assert_se(ca_name_cache_get_hits(c) == 1);
+
+        assert_se(ca_name_cache_name_to_uid(c, "root", &uid) > 0);
+        assert_se(uid == 0);
+        assert_se(ca_name_cache_name_to_uid(c, "root", &uid) > 0);
+        assert_se(uid == 0);
+
+        assert_se(ca_name_cache_get_hits(c) == 2);
+        assert_se(ca_name_cache_get_misses(c) == 2);
+
+        /* Users that don't exist are remembered too */
+        assert_se(ca_name_cache_uid_to_name(c, (uid_t) UNKNOWN_ID, &name) == 0);
+        assert_se(ca_name_cache_uid_to_name(c, (uid_t) UNKNOWN_ID, &name) == 0);
+        assert_se(ca_name_cache_name_to_uid(c, UNKNOWN_NAME, &uid) == 0);
+        assert_se(ca_name_cache_name_to_uid(c, UNKNOWN_NAME, &uid) == 0);
+
+        assert_se(ca_name_cache_get_hits(c) == 4);
+        assert_se(ca_name_cache_get_misses(c) == 4);
+
+        assert_se(ca_name_cache_uid_to_name(c, UID_INVALID, &name) == -EINVAL);
+}
+
+static void test_groups(CaNameCache *c) {
+        uint64_t hits;
+        char *name;
+        gid_t gid;
+
+        hits = ca_name_cache_get_hits(c);
+
+        assert_se(ca_name_cache_gid_to_name(c, 0, &name) > 0);
+        assert_se(ca_name_cache_name_to_gid(c, name, &gid) > 0);
+        assert_se(gid == 0);
+        free(name);
+
+        assert_se(ca_name_cache_gid_to_name(c, (gid_t) UNKNOWN_ID, &name) == 0);
+        assert_se(ca_name_cache_name_to_gid(c, UNKNOWN_NAME, &gid) == 0);
+
+        /* Users and groups are kept apart */
+        assert_se(ca_name_cache_get_hits(c) == hits);
+
+        assert_se(ca_name_cache_gid_to_name(c, 0, &name) > 0);
+        free(name);
+        assert_se(ca_name_cache_name_to_gid(c, UNKNOWN_NAME, &gid) == 0);
+
+        assert_se(ca_name_cache_get_hits(c) == hits + 2);
+}
+
+int main(int argc, char *argv[]) {
+        CaNameCache *c;
+
+        assert_se(c = ca_name_cache_new());
+
+        test_users(c);
+        test_groups(c);
+
+        printf("%" PRIu64 " hits, %" PRIu64 " misses\n", ca_name_cache_get_hits(c), ca_name_cache_get_misses(c));
+
+        assert_se(ca_name_cache_ref(c) == c);
+        assert_se(!ca_name_cache_unref(c));
+        assert_se(!ca_name_cache_unref(c));
+
+        return 0;
+}
@@ -0,0 +1,134 @@
+#include <stdio.h>
+
+#include "caprefetch.h"
+#include "util.h"
+
+#define CHUNK_SIZE (64U*1024U)
+#define NSEC_PER_SEC UINT64_C(1000000000)
+
+static void make_id(CaDigest *digest, unsigned i, CaChunkID *ret) {
+        assert_se(ca_chunk_id_make(digest, &i, sizeof(i), ret) >= 0);
+}
+
+static void test_window(CaDigest *digest) {
+        CaPrefetch *p;
+        CaChunkID id;
+        unsigned i;
+
+        assert_se(p = ca_prefetch_new());
+        assert_se(ca_prefetch_get_window(p) == CA_PREFETCH_WINDOW_MIN);
+        assert_se(ca_prefetch_next(p) == 0);
+        assert_se(!ca_prefetch_full(p));
+
+        /* Requests fill the window, chunks we have locally don't */
+        for (i = 0; !ca_prefetch_full(p); i++) {
+                make_id(digest, i, &id);
+                assert_se(ca_prefetch_is_requested(p, &id) == 0);
+                assert_se(ca_prefetch_push(p, &id, CHUNK_SIZE, i % 2 == 0) >= 0);
+        }
+
+        assert_se(i == 2 * CA_PREFETCH_WINDOW_MIN / CHUNK_SIZE - 1);
+        assert_se(ca_prefetch_next(p) == i);
+        assert_se(ca_prefetch_get_requested(p) == CA_PREFETCH_WINDOW_MIN / CHUNK_SIZE);
+
+        make_id(digest, 0, &id);
+        assert_se(ca_prefetch_is_requested(p, &id) > 0);
+        assert_se(ca_prefetch_push(p, &id, CHUNK_SIZE, true) == -EEXIST);
+        make_id(digest, 1, &id);
+        assert_se(ca_prefetch_is_requested(p, &id) == 0);
+
+        /* Once the decoder moved on there's room again, and the chunks it passed may be requested again */
+        assert_se(ca_prefetch_advance(p, 4) >= 0);
+        assert_se(!ca_prefetch_full(p));
+        make_id(digest, 0, &id);
+        assert_se(ca_prefetch_is_requested(p, &id) == 0);
+        make_id(digest, 4, &id);
+        assert_se(ca_prefetch_is_requested(p, &id) > 0);
+
+        /* Duplicates within the window are only requested once */
+        assert_se(ca_prefetch_push(p, &id, CHUNK_SIZE, false) >= 0);
+        assert_se(ca_prefetch_get_duplicates(p) == 1);
+
+        /* Seeking backwards starts over */
+        assert_se(ca_prefetch_advance(p, 2) >= 0);
+        assert_se(ca_prefetch_next(p) == 2);
+        assert_se(ca_prefetch_is_requested(p, &id) == 0);
+
+        ca_prefetch_free(p);
+}
+
+static void test_remove(CaDigest *digest) {
+        CaPrefetch *p;
+        CaChunkID id;
+        unsigned i, j;
+
+        /* Lots of entries passing through the window, to see that removal keeps all others findable */
+        assert_se(p = ca_prefetch_new());
+        assert_se(ca_prefetch_set_window_max(p, UINT64_MAX) >= 0);
+
+        for (i = 0; i < CA_PREFETCH_CHUNKS_MAX * 4; i++) {
+                make_id(digest, i, &id);
+                assert_se(ca_prefetch_push(p, &id, 1, true) >= 0);
+
+                if (i % 1000 == 999) {
+                        assert_se(ca_prefetch_advance(p, i - 500) >= 0);
+
+                        for (j = i - 500; j <= i; j++) {
+                                make_id(digest, j, &id);
+                                assert_se(ca_prefetch_is_requested(p, &id) > 0);
+                        }
+
+                        make_id(digest, i - 501, &id);
+                        assert_se(ca_prefetch_is_requested(p, &id) == 0);
+                }
+        }
+
+        ca_prefetch_free(p);
+}
+
+static void test_adapt(void) {
+        uint64_t t = NSEC_PER_SEC, window;
+        CaPrefetch *p;
+        unsigned i;
+
+        assert_se(p = ca_prefetch_new());
+
+        /* Each stall doubles the window, up to the maximum */
+        assert_se(ca_prefetch_put_consumed(p, CHUNK_SIZE, true, t) >= 0);
+        assert_se(ca_prefetch_get_window(p) == 2 * CA_PREFETCH_WINDOW_MIN);
+
+        for (i = 0; i < 16; i++)
+                assert_se(ca_prefetch_put_consumed(p, CHUNK_SIZE, true, t) >= 0);
+        assert_se(ca_prefetch_get_window(p) == CA_PREFETCH_WINDOW_MAX_DEFAULT);
+        assert_se(ca_prefetch_get_stalls(p) == 17);
+
+        /* At a slow 1 MiB/s there's no point in requesting more than a couple of seconds ahead */
+        for (i = 0; i < 32; i++) {
+                t += NSEC_PER_SEC;
+                assert_se(ca_prefetch_put_consumed(p, 1024U*1024U, false, t) >= 0);
+        }
+
+        window = ca_prefetch_get_window(p);
+        printf("window at 1 MiB/s: %" PRIu64 " bytes\n", window);
+        assert_se(window >= CA_PREFETCH_WINDOW_MIN);
+        assert_se(window < 16U*1024U*1024U);
+
+        assert_se(ca_prefetch_put_consumed(p, CHUNK_SIZE, true, t) >= 0);
+        assert_se(ca_prefetch_get_window(p) == window);
+
+        ca_prefetch_free(p);
+}
+
+int main(int argc, char *argv[]) {
+        CaDigest *digest;
+
+        assert_se(ca_digest_new(CA_DIGEST_DEFAULT, &digest) >= 0);
+
+        test_window(digest);
+        test_remove(digest);
+        test_adapt();
+
+        ca_digest_free(digest);
+
+        return 0;
+}
@@ -0,0 +1,153 @@
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "cachunkid.h"
+#include "caformat.h"
+#include "casync.h"
+#include "rm-rf.h"
+#include "util.h"
+
+/* Of the regular files in the tree, every how many'th is modified for the update */
+#define MODIFY_EVERY 10U
+
+static unsigned n_seen = 0, n_modified = 0;
+
+static uint64_t feature_flags(void) {
+        uint64_t flags = CA_FORMAT_WITH_BEST|CA_FORMAT_EXCLUDE_NODUMP;
+
+        if (geteuid() != 0)
+                flags &= ~CA_FORMAT_WITH_PRIVILEGED;
+
+        return flags;
+}
+
+static void run(CaSync *s, CaChunkID *ret_digest) {
+        int r;
+
+        assert_se(ca_sync_enable_archive_digest(s, true) >= 0);
+
+        for (;;) {
+                r = ca_sync_step(s);
+                assert_se(r >= 0);
+
+                if (r == CA_SYNC_FINISHED)
+                        break;
+        }
+
+        assert_se(ca_sync_get_archive_digest(s, ret_digest) >= 0);
+}
+
+static void make(const char *tree, const char *store, const char *index, CaChunkID *ret_digest) {
+        CaSync *s;
+
+        assert_se(s = ca_sync_new_encode());
+        assert_se(ca_sync_set_feature_flags(s, feature_flags()) >= 0);
+        assert_se(ca_sync_set_base_path(s, tree) >= 0);
+        assert_se(ca_sync_set_store_path(s, store) >= 0);
+        assert_se(ca_sync_set_index_path(s, index) >= 0);
+
+        run(s, ret_digest);
+        ca_sync_unref(s);
+}
+
+static void extract(const char *index, const char *store, const char *tree, int seed, CaChunkID *ret_digest) {
+        uint64_t n = 0;
+        CaSync *s;
+
+        assert_se(s = ca_sync_new_decode());
+        assert_se(ca_sync_set_base_mode(s, S_IFDIR) >= 0);
+        assert_se(ca_sync_set_base_path(s, tree) >= 0);
+        assert_se(ca_sync_set_index_path(s, index) >= 0);
+        assert_se(ca_sync_set_store_path(s, store) >= 0);
+
+        if (seed == 1)
+                assert_se(ca_sync_add_seed_path(s, tree) >= 0);
+        else if (seed == 2)
+                assert_se(ca_sync_set_lazy_output_seed(s, true) >= 0);
+
+        run(s, ret_digest);
+
+        if (seed == 2) {
+                assert_se(ca_sync_get_output_seed_bytes(s, &n) >= 0);
+                printf("%" PRIu64 " bytes taken from old files, ", n);
+        }
+
+        ca_sync_unref(s);
+}
+
+static int modify(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+        uint8_t data[64];
+        int fd;
+
+        if (type != FTW_F || !S_ISREG(st->st_mode) || st->st_size < (off_t) sizeof(data))
+                return 0;
+        if (n_seen++ % MODIFY_EVERY != 0)
+                return 0;
+
+        assert_se(dev_urandom(data, sizeof(data)) >= 0);
+
+        fd = open(path, O_WRONLY|O_CLOEXEC|O_NOCTTY);
+        if (fd < 0) /* Some test files may be immutable */
+                return 0;
+
+        assert_se(pwrite(fd, data, sizeof(data), st->st_size / 2) == (ssize_t) sizeof(data));
+        safe_close(fd);
+
+        n_modified++;
+        return 0;
+}
+
+int main(int argc, char *argv[]) {
+        char *base, *store, *old_index, *new_index, *new_tree, *full_tree, *lazy_tree;
+        CaChunkID digest, expected;
+        static const char* const names[] = { "none", "full", "lazy" };
+        unsigned i;
+
+        assert_se(asprintf(&base, "/var/tmp/test-caseed-benchmark.%" PRIx64, random_u64()) >= 0);
+        assert_se(mkdir(base, 0777) >= 0);
+
+        assert_se(store = strjoin(base, "/store", NULL));
+        assert_se(old_index = strjoin(base, "/old.caidx", NULL));
+        assert_se(new_index = strjoin(base, "/new.caidx", NULL));
+        assert_se(new_tree = strjoin(base, "/new", NULL));
+        assert_se(full_tree = strjoin(base, "/full", NULL));
+        assert_se(lazy_tree = strjoin(base, "/lazy", NULL));
+
+        /* The update modifies a few bytes in some of the files of the tree */
+        make(argc > 1 ? argv[1] : "test-files", store, old_index, &digest);
+        extract(old_index, store, new_tree, 0, &digest);
+        assert_se(nftw(new_tree, modify, 16, FTW_PHYS) >= 0);
+        make(new_tree, store, new_index, &expected);
+
+        printf("%u of %u files modified\n", n_modified, n_seen);
+
+        for (i = 0; i < ELEMENTSOF(names); i++) {
+                const char *tree = i == 2 ? lazy_tree : full_tree;
+                uint64_t start;
+
+                (void) rm_rf(tree, REMOVE_ROOT|REMOVE_PHYSICAL);
+                extract(old_index, store, tree, 0, &digest);
+
+                printf("seed %s: ", names[i]);
+
+                start = now(CLOCK_MONOTONIC);
+                extract(new_index, store, tree, i, &digest);
+                printf("%.3f s\n", (double) (now(CLOCK_MONOTONIC) - start) / 1e9);
+
+                assert_se(ca_chunk_id_equal(&digest, &expected));
+        }
+
+        (void) rm_rf(base, REMOVE_ROOT|REMOVE_PHYSICAL);
+
+        free(base);
+        free(store);
+        free(old_index);
+        free(new_index);
+        free(new_tree);
+        free(full_tree);
+        free(lazy_tree);
+
+        return 0;
+}
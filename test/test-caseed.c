@@ -0,0 +1,181 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "cachunk.h"
+#include "caformat.h"
+#include "caseed.h"
+#include "rm-rf.h"
+#include "util.h"
+
+#define N_FILES 8U
+#define FILE_SIZE (256U*1024U)
+
+static void make_file(const char *dir, unsigned i, uint64_t offset, size_t size) {
+        uint8_t *data;
+        char *path;
+        int fd;
+
+        assert_se(asprintf(&path, "%s/file%u", dir, i) >= 0);
+        assert_se(data = malloc(size));
+        assert_se(dev_urandom(data, size) >= 0);
+
+        assert_se((fd = open(path, O_WRONLY|O_CREAT|O_CLOEXEC, 0644)) >= 0);
+        assert_se(pwrite(fd, data, size, offset) == (ssize_t) size);
+        safe_close(fd);
+
+        free(data);
+        free(path);
+}
+
+static CaSeed *scan(const char *tree, const char *cache, uint64_t *ret_skipped) {
+        uint64_t flags = CA_FORMAT_WITH_BEST|CA_FORMAT_EXCLUDE_NODUMP;
+        CaSeed *s;
+        int r;
+
+        if (geteuid() != 0)
+                flags &= ~CA_FORMAT_WITH_PRIVILEGED;
+
+        assert_se(s = ca_seed_new());
+        assert_se(ca_seed_set_base_path(s, tree) >= 0);
+        assert_se(ca_seed_set_cache_path(s, cache) >= 0);
+        assert_se(ca_seed_set_feature_flags(s, flags) >= 0);
+        assert_se(ca_seed_set_chunk_size_min(s, 4096) >= 0);
+        assert_se(ca_seed_set_chunk_size_avg(s, 16384) >= 0);
+        assert_se(ca_seed_set_chunk_size_max(s, 65536) >= 0);
+        assert_se(ca_seed_set_hardlink(s, true) >= 0);
+
+        do {
+                r = ca_seed_step(s);
+                assert_se(r >= 0);
+        } while (r != CA_SEED_READY);
+
+        assert_se(ca_seed_get_skipped_bytes(s, ret_skipped) >= 0);
+        return s;
+}
+
+typedef struct Entries {
+        CaChunkID *ids;
+        size_t n_ids, n_allocated_ids;
+} Entries;
+
+static int add_entry(const CaChunkID *id, void *userdata) {
+        Entries *e = userdata;
+
+        assert_se(GREEDY_REALLOC(e->ids, e->n_allocated_ids, e->n_ids + 1));
+        e->ids[e->n_ids++] = *id;
+
+        return 0;
+}
+
+static int entry_compare(const void *a, const void *b) {
+        return memcmp(a, b, sizeof(CaChunkID));
+}
+
+static void list_entries(CaSeed *s, Entries *ret) {
+        *ret = (Entries) {};
+
+        assert_se(ca_seed_enumerate(s, add_entry, ret) >= 0);
+        assert_se(ret->n_ids > 0);
+
+        qsort(ret->ids, ret->n_ids, sizeof(CaChunkID), entry_compare);
+}
+
+static bool entries_equal(const Entries *a, const Entries *b) {
+        return a->n_ids == b->n_ids && memcmp(a->ids, b->ids, a->n_ids * sizeof(CaChunkID)) == 0;
+}
+
+static void check_entries(CaSeed *s, const Entries *entries) {
+        size_t i;
+
+        for (i = 0; i < entries->n_ids; i++) {
+                const void *p;
+                size_t l;
+                int r;
+
+                r = ca_seed_get(s, entries->ids + i, &p, &l, NULL);
+                if (r == -ENOLINK) /* Chunks covering a GOODBYE record can't be generated after a seek */
+                        continue;
+                if (r == -ENOENT) {
+                        char *target;
+
+                        /* Not a chunk, but a hardlink entry then */
+                        assert_se(ca_seed_get_hardlink_target(s, entries->ids + i, &target) >= 0);
+                        free(target);
+                } else
+                        assert_se(r >= 0);
+        }
+}
+
+int main(int argc, char *argv[]) {
+        char *base, *tree, *cache, *reference;
+        Entries first, second, expected;
+        uint64_t skipped, skipped_all;
+        CaSeed *s, *t;
+        unsigned i;
+
+        assert_se(asprintf(&base, "/var/tmp/test-caseed.%" PRIx64, random_u64()) >= 0);
+        assert_se(tree = strjoin(base, "/tree", NULL));
+        assert_se(cache = strjoin(base, "/cache", NULL));
+        assert_se(reference = strjoin(base, "/reference", NULL));
+
+        assert_se(mkdir(base, 0777) >= 0);
+        assert_se(mkdir(tree, 0777) >= 0);
+
+        for (i = 0; i < N_FILES; i++)
+                make_file(tree, i, 0, FILE_SIZE);
+
+        /* Nothing known about the tree on the first run */
+        s = scan(tree, cache, &skipped);
+        assert_se(skipped == 0);
+        list_entries(s, &first);
+        ca_seed_unref(s);
+
+        /* Nothing changed, hence most of the files are skipped, and we end up with the same chunks */
+        s = scan(tree, cache, &skipped_all);
+        assert_se(skipped_all >= N_FILES * FILE_SIZE / 2);
+        list_entries(s, &second);
+        assert_se(entries_equal(&first, &second));
+        check_entries(s, &second);
+        ca_seed_unref(s);
+
+        /* While somebody is using the cache, we go without it */
+        s = scan(tree, cache, &skipped);
+        t = scan(tree, cache, &skipped);
+        assert_se(skipped == 0);
+        ca_seed_unref(t);
+        ca_seed_unref(s);
+
+        /* Only the changed file is read again, and the chunks match those of a full scan, without stale ones */
+        make_file(tree, 3, FILE_SIZE / 2, 100);
+
+        s = scan(tree, cache, &skipped);
+        assert_se(skipped > 0);
+        assert_se(skipped < skipped_all);
+
+        t = scan(tree, reference, &skipped);
+        assert_se(skipped == 0);
+
+        free(second.ids);
+        list_entries(s, &second);
+        list_entries(t, &expected);
+        assert_se(entries_equal(&second, &expected));
+        assert_se(!entries_equal(&first, &second));
+        check_entries(s, &second);
+
+        ca_seed_unref(t);
+        ca_seed_unref(s);
+
+        free(first.ids);
+        free(second.ids);
+        free(expected.ids);
+
+        (void) rm_rf(base, REMOVE_ROOT|REMOVE_PHYSICAL);
+
+        free(base);
+        free(tree);
+        free(cache);
+        free(reference);
+
+        return 0;
+}
@@ -0,0 +1,148 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "caformat.h"
+#include "caseed.h"
+#include "caseedpool.h"
+#include "rm-rf.h"
+#include "util.h"
+
+#define N_SEEDS 4U
+#define N_FILES 4U
+#define FILE_SIZE (512U*1024U)
+
+static void make_tree(const char *path) {
+        unsigned i;
+
+        assert_se(mkdir(path, 0777) >= 0);
+
+        for (i = 0; i < N_FILES; i++) {
+                uint8_t *data;
+                char *p;
+                int fd;
+
+                assert_se(asprintf(&p, "%s/file%u", path, i) >= 0);
+                assert_se(data = malloc(FILE_SIZE));
+                assert_se(dev_urandom(data, FILE_SIZE) >= 0);
+
+                assert_se((fd = open(p, O_WRONLY|O_CREAT|O_CLOEXEC, 0644)) >= 0);
+                assert_se(loop_write(fd, data, FILE_SIZE) >= 0);
+                safe_close(fd);
+
+                free(data);
+                free(p);
+        }
+}
+
+static CaSeed *make_seed(const char *path) {
+        uint64_t flags = CA_FORMAT_WITH_BEST|CA_FORMAT_EXCLUDE_NODUMP;
+        CaSeed *s;
+
+        if (geteuid() != 0)
+                flags &= ~CA_FORMAT_WITH_PRIVILEGED;
+
+        assert_se(s = ca_seed_new());
+        assert_se(ca_seed_set_base_path(s, path) >= 0);
+        assert_se(ca_seed_set_feature_flags(s, flags) >= 0);
+        assert_se(ca_seed_set_chunk_size_min(s, 4096) >= 0);
+        assert_se(ca_seed_set_chunk_size_avg(s, 16384) >= 0);
+        assert_se(ca_seed_set_chunk_size_max(s, 65536) >= 0);
+
+        return s;
+}
+
+static int check_entry(const CaChunkID *id, void *userdata) {
+        CaSeed *s = userdata;
+
+        assert_se(ca_seed_has(s, id) > 0);
+        return 0;
+}
+
+static void test_pool(char **trees) {
+        CaSeed *seeds[N_SEEDS], *reference;
+        CaSeedPool *p;
+        unsigned i;
+        int r;
+
+        for (i = 0; i < N_SEEDS; i++)
+                seeds[i] = make_seed(trees[i]);
+
+        assert_se(ca_seed_pool_new(seeds, N_SEEDS, 0, &p) >= 0);
+
+        for (;;) {
+                struct pollfd pollfd = {
+                        .fd = ca_seed_pool_get_fd(p),
+                        .events = POLLIN,
+                };
+
+                r = ca_seed_pool_process(p);
+                assert_se(r >= 0);
+                if (r == 0)
+                        break;
+
+                assert_se(poll(&pollfd, 1, -1) >= 0);
+        }
+
+        for (i = 0; i < N_SEEDS; i++) {
+                assert_se(ca_seed_pool_is_done(p, i));
+
+                /* Indexing on a worker yields the same as indexing on our own */
+                reference = make_seed(trees[i]);
+                do {
+                        r = ca_seed_step(reference);
+                        assert_se(r >= 0);
+                } while (r != CA_SEED_READY);
+
+                assert_se(ca_seed_enumerate(reference, check_entry, seeds[i]) >= 0);
+                ca_seed_unref(reference);
+        }
+
+        assert_se(!ca_seed_pool_is_done(p, N_SEEDS));
+
+        ca_seed_pool_free(p);
+
+        for (i = 0; i < N_SEEDS; i++)
+                ca_seed_unref(seeds[i]);
+}
+
+static void test_abort(char **trees) {
+        CaSeed *seeds[N_SEEDS];
+        CaSeedPool *p;
+        unsigned i;
+
+        for (i = 0; i < N_SEEDS; i++)
+                seeds[i] = make_seed(trees[i]);
+
+        /* Freeing the pool while the workers are busy stops them */
+        assert_se(ca_seed_pool_new(seeds, N_SEEDS, 2, &p) >= 0);
+        ca_seed_pool_free(p);
+
+        for (i = 0; i < N_SEEDS; i++)
+                ca_seed_unref(seeds[i]);
+}
+
+int main(int argc, char *argv[]) {
+        char *base, *trees[N_SEEDS];
+        unsigned i;
+
+        assert_se(asprintf(&base, "/var/tmp/test-caseedpool.%" PRIx64, random_u64()) >= 0);
+        assert_se(mkdir(base, 0777) >= 0);
+
+        for (i = 0; i < N_SEEDS; i++) {
+                assert_se(asprintf(trees + i, "%s/seed%u", base, i) >= 0);
+                make_tree(trees[i]);
+        }
+
+        test_pool(trees);
+        test_abort(trees);
+
+        (void) rm_rf(base, REMOVE_ROOT|REMOVE_PHYSICAL);
+
+        for (i = 0; i < N_SEEDS; i++)
+                free(trees[i]);
+        free(base);
+
+        return 0;
+}
@@ -0,0 +1,208 @@
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "cachunk.h"
+#include "castore.h"
+#include "castoreindex.h"
+#include "rm-rf.h"
+#include "util.h"
+
+/* Enough chunks to make the table grow a couple of times beyond its initial size */
+#define N_CHUNKS 20000U
+
+static void make_id(unsigned i, CaChunkID *ret) {
+        CaDigest *digest;
+
+        assert_se(ca_digest_new(CA_DIGEST_DEFAULT, &digest) >= 0);
+        assert_se(ca_chunk_id_make(digest, &i, sizeof(i), ret) >= 0);
+        ca_digest_free(digest);
+}
+
+static void test_store(const char *path) {
+        static const char data[] = "chunk data";
+        CaChunkID id, other;
+        CaStore *store;
+
+        make_id(0, &id);
+        make_id(1, &other);
+
+        /* Without an index none is created */
+        assert_se(store = ca_store_new());
+        assert_se(ca_store_set_path(store, path) >= 0);
+        assert_se(ca_store_put(store, &id, CA_CHUNK_UNCOMPRESSED, data, sizeof(data)) >= 0);
+        assert_se(ca_store_rebuild_index(store) == -ENOTTY);
+        ca_store_unref(store);
+
+        /* When enabled, the index is built from the existing chunks */
+        assert_se(store = ca_store_new());
+        assert_se(ca_store_set_path(store, path) >= 0);
+        assert_se(ca_store_set_index(store, true) >= 0);
+        assert_se(ca_store_has(store, &id) > 0);
+        assert_se(ca_store_has(store, &other) == 0);
+        assert_se(ca_store_put(store, &id, CA_CHUNK_UNCOMPRESSED, data, sizeof(data)) == -EEXIST);
+        assert_se(ca_store_put(store, &other, CA_CHUNK_UNCOMPRESSED, data, sizeof(data)) >= 0);
+        assert_se(ca_store_has(store, &other) > 0);
+
+        /* A chunk removed behind the index' back is written again rather than skipped */
+        assert_se(ca_chunk_file_remove(AT_FDCWD, path, &other) >= 0);
+        assert_se(ca_store_put(store, &other, CA_CHUNK_UNCOMPRESSED, data, sizeof(data)) >= 0);
+        assert_se(ca_chunk_file_test(AT_FDCWD, path, &other) > 0);
+
+        assert_se(ca_chunk_file_remove(AT_FDCWD, path, &other) >= 0);
+        assert_se(ca_store_has(store, &other) == 0);
+        assert_se(ca_store_put(store, &other, CA_CHUNK_UNCOMPRESSED, data, sizeof(data)) >= 0);
+        ca_store_unref(store);
+
+        /* Once there is one, it is used by default */
+        assert_se(store = ca_store_new());
+        assert_se(ca_store_set_path(store, path) >= 0);
+        assert_se(ca_store_rebuild_index(store) >= 0);
+        assert_se(ca_store_has(store, &other) > 0);
+        ca_store_unref(store);
+}
+
+static void test_index(const char *path) {
+        static const char data[] = "chunk data";
+        CaStoreIndex *i;
+        CaChunkID id;
+        unsigned k;
+
+        assert_se(ca_store_index_open(path, false, &i) == -ENOENT);
+        assert_se(ca_store_index_open(path, true, &i) >= 0);
+        assert_se(ca_store_index_entries(i) == 0);
+
+        make_id(0, &id);
+        assert_se(ca_store_index_lookup(i, &id) == 0);
+
+        for (k = 0; k < N_CHUNKS; k++) {
+                make_id(k, &id);
+                assert_se(ca_store_index_add(i, &id) > 0);
+                assert_se(ca_store_index_add(i, &id) == 0);
+        }
+
+        assert_se(ca_store_index_entries(i) == N_CHUNKS);
+
+        for (k = 0; k < N_CHUNKS; k++) {
+                make_id(k, &id);
+                assert_se(ca_store_index_lookup(i, &id) > 0);
+        }
+
+        make_id(N_CHUNKS, &id);
+        assert_se(ca_store_index_lookup(i, &id) == 0);
+        assert_se(ca_store_index_remove(i, &id) == 0);
+
+        /* Removing entries must not hide the others that collided with them */
+        for (k = 0; k < N_CHUNKS; k += 3) {
+                make_id(k, &id);
+                assert_se(ca_store_index_remove(i, &id) > 0);
+                assert_se(ca_store_index_remove(i, &id) == 0);
+        }
+
+        for (k = 0; k < N_CHUNKS; k++) {
+                make_id(k, &id);
+                assert_se(ca_store_index_lookup(i, &id) == (k % 3 != 0));
+        }
+
+        for (k = 0; k < N_CHUNKS; k += 3) {
+                make_id(k, &id);
+                assert_se(ca_store_index_add(i, &id) > 0);
+        }
+
+        assert_se(ca_store_index_entries(i) == N_CHUNKS);
+
+        ca_store_index_free(i);
+
+        /* The index is persistent */
+        assert_se(ca_store_index_open(path, false, &i) >= 0);
+        assert_se(ca_store_index_entries(i) == N_CHUNKS);
+        make_id(N_CHUNKS - 1, &id);
+        assert_se(ca_store_index_lookup(i, &id) > 0);
+
+        /* Chunks put in place behind the index' back are only picked up when rebuilding it, and so is the removal of
+         * chunks */
+        make_id(N_CHUNKS, &id);
+        assert_se(ca_chunk_file_save(AT_FDCWD, path, &id, CA_CHUNK_UNCOMPRESSED, CA_CHUNK_COMPRESSED,
+                                     CA_COMPRESSION_DEFAULT, CA_COMPRESSION_LEVEL_DEFAULT, data, sizeof(data)) >= 0);
+        assert_se(ca_store_index_lookup(i, &id) == 0);
+
+        assert_se(ca_store_index_rebuild(i) >= 0);
+        assert_se(ca_store_index_entries(i) == 1);
+        assert_se(ca_store_index_lookup(i, &id) > 0);
+
+        assert_se(ca_chunk_file_remove(AT_FDCWD, path, &id) >= 0);
+        assert_se(ca_store_index_rebuild(i) >= 0);
+        assert_se(ca_store_index_entries(i) == 0);
+        assert_se(ca_store_index_lookup(i, &id) == 0);
+
+        /* The null ID is used to mark empty buckets, hence can't be indexed */
+        zero(id);
+        assert_se(ca_store_index_add(i, &id) == -EDOM);
+
+        ca_store_index_free(i);
+}
+
+static void test_shared(const char *path) {
+        static const char data[] = "chunk data";
+        CaStoreIndex *a, *b;
+        CaChunkID id;
+        unsigned k;
+
+        /* Two handles on the same index, like two processes would have. Misses must be trustworthy even after the
+         * other one replaced the file, by growing or rebuilding it. */
+        assert_se(ca_store_index_open(path, true, &a) >= 0);
+        assert_se(ca_store_index_open(path, false, &b) >= 0);
+
+        for (k = 0; k < N_CHUNKS; k++) {
+                make_id(k, &id);
+                assert_se(ca_store_index_add(b, &id) > 0);
+        }
+
+        for (k = 0; k < N_CHUNKS; k++) {
+                make_id(k, &id);
+                assert_se(ca_store_index_lookup(a, &id) > 0);
+        }
+
+        for (k = 0; k < N_CHUNKS; k += 3) {
+                make_id(k, &id);
+                assert_se(ca_store_index_remove(b, &id) > 0);
+        }
+
+        for (k = 0; k < N_CHUNKS; k++) {
+                make_id(k, &id);
+                assert_se(ca_store_index_lookup(a, &id) == (k % 3 != 0));
+        }
+
+        make_id(N_CHUNKS, &id);
+        assert_se(ca_chunk_file_save(AT_FDCWD, path, &id, CA_CHUNK_UNCOMPRESSED, CA_CHUNK_COMPRESSED,
+                                     CA_COMPRESSION_DEFAULT, CA_COMPRESSION_LEVEL_DEFAULT, data, sizeof(data)) >= 0);
+        assert_se(ca_store_index_rebuild(b) >= 0);
+        assert_se(ca_store_index_lookup(a, &id) > 0);
+
+        make_id(N_CHUNKS + 1, &id);
+        assert_se(ca_store_index_lookup(a, &id) == 0);
+        assert_se(ca_store_index_add(b, &id) > 0);
+        assert_se(ca_store_index_lookup(a, &id) > 0);
+
+        ca_store_index_free(a);
+        ca_store_index_free(b);
+}
+
+int main(int argc, char *argv[]) {
+        char *path;
+
+        assert_se(asprintf(&path, "/var/tmp/test-castoreindex.%" PRIx64 "/", random_u64()) >= 0);
+        test_store(path);
+        (void) rm_rf(path, REMOVE_ROOT|REMOVE_PHYSICAL);
+
+        assert_se(mkdir(path, 0777) >= 0);
+        test_index(path);
+        (void) rm_rf(path, REMOVE_ROOT|REMOVE_PHYSICAL);
+
+        assert_se(mkdir(path, 0777) >= 0);
+        test_shared(path);
+        (void) rm_rf(path, REMOVE_ROOT|REMOVE_PHYSICAL);
+
+        free(path);
+
+        return 0;
+}
@@ -0,0 +1,277 @@
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "cachunk.h"
+#include "castore.h"
+#include "castorepack.h"
+#include "rm-rf.h"
+#include "util.h"
+
+#define N_CHUNKS 500U
+#define CHUNK_SIZE_MAX 4096U
+
+/* Small enough to end up with a bunch of packs */
+#define PACK_SIZE_MAX (64U*1024U)
+
+typedef struct Chunk {
+        CaChunkID id;
+        size_t size;
+        uint8_t data[CHUNK_SIZE_MAX];
+} Chunk;
+
+static void make_chunks(Chunk *chunks) {
+        CaDigest *digest;
+        unsigned i;
+
+        assert_se(ca_digest_new(CA_DIGEST_DEFAULT, &digest) >= 0);
+
+        for (i = 0; i < N_CHUNKS; i++) {
+                chunks[i].size = 1 + random_u64() % CHUNK_SIZE_MAX;
+                assert_se(dev_urandom(chunks[i].data, chunks[i].size) >= 0);
+                assert_se(ca_chunk_id_make(digest, chunks[i].data, chunks[i].size, &chunks[i].id) >= 0);
+        }
+
+        ca_digest_free(digest);
+}
+
+static void check_chunks(CaStorePack *p, const Chunk *chunks, unsigned n) {
+        ReallocBuffer buffer = {};
+        unsigned i;
+
+        for (i = 0; i < n; i++) {
+                CaChunkCompression compression;
+
+                assert_se(ca_store_pack_has(p, &chunks[i].id) > 0);
+                assert_se(ca_store_pack_get(p, &chunks[i].id, &buffer, &compression) >= 0);
+                assert_se(compression == (i % 2 ? CA_CHUNK_COMPRESSED : CA_CHUNK_UNCOMPRESSED));
+                assert_se(realloc_buffer_size(&buffer) == chunks[i].size);
+                assert_se(memcmp(realloc_buffer_data(&buffer), chunks[i].data, chunks[i].size) == 0);
+        }
+
+        realloc_buffer_free(&buffer);
+}
+
+static void test_pack(const char *path, const Chunk *chunks) {
+        ReallocBuffer buffer = {};
+        CaStorePack *writer, *reader;
+        unsigned i;
+        uint64_t n;
+        int r;
+
+        assert_se(ca_store_pack_open(path, false, &writer) == -ENOENT);
+        assert_se(ca_store_pack_open(path, true, &writer) >= 0);
+        assert_se(ca_store_pack_set_size_max(writer, PACK_SIZE_MAX) >= 0);
+
+        assert_se(ca_store_pack_open(path, false, &reader) >= 0);
+        assert_se(ca_store_pack_has(reader, &chunks[0].id) == 0);
+        assert_se(ca_store_pack_get(reader, &chunks[0].id, &buffer, NULL) == -ENOENT);
+
+        /* Data isn't interpreted, hence we can just claim half of the chunks to be compressed */
+        for (i = 0; i < N_CHUNKS; i++) {
+                assert_se(ca_store_pack_put(writer, &chunks[i].id, i % 2 ? CA_CHUNK_COMPRESSED : CA_CHUNK_UNCOMPRESSED, chunks[i].data, chunks[i].size) >= 0);
+                assert_se(ca_store_pack_put(writer, &chunks[i].id, CA_CHUNK_UNCOMPRESSED, chunks[i].data, chunks[i].size) == -EEXIST);
+
+                /* Readers see new chunks right away, whether they're in the tail of the pack or in a sealed one */
+                if (i % 50 == 0)
+                        check_chunks(reader, chunks, i + 1);
+        }
+
+        check_chunks(writer, chunks, N_CHUNKS);
+        check_chunks(reader, chunks, N_CHUNKS);
+
+        n = ca_store_pack_n_packs(writer);
+        assert_se(n > 1);
+        assert_se(ca_store_pack_n_packs(reader) == n);
+
+        ca_store_pack_free(writer);
+
+        /* Let's see if it's all still there, now from the index files only */
+        assert_se(ca_store_pack_open(path, false, &writer) >= 0);
+        check_chunks(writer, chunks, N_CHUNKS);
+
+        /* Larger packs allow merging the existing ones */
+        assert_se(ca_store_pack_set_size_max(writer, PACK_SIZE_MAX * 8) >= 0);
+        r = ca_store_pack_compact(writer);
+        assert_se(r > 0);
+        assert_se(ca_store_pack_n_packs(writer) == n - r);
+        assert_se(ca_store_pack_n_packs(writer) < n);
+
+        check_chunks(writer, chunks, N_CHUNKS);
+        check_chunks(reader, chunks, N_CHUNKS);
+
+        /* Nothing left to merge */
+        assert_se(ca_store_pack_compact(writer) == 0);
+
+        ca_store_pack_free(reader);
+        ca_store_pack_free(writer);
+
+        realloc_buffer_free(&buffer);
+}
+
+static void read_file(const char *path, const char *name, ReallocBuffer *buffer) {
+        char *p;
+        int fd, r;
+
+        assert_se(p = strjoin(path, "/", name, NULL));
+        assert_se((fd = open(p, O_RDONLY|O_CLOEXEC)) >= 0);
+
+        realloc_buffer_empty(buffer);
+        do {
+                r = realloc_buffer_read(buffer, fd);
+                assert_se(r >= 0);
+        } while (r > 0);
+
+        safe_close(fd);
+        free(p);
+}
+
+static void test_remote(const char *path, const Chunk *chunks) {
+        ReallocBuffer manifest = {}, index = {}, pack = {};
+        unsigned i, found = 0;
+        uint64_t *numbers;
+        size_t n, j;
+
+        /* Reads the store the way casync-http does, i.e. without listing the directory */
+        read_file(path, CA_STORE_PACK_MANIFEST_FILENAME, &manifest);
+        assert_se(ca_store_pack_parse_manifest(realloc_buffer_data(&manifest), realloc_buffer_size(&manifest), &numbers, &n) >= 0);
+        assert_se(n > 1);
+
+        assert_se(ca_store_pack_parse_manifest("xyz\n", 4, &numbers, &n) == -EBADMSG);
+
+        for (j = 0; j < n; j++) {
+                char name[16 + 6 + 1];
+
+                snprintf(name, sizeof(name), "%016" PRIx64 ".index", numbers[j]);
+                read_file(path, name, &index);
+                assert_se(ca_store_pack_index_validate(realloc_buffer_data(&index), realloc_buffer_size(&index)) >= 0);
+                assert_se(ca_store_pack_index_validate(realloc_buffer_data(&index), realloc_buffer_size(&index) - 1) == -EBADMSG);
+
+                snprintf(name, sizeof(name), "%016" PRIx64 ".pack", numbers[j]);
+                read_file(path, name, &pack);
+
+                for (i = 0; i < N_CHUNKS; i++) {
+                        CaChunkCompression compression;
+                        uint64_t offset, size;
+                        const void *data;
+                        size_t l;
+                        int r;
+
+                        r = ca_store_pack_index_find(realloc_buffer_data(&index), realloc_buffer_size(&index), &chunks[i].id, &offset, &size);
+                        if (r == -ENOENT)
+                                continue;
+                        assert_se(r >= 0);
+                        assert_se(offset + size <= realloc_buffer_size(&pack));
+
+                        assert_se(ca_store_pack_parse_record(realloc_buffer_data_offset(&pack, offset), size, &chunks[i].id, &data, &l, &compression) >= 0);
+                        assert_se(compression == (i % 2 ? CA_CHUNK_COMPRESSED : CA_CHUNK_UNCOMPRESSED));
+                        assert_se(l == chunks[i].size);
+                        assert_se(memcmp(data, chunks[i].data, l) == 0);
+
+                        /* The record belongs to this chunk only, and must be complete */
+                        assert_se(ca_store_pack_parse_record(realloc_buffer_data_offset(&pack, offset), size, &chunks[(i + 1) % N_CHUNKS].id, &data, &l, &compression) < 0);
+                        assert_se(ca_store_pack_parse_record(realloc_buffer_data_offset(&pack, offset), size - 1, &chunks[i].id, &data, &l, &compression) < 0);
+
+                        found++;
+                }
+        }
+
+        assert_se(found == N_CHUNKS);
+
+        free(numbers);
+        realloc_buffer_free(&manifest);
+        realloc_buffer_free(&index);
+        realloc_buffer_free(&pack);
+}
+
+static void test_store(const char *path, const Chunk *chunks) {
+        CaChunkCompression compression;
+        CaStore *store;
+        const void *p;
+        size_t l;
+        char *url;
+
+        url = strjoina(CA_STORE_PACK_URL_PREFIX, path);
+
+        assert_se(store = ca_store_new());
+        assert_se(ca_store_set_path(store, url) >= 0);
+        assert_se(ca_store_has(store, &chunks[0].id) == 0);
+        assert_se(ca_store_get(store, &chunks[0].id, CA_CHUNK_AS_IS, &p, &l, NULL) == -ENOENT);
+        assert_se(ca_store_put(store, &chunks[0].id, CA_CHUNK_UNCOMPRESSED, chunks[0].data, chunks[0].size) >= 0);
+        assert_se(ca_store_put(store, &chunks[0].id, CA_CHUNK_UNCOMPRESSED, chunks[0].data, chunks[0].size) == -EEXIST);
+        assert_se(ca_store_rebuild_index(store) == -ENOTTY);
+        ca_store_unref(store);
+
+        /* The marker file tells a plain path is a pack store too */
+        assert_se(store = ca_store_new());
+        assert_se(ca_store_set_path(store, path) >= 0);
+        assert_se(ca_store_has(store, &chunks[0].id) > 0);
+        assert_se(ca_store_get(store, &chunks[0].id, CA_CHUNK_UNCOMPRESSED, &p, &l, &compression) >= 0);
+        assert_se(compression == CA_CHUNK_UNCOMPRESSED);
+        assert_se(l == chunks[0].size);
+        assert_se(memcmp(p, chunks[0].data, l) == 0);
+        assert_se(ca_store_compact(store) == 0);
+        ca_store_unref(store);
+}
+
+static void test_compact_active(const char *path, const Chunk *chunks) {
+        /* Tiny and large chunks alternating, so that the tiny ones end up in small packs of their own, except for the
+         * last one, which is followed by a chunk that fills the pack we append to beyond half its maximum size */
+        static const size_t sizes[] = { 8, 4000, 8, 4000, 8, 2500 };
+        ReallocBuffer manifest = {};
+        CaStorePack *writer, *reader;
+        char *index_path;
+        unsigned i;
+
+        assert_se(mkdir(path, 0777) >= 0);
+        assert_se(ca_store_pack_open(path, true, &writer) >= 0);
+        assert_se(ca_store_pack_set_size_max(writer, 4096) >= 0);
+
+        for (i = 0; i < ELEMENTSOF(sizes); i++)
+                assert_se(ca_store_pack_put(writer, &chunks[i].id, CA_CHUNK_UNCOMPRESSED, chunks[i].data, sizes[i]) >= 0);
+
+        assert_se(ca_store_pack_n_packs(writer) == 5);
+
+        /* Only the two small packs are merged, the one we append to is kept, and needs to be sealed */
+        assert_se(ca_store_pack_compact(writer) == 1);
+        assert_se(ca_store_pack_put(writer, &chunks[ELEMENTSOF(sizes)].id, CA_CHUNK_UNCOMPRESSED, chunks[0].data, 8) >= 0);
+        ca_store_pack_free(writer);
+
+        assert_se(asprintf(&index_path, "%s%016" PRIx64 ".index", path, (uint64_t) 5) >= 0);
+        assert_se(access(index_path, F_OK) >= 0);
+        free(index_path);
+
+        read_file(path, CA_STORE_PACK_MANIFEST_FILENAME, &manifest);
+        assert_se(memmem(realloc_buffer_data(&manifest), realloc_buffer_size(&manifest), "0000000000000005\n", 17));
+        realloc_buffer_free(&manifest);
+
+        assert_se(ca_store_pack_open(path, false, &reader) >= 0);
+        for (i = 0; i <= ELEMENTSOF(sizes); i++)
+                assert_se(ca_store_pack_has(reader, &chunks[i].id) > 0);
+        ca_store_pack_free(reader);
+}
+
+int main(int argc, char *argv[]) {
+        Chunk *chunks;
+        char *path;
+
+        assert_se(chunks = new(Chunk, N_CHUNKS));
+        make_chunks(chunks);
+
+        assert_se(asprintf(&path, "/var/tmp/test-castorepack.%" PRIx64 "/", random_u64()) >= 0);
+
+        assert_se(mkdir(path, 0777) >= 0);
+        test_pack(path, chunks);
+        test_remote(path, chunks);
+        (void) rm_rf(path, REMOVE_ROOT|REMOVE_PHYSICAL);
+
+        test_store(path, chunks);
+        (void) rm_rf(path, REMOVE_ROOT|REMOVE_PHYSICAL);
+
+        test_compact_active(path, chunks);
+        (void) rm_rf(path, REMOVE_ROOT|REMOVE_PHYSICAL);
+
+        free(path);
+        free(chunks);
+
+        return 0;
+}
@@ -0,0 +1,147 @@
+#include <stdio.h>
+
+#include "castorewriter.h"
+#include "rm-rf.h"
+#include "util.h"
+
+#define CHUNK_SIZE (64U*1024U)
+#define N_CHUNKS 1000U
+
+static void make_data(unsigned i, uint8_t *ret) {
+        size_t k;
+
+        for (k = 0; k < CHUNK_SIZE; k++)
+                ret[k] = (uint8_t) ((k >> 7) ^ k);
+
+        memcpy(ret, &i, sizeof(i));
+}
+
+/* Every tenth chunk is the same, to see that duplicates are only written once */
+static unsigned chunk_number(unsigned i) {
+        return i % 10 == 9 ? 0 : i;
+}
+
+static void make_store(CaStore **ret, char **ret_path) {
+        assert_se(asprintf(ret_path, "/var/tmp/test-castorewriter.%" PRIx64, random_u64()) >= 0);
+        assert_se(*ret = ca_store_new());
+        assert_se(ca_store_set_path(*ret, *ret_path) >= 0);
+}
+
+static void test_write(CaDigest *digest) {
+        uint8_t data[CHUNK_SIZE];
+        CaStore *store, *cache;
+        char *path, *cache_path;
+        uint64_t n_reused = 0;
+        CaStoreWriter *w;
+        CaChunkID id;
+        unsigned i, n_busy = 0;
+        int r;
+
+        make_store(&store, &path);
+        make_store(&cache, &cache_path);
+
+        assert_se(ca_store_writer_new(CA_STORE_WRITER_THREADS_DEFAULT, store, cache, &w) >= 0);
+
+        for (i = 0; i < N_CHUNKS; i++) {
+                make_data(chunk_number(i), data);
+                assert_se(ca_chunk_id_make(digest, data, sizeof(data), &id) >= 0);
+
+                while (ca_store_writer_is_full(w)) {
+                        assert_se(ca_store_writer_put(w, &id, data, sizeof(data)) == -EAGAIN);
+                        assert_se(ca_store_writer_collect(w, true, &n_reused) > 0);
+                }
+
+                r = ca_store_writer_put(w, &id, data, sizeof(data));
+                assert_se(r >= 0);
+                if (r > 0)
+                        n_busy++;
+
+                assert_se(ca_store_writer_queued(w) <= CA_STORE_WRITER_QUEUE_MAX);
+                assert_se(ca_store_writer_collect(w, false, &n_reused) > 0);
+        }
+
+        while ((r = ca_store_writer_collect(w, true, &n_reused)) > 0)
+                ;
+        assert_se(r == 0);
+        assert_se(ca_store_writer_queued(w) == 0);
+
+        /* Each repetition of the first chunk was either still being written, or found in the store */
+        printf("%u chunks, %" PRIu64 " found in the store, %u still being written\n", N_CHUNKS, n_reused, n_busy);
+        assert_se(n_reused + n_busy == N_CHUNKS / 10);
+
+        for (i = 0; i < N_CHUNKS; i++) {
+                const void *p;
+                size_t l;
+
+                make_data(chunk_number(i), data);
+                assert_se(ca_chunk_id_make(digest, data, sizeof(data), &id) >= 0);
+
+                assert_se(ca_store_get(store, &id, CA_CHUNK_UNCOMPRESSED, &p, &l, NULL) >= 0);
+                assert_se(l == sizeof(data));
+                assert_se(memcmp(p, data, l) == 0);
+
+                assert_se(ca_store_has(cache, &id) > 0);
+        }
+
+        ca_store_writer_free(w);
+        ca_store_unref(store);
+        ca_store_unref(cache);
+
+        (void) rm_rf(path, REMOVE_ROOT|REMOVE_PHYSICAL);
+        (void) rm_rf(cache_path, REMOVE_ROOT|REMOVE_PHYSICAL);
+        free(path);
+        free(cache_path);
+}
+
+static void test_wait(CaDigest *digest) {
+        uint8_t data[CHUNK_SIZE];
+        CaChunkID id, other;
+        CaStore *store;
+        CaStoreWriter *w;
+        uint64_t n_reused = 0;
+        char *path;
+        unsigned i;
+
+        make_store(&store, &path);
+
+        assert_se(ca_store_writer_new(1, NULL, store, &w) >= 0);
+
+        /* Queue a few, so that the last one is still outstanding for a while */
+        for (i = 0; i < 8; i++) {
+                make_data(i, data);
+                assert_se(ca_chunk_id_make(digest, data, sizeof(data), &id) >= 0);
+                assert_se(ca_store_writer_put(w, &id, data, sizeof(data)) == 0);
+        }
+
+        /* Once waited for, the chunk may be read back even though it wasn't collected yet */
+        assert_se(ca_store_writer_wait(w, &id) > 0);
+        assert_se(ca_store_has(store, &id) > 0);
+        assert_se(ca_store_writer_queued(w) == 8);
+
+        make_data(i, data);
+        assert_se(ca_chunk_id_make(digest, data, sizeof(data), &other) >= 0);
+        assert_se(ca_store_writer_wait(w, &other) == 0);
+
+        while (ca_store_writer_collect(w, true, &n_reused) > 0)
+                ;
+        assert_se(ca_store_writer_wait(w, &id) == 0);
+
+        ca_store_writer_free(w);
+        ca_store_unref(store);
+
+        (void) rm_rf(path, REMOVE_ROOT|REMOVE_PHYSICAL);
+        free(path);
+}
+
+int main(int argc, char *argv[]) {
+        CaDigest *digest;
+
+        assert_se(ca_digest_new(CA_DIGEST_DEFAULT, &digest) >= 0);
+
+        test_write(digest);
+        test_wait(digest);
+
+        ca_digest_free(digest);
+
+        return 0;
+}
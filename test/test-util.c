@@ -1,5 +1,6 @@
 #include <fcntl.h>
 
+#include "realloc-buffer.h"
 #include "util.h"
 
 #define PART1 127
@@ -8,7 +9,26 @@
 #define PART4 4444
 #define PART5 13
 
-int main(int argc, char *argv[]) {
+static void test_memeqzero(void) {
+        uint8_t buffer[4096];
+        size_t i;
+
+        memzero(buffer, sizeof(buffer));
+        assert_se(memeqzero(buffer, 0));
+        assert_se(memeqzero(buffer, 1));
+        assert_se(memeqzero(buffer, sizeof(buffer)));
+
+        /* A single non-zero byte is found wherever it is */
+        for (i = 0; i < sizeof(buffer); i += 37) {
+                buffer[i] = 1;
+                assert_se(!memeqzero(buffer, sizeof(buffer)));
+                assert_se(!memeqzero(buffer, i + 1));
+                assert_se(memeqzero(buffer, i));
+                buffer[i] = 0;
+        }
+}
+
+static void test_holes(void) {
         uint8_t buffer[PART1 + PART2 + PART3 + PART4 + PART5];
         uint8_t buffer2[sizeof(buffer)];
         char fn[] = "/tmp/zeroXXXXXX";
@@ -56,5 +76,48 @@ int main(int argc, char *argv[]) {
 
         assert_se(memcmp(buffer, buffer2, MIN(sizeof(buffer), (size_t) PIPE_BUF)) == 0);
 
+        /* A block of nothing but zeroes is punched as a whole */
+        strcpy(fn, "/tmp/zeroXXXXXX");
+        fd = mkostemp(fn, O_CLOEXEC);
+        assert_se(fd >= 0);
+        assert_se(unlink(fn) == 0);
+
+        memzero(buffer, sizeof(buffer));
+        assert_se(loop_write_with_holes(fd, buffer, sizeof(buffer), &n_punched) >= 0);
+        assert_se(n_punched == sizeof(buffer));
+        assert_se(lseek(fd, 0, SEEK_CUR) == sizeof(buffer));
+
+        memset(buffer2, 0xFF, sizeof(buffer2));
+        assert_se(lseek(fd, 0, SEEK_SET) == 0);
+        assert_se(loop_read(fd, buffer2, sizeof(buffer2)) == sizeof(buffer2));
+        assert_se(memeqzero(buffer2, sizeof(buffer2)));
+
+        fd = safe_close(fd);
+}
+
+static void test_realloc_buffer_acquire0(void) {
+        ReallocBuffer rb = {};
+        uint8_t *p;
+
+        /* Works on a buffer that never had anything allocated */
+        p = realloc_buffer_acquire0(&rb, 4711);
+        assert_se(p);
+        assert_se(realloc_buffer_size(&rb) == 4711);
+        assert_se(memeqzero(p, 4711));
+
+        memset(p, 'x', 4711);
+        p = realloc_buffer_acquire0(&rb, 13);
+        assert_se(p);
+        assert_se(realloc_buffer_size(&rb) == 13);
+        assert_se(memeqzero(p, 13));
+
+        realloc_buffer_free(&rb);
+}
+
+int main(int argc, char *argv[]) {
+        test_memeqzero();
+        test_holes();
+        test_realloc_buffer_acquire0();
+
         return 0;
 }